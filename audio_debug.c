@@ -239,6 +239,7 @@ void test_audio(void)
 
 	generate_aes_data(&aes_data);
 
+	syscalls_memset(&audio_stream, 0, sizeof(audio_stream));
 	syscalls_strncpy(audio_stream.pcm_data_file,
 			 pcm_testdata,
 			 sizeof(audio_stream.pcm_data_file));
@@ -253,6 +254,7 @@ void test_audio(void)
 	}
 
 	init_audio_stream(&audio_stream);
+	open_audio_track(&audio_stream, audio_stream.pcm_data_file);
 	send_audio_stream(&audio_stream, &aes_data);
 
 out:
@@ -17,6 +17,7 @@ You should have received a copy of the GNU General Public License
 along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <poll.h>
+#include <errno.h>
 
 #include "syscalls.h"
 #include "config.h"
@@ -25,29 +26,35 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "audio_stream.h"
 #include "raop_play_send_audio.h"
 #include "audio_debug.h"
+#include "probes.h"
+#include "metrics.h"
 
 #define DEFAULT_FACILITY LT_AUDIO_STREAM
 
+/* Packet buffers for every stream */
+static struct utility_buf_pool *packet_pool;
+static pthread_once_t packet_pool_once = PTHREAD_ONCE_INIT;
+
+
+static void packet_pool_init(void)
+{
+	utility_buf_pool_create(&packet_pool, TRANSMIT_BUFLEN,
+				AUDIO_PACKET_POOL_FREE, "audio packets");
+}
+
+
 utility_retcode_t init_audio_stream(struct audio_stream *audio_stream)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
+	int i;
 
 	FUNC_ENTER;
 
-	get_pcm_data_file(audio_stream->pcm_data_file,
-			  sizeof(audio_stream->pcm_data_file));
-
-	audio_stream->pcm_fd =
-		syscalls_open(audio_stream->pcm_data_file, O_RDONLY, 0);
-
-	if (audio_stream->pcm_fd < 0) { 
-		ERRR("Failed to open PCM data file\n");
-		ret = UTILITY_FAILURE;
-		goto out;
+	audio_stream->pcm_fd = -1;
+	if (NULL == audio_stream->session_id) {
+		audio_stream->session_id = "";
 	}
 
-	audio_stream->pcm_data_available = 1;
-
 	audio_stream->pcm_buf = syscalls_malloc(PCM_BUFLEN);
 	if (NULL == audio_stream->pcm_buf) {
 		ERRR("Failed to allocate memory for PCM audio buffer\n");
@@ -69,13 +76,33 @@ utility_retcode_t init_audio_stream(struct audio_stream *audio_stream)
 		goto out;
 	}
 
-	audio_stream->transmit_buf = syscalls_malloc(TRANSMIT_BUFLEN);
-	if (NULL == audio_stream->transmit_buf) {
-		ERRR("Failed to allocate memory for transmit audio buffer\n");
+	audio_stream->rtp_control_fd = -1;
+	audio_stream->timing = NULL;
+	audio_stream->marker = UTILITY_TRUE;
+
+	/* Only UDP can lose packets that need to be sent again */
+	audio_stream->ring_len = audio_stream->rtp_over_udp ?
+		AUDIO_RETRANSMIT_RING_LEN : AUDIO_SEND_QUEUE_LEN;
+
+	syscalls_pthread_once(&packet_pool_once, packet_pool_init);
+	if (NULL == packet_pool) {
+		ERRR("No pool for transmit audio buffers\n");
 		ret = UTILITY_FAILURE;
 		goto out;
 	}
 
+	for (i = 0 ; i < (int)audio_stream->ring_len ; i++) {
+		audio_stream->send_ring[i].buf = utility_buf_alloc(packet_pool);
+		if (NULL == audio_stream->send_ring[i].buf) {
+			ERRR("Failed to allocate memory for transmit audio buffer\n");
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
+	}
+
+	audio_stream->transmit_buf = audio_stream->send_ring[0].buf->data;
+	audio_stream->queue_len = 0;
+
 out:
 	FUNC_RETURN;
 	return ret;
@@ -109,42 +136,62 @@ static utility_retcode_t poll_server(struct audio_stream *audio_stream)
 		goto out;
 	}
 
-	INFO("%d events occurred\n", select_ret);
+	INFO_RATELIMITED("%d events occurred\n", select_ret);
 
 	if (FD_ISSET(audio_stream->session_fd, &read_fds)) {
-		INFO("Server is ready for reading\n");
+		INFO_RATELIMITED("Server is ready for reading\n");
 		audio_stream->server_ready_for_reading = 1;
 	}
 
 	if (FD_ISSET(audio_stream->session_fd, &write_fds)) {
-		INFO("Server is ready for writing\n");
+		INFO_RATELIMITED("Server is ready for writing\n");
 		audio_stream->server_ready_for_writing = 1;
 	}
 
+	flight_record(audio_stream->recorder, FLIGHT_POLL, 0, select_ret,
+		      (audio_stream->server_ready_for_reading ?
+		       FLIGHT_POLL_READABLE : 0) |
+		      (audio_stream->server_ready_for_writing ?
+		       FLIGHT_POLL_WRITABLE : 0));
+
 out:
 	FUNC_RETURN;
 	return ret;
 }
 
 
-static utility_retcode_t read_server(int session_fd)
+static utility_retcode_t read_server(struct audio_stream *audio_stream)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
 	uint8_t buf[256];
 	uint32_t *size_data;
 	int rsize, read_ret;
+	int session_fd = audio_stream->session_fd;
 
 	FUNC_ENTER;
 
-	INFO("Preparing to read from session fd (%d)\n", session_fd);
+	INFO_RATELIMITED("Preparing to read from session fd (%d)\n",
+			 session_fd);
 
 	read_ret = syscalls_read(session_fd, buf, sizeof(buf));
 
+	flight_record(audio_stream->recorder, FLIGHT_SERVER_READ, 0,
+		      read_ret, (read_ret < 0) ? errno : 0);
+
 	if (0 < read_ret) {
-		INFO("Read %d bytes from server\n", ret);
+		if (NULL != audio_stream->timeline) {
+			timeline_mark(audio_stream->timeline,
+				      TIMELINE_FIRST_SERVER_ACK);
+		}
+
+		INFO_RATELIMITED("Read %d bytes from server\n", ret);
 		size_data = (uint32_t *)(buf + 0x2c);
 		rsize = syscalls_ntohl(*size_data);
-		INFO("Size in server: %d\n", rsize);
+		INFO_RATELIMITED("Size in server: %d\n", rsize);
+
+		if (read_ret >= 0x2c + (int)sizeof(*size_data)) {
+			metrics_set(METRIC_RECEIVER_BUFFER, rsize);
+		}
 	}
 
 	if (0 > read_ret) {
@@ -162,38 +209,381 @@ static utility_retcode_t read_server(int session_fd)
 }
 
 
+/* Next track prefetch.  While a track plays, a thread opens the next
+ * track in the playlist and builds the chunk that joins the two: the
+ * end of the current track that doesn't fill a whole chunk, followed
+ * by the start of the next one.  It converts that chunk too, so the
+ * change of track costs the send loop nothing. */
+static void *prefetch_thread(void *arg)
+{
+	struct audio_stream *audio_stream = arg;
+	struct audio_prefetch *prefetch = &audio_stream->prefetch;
+	struct audio_stream scratch;
+	struct stat st;
+	ssize_t read_ret;
+	size_t need;
+	int fd;
+
+	FUNC_ENTER;
+
+	syscalls_pthread_mutex_lock(&prefetch->lock);
+
+	for (;;) {
+		while (prefetch->running &&
+		       AUDIO_PREFETCH_REQUESTED != prefetch->state) {
+			syscalls_pthread_cond_wait(&prefetch->cond,
+						   &prefetch->lock);
+		}
+
+		if (!prefetch->running) {
+			break;
+		}
+
+		syscalls_pthread_mutex_unlock(&prefetch->lock);
+
+		prefetch->pcm_len = 0;
+
+		fd = syscalls_open(prefetch->file, O_RDONLY, 0);
+		if (fd < 0 || syscalls_fstat(fd, &st) < 0) {
+			ERRR("Failed to open next track \"%s\"\n",
+			     prefetch->file);
+			goto failed;
+		}
+
+		syscalls_posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+
+		if (0 != prefetch->tail_len &&
+		    syscalls_pread(prefetch->current_fd, prefetch->pcm_buf,
+				   prefetch->tail_len, prefetch->tail_offset) !=
+		    (ssize_t)prefetch->tail_len) {
+			ERRR("Failed to read the end of the current track\n");
+			goto failed;
+		}
+
+		prefetch->pcm_len = prefetch->tail_len;
+		need = PCM_READ_SIZE - prefetch->tail_len;
+
+		while (prefetch->pcm_len < PCM_READ_SIZE) {
+			read_ret = syscalls_read(fd,
+						 prefetch->pcm_buf + prefetch->pcm_len,
+						 PCM_READ_SIZE - prefetch->pcm_len);
+			if (read_ret <= 0) {
+				break;
+			}
+			prefetch->pcm_len += read_ret;
+		}
+
+		if (prefetch->pcm_len < PCM_READ_SIZE) {
+			/* A track shorter than a chunk; the send loop
+			 * joins it to the one after itself. */
+			DEBG("Next track \"%s\" is too short to prefetch\n",
+			     prefetch->file);
+			goto failed;
+		}
+
+		syscalls_memset(&scratch, 0, sizeof(scratch));
+		syscalls_memset(prefetch->converted_buf, 0, CONVERTED_BUFLEN);
+		scratch.pcm_buf = prefetch->pcm_buf;
+		scratch.pcm_len = prefetch->pcm_len;
+		scratch.pcm_num_samples_read = prefetch->pcm_len / PCM_BYTES_PER_SAMPLE;
+		scratch.converted_buf = prefetch->converted_buf;
+
+		if (UTILITY_SUCCESS != convert_audio_data(&scratch)) {
+			goto failed;
+		}
+
+		prefetch->converted_len = scratch.converted_len;
+		prefetch->fd = fd;
+		prefetch->size = st.st_size;
+		prefetch->used = need;
+
+		syscalls_pthread_mutex_lock(&prefetch->lock);
+		prefetch->state = AUDIO_PREFETCH_READY;
+		syscalls_pthread_cond_signal(&prefetch->cond);
+		continue;
+
+	failed:
+		if (fd >= 0) {
+			syscalls_close(fd);
+		}
+
+		syscalls_pthread_mutex_lock(&prefetch->lock);
+		prefetch->state = AUDIO_PREFETCH_FAILED;
+		syscalls_pthread_cond_signal(&prefetch->cond);
+	}
+
+	syscalls_pthread_mutex_unlock(&prefetch->lock);
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+static utility_boolean_t have_next_track(struct audio_stream *audio_stream)
+{
+	return audio_stream->playlist_next < audio_stream->playlist_len;
+}
+
+
+/* Asks for the chunk that joins the current track to the next. */
+static void request_prefetch(struct audio_stream *audio_stream)
+{
+	struct audio_prefetch *prefetch = &audio_stream->prefetch;
+
+	if (!have_next_track(audio_stream) || !prefetch->running) {
+		return;
+	}
+
+	syscalls_pthread_mutex_lock(&prefetch->lock);
+
+	prefetch->file = audio_stream->playlist[audio_stream->playlist_next];
+	prefetch->current_fd = audio_stream->pcm_fd;
+	prefetch->tail_len = audio_stream->pcm_remaining % PCM_READ_SIZE;
+	prefetch->tail_offset = audio_stream->pcm_size - prefetch->tail_len;
+	prefetch->fd = -1;
+	prefetch->state = AUDIO_PREFETCH_REQUESTED;
+
+	syscalls_pthread_cond_signal(&prefetch->cond);
+	syscalls_pthread_mutex_unlock(&prefetch->lock);
+}
+
+
+/* Waits for an outstanding request and returns how it went. */
+static audio_prefetch_state_t wait_prefetch(struct audio_prefetch *prefetch)
+{
+	audio_prefetch_state_t state;
+
+	if (!prefetch->running) {
+		return AUDIO_PREFETCH_IDLE;
+	}
+
+	syscalls_pthread_mutex_lock(&prefetch->lock);
+
+	while (AUDIO_PREFETCH_REQUESTED == prefetch->state) {
+		syscalls_pthread_cond_wait(&prefetch->cond, &prefetch->lock);
+	}
+
+	state = prefetch->state;
+	prefetch->state = AUDIO_PREFETCH_IDLE;
+
+	syscalls_pthread_mutex_unlock(&prefetch->lock);
+
+	return state;
+}
+
+
+static utility_retcode_t start_prefetch(struct audio_stream *audio_stream)
+{
+	struct audio_prefetch *prefetch = &audio_stream->prefetch;
+
+	FUNC_ENTER;
+
+	prefetch->pcm_buf = syscalls_malloc(PCM_BUFLEN);
+	prefetch->converted_buf = syscalls_malloc(CONVERTED_BUFLEN);
+	if (NULL == prefetch->pcm_buf || NULL == prefetch->converted_buf) {
+		goto failed;
+	}
+
+	syscalls_pthread_mutex_init(&prefetch->lock, NULL);
+	pthread_cond_init(&prefetch->cond, NULL);
+	prefetch->state = AUDIO_PREFETCH_IDLE;
+	prefetch->running = UTILITY_TRUE;
+
+	if (0 != syscalls_pthread_create(&prefetch->thread, NULL,
+					 prefetch_thread, audio_stream)) {
+		prefetch->running = UTILITY_FALSE;
+		goto failed;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+failed:
+	/* Tracks are still joined, just without the head start */
+	WARN("Failed to start next track prefetch\n");
+	syscalls_free(prefetch->pcm_buf);
+	syscalls_free(prefetch->converted_buf);
+	prefetch->pcm_buf = NULL;
+	prefetch->converted_buf = NULL;
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+static void stop_prefetch(struct audio_stream *audio_stream)
+{
+	struct audio_prefetch *prefetch = &audio_stream->prefetch;
+
+	FUNC_ENTER;
+
+	if (!prefetch->running) {
+		goto out;
+	}
+
+	if (AUDIO_PREFETCH_READY == wait_prefetch(prefetch)) {
+		syscalls_close(prefetch->fd);
+	}
+
+	syscalls_pthread_mutex_lock(&prefetch->lock);
+	prefetch->running = UTILITY_FALSE;
+	syscalls_pthread_cond_signal(&prefetch->cond);
+	syscalls_pthread_mutex_unlock(&prefetch->lock);
+
+	syscalls_pthread_join(prefetch->thread, NULL);
+
+	pthread_cond_destroy(&prefetch->cond);
+	pthread_mutex_destroy(&prefetch->lock);
+
+	syscalls_free(prefetch->pcm_buf);
+	syscalls_free(prefetch->converted_buf);
+	prefetch->pcm_buf = NULL;
+	prefetch->converted_buf = NULL;
+
+out:
+	FUNC_RETURN;
+	return;
+}
+
+
+/* Moves on to the next track in the playlist without help from the
+ * prefetch thread. */
+static utility_retcode_t open_next_track(struct audio_stream *audio_stream)
+{
+	utility_retcode_t ret;
+
+	FUNC_ENTER;
+
+	if (AUDIO_PREFETCH_READY == wait_prefetch(&audio_stream->prefetch)) {
+		syscalls_close(audio_stream->prefetch.fd);
+	}
+
+	ret = open_audio_track(audio_stream,
+			       audio_stream->playlist[audio_stream->playlist_next]);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	audio_stream->playlist_next++;
+	audio_stream->track_changes++;
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Uses the joining chunk the prefetch thread built, if it built one,
+ * and moves on to the next track. */
+static utility_boolean_t take_prefetched_chunk(struct audio_stream *audio_stream)
+{
+	struct audio_prefetch *prefetch = &audio_stream->prefetch;
+
+	if (AUDIO_PREFETCH_READY != wait_prefetch(prefetch)) {
+		return UTILITY_FALSE;
+	}
+
+	if (prefetch->tail_len != audio_stream->pcm_remaining) {
+		WARN("Prefetched chunk doesn't match the end of the track\n");
+		syscalls_close(prefetch->fd);
+		return UTILITY_FALSE;
+	}
+
+	syscalls_memcpy(audio_stream->pcm_buf, prefetch->pcm_buf,
+			prefetch->pcm_len);
+	audio_stream->pcm_len = prefetch->pcm_len;
+	audio_stream->pcm_num_samples_read =
+		audio_stream->pcm_len / PCM_BYTES_PER_SAMPLE;
+
+	syscalls_memcpy(audio_stream->converted_buf, prefetch->converted_buf,
+			prefetch->converted_len);
+	audio_stream->converted_len = prefetch->converted_len;
+	audio_stream->chunk_converted = 1;
+
+	syscalls_close(audio_stream->pcm_fd);
+	audio_stream->pcm_fd = prefetch->fd;
+	audio_stream->pcm_size = prefetch->size;
+	audio_stream->pcm_remaining = prefetch->size - prefetch->used;
+	audio_stream->playlist_next++;
+	audio_stream->track_changes++;
+	audio_stream->track_starting = 1;
+
+	DEBG("Joined tracks with prefetched chunk, %d bytes from the next\n",
+	     (int)prefetch->used);
+
+	request_prefetch(audio_stream);
+
+	return UTILITY_TRUE;
+}
+
+
+/* Fills the PCM buffer with the next chunk.  A track that ends part
+ * way through a chunk is followed by the next track in the playlist,
+ * so only the last chunk of the last track can be short. */
 static utility_retcode_t read_audio_data(struct audio_stream *audio_stream)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
+	unsigned int track_changes = audio_stream->track_changes;
 	int read_ret;
 
-	INFO("Preparing to get next PCM audio sample (fd: %d\n",
-	     audio_stream->pcm_fd);
+	INFO_RATELIMITED("Preparing to get next PCM audio sample (fd: %d\n",
+			 audio_stream->pcm_fd);
 
-	read_ret = syscalls_read(audio_stream->pcm_fd,
-				 audio_stream->pcm_buf,
-				 PCM_READ_SIZE);
+	audio_stream->pcm_len = 0;
 
-	if (0 > read_ret) {
-		ERRR("PCM data read failed: %s\n", strerror(errno));
-		ret = UTILITY_FAILURE;
+	if (have_next_track(audio_stream) &&
+	    audio_stream->pcm_remaining < PCM_READ_SIZE &&
+	    take_prefetched_chunk(audio_stream)) {
 		goto out;
 	}
 
-	audio_stream->pcm_len = read_ret;
-	audio_stream->pcm_num_samples_read =
-		audio_stream->pcm_len / PCM_BYTES_PER_SAMPLE;
+	while (audio_stream->pcm_len < PCM_READ_SIZE) {
+		read_ret = syscalls_read(audio_stream->pcm_fd,
+					 audio_stream->pcm_buf +
+					 audio_stream->pcm_len,
+					 PCM_READ_SIZE - audio_stream->pcm_len);
 
-	INFO("Read %d bytes of PCM data\n", (int)audio_stream->pcm_len);
+		if (0 > read_ret) {
+			ERRR("PCM data read failed: %s\n", strerror(errno));
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
 
-	/* dump_raw_pcm(audio_stream->pcm_buf, audio_stream->pcm_len); */
+		if (0 == read_ret) {
+			if (have_next_track(audio_stream)) {
+				ret = open_next_track(audio_stream);
+				if (UTILITY_SUCCESS != ret) {
+					goto out;
+				}
+				continue;
+			}
 
-	if (0 == read_ret) {
-		INFO("Finished reading PCM data\n");
-		audio_stream->pcm_data_available = 0;
+			INFO("Finished reading PCM data\n");
+			audio_stream->pcm_data_available = 0;
+			break;
+		}
+
+		audio_stream->pcm_len += read_ret;
+		audio_stream->pcm_remaining -= MIN((size_t)read_ret,
+						   audio_stream->pcm_remaining);
+	}
+
+	audio_stream->pcm_num_samples_read =
+		audio_stream->pcm_len / PCM_BYTES_PER_SAMPLE;
+
+	/* Only now that the chunk is full do reads of the new track
+	 * line up with the chunks again. */
+	if (track_changes != audio_stream->track_changes) {
+		request_prefetch(audio_stream);
 	}
 
 out:
+	INFO_SAMPLED(AUDIO_LOG_SAMPLE, "Read %d bytes of PCM data\n",
+		     (int)audio_stream->pcm_len);
+	flight_record(audio_stream->recorder, FLIGHT_PCM_READ, 0,
+		      audio_stream->pcm_len, 0);
+
+	/* dump_raw_pcm(audio_stream->pcm_buf, audio_stream->pcm_len); */
+
 	return ret;
 }
 
@@ -202,8 +592,9 @@ utility_retcode_t convert_audio_data(struct audio_stream *audio_stream)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
 
-	DEBG("Converting %d samples (%d bytes) to bigendian order\n",
-	     audio_stream->pcm_num_samples_read, audio_stream->pcm_len);
+	DEBG_SAMPLED(AUDIO_LOG_SAMPLE,
+		     "Converting %d samples (%d bytes) to bigendian order\n",
+		     audio_stream->pcm_num_samples_read, audio_stream->pcm_len);
 
 	ret = raopd_convert_audio_data(audio_stream);
 	if (UTILITY_SUCCESS != ret) {
@@ -221,7 +612,7 @@ utility_retcode_t raopd_convert_audio_data(struct audio_stream *audio_stream)
 	int i;
 
 
-	DEBG("Creating 3 byte header\n");
+	DEBG_SAMPLED(AUDIO_LOG_SAMPLE, "Creating 3 byte header\n");
 
 	/* These statements set the bitfields in the first 3 bytes of
 	 * the audio buffer.  It would be better to do this with a
@@ -233,7 +624,8 @@ utility_retcode_t raopd_convert_audio_data(struct audio_stream *audio_stream)
 	readp = audio_stream->pcm_buf;
 	writep = (audio_stream->converted_buf + 3);
 
-	DEBG("Converting PCM data to big-endian format\n");
+	DEBG_SAMPLED(AUDIO_LOG_SAMPLE,
+		     "Converting PCM data to big-endian format\n");
 
 	/* We want big-endian samples; this logic assumes that the
 	 * input PCM data is little-endian. */
@@ -247,7 +639,8 @@ utility_retcode_t raopd_convert_audio_data(struct audio_stream *audio_stream)
 
 	writep = audio_stream->converted_buf + 3;
 
-	DEBG("Bit-shifting %d bytes\n", audio_stream->pcm_len);
+	DEBG_SAMPLED(AUDIO_LOG_SAMPLE, "Bit-shifting %d bytes\n",
+		     audio_stream->pcm_len);
 
 	/* Bit-shift everything left one bit across the byte boundary. (?!?) */
 	for (i = 0 ; i < (int)(audio_stream->pcm_len) ; i++) {
@@ -263,7 +656,8 @@ utility_retcode_t raopd_convert_audio_data(struct audio_stream *audio_stream)
 	 * love to know.  */
 	audio_stream->converted_len = audio_stream->pcm_len + 3 + 64;
 
-	INFO("Converted PCM data is %d bytes\n", audio_stream->converted_len);
+	INFO_SAMPLED(AUDIO_LOG_SAMPLE, "Converted PCM data is %d bytes\n",
+		     audio_stream->converted_len);
 
 	/* dump_converted(audio_stream->converted_buf,
 	   audio_stream->converted_len); */
@@ -273,20 +667,25 @@ utility_retcode_t raopd_convert_audio_data(struct audio_stream *audio_stream)
 
 
 static utility_retcode_t encrypt_audio_data(struct audio_stream *audio_stream,
-					    struct aes_data *aes_data)
+					    struct aes_data *aes_data,
+					    const struct audio_chunk *chunk)
 {
-	INFO("Attempting to encrypt %d bytes of audio data\n",
-	     audio_stream->converted_len);
+	INFO_RATELIMITED("Attempting to encrypt %d bytes of audio data\n",
+			 chunk->len);
 
 	initialize_aes(aes_data);
 
+	audio_stream->encrypted_len = 0;
 	aes_encrypt_data(aes_data,
 			 audio_stream->encrypted_buf,
 			 &audio_stream->encrypted_len,
-			 audio_stream->converted_buf,
-			 audio_stream->converted_len);
+			 chunk->data,
+			 chunk->len);
 
-	INFO("Encrypted data length: %d\n", audio_stream->encrypted_len);
+	INFO_SAMPLED(AUDIO_LOG_SAMPLE, "Encrypted data length: %d\n",
+		     audio_stream->encrypted_len);
+	flight_record(audio_stream->recorder, FLIGHT_ENCRYPTED,
+		      audio_stream->next_seq, audio_stream->encrypted_len, 0);
 
 	dump_encrypted(audio_stream->encrypted_buf,
 		       audio_stream->encrypted_len);
@@ -302,10 +701,10 @@ static utility_retcode_t write_data(struct audio_stream *audio_stream)
 
 	FUNC_ENTER;
 
-	DEBG("Attempting to write %d bytes to server "
-	     "(written: %d audio_stream->transmit_len: %d)\n",
-	     audio_stream->transmit_len - audio_stream->written,
-	     audio_stream->written, audio_stream->transmit_len);
+	DEBG_RATELIMITED("Attempting to write %d bytes to server "
+			 "(written: %d audio_stream->transmit_len: %d)\n",
+			 audio_stream->transmit_len - audio_stream->written,
+			 audio_stream->written, audio_stream->transmit_len);
 
 	write_ret = syscalls_write(audio_stream->session_fd,
 				   audio_stream->transmit_buf +
@@ -313,20 +712,33 @@ static utility_retcode_t write_data(struct audio_stream *audio_stream)
 				   audio_stream->transmit_len -
 				   audio_stream->written);
 
+	flight_record(audio_stream->recorder, FLIGHT_WRITE,
+		      audio_stream->rtp_seq, write_ret,
+		      (write_ret < 0) ? errno : 0);
+
 	if (write_ret > 0) {
 
-		INFO("Wrote %d bytes to server\n", write_ret);
+		INFO_SAMPLED(AUDIO_LOG_SAMPLE, "Wrote %d bytes to server\n",
+			     write_ret);
 
 		dump_complete_raopd(audio_stream->transmit_buf + 
 				    audio_stream->written,
 				    write_ret);
 
 		audio_stream->total_bytes_transmitted += write_ret;
+		metrics_add(METRIC_BYTES_SENT, write_ret);
 		audio_stream->written += write_ret;
 
-		DEBG("written this chunk: %d total written: %llu\n",
-		     audio_stream->written,
-		     audio_stream->total_bytes_transmitted);
+		if (audio_stream->written == audio_stream->transmit_len &&
+		    NULL != audio_stream->timeline) {
+			timeline_mark(audio_stream->timeline,
+				      TIMELINE_FIRST_PACKET_WRITTEN);
+		}
+
+		DEBG_SAMPLED(AUDIO_LOG_SAMPLE,
+			     "written this chunk: %d total written: %llu\n",
+			     audio_stream->written,
+			     audio_stream->total_bytes_transmitted);
 
 	}
 
@@ -358,7 +770,7 @@ static utility_retcode_t poll_server_and_write_data(struct audio_stream *audio_s
 
 		if (0 != audio_stream->server_ready_for_reading) {
 
-			ret = read_server(audio_stream->session_fd);
+			ret = read_server(audio_stream);
 
 			if (UTILITY_SUCCESS != ret) {
 				break;
@@ -381,18 +793,36 @@ static utility_retcode_t poll_server_and_write_data(struct audio_stream *audio_s
 		retries++;
 	}
 
-	DEBG("written: %d audio_stream->transmit_len: %d\n",
-	     audio_stream->written, audio_stream->transmit_len);
+	DEBG_SAMPLED(AUDIO_LOG_SAMPLE,
+		     "written: %d audio_stream->transmit_len: %d\n",
+		     audio_stream->written, audio_stream->transmit_len);
 
 	if (retries == AUDIO_WRITE_RETRIES) {
 		ret = UTILITY_FAILURE;
+	} else if (retries > 1) {
+		/* The socket wasn't ready for all of it at once */
+		metrics_add(METRIC_SOCKET_STALLS, 1);
 	}
 
 	return ret;
 }
 
 
-static utility_retcode_t prepare_transmit_buf(struct audio_stream *audio_stream)
+/* Puts the packet's sequence number and timestamp into its RTP
+ * header, the 12 bytes after the 4 byte interleaved header. */
+void fill_rtp_header(uint8_t *header, uint16_t seq, uint32_t rtp_time)
+{
+	header[6] = seq >> 8;
+	header[7] = seq & 0xff;
+	header[8] = rtp_time >> 24;
+	header[9] = (rtp_time >> 16) & 0xff;
+	header[10] = (rtp_time >> 8) & 0xff;
+	header[11] = rtp_time & 0xff;
+}
+
+
+static utility_retcode_t prepare_transmit_buf(struct audio_stream *audio_stream,
+					      struct audio_packet *packet)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
 	int reported_len;
@@ -400,23 +830,32 @@ static utility_retcode_t prepare_transmit_buf(struct audio_stream *audio_stream)
 
 	uint8_t header[] = {
 		0x24, 0x00, 0x00, 0x00,
-		0xf0, 0xff, 0x00, 0x00,
+		RTP_AUDIO_TCP_BYTE0, RTP_AUDIO_TCP_BYTE1, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00,
         };
 
+	/* The interleaved header in front is skipped over UDP */
+	if (audio_stream->rtp_over_udp) {
+		header[4] = RTP_AUDIO_UDP_BYTE0;
+		header[5] = RTP_AUDIO_UDP_BYTE1;
+	}
+
 	transmit_buf = (struct transmit_buffer *)audio_stream->transmit_buf;
 
 	syscalls_memcpy(transmit_buf->header,
 			header,
 			sizeof(header));
 
+	fill_rtp_header(transmit_buf->header, packet->seq, packet->rtp_time);
+
 	syscalls_memcpy(transmit_buf->data,
 			audio_stream->encrypted_buf,
 			audio_stream->encrypted_len);
+	syscalls_memset(transmit_buf->data + audio_stream->encrypted_len, 0, 3);
 
-	INFO("Copied %d bytes to transmit buffer\n",
-	     audio_stream->encrypted_len);
+	INFO_RATELIMITED("Copied %d bytes to transmit buffer\n",
+			 audio_stream->encrypted_len);
 
 	/* It's totally unclear why the transmit len should be 3 bytes
 	 * longer than the actual data--this must be related to the 3
@@ -430,7 +869,7 @@ static utility_retcode_t prepare_transmit_buf(struct audio_stream *audio_stream)
 	 * not clear why the reported length in the header is
 	 * 4 bytes less than the actual length.  */
 	reported_len = audio_stream->transmit_len - 4;
-	INFO("Reported length: %d\n", reported_len);
+	INFO_RATELIMITED("Reported length: %d\n", reported_len);
 
 	transmit_buf->header[2] = reported_len >> 8;
 	transmit_buf->header[3] = reported_len & 0xff;
@@ -444,18 +883,20 @@ utility_retcode_t raop_play_send_audio_stream(struct audio_stream *audio_stream,
 {
 	hacked_send_audio(audio_stream->pcm_data_file,
 			  audio_stream->session_fd,
-			  aes_data);
+			  aes_data,
+			  audio_stream->latency);
 
 	return UTILITY_SUCCESS;
 }
 
 
+/* Clears what is read and converted.  The encrypted and transmit
+ * buffers are written over, not cleared, as a source stream's chunk
+ * is encrypted for each session fed from it. */
 static void begin_audio_chunk(struct audio_stream *audio_stream)
 {
 	syscalls_memset(audio_stream->pcm_buf, 0, PCM_BUFLEN);
 	syscalls_memset(audio_stream->converted_buf, 0, CONVERTED_BUFLEN);
-	syscalls_memset(audio_stream->encrypted_buf, 0, ENCRYPTED_BUFLEN);
-	syscalls_memset(audio_stream->transmit_buf, 0, TRANSMIT_BUFLEN);
 
 	audio_stream->server_ready_for_reading = 0;
 	audio_stream->server_ready_for_writing = 0;
@@ -465,83 +906,807 @@ static void begin_audio_chunk(struct audio_stream *audio_stream)
 	audio_stream->encrypted_len = 0;
 	audio_stream->transmit_len = 0;
 	audio_stream->written = 0;
+	audio_stream->chunk_converted = 0;
 
 	return;
 }
 
 
-utility_retcode_t raopd_send_audio_stream(struct audio_stream *audio_stream,
-					  struct aes_data *aes_data)
+/* Opens the next track's PCM data.  The connection and buffers set
+ * up by init_audio_stream() carry over, and so do the RTP sequence
+ * number and timestamp, so the server sees one continuous stream.
+ * NULL means the file from the config. */
+utility_retcode_t open_audio_track(struct audio_stream *audio_stream,
+				   const char *pcm_data_file)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
-	int retries = 0;
+	struct stat st;
 
 	FUNC_ENTER;
 
-	ret = initialize_aes(aes_data);
-	if (UTILITY_SUCCESS != ret) {
-		ERRR("Failed to initialize AES data\n");
+	if (audio_stream->pcm_fd >= 0) {
+		syscalls_close(audio_stream->pcm_fd);
+	}
+
+	/* The caller may pass the name already in place */
+	if (NULL == pcm_data_file) {
+		get_pcm_data_file(audio_stream->pcm_data_file,
+				  sizeof(audio_stream->pcm_data_file));
+	} else if (pcm_data_file != audio_stream->pcm_data_file) {
+		syscalls_strncpy(audio_stream->pcm_data_file,
+				 pcm_data_file,
+				 sizeof(audio_stream->pcm_data_file));
+	}
+
+	audio_stream->pcm_fd =
+		syscalls_open(audio_stream->pcm_data_file, O_RDONLY, 0);
+
+	if (audio_stream->pcm_fd < 0) {
+		ERRR("Failed to open PCM data file \"%s\"\n",
+		     audio_stream->pcm_data_file);
+		ret = UTILITY_FAILURE;
 		goto out;
 	}
 
-	do {
-		begin_audio_chunk(audio_stream);
+	if (syscalls_fstat(audio_stream->pcm_fd, &st) < 0) {
+		ERRR("Failed to stat PCM data file \"%s\"\n",
+		     audio_stream->pcm_data_file);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
 
-		ret = read_audio_data(audio_stream);
-		if (UTILITY_SUCCESS != ret) {
-			ERRR("Failed to read audio data\n");
-			goto out;
-		}
+	audio_stream->pcm_size = st.st_size;
+	audio_stream->pcm_remaining = st.st_size;
+	audio_stream->pcm_data_available = 1;
+	audio_stream->track_starting = 1;
+	audio_stream->position = 0;
 
-		if (0 != audio_stream->pcm_len) {
+out:
+	FUNC_RETURN;
+	return ret;
+}
 
-			ret = convert_audio_data(audio_stream);
-			if (UTILITY_SUCCESS != ret) {
-				ERRR("Failed to convert audio data\n");
-				goto out;
-			}
 
-			ret = encrypt_audio_data(audio_stream, aes_data);
-			if (UTILITY_SUCCESS != ret) {
-				ERRR("Failed to encrypt audio data\n");
-				goto out;
-			}
+static struct audio_packet *ring_packet(struct audio_stream *audio_stream,
+				       uint16_t seq)
+{
+	return &audio_stream->send_ring[seq & (audio_stream->ring_len - 1)];
+}
 
-			prepare_transmit_buf(audio_stream);
 
-			ret = poll_server_and_write_data(audio_stream);
-			if (UTILITY_SUCCESS != ret) {
-				ERRR("Session ended\n");
-				goto out;
-			}
+/* The written packet with sequence number seq, if it is still in the
+ * ring. */
+static struct audio_packet *find_sent_packet(struct audio_stream *audio_stream,
+					     uint16_t seq)
+{
+	struct audio_packet *packet = ring_packet(audio_stream, seq);
+	uint16_t age = audio_stream->rtp_seq - seq;
+
+	if (0 == age || age > audio_stream->ring_len ||
+	    packet->seq != seq || 0 == packet->sent_ns) {
+		return NULL;
+	}
+
+	return packet;
+}
+
+
+/* Resends count packets from seq on.  The ring is indexed by
+ * sequence number, so each is found directly, and the whole range
+ * goes to the kernel in one sendmmsg(). */
+static void resend_packets(struct audio_stream *audio_stream,
+			   uint16_t seq,
+			   unsigned int count)
+{
+	struct mmsghdr msgs[AUDIO_RETRANSMIT_RING_LEN];
+	struct iovec iov[AUDIO_RETRANSMIT_RING_LEN][2];
+	uint8_t headers[AUDIO_RETRANSMIT_RING_LEN][6];
+	struct audio_packet *packet;
+	unsigned int i, num = 0;
+	uint64_t now, age;
+	int sent;
+
+	count = MIN(count, audio_stream->ring_len);
+	now = utility_time_ns();
+
+	syscalls_memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0 ; i < count ; i++, seq++) {
+		packet = find_sent_packet(audio_stream, seq);
+		if (NULL == packet) {
+			audio_stream->resend_misses++;
+			continue;
 		}
 
-	} while (audio_stream->pcm_data_available);
+		/* A resend reply followed by the original RTP packet.  The
+		 * packet's first two bytes are written here rather than
+		 * taken from the ring, so a resend never carries the
+		 * marker bit. */
+		headers[num][0] = 0x80;
+		headers[num][1] = 0xd6;
+		headers[num][2] = seq >> 8;
+		headers[num][3] = seq & 0xff;
+		headers[num][4] = RTP_AUDIO_UDP_BYTE0;
+		headers[num][5] = RTP_AUDIO_UDP_BYTE1;
+
+		iov[num][0].iov_base = headers[num];
+		iov[num][0].iov_len = sizeof(headers[num]);
+		iov[num][1].iov_base = packet->buf->data +
+			RTP_INTERLEAVED_HEADER_LEN + 2;
+		iov[num][1].iov_len = packet->len -
+			RTP_INTERLEAVED_HEADER_LEN - 2;
+		msgs[num].msg_hdr.msg_iov = iov[num];
+		msgs[num].msg_hdr.msg_iovlen = 2;
+
+		age = now - packet->sent_ns;
+		audio_stream->resend_age_total_ns += age;
+		audio_stream->resend_age_max_ns =
+			MAX(audio_stream->resend_age_max_ns, age);
+		num++;
+	}
 
-	while (UTILITY_SUCCESS == read_server(audio_stream->session_fd) &&
-		retries < SERVER_READ_RETRIES) {
+	if (0 == num) {
+		return;
+	}
 
-		INFO("Waiting for server to close the connection\n");
-		syscalls_sleep(2);
-		retries++;
+	sent = syscalls_sendmmsg(audio_stream->rtp_control_fd, msgs, num, 0);
+	if (sent < 0) {
+		ERRR("Failed to resend packets: %s\n", strerror(errno));
+		return;
 	}
 
+	audio_stream->packets_resent += sent;
+	metrics_add(METRIC_PACKETS_RESENT, sent);
+	RAOPD_PROBE4(resend, audio_stream->session_id, (uint16_t)(seq - count),
+		     count, sent);
+	flight_record(audio_stream->recorder, FLIGHT_RESEND,
+		      (uint16_t)(seq - count), count, sent);
 
-out:
-	FUNC_RETURN;
-	return ret;
+	DEBG("Resent %d of %u packets from seq %u\n", sent, count,
+	     (unsigned int)(uint16_t)(seq - count));
 }
 
 
-utility_retcode_t send_audio_stream(struct audio_stream *audio_stream,
-				    struct aes_data *aes_data)
+/* Answers the resend requests waiting on the control port.  A
+ * request is 0x80 0xd5, its own sequence number, then the first
+ * missing sequence number and how many follow it. */
+static void handle_resend_requests(struct audio_stream *audio_stream)
 {
-	lt_set_level(LT_AUDIO_STREAM, LT_INFO);
-	lt_set_level(LT_RAOP_PLAY_SEND_AUDIO, LT_INFO);
+	uint8_t buf[64];
+	int read_ret;
 
-	open_audio_dump_files();
+	if (audio_stream->rtp_control_fd < 0) {
+		return;
+	}
 
-	INFO("Starting to send audio stream\n");
+	while ((read_ret = syscalls_recv(audio_stream->rtp_control_fd,
+					 buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		if (read_ret < 8 || 0xd5 != buf[1]) {
+			continue;
+		}
+
+		audio_stream->resend_requests++;
+		resend_packets(audio_stream,
+			       (buf[4] << 8) | buf[5],
+			       (buf[6] << 8) | buf[7]);
+	}
+}
 
-	return send_audio_stream_internal(audio_stream, aes_data);
+
+/* Reads and converts the next chunk.  chunk->pcm_len is 0 at the end
+ * of the PCM data.  The chunk stays valid until the next read. */
+utility_retcode_t read_audio_chunk(struct audio_stream *audio_stream,
+					  struct audio_chunk *chunk)
+{
+	utility_retcode_t ret;
+	uint64_t begin;
+
+	begin_audio_chunk(audio_stream);
+	chunk->pcm_len = 0;
+
+	RAOPD_PROBE2(read_start, audio_stream->session_id,
+		     audio_stream->next_seq);
+	begin = stage_latency_begin(audio_stream->latency);
+	ret = read_audio_data(audio_stream);
+	stage_latency_end(audio_stream->latency, STAGE_READ, begin);
+	RAOPD_PROBE3(read_done, audio_stream->session_id,
+		     audio_stream->next_seq, audio_stream->pcm_len);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Failed to read audio data\n");
+		goto out;
+	}
+
+	if (0 == audio_stream->pcm_len) {
+		goto out;
+	}
+
+	if (audio_stream->pcm_len < PCM_READ_SIZE) {
+		audio_stream->short_chunks++;
+	}
+
+	if (!audio_stream->chunk_converted) {
+		RAOPD_PROBE2(convert_start, audio_stream->session_id,
+			     audio_stream->next_seq);
+		begin = stage_latency_begin(audio_stream->latency);
+		ret = convert_audio_data(audio_stream);
+		stage_latency_end(audio_stream->latency, STAGE_CONVERT, begin);
+		RAOPD_PROBE3(convert_done, audio_stream->session_id,
+			     audio_stream->next_seq,
+			     audio_stream->converted_len);
+		if (UTILITY_SUCCESS != ret) {
+			ERRR("Failed to convert audio data\n");
+			goto out;
+		}
+		flight_record(audio_stream->recorder, FLIGHT_CONVERTED, 0,
+			      audio_stream->converted_len, 0);
+	}
+
+	chunk->data = audio_stream->converted_buf;
+	chunk->len = audio_stream->converted_len;
+	chunk->pcm_len = audio_stream->pcm_len;
+	chunk->end_frame = (audio_stream->pcm_size -
+			    audio_stream->pcm_remaining) / PCM_BYTES_PER_FRAME;
+	chunk->track_start = audio_stream->track_starting;
+	audio_stream->track_starting = 0;
+
+out:
+	return ret;
+}
+
+
+/* Encrypts a converted chunk into the packet at the tail of the send
+ * queue. */
+static utility_retcode_t queue_audio_chunk(struct audio_stream *audio_stream,
+					   struct aes_data *aes_data,
+					   const struct audio_chunk *chunk)
+{
+	utility_retcode_t ret;
+	struct audio_packet *packet;
+	uint64_t begin;
+
+	packet = ring_packet(audio_stream, audio_stream->next_seq);
+	packet->sent_ns = 0;
+
+	if (utility_buf_shared(packet->buf)) {
+		utility_buf_put(packet->buf);
+		packet->buf = utility_buf_alloc(packet_pool);
+		if (NULL == packet->buf) {
+			ERRR("Failed to allocate memory for transmit audio buffer\n");
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
+	}
+	audio_stream->transmit_buf = packet->buf->data;
+
+	RAOPD_PROBE2(encrypt_start, audio_stream->session_id,
+		     audio_stream->next_seq);
+	begin = stage_latency_begin(audio_stream->latency);
+	ret = encrypt_audio_data(audio_stream, aes_data, chunk);
+	stage_latency_end(audio_stream->latency, STAGE_ENCRYPT, begin);
+	RAOPD_PROBE3(encrypt_done, audio_stream->session_id,
+		     audio_stream->next_seq, audio_stream->encrypted_len);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Failed to encrypt audio data\n");
+		goto out;
+	}
+
+	packet->seq = audio_stream->next_seq++;
+	packet->rtp_time = audio_stream->next_rtp_time;
+	audio_stream->next_rtp_time += chunk->pcm_len / PCM_BYTES_PER_FRAME;
+
+	begin = stage_latency_begin(audio_stream->latency);
+	prepare_transmit_buf(audio_stream, packet);
+	stage_latency_end(audio_stream->latency, STAGE_FRAME, begin);
+
+	packet->len = audio_stream->transmit_len;
+	packet->buf->len = packet->len;
+	packet->pcm_len = chunk->pcm_len;
+	packet->end_frame = chunk->end_frame;
+	packet->track_start = chunk->track_start;
+	audio_stream->queue_len++;
+	metrics_gauge_add(METRIC_SEND_QUEUE, 1);
+
+	flight_record(audio_stream->recorder, FLIGHT_QUEUED, packet->seq,
+		      audio_stream->queue_len, 0);
+
+out:
+	return ret;
+}
+
+
+/* Reads, converts and encrypts the next chunk into the packet at the
+ * tail of the send queue.  Queues nothing at the end of the PCM data. */
+static utility_retcode_t queue_audio_packet(struct audio_stream *audio_stream,
+					    struct aes_data *aes_data)
+{
+	utility_retcode_t ret;
+	struct audio_chunk chunk;
+
+	ret = read_audio_chunk(audio_stream, &chunk);
+	if (UTILITY_SUCCESS != ret || 0 == chunk.pcm_len) {
+		goto out;
+	}
+
+	ret = queue_audio_chunk(audio_stream, aes_data, &chunk);
+
+out:
+	return ret;
+}
+
+
+/* Writes the packet at the head of the send queue. */
+static utility_retcode_t send_queued_packet(struct audio_stream *audio_stream)
+{
+	utility_retcode_t ret;
+	struct audio_packet *packet;
+	uint64_t begin, now;
+
+	packet = ring_packet(audio_stream, audio_stream->rtp_seq);
+
+	audio_stream->transmit_buf = packet->buf->data;
+	audio_stream->transmit_len = packet->len;
+	audio_stream->written = audio_stream->rtp_over_udp ?
+		RTP_INTERLEAVED_HEADER_LEN : 0;
+	audio_stream->server_ready_for_reading = 0;
+	audio_stream->server_ready_for_writing = 0;
+
+	/* Queued before it was known to be the first, so marked now */
+	if (audio_stream->rtp_over_udp && audio_stream->marker) {
+		packet->buf->data[RTP_INTERLEAVED_HEADER_LEN + 1] |= RTP_MARKER;
+	}
+
+	RAOPD_PROBE3(write_start, audio_stream->session_id, packet->seq,
+		     packet->len);
+	begin = stage_latency_begin(audio_stream->latency);
+	ret = poll_server_and_write_data(audio_stream);
+	stage_latency_end(audio_stream->latency, STAGE_WRITE, begin);
+	RAOPD_PROBE3(write_done, audio_stream->session_id, packet->seq,
+		     audio_stream->written);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Session ended\n");
+		goto out;
+	}
+
+	now = utility_time_ns();
+	if (packet->track_start) {
+		if (0 != audio_stream->last_packet_ns) {
+			audio_stream->track_gap_ns =
+				now - audio_stream->last_packet_ns;
+		}
+		audio_stream->track_first_packet_ns = now;
+	}
+	audio_stream->last_packet_ns = now;
+	audio_stream->marker = UTILITY_FALSE;
+	packet->sent_ns = now;
+	flight_record(audio_stream->recorder, FLIGHT_SENT, packet->seq,
+		      packet->len, 0);
+
+	if (NULL != audio_stream->timing && audio_stream->reanchor) {
+		rtp_timing_anchor(audio_stream->timing, packet->rtp_time, now);
+		audio_stream->reanchor = UTILITY_FALSE;
+	}
+	audio_stream->packets_sent++;
+	metrics_add(METRIC_PACKETS_SENT, 1);
+
+	if (0 != audio_stream->restart_ns) {
+		audio_stream->restart_latency_ns = now - audio_stream->restart_ns;
+		audio_stream->restart_ns = 0;
+	}
+
+	audio_stream->rtp_seq = packet->seq + 1;
+	audio_stream->rtp_time = packet->rtp_time +
+		packet->pcm_len / PCM_BYTES_PER_FRAME;
+	audio_stream->position = packet->end_frame;
+
+	audio_stream->queue_len--;
+	metrics_gauge_add(METRIC_SEND_QUEUE, -1);
+
+out:
+	return ret;
+}
+
+
+/* Notes the failure in the stream's flight recorder and writes the
+ * recorder out. */
+static void record_failure(struct audio_stream *audio_stream)
+{
+	flight_record(audio_stream->recorder, FLIGHT_ERROR,
+		      audio_stream->rtp_seq, 0, 0);
+	flight_recorder_dump(audio_stream->recorder, "error");
+}
+
+
+/* Writes the packet at the head of the send queue, answers any
+ * resend requests that have come in and tops the queue up again.
+ * Sets done once the current track, and any that follow it in the
+ * playlist, have been written to the end of their PCM data. */
+utility_retcode_t send_audio_packet(struct audio_stream *audio_stream,
+				    struct aes_data *aes_data,
+				    utility_boolean_t *done)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	*done = UTILITY_FALSE;
+
+	if (0 == audio_stream->queue_len &&
+	    audio_stream->pcm_data_available) {
+		ret = queue_audio_packet(audio_stream, aes_data);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+	}
+
+	if (0 == audio_stream->queue_len) {
+		*done = UTILITY_TRUE;
+		goto out;
+	}
+
+	ret = send_queued_packet(audio_stream);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	handle_resend_requests(audio_stream);
+
+	while (audio_stream->queue_len < AUDIO_SEND_QUEUE_LEN &&
+	       audio_stream->pcm_data_available) {
+		ret = queue_audio_packet(audio_stream, aes_data);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+	}
+
+out:
+	if (UTILITY_SUCCESS != ret) {
+		record_failure(audio_stream);
+	}
+
+	return ret;
+}
+
+
+/* Encrypts a chunk read from a source stream (see
+ * init_audio_source()) for this stream's server, writes it and
+ * answers any resend requests that have come in. */
+utility_retcode_t send_audio_chunk(struct audio_stream *audio_stream,
+				   struct aes_data *aes_data,
+				   const struct audio_chunk *chunk)
+{
+	utility_retcode_t ret;
+
+	ret = queue_audio_chunk(audio_stream, aes_data, chunk);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	ret = send_queued_packet(audio_stream);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	handle_resend_requests(audio_stream);
+
+out:
+	if (UTILITY_SUCCESS != ret) {
+		record_failure(audio_stream);
+	}
+
+	return ret;
+}
+
+
+/* Sends the current track, and any that follow it in the playlist,
+ * to the end of their PCM data, and closes the PCM file.
+ *
+ * Up to AUDIO_SEND_QUEUE_LEN packets are encoded ahead of the one
+ * being written.  If a pause is requested, returns with the queue
+ * and the PCM file as they are and paused set; calling this again
+ * resumes from the packets already queued. */
+utility_retcode_t send_audio_track(struct audio_stream *audio_stream,
+				   struct aes_data *aes_data)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	utility_boolean_t done;
+
+	FUNC_ENTER;
+
+	if (audio_stream->paused) {
+		DEBG("Resuming with %d packets queued\n",
+		     audio_stream->queue_len);
+		flight_record(audio_stream->recorder, FLIGHT_RESUME, 0,
+			      audio_stream->queue_len, 0);
+		audio_stream->paused = UTILITY_FALSE;
+	} else if (have_next_track(audio_stream) &&
+		   UTILITY_SUCCESS == start_prefetch(audio_stream)) {
+		request_prefetch(audio_stream);
+	}
+
+	for (;;) {
+		ret = send_audio_packet(audio_stream, aes_data, &done);
+		if (UTILITY_SUCCESS != ret || done) {
+			goto out;
+		}
+
+		if (__atomic_load_n(&audio_stream->pause_requested,
+				    __ATOMIC_ACQUIRE) ||
+		    __atomic_load_n(&audio_stream->seek_requested,
+				    __ATOMIC_ACQUIRE)) {
+			audio_stream->paused = UTILITY_TRUE;
+			DEBG("Pausing with %d packets queued\n",
+			     audio_stream->queue_len);
+			flight_record(audio_stream->recorder, FLIGHT_PAUSE, 0,
+				      audio_stream->queue_len, 0);
+			goto paused;
+		}
+	}
+
+out:
+	close_audio_track(audio_stream);
+
+paused:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Forgets the packets encoded but not yet written.  The next packet
+ * encoded takes the sequence number and timestamp the first of them
+ * had, so the stream carries on from what the server has seen. */
+static void drop_queued_packets(struct audio_stream *audio_stream)
+{
+	metrics_gauge_add(METRIC_SEND_QUEUE, -audio_stream->queue_len);
+	audio_stream->queue_len = 0;
+	audio_stream->next_seq = audio_stream->rtp_seq;
+	audio_stream->next_rtp_time = audio_stream->rtp_time;
+}
+
+
+/* Moves a paused track to frame, counted from the start of the track
+ * being read.  PCM frames are all the same size, so the frame gives
+ * the file offset directly and any frame can be sought to, not just
+ * the start of a packet.  The packets queued at the old position are
+ * dropped, so audio from the new position is at most one packet
+ * away once the track resumes. */
+utility_retcode_t seek_audio_track(struct audio_stream *audio_stream,
+				   uint64_t frame)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	off_t offset = frame * PCM_BYTES_PER_FRAME;
+
+	FUNC_ENTER;
+
+	if (audio_stream->pcm_fd < 0) {
+		ERRR("No track to seek in\n");
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	if (offset > audio_stream->pcm_size) {
+		ERRR("Seek to frame %llu is past the end of the track\n",
+		     (unsigned long long)frame);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	if (syscalls_lseek(audio_stream->pcm_fd, offset, SEEK_SET) < 0) {
+		ERRR("Failed to seek in PCM data: %s\n", strerror(errno));
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	DEBG("Seeking from frame %llu to %llu, dropping %d packets\n",
+	     (unsigned long long)audio_stream->position,
+	     (unsigned long long)frame, audio_stream->queue_len);
+
+	drop_queued_packets(audio_stream);
+
+	audio_stream->pcm_remaining = audio_stream->pcm_size - offset;
+	audio_stream->pcm_data_available = 1;
+	audio_stream->position = frame;
+
+	/* What was prefetched joins on at the old position */
+	if (AUDIO_PREFETCH_READY == wait_prefetch(&audio_stream->prefetch)) {
+		syscalls_close(audio_stream->prefetch.fd);
+	}
+	request_prefetch(audio_stream);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Drops whatever is left of the current track, paused or not. */
+void close_audio_track(struct audio_stream *audio_stream)
+{
+	FUNC_ENTER;
+
+	stop_prefetch(audio_stream);
+
+	if (audio_stream->pcm_fd >= 0) {
+		syscalls_close(audio_stream->pcm_fd);
+	}
+	audio_stream->pcm_fd = -1;
+	audio_stream->pcm_data_available = 0;
+	drop_queued_packets(audio_stream);
+	audio_stream->paused = UTILITY_FALSE;
+	__atomic_store_n(&audio_stream->pause_requested, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&audio_stream->seek_requested, 0, __ATOMIC_RELAXED);
+
+	flight_record(audio_stream->recorder, FLIGHT_TRACK_END, 0, 0, 0);
+
+	FUNC_RETURN;
+	return;
+}
+
+
+/* Sets up a stream that only reads and converts, with no server of
+ * its own: a source whose chunks (see read_audio_chunk()) are sent
+ * to several servers with send_audio_chunk().  Tracks are opened
+ * with open_audio_track(). */
+utility_retcode_t init_audio_source(struct audio_stream *source)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	FUNC_ENTER;
+
+	syscalls_memset(source, 0, sizeof(*source));
+	source->pcm_fd = -1;
+	source->session_id = "source";
+	source->rtp_control_fd = -1;
+	/* The sessions time their own encrypting and writing */
+	source->latency = stage_latency_open("source", STAGE_PATH_RAOPD);
+
+	source->pcm_buf = syscalls_malloc(PCM_BUFLEN);
+	source->converted_buf = syscalls_malloc(CONVERTED_BUFLEN);
+	if (NULL == source->pcm_buf || NULL == source->converted_buf) {
+		ERRR("Failed to allocate memory for audio source\n");
+		destroy_audio_source(source);
+		ret = UTILITY_FAILURE;
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+void destroy_audio_source(struct audio_stream *source)
+{
+	FUNC_ENTER;
+
+	close_audio_track(source);
+
+	stage_latency_log(source->latency);
+	stage_latency_close(source->latency);
+	source->latency = NULL;
+
+	syscalls_free(source->pcm_buf);
+	syscalls_free(source->converted_buf);
+	source->pcm_buf = NULL;
+	source->converted_buf = NULL;
+
+	FUNC_RETURN;
+}
+
+
+/* Gives the packet buffers back; nothing more can be queued or
+ * resent. */
+static void release_send_ring(struct audio_stream *audio_stream)
+{
+	unsigned int i;
+
+	for (i = 0 ; i < audio_stream->ring_len ; i++) {
+		if (NULL != audio_stream->send_ring[i].buf) {
+			utility_buf_put(audio_stream->send_ring[i].buf);
+			audio_stream->send_ring[i].buf = NULL;
+		}
+	}
+
+	audio_stream->ring_len = 0;
+	metrics_gauge_add(METRIC_SEND_QUEUE, -audio_stream->queue_len);
+	audio_stream->queue_len = 0;
+	audio_stream->transmit_buf = NULL;
+}
+
+
+/* Waits for the server to close the connection once the last track
+ * has been sent, then frees the stream's buffers. */
+utility_retcode_t finish_audio_stream(struct audio_stream *audio_stream)
+{
+	struct pollfd pfd;
+	int retries = 0;
+
+	FUNC_ENTER;
+
+	/* There is no connection for the server to close, but it may
+	 * still be asking for the last packets again */
+	if (audio_stream->rtp_over_udp) {
+		pfd.fd = audio_stream->rtp_control_fd;
+		pfd.events = POLLIN;
+
+		while (pfd.fd >= 0 &&
+		       syscalls_poll(&pfd, 1, AUDIO_RESEND_LINGER) > 0) {
+			handle_resend_requests(audio_stream);
+		}
+		goto out;
+	}
+
+	while (UTILITY_SUCCESS == read_server(audio_stream) &&
+		retries < SERVER_READ_RETRIES) {
+
+		INFO("Waiting for server to close the connection\n");
+		syscalls_sleep(2);
+		retries++;
+	}
+
+out:
+	release_send_ring(audio_stream);
+
+	syscalls_free(audio_stream->pcm_buf);
+	syscalls_free(audio_stream->converted_buf);
+	syscalls_free(audio_stream->encrypted_buf);
+	audio_stream->pcm_buf = NULL;
+	audio_stream->converted_buf = NULL;
+	audio_stream->encrypted_buf = NULL;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t raopd_send_audio_stream(struct audio_stream *audio_stream,
+					  struct aes_data *aes_data)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	FUNC_ENTER;
+
+	ret = initialize_aes(aes_data);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Failed to initialize AES data\n");
+		goto out;
+	}
+
+	ret = send_audio_track(audio_stream, aes_data);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	finish_audio_stream(audio_stream);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Debugging aids for the audio path: more logging, and copies of
+ * the data at each stage under ./audio_debug. */
+void begin_audio_stream_debug(void)
+{
+	lt_set_level(LT_AUDIO_STREAM, LT_INFO);
+	lt_set_level(LT_RAOP_PLAY_SEND_AUDIO, LT_INFO);
+
+	open_audio_dump_files();
+}
+
+
+utility_retcode_t send_audio_stream(struct audio_stream *audio_stream,
+				    struct aes_data *aes_data)
+{
+	utility_retcode_t ret;
+
+	begin_audio_stream_debug();
+
+	INFO("Starting to send audio stream\n");
+
+	audio_stream->latency = stage_latency_open(CODE_VERSION, CODE_PATH);
+
+	ret = send_audio_stream_internal(audio_stream, aes_data);
+
+	stage_latency_log(audio_stream->latency);
+	stage_latency_close(audio_stream->latency);
+	audio_stream->latency = NULL;
+
+	return ret;
 }
@@ -19,8 +19,13 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef AUDIO_STREAM_H
 #define AUDIO_STREAM_H
 
+
 #include "encryption.h"
 #include "config.h"
+#include "timeline.h"
+#include "rtp_timing.h"
+#include "flight_recorder.h"
+#include "stage_latency.h"
 
 #define PCM_BUFLEN 32 * 1024
 #define CONVERTED_BUFLEN 32 * 1024
@@ -28,6 +33,35 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #define TRANSMIT_BUFLEN 32 * 1024
 #define PCM_READ_SIZE 16 * 1024
 #define PCM_BYTES_PER_SAMPLE 2
+#define PCM_CHANNELS 2
+#define PCM_BYTES_PER_FRAME (PCM_BYTES_PER_SAMPLE * PCM_CHANNELS)
+
+/* The '$', channel and length in front of each RTP packet on the TCP
+ * connection; over UDP the packet goes without it. */
+#define RTP_INTERLEAVED_HEADER_LEN 4
+
+/* The first two bytes of an audio packet's RTP header.  Over UDP it
+ * is a plain RTP version 2 header with payload type 0x60, and the
+ * marker bit set on the first packet of the stream and the first
+ * after a FLUSH. */
+#define RTP_AUDIO_TCP_BYTE0 0xf0
+#define RTP_AUDIO_TCP_BYTE1 0xff
+#define RTP_AUDIO_UDP_BYTE0 0x80
+#define RTP_AUDIO_UDP_BYTE1 0x60
+#define RTP_MARKER 0x80
+
+/* Packets encoded ahead of the one being written: about 370 ms */
+#define AUDIO_SEND_QUEUE_LEN 4
+/* Packets kept for resending over UDP, send queue included: about
+ * 2.6 s of audio.  Both lengths are powers of two. */
+#define AUDIO_RETRANSMIT_RING_LEN 32
+/* Written packets kept in the shared packet pool for reuse */
+#define AUDIO_PACKET_POOL_FREE 256
+/* How long to keep answering resend requests after the last packet */
+#define AUDIO_RESEND_LINGER 200 /* miliseconds */
+/* The per-packet log messages that are sampled rather than rate
+ * limited log one packet in this many */
+#define AUDIO_LOG_SAMPLE 64
 
 #define AUDIO_WRITE_RETRIES 10
 #define SERVER_READ_RETRIES 10
@@ -39,10 +73,73 @@ struct transmit_buffer {
 	uint8_t data[];
 };
 
+/* An encrypted packet waiting to be written.  If anyone else holds a
+ * reference to buf when the slot comes round again, the slot takes a
+ * new buffer rather than writing over it. */
+struct audio_packet {
+	struct utility_buf *buf;
+	size_t len;
+	/* utility_time_ns() when it was written, 0 while queued */
+	uint64_t sent_ns;
+	size_t pcm_len;
+	uint16_t seq;
+	uint32_t rtp_time;
+	/* Frames of its track up to the end of this packet */
+	uint64_t end_frame;
+	int track_start;
+};
+
+/* A chunk read and converted, to be encrypted for one server or
+ * several */
+struct audio_chunk {
+	const uint8_t *data;
+	size_t len;
+	size_t pcm_len;
+	/* As for struct audio_packet */
+	uint64_t end_frame;
+	int track_start;
+};
+
+typedef enum {
+	AUDIO_PREFETCH_IDLE,
+	AUDIO_PREFETCH_REQUESTED,
+	AUDIO_PREFETCH_READY,
+	AUDIO_PREFETCH_FAILED
+} audio_prefetch_state_t;
+
+/* The chunk that joins the current track to the next, built by a
+ * thread while the current track plays. */
+struct audio_prefetch {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	utility_boolean_t running;
+	audio_prefetch_state_t state;
+
+	/* Request: the tail of the current track and the next file */
+	const char *file;
+	int current_fd;
+	off_t tail_offset;
+	size_t tail_len;
+
+	/* Result: the next track, open and read past the part that
+	 * went into the chunk */
+	int fd;
+	off_t size;
+	size_t used;
+	uint8_t *pcm_buf;
+	size_t pcm_len;
+	uint8_t *converted_buf;
+	size_t converted_len;
+};
+
 struct audio_stream {
 	char pcm_data_file[MAX_FILE_NAME_LEN];
 	int pcm_fd;
 	int session_fd;
+	/* session_fd is a UDP socket connected to the server's data
+	 * port rather than a TCP connection */
+	utility_boolean_t rtp_over_udp;
 	int server_ready_for_reading;
 	int server_ready_for_writing;
 
@@ -51,10 +148,21 @@ struct audio_stream {
 	size_t pcm_len;
 	size_t pcm_num_samples_read;
 	int pcm_data_available;
+	off_t pcm_size;
+	size_t pcm_remaining;
+
+	/* Tracks to play after the current one, without a break */
+	const char * const *playlist;
+	int playlist_len;
+	int playlist_next;
+	struct audio_prefetch prefetch;
+	unsigned int track_changes;
+	unsigned int short_chunks;
 
 	uint8_t *converted_buf;
 	size_t converted_bufsize;
 	size_t converted_len;
+	int chunk_converted;
 
 	uint8_t *encrypted_buf;
 	size_t encrypted_bufsize;
@@ -64,8 +172,74 @@ struct audio_stream {
 	size_t transmit_bufsize;
 	size_t transmit_len;
 
+	/* The packet with sequence number seq is in slot seq &
+	 * (ring_len - 1).  The queue is the queue_len slots from
+	 * rtp_seq on; over UDP the slots behind it hold the packets
+	 * already written, for resending. */
+	struct audio_packet send_ring[AUDIO_RETRANSMIT_RING_LEN];
+	unsigned int ring_len;
+	int queue_len;
+
+	/* RTP over UDP: the socket resend requests arrive on, connected
+	 * to the server's control port, or -1 */
+	int rtp_control_fd;
+	unsigned long packets_sent;
+	unsigned int resend_requests;
+	unsigned int packets_resent;
+	unsigned int resend_misses;
+	uint64_t resend_age_total_ns;
+	uint64_t resend_age_max_ns;
+	/* The session's sync packets, or NULL; reanchor is set when
+	 * the next packet written starts the stream or follows a
+	 * FLUSH */
+	struct rtp_timing *timing;
+	utility_boolean_t reanchor;
+	/* Set when the next packet written starts the stream or
+	 * follows a FLUSH, for the RTP marker bit over UDP */
+	utility_boolean_t marker;
+
+	/* Set, from anywhere, to stop send_audio_track() after the
+	 * packet it is writing.  A seek stops it the same way; its
+	 * flag is stored with release order after seek_frame, so
+	 * loading it with acquire order makes seek_frame valid. */
+	int pause_requested;
+	int seek_requested;
+	uint64_t seek_frame;
+	utility_boolean_t paused;
+	/* utility_time_ns() when a resume or seek was started, and the
+	 * time from then to the first packet written */
+	uint64_t restart_ns;
+	uint64_t restart_latency_ns;
+
 	size_t written;
 	unsigned long long total_bytes_transmitted;
+
+	/* Sequence number and timestamp (in frames) the next packet
+	 * written will carry, for RTP-Info, and the same for the next
+	 * packet encoded into the send queue. */
+	uint16_t rtp_seq;
+	uint32_t rtp_time;
+	uint16_t next_seq;
+	uint32_t next_rtp_time;
+	/* Frames of the current track written so far */
+	uint64_t position;
+	/* utility_time_ns() when the current track's first packet and
+	 * the most recent packet were written, and the time between the
+	 * last packet of the previous track and the first of this one */
+	uint64_t track_first_packet_ns;
+	uint64_t last_packet_ns;
+	uint64_t track_gap_ns;
+	int track_starting;
+
+	/* Where to note the first packet and the first reply from the
+	 * server, if anywhere. */
+	struct timeline *timeline;
+	/* The session's flight recorder, or NULL */
+	struct flight_recorder *recorder;
+	/* Where each stage of each packet is timed, or NULL */
+	struct stage_latency *latency;
+	/* The RTSP session's identifier, for probes (see probes.h) */
+	const char *session_id;
 };
 
 //#define USE_RAOP_PLAY_CODE
@@ -73,11 +247,13 @@ struct audio_stream {
 #ifdef USE_RAOP_PLAY_CODE
 
 #define CODE_VERSION "raop_play"
+#define CODE_PATH STAGE_PATH_RAOP_PLAY
 #define send_audio_stream_internal raop_play_send_audio_stream
 
 #else /* #ifdef USE_RAOP_PLAY_CODE */
 
 #define CODE_VERSION "raopd"
+#define CODE_PATH STAGE_PATH_RAOPD
 #define send_audio_stream_internal raopd_send_audio_stream
 
 #endif /* #ifdef USE_RAOP_PLAY_CODE */
@@ -89,7 +265,27 @@ utility_retcode_t raopd_send_audio_stream(struct audio_stream *audio_stream,
 					  struct aes_data *aes_data);
 utility_retcode_t send_audio_stream(struct audio_stream *audio_stream,
 				    struct aes_data *aes_data);
+void begin_audio_stream_debug(void);
+utility_retcode_t open_audio_track(struct audio_stream *audio_stream,
+				   const char *pcm_data_file);
+utility_retcode_t init_audio_source(struct audio_stream *source);
+void destroy_audio_source(struct audio_stream *source);
+utility_retcode_t read_audio_chunk(struct audio_stream *audio_stream,
+				   struct audio_chunk *chunk);
+utility_retcode_t send_audio_chunk(struct audio_stream *audio_stream,
+				   struct aes_data *aes_data,
+				   const struct audio_chunk *chunk);
+utility_retcode_t send_audio_packet(struct audio_stream *audio_stream,
+				    struct aes_data *aes_data,
+				    utility_boolean_t *done);
+utility_retcode_t send_audio_track(struct audio_stream *audio_stream,
+				   struct aes_data *aes_data);
+utility_retcode_t seek_audio_track(struct audio_stream *audio_stream,
+				   uint64_t frame);
+void close_audio_track(struct audio_stream *audio_stream);
+utility_retcode_t finish_audio_stream(struct audio_stream *audio_stream);
 
+void fill_rtp_header(uint8_t *header, uint16_t seq, uint32_t rtp_time);
 utility_retcode_t convert_audio_data(struct audio_stream *audio_stream);
 utility_retcode_t raop_play_convert_audio_data(struct audio_stream *audio_stream);
 utility_retcode_t raopd_convert_audio_data(struct audio_stream *audio_stream);
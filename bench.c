@@ -0,0 +1,2944 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "rtsp.h"
+#include "rtsp_client.h"
+#include "encryption.h"
+#include "config.h"
+#include "timeline.h"
+#include "fake_receiver.h"
+#include "flight_recorder.h"
+#include "stage_latency.h"
+#include "metrics.h"
+#include "syscalls_acct.h"
+#include "perf_counters.h"
+
+#define DEFAULT_FACILITY LT_BENCH
+
+/* raopd_bench runs parts of raopd against local stand-ins and reports
+ * how long they take.  Nothing in here talks to real hardware. */
+
+struct bench_stats {
+	uint64_t min;
+	uint64_t max;
+	uint64_t total;
+	int count;
+};
+
+
+static void bench_stats_add(struct bench_stats *stats, uint64_t ns)
+{
+	if (0 == stats->count || ns < stats->min) {
+		stats->min = ns;
+	}
+
+	if (ns > stats->max) {
+		stats->max = ns;
+	}
+
+	stats->total += ns;
+	stats->count++;
+}
+
+
+static void bench_stats_report(const char *name, struct bench_stats *stats)
+{
+	if (0 == stats->count) {
+		ERRR("%s: no successful runs\n", name);
+		return;
+	}
+
+	INFO("%-28s runs: %4d  min: %9.3f ms  mean: %9.3f ms  max: %9.3f ms\n",
+	     name, stats->count,
+	     stats->min / 1e6,
+	     (stats->total / stats->count) / 1e6,
+	     stats->max / 1e6);
+}
+
+
+static int bench_arg(int argc, char **argv, int index, int default_value)
+{
+	if (index < argc) {
+		return (int)syscalls_strtoul(argv[index], NULL, 0);
+	}
+
+	return default_value;
+}
+
+
+/* The audio path turns its own logging up; keep it out of the
+ * measurements. */
+static int quiet_stdout(void)
+{
+	int saved_stdout, null_fd;
+
+	syscalls_fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	null_fd = syscalls_open("/dev/null", O_WRONLY, 0);
+	dup2(null_fd, STDOUT_FILENO);
+	syscalls_close(null_fd);
+
+	return saved_stdout;
+}
+
+
+static void restore_stdout(int saved_stdout)
+{
+	syscalls_fflush(stdout);
+	dup2(saved_stdout, STDOUT_FILENO);
+	syscalls_close(saved_stdout);
+}
+
+
+static utility_retcode_t time_handshakes(const char *name,
+					 unsigned int latency_ms,
+					 utility_boolean_t pipelining,
+					 utility_boolean_t refuse_pipelining,
+					 int iterations)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session session;
+	struct bench_stats stats;
+	uint64_t start;
+	int i, saved_stdout;
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	syscalls_memset(&stats, 0, sizeof(stats));
+
+	receiver.latency_ms = latency_ms;
+	receiver.refuse_pipelining = refuse_pipelining;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		return ret;
+	}
+
+	for (i = 0 ; i < iterations ; i++) {
+		init_rtsp_server(&server);
+		syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+		server.port = receiver.port;
+		server.pipelining = pipelining;
+
+		start = utility_time_ns();
+		ret = rtsp_start_session(&session, &server);
+		if (UTILITY_SUCCESS == ret) {
+			bench_stats_add(&stats, utility_time_ns() - start);
+		}
+
+		saved_stdout = quiet_stdout();
+		rtsp_end_session(&session);
+		restore_stdout(saved_stdout);
+	}
+
+	fake_receiver_stop(&receiver);
+	bench_stats_report(name, &stats);
+
+	return ret;
+}
+
+
+/* A handshake with a server that refuses SETUP must fail, whether
+ * SETUP goes on its own or pipelined after ANNOUNCE. */
+static utility_retcode_t check_refused_setup(utility_boolean_t pipelining)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session session;
+	int saved_stdout;
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.refuse_method = "SETUP";
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		return ret;
+	}
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+	server.pipelining = pipelining;
+
+	if (UTILITY_SUCCESS == rtsp_start_session(&session, &server) ||
+	    RTSP_HANDSHAKE_FAILED != session.handshake.state) {
+		ERRR("Handshake %s succeeded though SETUP was refused\n",
+		     pipelining ? "pipelined" : "in lock-step");
+		ret = UTILITY_FAILURE;
+	}
+
+	saved_stdout = quiet_stdout();
+	rtsp_end_session(&session);
+	restore_stdout(saved_stdout);
+	fake_receiver_stop(&receiver);
+
+	return ret;
+}
+
+
+/* Time from starting to connect until the SET_PARAMETER that follows
+ * RECORD has been answered.  Then checks that a refused SETUP fails
+ * the handshake. */
+static utility_retcode_t bench_handshake(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 50);
+	int iterations = bench_arg(argc, argv, 1, 10);
+
+	INFO("RTSP handshake, %u ms round trip, %d runs per mode\n",
+	     latency_ms, iterations);
+
+	time_handshakes("lock-step", latency_ms,
+			UTILITY_FALSE, UTILITY_FALSE, iterations);
+	time_handshakes("pipelined", latency_ms,
+			UTILITY_TRUE, UTILITY_FALSE, iterations);
+	time_handshakes("pipelined, refused", latency_ms,
+			UTILITY_TRUE, UTILITY_TRUE, iterations);
+
+	if (UTILITY_SUCCESS != check_refused_setup(UTILITY_FALSE) ||
+	    UTILITY_SUCCESS != check_refused_setup(UTILITY_TRUE)) {
+		ret = UTILITY_FAILURE;
+	} else {
+		INFO("Refused SETUP fails the handshake\n");
+	}
+
+	return ret;
+}
+
+
+static utility_retcode_t time_sessions(struct fake_receiver *receiver,
+				      utility_boolean_t concurrent,
+				      int num_sessions)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_server *servers;
+	struct rtsp_session *sessions;
+	uint64_t start, elapsed;
+	int i, num_done = 0, saved_stdout;
+
+	servers = syscalls_malloc(num_sessions * sizeof(*servers));
+	sessions = syscalls_malloc(num_sessions * sizeof(*sessions));
+
+	for (i = 0 ; i < num_sessions ; i++) {
+		init_rtsp_server(&servers[i]);
+		syscalls_strncpy(servers[i].host, receiver->host,
+				 sizeof(servers[i].host));
+		servers[i].port = receiver->port;
+	}
+
+	start = utility_time_ns();
+
+	if (concurrent) {
+		ret = rtsp_start_sessions(sessions, servers, num_sessions);
+	} else {
+		for (i = 0 ; i < num_sessions ; i++) {
+			if (UTILITY_SUCCESS !=
+			    rtsp_start_session(&sessions[i], &servers[i])) {
+				ret = UTILITY_FAILURE;
+			}
+		}
+	}
+
+	elapsed = utility_time_ns() - start;
+
+	saved_stdout = quiet_stdout();
+	for (i = 0 ; i < num_sessions ; i++) {
+		if (RTSP_HANDSHAKE_DONE == sessions[i].handshake.state) {
+			num_done++;
+		}
+		rtsp_end_session(&sessions[i]);
+	}
+	restore_stdout(saved_stdout);
+
+	INFO("%-28s sessions: %4d/%-4d  total: %9.3f ms  per session: %9.3f ms\n",
+	     concurrent ? "concurrent" : "one at a time",
+	     num_done, num_sessions, elapsed / 1e6,
+	     (elapsed / num_sessions) / 1e6);
+
+	syscalls_free(sessions);
+	syscalls_free(servers);
+
+	return ret;
+}
+
+
+/* Time to bring up N sessions, one after another and all from one
+ * thread at once. */
+static utility_retcode_t bench_sessions(int argc, char **argv)
+{
+	utility_retcode_t ret;
+	struct fake_receiver receiver;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 20);
+	int num_sessions = bench_arg(argc, argv, 1, 100);
+
+	if (num_sessions <= 0) {
+		ERRR("Need at least one session\n");
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		return ret;
+	}
+
+	INFO("RTSP session startup, %u ms round trip, %d sessions\n",
+	     latency_ms, num_sessions);
+
+	ret = time_sessions(&receiver, UTILITY_FALSE, num_sessions);
+	if (UTILITY_SUCCESS == ret) {
+		ret = time_sessions(&receiver, UTILITY_TRUE, num_sessions);
+	}
+
+	fake_receiver_stop(&receiver);
+
+	return ret;
+}
+
+
+static void time_key_takes(const char *name, int iterations)
+{
+	struct aes_data aes_data;
+	struct bench_stats stats;
+	uint64_t start;
+	int i;
+
+	syscalls_memset(&stats, 0, sizeof(stats));
+
+	for (i = 0 ; i < iterations ; i++) {
+		start = utility_time_ns();
+		if (UTILITY_SUCCESS == take_aes_data(&aes_data)) {
+			bench_stats_add(&stats, utility_time_ns() - start);
+		}
+
+		/* Give the pool thread a moment to refill, as the gap
+		 * between sessions would. */
+		syscalls_usleep(2000);
+	}
+
+	bench_stats_report(name, &stats);
+}
+
+
+/* Session setup time with keys generated on demand and with keys
+ * taken from the background pool. */
+static utility_retcode_t bench_setup(int argc, char **argv)
+{
+	utility_retcode_t ret;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 0);
+	int iterations = bench_arg(argc, argv, 1, 50);
+	int pool_size;
+
+	get_aes_key_pool_size(&pool_size);
+
+	INFO("Session setup, %u ms round trip, %d runs, pool of %d\n",
+	     latency_ms, iterations, pool_size);
+
+	time_key_takes("keys, no pool", iterations);
+	time_handshakes("setup, no pool", latency_ms,
+			UTILITY_TRUE, UTILITY_FALSE, iterations);
+
+	ret = aes_key_pool_start(pool_size);
+	if (UTILITY_SUCCESS != ret) {
+		return ret;
+	}
+
+	/* Let it fill */
+	syscalls_usleep(100000);
+
+	time_key_takes("keys, pool", iterations);
+	time_handshakes("setup, pool", latency_ms,
+			UTILITY_TRUE, UTILITY_FALSE, iterations);
+
+	return aes_key_pool_stop();
+}
+
+
+/* What get_random_bytes() used to do, for comparison. */
+static utility_retcode_t read_urandom(uint8_t *buf, size_t size)
+{
+	int fd;
+	ssize_t ret;
+
+	fd = syscalls_open(RANDOM_SOURCE_PATH, O_RDONLY, 0);
+	if (fd < 0) {
+		return UTILITY_FAILURE;
+	}
+
+	ret = syscalls_read(fd, buf, size);
+	syscalls_close(fd);
+
+	return (ret == (ssize_t)size) ? UTILITY_SUCCESS : UTILITY_FAILURE;
+}
+
+
+static utility_retcode_t time_random(const char *name,
+				     utility_retcode_t (*source)(uint8_t *buf,
+								 size_t size),
+				     size_t call_size,
+				     size_t total)
+{
+	uint8_t buf[4096];
+	uint64_t start, elapsed;
+	size_t done, calls = 0;
+
+	start = utility_time_ns();
+
+	for (done = 0 ; done < total ; done += call_size) {
+		if (UTILITY_SUCCESS != source(buf, call_size)) {
+			ERRR("%s: failed after %d calls\n", name, (int)calls);
+			return UTILITY_FAILURE;
+		}
+		calls++;
+	}
+
+	elapsed = utility_time_ns() - start;
+
+	INFO("%-16s %5d bytes/call  %9.1f MB/s  %9.1f ns/call\n",
+	     name, (int)call_size,
+	     (done / 1e6) / (elapsed / 1e9),
+	     (double)elapsed / calls);
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* get_random_bytes() throughput for the sizes raopd asks for (IVs
+ * and keys, challenges) and for bulk requests. */
+static utility_retcode_t bench_random(int argc, char **argv)
+{
+	static const size_t sizes[] = { 4, 16, 256, 4096 };
+	size_t total = (size_t)bench_arg(argc, argv, 0, 16) * 1024 * 1024;
+	size_t i;
+
+	for (i = 0 ; i < sizeof(sizes) / sizeof(sizes[0]) ; i++) {
+		if (UTILITY_SUCCESS != time_random("get_random_bytes",
+						   get_random_bytes,
+						   sizes[i], total)) {
+			return UTILITY_FAILURE;
+		}
+
+		/* Three syscalls per call, so far less data */
+		if (UTILITY_SUCCESS != time_random("open/read/close",
+						   read_urandom,
+						   sizes[i], total / 64)) {
+			return UTILITY_FAILURE;
+		}
+	}
+
+	return UTILITY_SUCCESS;
+}
+
+
+static int count_open_fds(void)
+{
+	DIR *dir;
+	int count = 0;
+
+	dir = opendir("/proc/self/fd");
+	if (NULL == dir) {
+		return -1;
+	}
+
+	while (NULL != readdir(dir)) {
+		count++;
+	}
+
+	closedir(dir);
+
+	/* ".", ".." and the directory's own fd */
+	return count - 3;
+}
+
+
+struct load_worker {
+	struct fake_receiver *receiver;
+	int rounds;
+	int sessions;
+	int failures;
+	pthread_t thread;
+};
+
+
+static void *run_load_worker(void *arg)
+{
+	struct load_worker *worker = arg;
+	struct rtsp_server *servers;
+	struct rtsp_session *sessions;
+	int round, i;
+
+	servers = syscalls_malloc(worker->sessions * sizeof(*servers));
+	sessions = syscalls_malloc(worker->sessions * sizeof(*sessions));
+
+	for (round = 0 ; round < worker->rounds ; round++) {
+		for (i = 0 ; i < worker->sessions ; i++) {
+			init_rtsp_server(&servers[i]);
+			syscalls_strncpy(servers[i].host, worker->receiver->host,
+					 sizeof(servers[i].host));
+			servers[i].port = worker->receiver->port;
+		}
+
+		if (UTILITY_SUCCESS != rtsp_start_sessions(sessions, servers,
+							   worker->sessions)) {
+			worker->failures++;
+		}
+
+		for (i = 0 ; i < worker->sessions ; i++) {
+			rtsp_end_session(&sessions[i]);
+		}
+	}
+
+	syscalls_free(sessions);
+	syscalls_free(servers);
+
+	return NULL;
+}
+
+
+/* Runs many sessions from several threads and checks that the
+ * process ends up with the fds it started with.  Exits non-zero if
+ * any leaked. */
+static utility_retcode_t bench_fdleak(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct load_worker *workers;
+	int num_threads = bench_arg(argc, argv, 0, 4);
+	int rounds = bench_arg(argc, argv, 1, 50);
+	int sessions = bench_arg(argc, argv, 2, 16);
+	int before, after, i, failures = 0, saved_stdout;
+	uint64_t start;
+
+	if (num_threads <= 0 || sessions <= 0) {
+		ERRR("Need at least one thread and one session\n");
+		return UTILITY_FAILURE;
+	}
+
+	before = count_open_fds();
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		return ret;
+	}
+
+	workers = syscalls_malloc(num_threads * sizeof(*workers));
+	syscalls_memset(workers, 0, num_threads * sizeof(*workers));
+
+	/* Every session ended logs its timeline */
+	saved_stdout = quiet_stdout();
+	start = utility_time_ns();
+
+	for (i = 0 ; i < num_threads ; i++) {
+		workers[i].receiver = &receiver;
+		workers[i].rounds = rounds;
+		workers[i].sessions = sessions;
+		syscalls_pthread_create(&workers[i].thread, NULL,
+					run_load_worker, &workers[i]);
+	}
+
+	for (i = 0 ; i < num_threads ; i++) {
+		syscalls_pthread_join(workers[i].thread, NULL);
+		failures += workers[i].failures;
+	}
+
+	restore_stdout(saved_stdout);
+
+	INFO("%d sessions from %d threads in %.3f ms, %d failed rounds\n",
+	     num_threads * rounds * sessions, num_threads,
+	     (utility_time_ns() - start) / 1e6, failures);
+
+	syscalls_free(workers);
+	fake_receiver_stop(&receiver);
+
+	/* The receiver's connection threads close their end once
+	 * they see ours closed; give them a moment. */
+	for (i = 0 ; i < 100 ; i++) {
+		after = count_open_fds();
+		if (after <= before) {
+			break;
+		}
+		syscalls_usleep(20000);
+	}
+
+	INFO("Open fds before: %d after: %d\n", before, after);
+
+	if (after != before || 0 != failures) {
+		ERRR("%d fds leaked\n", after - before);
+		ret = UTILITY_FAILURE;
+	}
+
+	return ret;
+}
+
+
+/* Writes len bytes of silence to a new temporary file. */
+static utility_retcode_t make_pcm_file_len(char *path, size_t len)
+{
+	uint8_t silence[PCM_READ_SIZE];
+	size_t chunk;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		ERRR("Failed to create PCM file\n");
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(silence, 0, sizeof(silence));
+	while (len > 0) {
+		chunk = MIN(len, sizeof(silence));
+		syscalls_write(fd, silence, chunk);
+		len -= chunk;
+	}
+
+	syscalls_close(fd);
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* Writes packets' worth of silence to a new temporary file. */
+static utility_retcode_t make_pcm_file(char *path, int packets)
+{
+	return make_pcm_file_len(path, (size_t)packets * PCM_READ_SIZE);
+}
+
+
+static int compare_int64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* Nearest rank percentile of a sorted array */
+static int64_t percentile(int64_t *sorted, int count, int pct)
+{
+	int rank = (pct * count + 99) / 100;
+
+	if (rank < 1) {
+		rank = 1;
+	}
+
+	return sorted[rank - 1];
+}
+
+
+struct startup_run {
+	struct rtsp_server server;
+	struct rtsp_session session;
+	struct fake_receiver *receiver;
+	char pcm_file[MAX_FILE_NAME_LEN];
+	utility_retcode_t ret;
+	volatile utility_boolean_t done;
+};
+
+
+/* Polled from the main thread while the run's thread is going; each
+ * field is written once. */
+static utility_boolean_t startup_reached_audio(struct startup_run *run)
+{
+	volatile uint64_t *ack =
+		&run->session.timeline.at[TIMELINE_FIRST_SERVER_ACK];
+
+	return run->done || 0 != *ack;
+}
+
+
+static void *run_startup(void *arg)
+{
+	struct startup_run *run = arg;
+	struct rtsp_session *session = &run->session;
+
+	run->ret = rtsp_start_session(session, &run->server);
+	if (UTILITY_SUCCESS == run->ret) {
+		run->ret = rtsp_play_track(session, run->pcm_file);
+		rtsp_end_session(session);
+	}
+
+	run->done = UTILITY_TRUE;
+
+	return NULL;
+}
+
+
+/* Time from the start of a session to each milestone, through to the
+ * receiver's reply to the first audio packet.  The audio path
+ * finishes by waiting a couple of seconds for the server to close,
+ * so each run is on its own thread and the next one starts as soon
+ * as the previous one has reached audio. */
+static utility_retcode_t bench_startup(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct startup_run *runs;
+	pthread_t *threads;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 5);
+	int num_runs = bench_arg(argc, argv, 1, 50);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	int64_t *offsets, offset;
+	int i, m, count, saved_stdout;
+
+	if (num_runs <= 0) {
+		ERRR("Need at least one run\n");
+		return UTILITY_FAILURE;
+	}
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, 1)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	runs = syscalls_malloc(num_runs * sizeof(*runs));
+	threads = syscalls_malloc(num_runs * sizeof(*threads));
+	offsets = syscalls_malloc(num_runs * sizeof(*offsets));
+
+	INFO("Session startup, %u ms round trip, %d runs\n",
+	     latency_ms, num_runs);
+
+	saved_stdout = quiet_stdout();
+
+	for (i = 0 ; i < num_runs ; i++) {
+		syscalls_memset(&runs[i], 0, sizeof(runs[i]));
+		init_rtsp_server(&runs[i].server);
+		syscalls_strncpy(runs[i].server.host, receiver.host,
+				 sizeof(runs[i].server.host));
+		runs[i].server.port = receiver.port;
+		syscalls_strncpy(runs[i].pcm_file, pcm_file,
+				 sizeof(runs[i].pcm_file));
+
+		syscalls_pthread_create(&threads[i], NULL,
+					run_startup, &runs[i]);
+
+		while (!startup_reached_audio(&runs[i])) {
+			syscalls_usleep(200);
+		}
+	}
+
+	for (i = 0 ; i < num_runs ; i++) {
+		syscalls_pthread_join(threads[i], NULL);
+	}
+
+	restore_stdout(saved_stdout);
+
+	INFO("%-22s %5s %10s %10s %10s %10s  (ms from session start)\n",
+	     "milestone", "runs", "p50", "p90", "p99", "max");
+
+	for (m = TIMELINE_SESSION_START + 1 ; m < TIMELINE_NUM_MILESTONES ; m++) {
+		count = 0;
+		for (i = 0 ; i < num_runs ; i++) {
+			offset = timeline_offset_us(&runs[i].session.timeline, m);
+			if (offset >= 0) {
+				offsets[count++] = offset;
+			}
+		}
+
+		if (0 == count) {
+			INFO("%-22s %5d\n", timeline_name(m), 0);
+			ret = UTILITY_FAILURE;
+			continue;
+		}
+
+		qsort(offsets, count, sizeof(*offsets), compare_int64);
+
+		INFO("%-22s %5d %10.3f %10.3f %10.3f %10.3f\n",
+		     timeline_name(m), count,
+		     percentile(offsets, count, 50) / 1e3,
+		     percentile(offsets, count, 90) / 1e3,
+		     percentile(offsets, count, 99) / 1e3,
+		     offsets[count - 1] / 1e3);
+	}
+
+	/* One run in full, as raopd logs it */
+	lt_set_level(LT_RTSP_CLIENT | LT_TIMELINE, LT_INFO);
+	rtsp_log_timeline(&runs[0].session);
+
+	syscalls_free(offsets);
+	syscalls_free(threads);
+	syscalls_free(runs);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* Gap between the last packet of one track and the first of the
+ * next, with a new session for each track and with one session that
+ * moves on with FLUSH. */
+static utility_retcode_t bench_tracks(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct bench_stats teardown, flush;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 5);
+	int num_tracks = bench_arg(argc, argv, 1, 5);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	uint64_t last_packet_ns = 0;
+	int i, saved_stdout;
+
+	syscalls_memset(&teardown, 0, sizeof(teardown));
+	syscalls_memset(&flush, 0, sizeof(flush));
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, 4)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+
+	INFO("Track changes, %u ms round trip, %d tracks of 4 packets, "
+	     "one packet is %.1f ms\n", latency_ms, num_tracks,
+	     PCM_READ_SIZE / PCM_BYTES_PER_FRAME / 44.1);
+
+	saved_stdout = quiet_stdout();
+
+	for (i = 0 ; i < num_tracks && UTILITY_SUCCESS == ret ; i++) {
+		init_rtsp_server(&server);
+		syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+		server.port = receiver.port;
+
+		ret = rtsp_start_session(session, &server);
+		if (UTILITY_SUCCESS == ret) {
+			ret = rtsp_play_track(session, pcm_file);
+		}
+
+		if (0 != i) {
+			bench_stats_add(&teardown,
+					session->audio_stream.track_first_packet_ns -
+					last_packet_ns);
+		}
+		last_packet_ns = session->audio_stream.last_packet_ns;
+
+		rtsp_end_session(session);
+	}
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_start_session(session, &server);
+	}
+
+	for (i = 0 ; i < num_tracks && UTILITY_SUCCESS == ret ; i++) {
+		ret = rtsp_play_track(session, pcm_file);
+
+		if (0 != i) {
+			bench_stats_add(&flush,
+					session->audio_stream.track_first_packet_ns -
+					last_packet_ns);
+		}
+		last_packet_ns = session->audio_stream.last_packet_ns;
+	}
+
+	rtsp_end_session(session);
+
+	restore_stdout(saved_stdout);
+
+	bench_stats_report("gap, new session per track", &teardown);
+	bench_stats_report("gap, FLUSH on same session", &flush);
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* Tracks that don't end on a packet boundary, played with a FLUSH
+ * before each and as one gapless playlist.  Counts the short packets
+ * sent and times the change from one track to the next. */
+static utility_retcode_t bench_playlist(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct audio_stream *audio_stream;
+	struct bench_stats flush, gapless;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 5);
+	int runs = bench_arg(argc, argv, 1, 20);
+	char pcm_files[2][sizeof("/tmp/raopd_bench_pcmXXXXXX")] = {
+		"/tmp/raopd_bench_pcmXXXXXX", "/tmp/raopd_bench_pcmXXXXXX"
+	};
+	const char *playlist[2] = { pcm_files[0], pcm_files[1] };
+	unsigned int flush_short, gapless_short, changes;
+	int i, saved_stdout;
+
+	syscalls_memset(&flush, 0, sizeof(flush));
+	syscalls_memset(&gapless, 0, sizeof(gapless));
+
+	/* Two and a half packets each */
+	if (UTILITY_SUCCESS != make_pcm_file_len(pcm_files[0],
+						 PCM_READ_SIZE * 5 / 2) ||
+	    UTILITY_SUCCESS != make_pcm_file_len(pcm_files[1],
+						 PCM_READ_SIZE * 5 / 2)) {
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+	audio_stream = &session->audio_stream;
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	INFO("Playlist, %u ms round trip, %d runs of 2 tracks of 2.5 packets\n",
+	     latency_ms, runs);
+
+	saved_stdout = quiet_stdout();
+
+	ret = rtsp_start_session(session, &server);
+
+	/* Starts the stream, so every run below begins with a FLUSH */
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_files[0]);
+	}
+
+	audio_stream->short_chunks = 0;
+	for (i = 0 ; i < runs && UTILITY_SUCCESS == ret ; i++) {
+		ret = rtsp_play_track(session, pcm_files[0]);
+		if (UTILITY_SUCCESS == ret) {
+			ret = rtsp_play_track(session, pcm_files[1]);
+		}
+		bench_stats_add(&flush, audio_stream->track_gap_ns);
+	}
+	flush_short = audio_stream->short_chunks;
+
+	audio_stream->short_chunks = 0;
+	audio_stream->track_changes = 0;
+	for (i = 0 ; i < runs && UTILITY_SUCCESS == ret ; i++) {
+		ret = rtsp_play_playlist(session, playlist, 2);
+		bench_stats_add(&gapless, audio_stream->track_gap_ns);
+	}
+	gapless_short = audio_stream->short_chunks;
+	changes = audio_stream->track_changes;
+
+	rtsp_end_session(session);
+
+	restore_stdout(saved_stdout);
+
+	bench_stats_report("track change, FLUSH per track", &flush);
+	bench_stats_report("track change, gapless playlist", &gapless);
+	INFO("short packets: FLUSH per track %u, gapless %u (%u joined tracks)\n",
+	     flush_short, gapless_short, changes);
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_files[0]);
+	unlink(pcm_files[1]);
+	return ret;
+}
+
+
+/* Time from starting a new session to its first packet, which is
+ * what getting audio going again costs without pause or seek. */
+static utility_retcode_t time_new_sessions(struct fake_receiver *receiver,
+					   struct rtsp_session *session,
+					   const char *pcm_file,
+					   int runs,
+					   struct bench_stats *stats)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_server server;
+	uint64_t start;
+	int i;
+
+	for (i = 0 ; i < runs && UTILITY_SUCCESS == ret ; i++) {
+		init_rtsp_server(&server);
+		syscalls_strncpy(server.host, receiver->host, sizeof(server.host));
+		server.port = receiver->port;
+
+		start = utility_time_ns();
+
+		ret = rtsp_start_session(session, &server);
+		if (UTILITY_SUCCESS == ret) {
+			rtsp_request_pause(session);
+			ret = rtsp_play_track(session, pcm_file);
+		}
+
+		bench_stats_add(stats,
+				session->audio_stream.track_first_packet_ns -
+				start);
+
+		rtsp_end_session(session);
+	}
+
+	return ret;
+}
+
+
+/* Resuming a paused track against starting a new session, which is
+ * what stopping used to cost. */
+static utility_retcode_t bench_pause(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct audio_stream *audio_stream;
+	struct bench_stats resume, restart;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 5);
+	int runs = bench_arg(argc, argv, 1, 20);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	unsigned long queued = 0;
+	int i, saved_stdout;
+
+	syscalls_memset(&resume, 0, sizeof(resume));
+	syscalls_memset(&restart, 0, sizeof(restart));
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, runs + 2)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+	audio_stream = &session->audio_stream;
+
+	INFO("Pause and resume, %u ms round trip, %d runs\n",
+	     latency_ms, runs);
+
+	saved_stdout = quiet_stdout();
+
+	ret = time_new_sessions(&receiver, session, pcm_file, runs, &restart);
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_start_session(session, &server);
+	}
+
+	/* Each resume writes one packet and pauses again */
+	if (UTILITY_SUCCESS == ret) {
+		rtsp_request_pause(session);
+		ret = rtsp_play_track(session, pcm_file);
+	}
+
+	for (i = 0 ; i < runs && UTILITY_SUCCESS == ret &&
+		     audio_stream->paused ; i++) {
+		queued += audio_stream->queue_len;
+
+		rtsp_request_pause(session);
+		ret = rtsp_resume(session);
+
+		bench_stats_add(&resume, audio_stream->restart_latency_ns);
+	}
+
+	rtsp_end_session(session);
+
+	restore_stdout(saved_stdout);
+
+	bench_stats_report("first packet, new session", &restart);
+	bench_stats_report("first packet, resume", &resume);
+	INFO("packets queued at pause: %.1f\n",
+	     (double)queued / (0 == resume.count ? 1 : resume.count));
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* Seeking while a track plays, to frames that don't start a packet.
+ * Checks that exactly the frames from the seek on were sent. */
+static utility_retcode_t bench_seek(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct audio_stream *audio_stream;
+	struct bench_stats seek, restart;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 5);
+	int runs = bench_arg(argc, argv, 1, 20);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	const uint64_t track_frames = 8 * PCM_READ_SIZE / PCM_BYTES_PER_FRAME;
+	uint64_t frame;
+	uint32_t start_rtp_time, sent;
+	int i, saved_stdout, wrong = 0;
+
+	syscalls_memset(&seek, 0, sizeof(seek));
+	syscalls_memset(&restart, 0, sizeof(restart));
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, 8)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+	audio_stream = &session->audio_stream;
+
+	INFO("Seek, %u ms round trip, %d runs\n", latency_ms, runs);
+
+	saved_stdout = quiet_stdout();
+
+	ret = time_new_sessions(&receiver, session, pcm_file, runs, &restart);
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_start_session(session, &server);
+	}
+
+	/* Each run writes one packet from the start of the track, then
+	 * seeks and plays to the end */
+	for (i = 0 ; i < runs && UTILITY_SUCCESS == ret ; i++) {
+		frame = (i * 7919 + 1) % (track_frames - 1);
+		start_rtp_time = audio_stream->rtp_time;
+
+		rtsp_request_seek(session, frame);
+		ret = rtsp_play_track(session, pcm_file);
+
+		bench_stats_add(&seek, audio_stream->restart_latency_ns);
+
+		sent = audio_stream->rtp_time - start_rtp_time;
+		if (sent != PCM_READ_SIZE / PCM_BYTES_PER_FRAME +
+		    track_frames - frame) {
+			wrong++;
+		}
+	}
+
+	rtsp_end_session(session);
+
+	restore_stdout(saved_stdout);
+
+	bench_stats_report("first packet, new session", &restart);
+	bench_stats_report("first packet, seek", &seek);
+	INFO("runs that sent the wrong frames: %d\n", wrong);
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* Sends one track per transport and times it from the first packet
+ * to the last.  The receiver counts what arrives over UDP. */
+static utility_retcode_t time_transport(struct fake_receiver *receiver,
+					rtp_transport_t transport,
+					const char *pcm_file,
+					int packets,
+					const char *name)
+{
+	utility_retcode_t ret;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct audio_stream *audio_stream;
+	uint64_t start, elapsed;
+	int saved_stdout;
+
+	session = syscalls_malloc(sizeof(*session));
+	audio_stream = &session->audio_stream;
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver->host, sizeof(server.host));
+	server.port = receiver->port;
+	server.transport = transport;
+
+	saved_stdout = quiet_stdout();
+
+	start = utility_time_ns();
+
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+
+	elapsed = audio_stream->last_packet_ns -
+		audio_stream->track_first_packet_ns;
+
+	restore_stdout(saved_stdout);
+
+	INFO("%-4s handshake to first packet %8.3f ms, %d packets in "
+	     "%8.3f ms (%.0f packets/s)\n", name,
+	     (audio_stream->track_first_packet_ns - start) / 1000000.0,
+	     packets, elapsed / 1000000.0,
+	     packets * 1000000000.0 / (0 == elapsed ? 1 : elapsed));
+
+	saved_stdout = quiet_stdout();
+	rtsp_end_session(session);
+	restore_stdout(saved_stdout);
+
+	syscalls_free(session);
+
+	return ret;
+}
+
+
+static utility_retcode_t bench_udp(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	unsigned int latency_ms = bench_arg(argc, argv, 0, 5);
+	int packets = bench_arg(argc, argv, 1, 200);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.latency_ms = latency_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	INFO("RTP transports, %u ms round trip, %d packets\n",
+	     latency_ms, packets);
+
+	ret = time_transport(&receiver, RTP_TRANSPORT_TCP, pcm_file,
+			     packets, "TCP");
+	if (UTILITY_SUCCESS == ret) {
+		ret = time_transport(&receiver, RTP_TRANSPORT_UDP, pcm_file,
+				     packets, "UDP");
+	}
+
+	/* Let the receiver drain its socket */
+	syscalls_usleep(200000);
+
+	INFO("UDP receiver got %u packets, %u sequence gaps, "
+	     "%u marked, %u with bad RTP headers\n",
+	     receiver.udp_packets, receiver.udp_seq_gaps,
+	     receiver.udp_markers, receiver.udp_bad_headers);
+
+	if (0 != receiver.udp_bad_headers || 1 != receiver.udp_markers) {
+		ERRR("UDP packets didn't carry the RTP headers a receiver "
+		     "expects\n");
+		ret = UTILITY_FAILURE;
+	}
+
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* A UDP stream to a receiver that loses packets on purpose and asks
+ * for them again. */
+static utility_retcode_t bench_resend(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct audio_stream *audio_stream;
+	int drop_every = bench_arg(argc, argv, 0, 20);
+	int drop_burst = bench_arg(argc, argv, 1, 2);
+	int packets = bench_arg(argc, argv, 2, 200);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	int saved_stdout;
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.udp_drop_every = drop_every;
+	receiver.udp_drop_burst = drop_burst;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+	audio_stream = &session->audio_stream;
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+	server.transport = RTP_TRANSPORT_UDP;
+
+	INFO("Resends, %d packets over UDP losing %d in every %d\n",
+	     packets, drop_burst, drop_every);
+
+	saved_stdout = quiet_stdout();
+
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+
+	/* Answers the last requests */
+	rtsp_end_session(session);
+
+	restore_stdout(saved_stdout);
+
+	INFO("sent %lu packets, %u resend requests, resent %u (%.1f%%), "
+	     "%u no longer held\n",
+	     audio_stream->packets_sent, audio_stream->resend_requests,
+	     audio_stream->packets_resent,
+	     100.0 * audio_stream->packets_resent /
+	     (0 == audio_stream->packets_sent ? 1 : audio_stream->packets_sent),
+	     audio_stream->resend_misses);
+	INFO("age of resent packets: mean %.3f ms, max %.3f ms\n",
+	     audio_stream->resend_age_total_ns / 1000000.0 /
+	     (0 == audio_stream->packets_resent ? 1 : audio_stream->packets_resent),
+	     audio_stream->resend_age_max_ns / 1000000.0);
+	INFO("receiver: %u received, %u dropped, %u resends received, "
+	     "%u sequence gaps, %u with bad RTP headers\n",
+	     receiver.udp_packets, receiver.udp_dropped,
+	     receiver.udp_resent, receiver.udp_seq_gaps,
+	     receiver.udp_bad_headers);
+
+	if (0 != receiver.udp_bad_headers) {
+		ERRR("Packets or resends didn't carry the RTP headers a "
+		     "receiver expects\n");
+		ret = UTILITY_FAILURE;
+	}
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* A UDP stream to a receiver whose clock is offset_ms ahead of ours
+ * and whose timing replies are held up by up to jitter_ms, playing
+ * two tracks with seconds of timing exchange and sync packets after
+ * each. */
+static utility_retcode_t bench_timing(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct rtp_timing_stats stats;
+	int offset_ms = bench_arg(argc, argv, 0, 250);
+	int jitter_ms = bench_arg(argc, argv, 1, 5);
+	int seconds = bench_arg(argc, argv, 2, 4);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	int saved_stdout;
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, 50)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.timing_offset_ms = offset_ms;
+	receiver.timing_jitter_ms = jitter_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+	server.transport = RTP_TRANSPORT_UDP;
+
+	INFO("Timing, receiver clock %+d ms, up to %d ms jitter, %d s, "
+	     "latency %u ms\n", offset_ms, jitter_ms, seconds,
+	     server.playout_latency_ms);
+
+	saved_stdout = quiet_stdout();
+
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_idle(session, seconds * 500);
+	}
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_idle(session, seconds * 500);
+	}
+
+	rtsp_end_session(session);
+
+	restore_stdout(saved_stdout);
+
+	rtp_timing_get_stats(&session->timing, &stats);
+
+	INFO("%u of %u requests answered, %u stale\n",
+	     stats.replies, stats.requests_sent, stats.stale_replies);
+	INFO("offset estimate %.3f ms (error %.3f ms), from an exchange "
+	     "with rtt %.3f ms\n", stats.offset_ns / 1000000.0,
+	     stats.offset_ns / 1000000.0 - offset_ms,
+	     stats.offset_rtt_ns / 1000000.0);
+	INFO("raw offsets %.3f to %.3f ms (error up to %.3f ms)\n",
+	     stats.raw_offset_min_ns / 1000000.0,
+	     stats.raw_offset_max_ns / 1000000.0,
+	     MAX(stats.raw_offset_max_ns / 1000000.0 - offset_ms,
+		 offset_ms - stats.raw_offset_min_ns / 1000000.0));
+	INFO("rtt: min %.3f ms, mean %.3f ms, max %.3f ms\n",
+	     stats.rtt_min_ns / 1000000.0,
+	     stats.rtt_total_ns / 1000000.0 /
+	     (0 == stats.replies ? 1 : stats.replies),
+	     stats.rtt_max_ns / 1000000.0);
+	INFO("sent %u syncs, answered %u timing requests\n",
+	     stats.syncs_sent, stats.requests_answered);
+	INFO("receiver: %u syncs (%u after an anchor), latency %u frames, "
+	     "drift up to %u frames, %u timing requests, %u replies\n",
+	     receiver.syncs, receiver.first_syncs,
+	     receiver.sync_latency_frames, receiver.sync_drift_max_frames,
+	     receiver.timing_requests, receiver.timing_replies);
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* Spread, in ns, of when the receivers play the first frame */
+static int64_t room_skew(struct fake_receiver *receivers, int num)
+{
+	int64_t first = 0, last = 0;
+	int i;
+
+	for (i = 0 ; i < num ; i++) {
+		if (0 == receivers[i].play_start_ns) {
+			WARN("Room %d never worked out when to play\n", i);
+			continue;
+		}
+
+		if (0 == first || receivers[i].play_start_ns < first) {
+			first = receivers[i].play_start_ns;
+		}
+		if (0 == last || receivers[i].play_start_ns > last) {
+			last = receivers[i].play_start_ns;
+		}
+	}
+
+	return last - first;
+}
+
+
+/* Plays a track to rooms receivers, each with its clock set apart
+ * from ours by up to 100 ms either way and jitter_ms of jitter on
+ * timing requests.  First each gets the track from a session of its
+ * own, one after another; then all get it at once as a group sharing
+ * one clock.  Each receiver works out when it would play the first
+ * frame, and the spread of those is the skew between rooms. */
+static utility_retcode_t bench_rooms(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver *receivers;
+	struct rtsp_server *servers;
+	struct rtsp_session *sessions;
+	struct rtsp_group group;
+	int rooms = bench_arg(argc, argv, 0, 4);
+	int jitter_ms = bench_arg(argc, argv, 1, 2);
+	int seconds = bench_arg(argc, argv, 2, 3);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	int saved_stdout, i, pass;
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, 100)) {
+		return UTILITY_FAILURE;
+	}
+
+	receivers = syscalls_malloc(rooms * sizeof(*receivers));
+	servers = syscalls_malloc(rooms * sizeof(*servers));
+	sessions = syscalls_malloc(rooms * sizeof(*sessions));
+
+	INFO("%d rooms, clocks up to 100 ms apart, %d ms jitter\n",
+	     rooms, jitter_ms);
+
+	for (pass = 0 ; pass < 2 && UTILITY_SUCCESS == ret ; pass++) {
+		syscalls_memset(receivers, 0, rooms * sizeof(*receivers));
+
+		for (i = 0 ; i < rooms && UTILITY_SUCCESS == ret ; i++) {
+			receivers[i].timing_offset_ms = (i * 53) % 200 - 100;
+			receivers[i].timing_jitter_ms = jitter_ms;
+			ret = fake_receiver_start(&receivers[i]);
+
+			init_rtsp_server(&servers[i]);
+			syscalls_strncpy(servers[i].host, receivers[i].host,
+					 sizeof(servers[i].host));
+			servers[i].port = receivers[i].port;
+			servers[i].transport = RTP_TRANSPORT_UDP;
+		}
+
+		if (UTILITY_SUCCESS != ret) {
+			/* The one that failed is i - 1 */
+			for (i -= 2 ; i >= 0 ; i--) {
+				fake_receiver_stop(&receivers[i]);
+			}
+			break;
+		}
+
+		saved_stdout = quiet_stdout();
+
+		if (0 == pass) {
+			ret = rtsp_start_sessions(sessions, servers, rooms);
+			for (i = 0 ; i < rooms && UTILITY_SUCCESS == ret ; i++) {
+				ret = rtsp_play_track(&sessions[i], pcm_file);
+			}
+		} else {
+			ret = rtsp_group_start(&group, sessions, servers, rooms);
+			if (UTILITY_SUCCESS == ret) {
+				ret = rtsp_group_play_track(&group, pcm_file);
+			}
+		}
+
+		/* Syncs and timing exchanges */
+		syscalls_usleep(seconds * 1000000);
+
+		if (0 == pass) {
+			for (i = 0 ; i < rooms ; i++) {
+				rtsp_end_session(&sessions[i]);
+			}
+		} else {
+			rtsp_group_end(&group);
+		}
+
+		restore_stdout(saved_stdout);
+
+		if (1 == pass) {
+			lt_set_level(LT_RTSP_CLIENT, LT_INFO);
+			rtsp_group_log(&group);
+			lt_set_level(LT_RTSP_CLIENT, LT_DEFAULT_LEVEL);
+		}
+
+		INFO("%s: skew between rooms %.3f ms\n",
+		     0 == pass ? "one session at a time" : "group, one clock",
+		     room_skew(receivers, rooms) / 1000000.0);
+
+		for (i = 0 ; i < rooms ; i++) {
+			DEBG("room %d: clock %+d ms, %u syncs, latency %u "
+			     "frames\n", i, receivers[i].timing_offset_ms,
+			     receivers[i].syncs,
+			     receivers[i].sync_latency_frames);
+			fake_receiver_stop(&receivers[i]);
+		}
+	}
+
+	syscalls_free(sessions);
+	syscalls_free(servers);
+	syscalls_free(receivers);
+	unlink(pcm_file);
+	return ret;
+}
+
+
+static uint64_t thread_cpu_ns(void)
+{
+	struct timespec ts;
+
+	syscalls_clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+
+/* CPU time this thread spends per packet of a track played to a
+ * group of num receivers over UDP, after a first track has set the
+ * sessions up. */
+static utility_retcode_t time_group_track(int num,
+					  utility_boolean_t fan_out,
+					  char *pcm_file,
+					  int packets,
+					  double *ns_per_packet)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct fake_receiver *receivers;
+	struct rtsp_server *servers;
+	struct rtsp_session *sessions;
+	struct rtsp_group group;
+	int saved_stdout, started, i;
+	uint64_t start;
+
+	receivers = syscalls_malloc(num * sizeof(*receivers));
+	servers = syscalls_malloc(num * sizeof(*servers));
+	sessions = syscalls_malloc(num * sizeof(*sessions));
+	syscalls_memset(receivers, 0, num * sizeof(*receivers));
+
+	for (started = 0 ; started < num ; started++) {
+		ret = fake_receiver_start(&receivers[started]);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+
+		init_rtsp_server(&servers[started]);
+		syscalls_strncpy(servers[started].host,
+				 receivers[started].host,
+				 sizeof(servers[started].host));
+		servers[started].port = receivers[started].port;
+		servers[started].transport = RTP_TRANSPORT_UDP;
+	}
+
+	saved_stdout = quiet_stdout();
+
+	ret = rtsp_group_start(&group, sessions, servers, num);
+	group.fan_out = fan_out;
+
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_group_play_track(&group, pcm_file);
+	}
+
+	start = thread_cpu_ns();
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_group_play_track(&group, pcm_file);
+	}
+	*ns_per_packet = (double)(thread_cpu_ns() - start) / packets;
+
+	rtsp_group_end(&group);
+
+	restore_stdout(saved_stdout);
+
+out:
+	for (i = 0 ; i < started ; i++) {
+		fake_receiver_stop(&receivers[i]);
+	}
+
+	syscalls_free(sessions);
+	syscalls_free(servers);
+	syscalls_free(receivers);
+
+	return ret;
+}
+
+
+/* Sender CPU per packet playing to 1, 16 and 64 receivers, with each
+ * session reading and converting the track itself and with the
+ * group's source doing it once for all of them. */
+static utility_retcode_t bench_fanout(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	static const int sizes[] = { 1, 16, 64 };
+	int packets = bench_arg(argc, argv, 0, 100);
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	double per_session[3], fan_out[3];
+	uint8_t *clear, *encrypted;
+	struct aes_data aes_data;
+	size_t encrypted_len;
+	uint64_t start;
+	int i;
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		return UTILITY_FAILURE;
+	}
+
+	INFO("Fan-out, %d packets, sender CPU per packet\n", packets);
+
+	for (i = 0 ; i < 3 && UTILITY_SUCCESS == ret ; i++) {
+		ret = time_group_track(sizes[i], UTILITY_FALSE, pcm_file,
+				       packets, &per_session[i]);
+		if (UTILITY_SUCCESS == ret) {
+			ret = time_group_track(sizes[i], UTILITY_TRUE, pcm_file,
+					       packets, &fan_out[i]);
+		}
+		if (UTILITY_SUCCESS != ret) {
+			break;
+		}
+
+		INFO("%2d receivers: read per session %8.1f us, "
+		     "fan-out %8.1f us\n", sizes[i],
+		     per_session[i] / 1000.0, fan_out[i] / 1000.0);
+	}
+
+	if (UTILITY_SUCCESS == ret) {
+		INFO("each receiver past the first: read per session %.1f us, "
+		     "fan-out %.1f us\n",
+		     (per_session[2] - per_session[0]) / 63 / 1000.0,
+		     (fan_out[2] - fan_out[0]) / 63 / 1000.0);
+	}
+
+	/* What each receiver can't avoid */
+	clear = syscalls_malloc(CONVERTED_BUFLEN);
+	encrypted = syscalls_malloc(ENCRYPTED_BUFLEN);
+	syscalls_memset(clear, 0x55, CONVERTED_BUFLEN);
+	take_aes_data(&aes_data);
+
+	start = thread_cpu_ns();
+	for (i = 0 ; i < packets ; i++) {
+		initialize_aes(&aes_data);
+		encrypted_len = 0;
+		aes_encrypt_data(&aes_data, encrypted, &encrypted_len,
+				 clear, PCM_READ_SIZE + 3 + 64);
+	}
+	INFO("encrypting a packet: %.1f us\n",
+	     (double)(thread_cpu_ns() - start) / packets / 1000.0);
+
+	syscalls_free(clear);
+	syscalls_free(encrypted);
+	unlink(pcm_file);
+	return ret;
+}
+
+
+/* Packets a buffer worker keeps out at once, as a send ring would */
+#define BUF_BENCH_WINDOW 8
+
+struct buf_worker {
+	pthread_t thread;
+	/* Where buffers come from, or NULL for malloc() */
+	struct utility_buf_pool *pool;
+	/* The buffer every refcount worker takes and drops */
+	struct utility_buf *shared;
+	pthread_mutex_t *lock;
+	unsigned int *locked_count;
+	int ops;
+};
+
+
+static void *run_alloc_worker(void *arg)
+{
+	struct buf_worker *worker = arg;
+	void *window[BUF_BENCH_WINDOW];
+	struct utility_buf *buf;
+	int i, slot;
+
+	syscalls_memset(window, 0, sizeof(window));
+
+	for (i = 0 ; i < worker->ops ; i++) {
+		slot = i % BUF_BENCH_WINDOW;
+
+		if (NULL != worker->pool) {
+			if (NULL != window[slot]) {
+				utility_buf_put(window[slot]);
+			}
+			buf = utility_buf_alloc(worker->pool);
+			buf->data[0] = (uint8_t)i;
+			window[slot] = buf;
+		} else {
+			syscalls_free(window[slot]);
+			window[slot] = syscalls_malloc(TRANSMIT_BUFLEN);
+			((uint8_t *)window[slot])[0] = (uint8_t)i;
+		}
+	}
+
+	for (slot = 0 ; slot < BUF_BENCH_WINDOW ; slot++) {
+		if (NULL == window[slot]) {
+			continue;
+		}
+		if (NULL != worker->pool) {
+			utility_buf_put(window[slot]);
+		} else {
+			syscalls_free(window[slot]);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void *run_refcnt_worker(void *arg)
+{
+	struct buf_worker *worker = arg;
+	int i;
+
+	for (i = 0 ; i < worker->ops ; i++) {
+		utility_buf_put(utility_buf_get(worker->shared));
+	}
+
+	return NULL;
+}
+
+
+static void *run_locked_refcnt_worker(void *arg)
+{
+	struct buf_worker *worker = arg;
+	int i;
+
+	for (i = 0 ; i < worker->ops ; i++) {
+		syscalls_pthread_mutex_lock(worker->lock);
+		(*worker->locked_count)++;
+		syscalls_pthread_mutex_unlock(worker->lock);
+
+		syscalls_pthread_mutex_lock(worker->lock);
+		(*worker->locked_count)--;
+		syscalls_pthread_mutex_unlock(worker->lock);
+	}
+
+	return NULL;
+}
+
+
+/* Runs num_threads copies of template at once and returns the wall
+ * time per operation. */
+static double time_buf_workers(void *(*run)(void *),
+			       const struct buf_worker *template,
+			       int num_threads)
+{
+	struct buf_worker workers[64];
+	uint64_t start;
+	int i;
+
+	start = utility_time_ns();
+
+	for (i = 0 ; i < num_threads ; i++) {
+		workers[i] = *template;
+		syscalls_pthread_create(&workers[i].thread, NULL,
+					run, &workers[i]);
+	}
+
+	for (i = 0 ; i < num_threads ; i++) {
+		syscalls_pthread_join(workers[i].thread, NULL);
+	}
+
+	return (double)(utility_time_ns() - start) /
+		((double)num_threads * template->ops);
+}
+
+
+/* Packet buffer allocation from the pool against malloc()/free(), and
+ * taking and dropping a reference to one shared packet against doing
+ * it under a lock or copying the packet, from 1 up to the given
+ * number of threads at once. */
+static utility_retcode_t bench_bufs(int argc, char **argv)
+{
+	int max_threads = bench_arg(argc, argv, 0, 8);
+	int ops = bench_arg(argc, argv, 1, 1000000);
+	struct utility_buf_pool *pool;
+	struct buf_worker template;
+	pthread_mutex_t lock;
+	unsigned int locked_count = 0;
+	uint8_t *copy;
+	uint64_t start;
+	int threads, copies, i;
+
+	if (max_threads <= 0 || max_threads > 64 || ops <= 0) {
+		ERRR("Need 1 to 64 threads and at least one operation\n");
+		return UTILITY_FAILURE;
+	}
+
+	if (UTILITY_SUCCESS != utility_buf_pool_create(&pool, TRANSMIT_BUFLEN,
+						       AUDIO_PACKET_POOL_FREE,
+						       "bench")) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_pthread_mutex_init(&lock, NULL);
+	syscalls_memset(&template, 0, sizeof(template));
+	template.ops = ops;
+	template.lock = &lock;
+	template.locked_count = &locked_count;
+	template.shared = utility_buf_alloc(pool);
+
+	INFO("%d byte packets, %d outstanding per thread, ns per operation\n",
+	     TRANSMIT_BUFLEN, BUF_BENCH_WINDOW);
+
+	for (threads = 1 ; threads <= max_threads ; threads *= 2) {
+		template.pool = pool;
+		INFO("%2d threads: alloc/put pool %7.1f\n", threads,
+		     time_buf_workers(run_alloc_worker, &template, threads));
+		template.pool = NULL;
+		INFO("%2d threads: malloc/free    %7.1f\n", threads,
+		     time_buf_workers(run_alloc_worker, &template, threads));
+		INFO("%2d threads: get/put atomic %7.1f\n", threads,
+		     time_buf_workers(run_refcnt_worker, &template, threads));
+		INFO("%2d threads: get/put locked %7.1f\n", threads,
+		     time_buf_workers(run_locked_refcnt_worker, &template,
+				      threads));
+	}
+
+	INFO("pool: %lu allocations, %lu from malloc()\n",
+	     pool->allocs, pool->misses);
+
+	/* What sharing a packet saves over handing out a copy */
+	copy = syscalls_malloc(TRANSMIT_BUFLEN);
+	copies = ops / 16 + 1;
+	start = utility_time_ns();
+	for (i = 0 ; i < copies ; i++) {
+		syscalls_memcpy(copy, template.shared->data, PCM_READ_SIZE + 32);
+		template.shared->data[i % 16] = copy[i % 32];
+	}
+	INFO("copying a packet instead: %.1f ns\n",
+	     (double)(utility_time_ns() - start) / copies);
+
+	syscalls_free(copy);
+	utility_buf_put(template.shared);
+	utility_buf_pool_destroy(pool);
+	pthread_mutex_destroy(&lock);
+
+	return UTILITY_SUCCESS;
+}
+
+
+struct log_worker {
+	pthread_t thread;
+	int messages;
+};
+
+
+static void *run_log_worker(void *arg)
+{
+	struct log_worker *worker = arg;
+	int i;
+
+	for (i = 0 ; i < worker->messages ; i++) {
+		INFO("flood message %d from worker %p\n", i, arg);
+	}
+
+	return NULL;
+}
+
+
+/* Time the calling thread spends in each of count INFO() calls */
+static void time_log_calls(int64_t *ns, int count)
+{
+	uint64_t start;
+	int i;
+
+	for (i = 0 ; i < count ; i++) {
+		start = utility_time_ns();
+		INFO("bench message %d of %d, position %llu\n", i, count,
+		     (unsigned long long)start);
+		ns[i] = utility_time_ns() - start;
+	}
+
+	qsort(ns, count, sizeof(*ns), compare_int64);
+}
+
+
+/* Logs num_threads * messages as fast as possible and returns the
+ * wall time. */
+static uint64_t flood_log(int num_threads, int messages)
+{
+	struct log_worker workers[64];
+	uint64_t start;
+	int i;
+
+	start = utility_time_ns();
+
+	for (i = 0 ; i < num_threads ; i++) {
+		workers[i].messages = messages;
+		syscalls_pthread_create(&workers[i].thread, NULL,
+					run_log_worker, &workers[i]);
+	}
+
+	for (i = 0 ; i < num_threads ; i++) {
+		syscalls_pthread_join(workers[i].thread, NULL);
+	}
+
+	return utility_time_ns() - start;
+}
+
+
+static void report_log_calls(const char *name, int64_t *ns, int count)
+{
+	int64_t total = 0;
+	int i;
+
+	for (i = 0 ; i < count ; i++) {
+		total += ns[i];
+	}
+
+	INFO("%-12s mean %7.0f ns  p50 %6lld  p99 %7lld  max %9lld\n", name,
+	     (double)total / count,
+	     (long long)percentile(ns, count, 50),
+	     (long long)percentile(ns, count, 99),
+	     (long long)ns[count - 1]);
+}
+
+
+/* What an INFO() costs the thread calling it with stdout going to a
+ * file: printed on the spot, and handed to the writer thread.  Then
+ * several threads log more than the ring holds, once dropping what
+ * doesn't fit and once waiting for room. */
+static utility_retcode_t bench_log(int argc, char **argv)
+{
+	int count = bench_arg(argc, argv, 0, 2000);
+	int num_threads = bench_arg(argc, argv, 1, 4);
+	char log_file[] = "/tmp/raopd_bench_logXXXXXX";
+	int64_t *sync_ns, *async_ns;
+	uint64_t drop_ns, wait_ns;
+	unsigned long dropped_before, dropped, waited;
+	int saved_stdout, fd;
+
+	if (count <= 0 || num_threads <= 0 || num_threads > 64) {
+		ERRR("Need at least one message and 1 to 64 threads\n");
+		return UTILITY_FAILURE;
+	}
+
+	fd = mkstemp(log_file);
+	if (fd < 0) {
+		ERRR("Failed to create log file\n");
+		return UTILITY_FAILURE;
+	}
+
+	sync_ns = syscalls_malloc(count * sizeof(*sync_ns));
+	async_ns = syscalls_malloc(count * sizeof(*async_ns));
+
+	syscalls_fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	syscalls_close(fd);
+
+	/* Flushed after every message, as a terminal would be */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	time_log_calls(sync_ns, count);
+
+	lt_start_writer(LT_OUTPUT_STDOUT, NULL, LT_OVERFLOW_DROP);
+	time_log_calls(async_ns, count);
+
+	dropped_before = lt_dropped();
+	drop_ns = flood_log(num_threads, NUM_LT_MSGS);
+	dropped = lt_dropped() - dropped_before;
+	lt_stop_writer();
+
+	lt_start_writer(LT_OUTPUT_STDOUT, NULL, LT_OVERFLOW_WAIT);
+	dropped_before = lt_dropped();
+	wait_ns = flood_log(num_threads, NUM_LT_MSGS);
+	waited = lt_dropped() - dropped_before;
+	lt_stop_writer();
+
+	restore_stdout(saved_stdout);
+
+	INFO("%d messages from one thread, time in INFO()\n", count);
+	report_log_calls("printed", sync_ns, count);
+	report_log_calls("queued", async_ns, count);
+
+	INFO("%d threads x %d messages, ring of %d\n", num_threads,
+	     NUM_LT_MSGS, NUM_LT_MSGS);
+	INFO("drop: %8.1f ms, %lu dropped\n", drop_ns / 1e6, dropped);
+	INFO("wait: %8.1f ms, %lu dropped\n", wait_ns / 1e6, waited);
+
+	syscalls_free(sync_ns);
+	syscalls_free(async_ns);
+	unlink(log_file);
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* Time in INFO() for the same messages printed, formatted into the
+ * writer's ring, and recorded in binary in trace mode.  The trace is
+ * kept in the file given, for lt_decode. */
+static utility_retcode_t bench_trace(int argc, char **argv)
+{
+	int count = bench_arg(argc, argv, 0, 5000);
+	char log_file[] = "/tmp/raopd_bench_logXXXXXX";
+	char trace_file[MAX_FILE_NAME_LEN] = "/tmp/raopd_bench_traceXXXXXX";
+	int64_t *printed_ns, *queued_ns, *traced_ns;
+	utility_boolean_t keep_trace = UTILITY_FALSE;
+	int saved_stdout, fd;
+	struct stat st;
+
+	if (count <= 0) {
+		ERRR("Need at least one message\n");
+		return UTILITY_FAILURE;
+	}
+
+	if (argc > 1) {
+		syscalls_strncpy(trace_file, argv[1], sizeof(trace_file));
+		keep_trace = UTILITY_TRUE;
+	} else {
+		fd = mkstemp(trace_file);
+		if (fd < 0) {
+			ERRR("Failed to create trace file\n");
+			return UTILITY_FAILURE;
+		}
+		syscalls_close(fd);
+	}
+
+	fd = mkstemp(log_file);
+	if (fd < 0) {
+		ERRR("Failed to create log file\n");
+		return UTILITY_FAILURE;
+	}
+
+	printed_ns = syscalls_malloc(count * sizeof(*printed_ns));
+	queued_ns = syscalls_malloc(count * sizeof(*queued_ns));
+	traced_ns = syscalls_malloc(count * sizeof(*traced_ns));
+
+	syscalls_fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	syscalls_close(fd);
+
+	time_log_calls(printed_ns, count);
+
+	lt_start_writer(LT_OUTPUT_STDOUT, NULL, LT_OVERFLOW_WAIT);
+	time_log_calls(queued_ns, count);
+	lt_stop_writer();
+
+	restore_stdout(saved_stdout);
+
+	if (UTILITY_SUCCESS != lt_start_trace(trace_file)) {
+		return UTILITY_FAILURE;
+	}
+	time_log_calls(traced_ns, count);
+	lt_stop_trace();
+
+	INFO("%d messages from one thread, time in INFO()\n", count);
+	report_log_calls("printed", printed_ns, count);
+	report_log_calls("queued", queued_ns, count);
+	report_log_calls("traced", traced_ns, count);
+
+	if (0 == stat(trace_file, &st)) {
+		INFO("trace: %lld bytes, %lu dropped, \"%s\"\n",
+		     (long long)st.st_size, lt_trace_dropped(),
+		     keep_trace ? trace_file : "removed");
+	}
+
+	syscalls_free(printed_ns);
+	syscalls_free(queued_ns);
+	syscalls_free(traced_ns);
+	unlink(log_file);
+	if (!keep_trace) {
+		unlink(trace_file);
+	}
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* What a disabled message cost before the level was tested at the
+ * call site: the call, its arguments and lt()'s bits_to_string() of
+ * the mask. */
+static void __attribute__ ((noinline)) old_disabled_lt(int i, const char *name)
+{
+	char bits[128];
+
+	bits_to_string((uint64_t)LT_BENCH, sizeof(lt_mask_t), bits,
+		       sizeof(bits));
+	lt(NULL, LT_BENCH, LT_DEBUG, __FILE__, __func__, __LINE__,
+	   "message %d from %s\n", i, name);
+}
+
+
+/* Cost of a log call site whose level is disabled, as the macros now
+ * expand it and as they used to, and the same per packet for the
+ * number of call sites the audio path and the fake receiver pass for
+ * each packet. */
+static utility_retcode_t bench_ltcost(int argc, char **argv)
+{
+	int calls = bench_arg(argc, argv, 0, 1000000);
+	int per_packet = bench_arg(argc, argv, 1, 52);
+	double inline_ns, call_ns, old_ns;
+	uint64_t start;
+	int i;
+
+	if (calls <= 0) {
+		ERRR("Need at least one call\n");
+		return UTILITY_FAILURE;
+	}
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		DEBG("message %d from %s\n", i, __func__);
+	}
+	inline_ns = (double)(utility_time_ns() - start) / calls;
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		lt(NULL, LT_BENCH, LT_DEBUG, __FILE__, __func__, __LINE__,
+		   "message %d from %s\n", i, __func__);
+	}
+	call_ns = (double)(utility_time_ns() - start) / calls;
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		old_disabled_lt(i, __func__);
+	}
+	old_ns = (double)(utility_time_ns() - start) / calls;
+
+	INFO("disabled DEBG(), LT_MIN_LEVEL %d, ns per call site\n",
+	     LT_MIN_LEVEL);
+	INFO("tested inline     %8.2f\n", inline_ns);
+	INFO("lt() call         %8.2f\n", call_ns);
+	INFO("lt() as it was    %8.2f\n", old_ns);
+	INFO("per packet (%d call sites): %.2f us before, %.3f us now\n",
+	     per_packet, old_ns * per_packet / 1000.0,
+	     inline_ns * per_packet / 1000.0);
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* Sends stdout to a new temporary file, named in path */
+static int stdout_to_file(char *path)
+{
+	int saved_stdout, fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		return -1;
+	}
+
+	syscalls_fflush(stdout);
+	saved_stdout = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	syscalls_close(fd);
+
+	return saved_stdout;
+}
+
+
+static long count_lines(const char *path)
+{
+	char buf[4096];
+	long lines = 0;
+	ssize_t i, len;
+	int fd;
+
+	fd = syscalls_open(path, O_RDONLY, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0 ; i < len ; i++) {
+			lines += ('\n' == buf[i]);
+		}
+	}
+
+	syscalls_close(fd);
+
+	return lines;
+}
+
+
+/* One per-packet message logged calls times as fast as the loop goes,
+ * plain, rate limited and sampled 1 in AUDIO_LOG_SAMPLE: time per call
+ * and what reaches the log, the summaries of what was held back
+ * included. */
+static utility_retcode_t bench_ratelimit(int argc, char **argv)
+{
+	int calls = bench_arg(argc, argv, 0, 100000);
+	const char *names[] = { "plain", "ratelimited", "sampled" };
+	double ns[3];
+	long lines[3];
+	char log_file[] = "/tmp/raopd_bench_logXXXXXX";
+	uint64_t start;
+	int saved_stdout, kind, i;
+
+	if (calls <= 0) {
+		ERRR("Need at least one call\n");
+		return UTILITY_FAILURE;
+	}
+
+	for (kind = 0 ; kind < 3 ; kind++) {
+		syscalls_strncpy(log_file, "/tmp/raopd_bench_logXXXXXX",
+				 sizeof(log_file));
+		saved_stdout = stdout_to_file(log_file);
+		if (saved_stdout < 0) {
+			ERRR("Failed to create log file\n");
+			return UTILITY_FAILURE;
+		}
+
+		start = utility_time_ns();
+		for (i = 0 ; i < calls ; i++) {
+			if (0 == kind) {
+				INFO("Wrote %d bytes to server\n", i);
+			} else if (1 == kind) {
+				INFO_RATELIMITED("Wrote %d bytes to server\n",
+						 i);
+			} else {
+				INFO_SAMPLED(AUDIO_LOG_SAMPLE,
+					     "Wrote %d bytes to server\n", i);
+			}
+		}
+		ns[kind] = (double)(utility_time_ns() - start) / calls;
+
+		lt_report_suppressed();
+		restore_stdout(saved_stdout);
+
+		lines[kind] = count_lines(log_file);
+		unlink(log_file);
+	}
+
+	INFO("%d calls to one INFO() call site\n", calls);
+	for (kind = 0 ; kind < 3 ; kind++) {
+		INFO("%-12s %8.1f ns per call  %7ld lines logged\n",
+		     names[kind], ns[kind], lines[kind]);
+	}
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* Lists the flight recorder files this process has written. */
+static void list_flight_files(const char *dir_name)
+{
+	char prefix[64];
+	struct dirent *entry;
+	struct stat st;
+	char path[MAX_FILE_NAME_LEN];
+	DIR *dir;
+
+	syscalls_snprintf(prefix, sizeof(prefix), "raopd_flight_%d_",
+			  (int)syscalls_getpid());
+
+	dir = opendir(dir_name);
+	if (NULL == dir) {
+		return;
+	}
+
+	while (NULL != (entry = readdir(dir))) {
+		if (0 != syscalls_strncmp(entry->d_name, prefix,
+					  syscalls_strlen(prefix))) {
+			continue;
+		}
+
+		syscalls_snprintf(path, sizeof(path), "%s/%s", dir_name,
+				  entry->d_name);
+		if (0 == stat(path, &st)) {
+			INFO("%s: %lld bytes\n", path, (long long)st.st_size);
+		}
+	}
+
+	closedir(dir);
+}
+
+
+/* What recording an event costs, with a recorder and without, then a
+ * TCP stream to a receiver that stops reading for stall ms part way
+ * through.  The watchdog should write the session's recorder out once
+ * for the stall, and FLIGHT_RECORDER_SIGNAL once more at the end.
+ * The files are left in /tmp for flight_render. */
+static utility_retcode_t bench_flight(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int packets = bench_arg(argc, argv, 0, 1000);
+	unsigned int stall_ms = bench_arg(argc, argv, 1, 3000);
+	int calls = 1000000;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct flight_recorder *recorder;
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	double recorded_ns, off_ns;
+	uint64_t start;
+	int saved_stdout, i;
+
+	if (packets < 4) {
+		ERRR("Need at least 4 packets\n");
+		return UTILITY_FAILURE;
+	}
+
+	ret = flight_recorder_start("/tmp", 1000);
+	if (UTILITY_SUCCESS != ret) {
+		return ret;
+	}
+
+	recorder = flight_recorder_open("bench");
+	if (NULL == recorder) {
+		ret = UTILITY_FAILURE;
+		goto stop;
+	}
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		flight_record(recorder, FLIGHT_QUEUED, i, i, 0);
+	}
+	recorded_ns = (double)(utility_time_ns() - start) / calls;
+	flight_recorder_close(recorder);
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		flight_record(NULL, FLIGHT_QUEUED, i, i, 0);
+	}
+	off_ns = (double)(utility_time_ns() - start) / calls;
+
+	INFO("flight_record(): %.1f ns per event, %.1f ns without a "
+	     "recorder\n", recorded_ns, off_ns);
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		ret = UTILITY_FAILURE;
+		goto stop;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+	receiver.audio_stall_after = packets / 4;
+	receiver.audio_stall_ms = stall_ms;
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	session = syscalls_malloc(sizeof(*session));
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	INFO("%d packets, receiver stops reading for %u ms after %u\n",
+	     packets, stall_ms, receiver.audio_stall_after);
+
+	saved_stdout = quiet_stdout();
+
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+
+	syscalls_raise(FLIGHT_RECORDER_SIGNAL);
+
+	rtsp_end_session(session);
+	restore_stdout(saved_stdout);
+
+	INFO("%lu packets sent\n", session->audio_stream.packets_sent);
+	list_flight_files("/tmp");
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+stop:
+	flight_recorder_stop();
+	return ret;
+}
+
+
+/* What timing a stage costs, then runs TCP streams of packets each,
+ * with each stage of each packet timed.  Each session's percentiles
+ * are logged as it ends, and the totals for all of them at the end. */
+static utility_retcode_t bench_stages(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int packets = bench_arg(argc, argv, 0, 1000);
+	int runs = bench_arg(argc, argv, 1, 2);
+	int calls = 1000000;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct stage_latency *latency;
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	uint64_t start, begin;
+	int saved_stdout, i;
+
+	lt_set_level(LT_STAGE_LATENCY, LT_INFO);
+	stage_latency_start();
+
+	latency = stage_latency_open("bench", STAGE_PATH_RAOPD);
+	if (NULL == latency) {
+		return UTILITY_FAILURE;
+	}
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		begin = stage_latency_begin(latency);
+		stage_latency_end(latency, STAGE_READ, begin);
+	}
+	INFO("Timing a stage: %.1f ns\n",
+	     (double)(utility_time_ns() - start) / calls);
+
+	/* Not to be counted in with the sessions */
+	syscalls_memset(&latency->stages, 0, sizeof(latency->stages));
+	stage_latency_close(latency);
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	session = syscalls_malloc(sizeof(*session));
+
+	for (i = 0 ; i < runs && UTILITY_SUCCESS == ret ; i++) {
+		saved_stdout = quiet_stdout();
+		ret = rtsp_start_session(session, &server);
+		if (UTILITY_SUCCESS == ret) {
+			ret = rtsp_play_track(session, pcm_file);
+		}
+		restore_stdout(saved_stdout);
+
+		stage_latency_log(session->audio_stream.latency);
+
+		saved_stdout = quiet_stdout();
+		rtsp_end_session(session);
+		restore_stdout(saved_stdout);
+	}
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+	stage_latency_stop();
+	return ret;
+}
+
+
+/* Fetches the metrics page from the Unix domain socket at path, or
+ * from 127.0.0.1:port if path is NULL, and logs the samples on it */
+static utility_retcode_t scrape_metrics(const char *path, int port)
+{
+	const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	char *page, *line, *next;
+	size_t size = 64 * 1024, len = 0;
+	int fd, ret;
+
+	page = syscalls_malloc(size);
+	if (NULL == page) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&sun, 0, sizeof(sun));
+	syscalls_memset(&sin, 0, sizeof(sin));
+
+	if (NULL != path) {
+		fd = syscalls_socket(AF_UNIX, SOCK_STREAM, 0);
+		sun.sun_family = AF_UNIX;
+		syscalls_strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+		ret = syscalls_connect(fd, (struct sockaddr *)&sun,
+				       sizeof(sun));
+	} else {
+		fd = syscalls_socket(AF_INET, SOCK_STREAM, 0);
+		sin.sin_family = AF_INET;
+		sin.sin_port = syscalls_htons(port);
+		syscalls_inet_pton(AF_INET, "127.0.0.1", &sin.sin_addr);
+		ret = syscalls_connect(fd, (struct sockaddr *)&sin,
+				       sizeof(sin));
+	}
+
+	if (ret < 0 ||
+	    (ssize_t)sizeof(request) - 1 !=
+	    syscalls_write(fd, request, sizeof(request) - 1)) {
+		syscalls_close(fd);
+		syscalls_free(page);
+		return UTILITY_FAILURE;
+	}
+
+	while (len < size - 1 &&
+	       (ret = syscalls_read(fd, page + len, size - 1 - len)) > 0) {
+		len += ret;
+	}
+	page[len] = '\0';
+	syscalls_close(fd);
+
+	INFO("%lu bytes from the metrics socket\n", (unsigned long)len);
+
+	/* Past the HTTP headers */
+	line = syscalls_strstr(page, "\r\n\r\n");
+	if (NULL != line) {
+		line += 4;
+	}
+
+	for ( ; NULL != line ; line = next) {
+		next = syscalls_strchr(line, '\n');
+		if (NULL != next) {
+			*next++ = '\0';
+		}
+
+		if ('#' != line[0] && '\0' != line[0]) {
+			INFO("  %s\n", line);
+		}
+	}
+
+	syscalls_free(page);
+	return UTILITY_SUCCESS;
+}
+
+
+/* What updating a counter costs, then a TCP stream with the metrics
+ * served, scraped once it is over.  Port 0 serves them on a Unix
+ * domain socket. */
+static utility_retcode_t bench_metrics(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int packets = bench_arg(argc, argv, 0, 200);
+	int port = bench_arg(argc, argv, 1, 0);
+	int calls = 1000000;
+	const char *path = "/tmp/raopd_bench_metrics";
+	char listen_on[MAX_FILE_NAME_LEN];
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	uint64_t start;
+	int saved_stdout, i;
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		metrics_add(METRIC_PACKETS_RESENT, 0);
+	}
+	INFO("metrics_add(): %.1f ns\n",
+	     (double)(utility_time_ns() - start) / calls);
+
+	if (0 == port) {
+		syscalls_strncpy(listen_on, path, sizeof(listen_on));
+	} else {
+		syscalls_snprintf(listen_on, sizeof(listen_on),
+				  "127.0.0.1:%d", port);
+		path = NULL;
+	}
+
+	stage_latency_start();
+	ret = metrics_start(listen_on);
+	if (UTILITY_SUCCESS != ret) {
+		goto stop;
+	}
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		ret = UTILITY_FAILURE;
+		goto stop;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	session = syscalls_malloc(sizeof(*session));
+
+	saved_stdout = quiet_stdout();
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+	restore_stdout(saved_stdout);
+
+	if (UTILITY_SUCCESS == ret) {
+		ret = scrape_metrics(path, port);
+	}
+
+	saved_stdout = quiet_stdout();
+	rtsp_end_session(session);
+	restore_stdout(saved_stdout);
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+stop:
+	metrics_stop();
+	stage_latency_stop();
+	return ret;
+}
+
+
+/* Logs what a free lock and a small malloc cost through the
+ * wrappers */
+static void time_wrappers(const char *what)
+{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	int calls = 1000000, i;
+	uint64_t start;
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		syscalls_pthread_mutex_lock(&lock);
+		syscalls_pthread_mutex_unlock(&lock);
+	}
+	INFO("Lock and unlock, %s: %.1f ns\n", what,
+	     (double)(utility_time_ns() - start) / calls);
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		syscalls_free(syscalls_malloc(64));
+	}
+	INFO("malloc and free of 64 bytes, %s: %.1f ns\n", what,
+	     (double)(utility_time_ns() - start) / calls);
+}
+
+
+/* What counting costs, then runs a TCP stream of packets with every
+ * call through syscalls.c counted, and logs the stream's calls per
+ * minute of audio.  Each thread's counts are logged at the end. */
+static utility_retcode_t bench_syscalls(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int packets = bench_arg(argc, argv, 0, 1000);
+	struct syscalls_acct before[SYSCALLS_ACCT_NUM];
+	struct syscalls_acct after[SYSCALLS_ACCT_NUM];
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	double minutes;
+	int saved_stdout, i;
+
+	lt_set_level(LT_SYSCALLS_ACCT, LT_INFO);
+
+	time_wrappers("not counted");
+	syscalls_acct_start();
+	time_wrappers("counted");
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		ret = UTILITY_FAILURE;
+		goto stop;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	session = syscalls_malloc(sizeof(*session));
+
+	syscalls_acct_total(before);
+
+	saved_stdout = quiet_stdout();
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+	rtsp_end_session(session);
+	restore_stdout(saved_stdout);
+
+	syscalls_acct_total(after);
+
+	minutes = (double)packets * PCM_READ_SIZE / PCM_BYTES_PER_FRAME /
+		RTP_SAMPLE_RATE / 60;
+
+	INFO("Per minute of audio (%.2f minutes streamed):\n", minutes);
+	INFO("  %-13s %10s %12s %10s\n", "call", "calls", "bytes", "ms");
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		if (after[i].calls == before[i].calls) {
+			continue;
+		}
+
+		INFO("  %-13s %10.1f %12.0f %10.3f\n", syscalls_acct_name(i),
+		     (after[i].calls - before[i].calls) / minutes,
+		     (after[i].bytes - before[i].bytes) / minutes,
+		     (after[i].ns - before[i].ns) / 1e6 / minutes);
+	}
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+stop:
+	syscalls_acct_stop();
+	return ret;
+}
+
+
+/* What reading the hardware counters costs, then runs a TCP stream of
+ * packets with them counted for each stage.  Where they aren't
+ * permitted the stream runs with its stages just timed. */
+static utility_retcode_t bench_perf(int argc, char **argv)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int packets = bench_arg(argc, argv, 0, 1000);
+	int calls = 100000;
+	struct fake_receiver receiver;
+	struct rtsp_server server;
+	struct rtsp_session *session;
+	struct perf_sample sample;
+	char pcm_file[] = "/tmp/raopd_bench_pcmXXXXXX";
+	uint64_t start;
+	int saved_stdout, i;
+
+	lt_set_level(LT_STAGE_LATENCY, LT_INFO);
+	lt_set_level(LT_PERF_COUNTERS, LT_INFO);
+
+	if (UTILITY_SUCCESS != perf_counters_start()) {
+		INFO("No hardware counters: only timing the stages\n");
+	}
+
+	start = utility_time_ns();
+	for (i = 0 ; i < calls ; i++) {
+		perf_counters_read(&sample);
+	}
+	INFO("Reading the counters: %.1f ns\n",
+	     (double)(utility_time_ns() - start) / calls);
+
+	stage_latency_start();
+
+	if (UTILITY_SUCCESS != make_pcm_file(pcm_file, packets)) {
+		ret = UTILITY_FAILURE;
+		goto stop;
+	}
+
+	syscalls_memset(&receiver, 0, sizeof(receiver));
+
+	ret = fake_receiver_start(&receiver);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	init_rtsp_server(&server);
+	syscalls_strncpy(server.host, receiver.host, sizeof(server.host));
+	server.port = receiver.port;
+
+	session = syscalls_malloc(sizeof(*session));
+
+	saved_stdout = quiet_stdout();
+	ret = rtsp_start_session(session, &server);
+	if (UTILITY_SUCCESS == ret) {
+		ret = rtsp_play_track(session, pcm_file);
+	}
+	rtsp_end_session(session);
+	restore_stdout(saved_stdout);
+
+	syscalls_free(session);
+	fake_receiver_stop(&receiver);
+
+out:
+	unlink(pcm_file);
+stop:
+	stage_latency_stop();
+	perf_counters_stop();
+	return ret;
+}
+
+
+struct bench {
+	const char *name;
+	const char *args;
+	utility_retcode_t (*run)(int argc, char **argv);
+};
+
+static const struct bench benches[] = {
+	{ "handshake", "[latency ms] [runs]", bench_handshake },
+	{ "sessions", "[latency ms] [sessions]", bench_sessions },
+	{ "setup", "[latency ms] [runs]", bench_setup },
+	{ "random", "[MB per size]", bench_random },
+	{ "fdleak", "[threads] [rounds] [sessions]", bench_fdleak },
+	{ "startup", "[latency ms] [runs]", bench_startup },
+	{ "tracks", "[latency ms] [tracks]", bench_tracks },
+	{ "playlist", "[latency ms] [runs]", bench_playlist },
+	{ "pause", "[latency ms] [runs]", bench_pause },
+	{ "seek", "[latency ms] [runs]", bench_seek },
+	{ "udp", "[latency ms] [packets]", bench_udp },
+	{ "resend", "[drop every] [drop burst] [packets]", bench_resend },
+	{ "timing", "[offset ms] [jitter ms] [seconds]", bench_timing },
+	{ "rooms", "[rooms] [jitter ms] [seconds]", bench_rooms },
+	{ "fanout", "[packets]", bench_fanout },
+	{ "bufs", "[threads] [operations]", bench_bufs },
+	{ "log", "[messages] [threads]", bench_log },
+	{ "ltcost", "[calls] [call sites per packet]", bench_ltcost },
+	{ "trace", "[messages] [trace file]", bench_trace },
+	{ "ratelimit", "[calls]", bench_ratelimit },
+	{ "flight", "[packets] [stall ms]", bench_flight },
+	{ "stages", "[packets] [runs]", bench_stages },
+	{ "metrics", "[packets] [port]", bench_metrics },
+	{ "syscalls", "[packets]", bench_syscalls },
+	{ "perf", "[packets]", bench_perf },
+};
+
+
+int main(int argc, char **argv)
+{
+	size_t i;
+
+	lt_init();
+	lt_set_level(LT_BENCH, LT_INFO);
+
+	for (i = 0 ; argc > 1 && i < sizeof(benches) / sizeof(benches[0]) ; i++) {
+		if (0 == syscalls_strcmp(argv[1], benches[i].name)) {
+			return (UTILITY_SUCCESS ==
+				benches[i].run(argc - 2, argv + 2)) ? 0 : 1;
+		}
+	}
+
+	for (i = 0 ; i < sizeof(benches) / sizeof(benches[0]) ; i++) {
+		ERRR("usage: raopd_bench %s %s\n", benches[i].name, benches[i].args);
+	}
+
+	return 1;
+}
@@ -17,7 +17,10 @@ You should have received a copy of the GNU General Public License
 along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 
 #include "lt.h"
 #include "utility.h"
@@ -25,21 +28,34 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "client.h"
 #include "config.h"
 #include "rtsp.h"
+#include "probes.h"
 
 #define DEFAULT_FACILITY LT_CLIENT
 
 utility_retcode_t connect_server(struct rtsp_session *session)
 {
 	int ret;
+	int nodelay = 1;
 
 	FUNC_ENTER;
 
 	INFO("Connecting to server at \"%s\" port %d\n",
 	     session->server->host, (int)session->server->port);
 
-	ret = connect_to_port(session->server->host,
-			      session->server->port,
-			      &session->control_fd);
+	/* The connection is non-blocking and may still be in
+	 * progress when this returns; see finish_connect(). */
+	ret = start_connect(session->server->host,
+			    session->server->port,
+			    &session->control_fd);
+
+	/* Requests are small and may be written back to back when
+	 * they're pipelined.  Without TCP_NODELAY the second one sits
+	 * in the kernel until the first is acknowledged, which costs
+	 * the server's delayed ACK timeout. */
+	if (UTILITY_SUCCESS == ret) {
+		syscalls_setsockopt(session->control_fd, IPPROTO_TCP,
+				    TCP_NODELAY, &nodelay, sizeof(nodelay));
+	}
 
 	INFO("fd for server control connection: %d\n", session->control_fd);
 
@@ -47,31 +63,69 @@ utility_retcode_t connect_server(struct rtsp_session *session)
 	return ret;
 }
 
-utility_retcode_t send_request(struct rtsp_request *request)
+/* Appends a request that has been built to the session's queue of
+ * data to be written to the server.  Requests that are pipelined
+ * are queued together and go out in as few writes as possible. */
+utility_retcode_t queue_request(struct rtsp_request *request)
 {
 	struct rtsp_session *session = request->session;
-	int ret;
+	utility_retcode_t ret = UTILITY_SUCCESS;
 
 	FUNC_ENTER;
 
-	INFO("Writing request (length %d) to server \"%s\"\n",
-	     request->request_length, session->server->name);
+	if (request->request_length >
+	    sizeof(session->send_buf) - session->send_len) {
+		ERRR("No room to queue request (length %d) to server \"%s\"\n",
+		     (int)request->request_length, session->server->name);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	INFO("Queueing request (length %d) to server \"%s\"\n",
+	     (int)request->request_length, session->server->name);
 
 	NOTC("\n----------------------------------------\n"
 	     "%s"
 	     "----------------------------------------\n", request->buf);
 
-	/* XXX This write call needs a timeout. */
-	ret = syscalls_write(session->control_fd,
-			     request->buf,
-			     request->request_length);
+	syscalls_memcpy(session->send_buf + session->send_len,
+			request->buf,
+			request->request_length);
+	session->send_len += request->request_length;
+
+	RAOPD_PROBE4(rtsp_request, session->identifier,
+		     request->request_line.method, session->sequence_number,
+		     request->request_length);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
 
-	if (-1 == ret) {
-		ERRR("Failed to write request (length %d) to server \"%s\".\n",
-		     request->request_length, session->server->name);
+
+/* Writes as much of the queued request data as the control
+ * connection will take.  A non-blocking control connection that
+ * isn't ready is not an error; send_len says how much is left. */
+utility_retcode_t write_requests(struct rtsp_session *session)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int write_ret;
+
+	FUNC_ENTER;
+
+	write_ret = syscalls_write(session->control_fd,
+				   session->send_buf,
+				   session->send_len);
+
+	if (write_ret > 0) {
+		session->send_len -= write_ret;
+		memmove(session->send_buf,
+			session->send_buf + write_ret,
+			session->send_len);
+	} else if (!(write_ret < 0 && EAGAIN == errno)) {
+		ERRR("Failed to write requests (length %d) to server \"%s\".\n",
+		     (int)session->send_len, session->server->name);
 		ret = UTILITY_FAILURE;
-	} else {
-		ret = UTILITY_SUCCESS;
 	}
 
 	FUNC_RETURN;
@@ -79,84 +133,273 @@ utility_retcode_t send_request(struct rtsp_request *request)
 }
 
 
-utility_retcode_t read_response(struct rtsp_response *response)
+utility_retcode_t flush_requests(struct rtsp_session *session)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	FUNC_ENTER;
+
+	/* XXX This write call needs a timeout. */
+	while (0 != session->send_len && UTILITY_SUCCESS == ret) {
+		ret = write_requests(session);
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Moves the first complete message in the session's receive buffer
+ * into the response buffer.  Returns UTILITY_FALSE if the receive
+ * buffer does not hold a complete message yet. */
+utility_boolean_t take_response(struct rtsp_response *response)
 {
 	struct rtsp_session *session = response->session;
-	int ret;
+	size_t len;
 
 	FUNC_ENTER;
 
-	INFO("Reading response from server \"%s\"\n", session->server->name);
+	len = rtsp_message_length(session->recv_buf);
+	if (0 == len) {
+		FUNC_RETURN;
+		return UTILITY_FALSE;
+	}
 
 	syscalls_memset(response->buf, 0, response->buflen);
+	syscalls_memcpy(response->buf, session->recv_buf, len);
 
-	DEBG("before read from fd %d\n", session->control_fd);
-
-	/* XXX This read call is not correct--it needs to have a
-	   timeout, and it assumes that all the data is going to come
-	   back in one read.  These problems need to be fixed,
-	   although it turns out that all the data for each response
-	   seems to come back in one shot, so this code will work for
-	   now.
+	session->recv_len -= len;
+	memmove(session->recv_buf, session->recv_buf + len, session->recv_len);
+	session->recv_buf[session->recv_len] = '\0';
 
-	   Reading the response is trivially more challenging than it
-	   appears because the network client code needs to understand
-	   a little bit about RTSP to know how much to read.
+	NOTC("response length: %d bytes\n"
+	     "----------------------------------------\n"
+	     "%s"
+	     "----------------------------------------\n",
+	     (int)len,
+	     response->buf);
 
-	   RFC2326, §9.2 Reliability and Acknowledgements
+	FUNC_RETURN;
+	return UTILITY_TRUE;
+}
 
-	   Unlike HTTP, an RTSP message MUST contain a Content-Length
-	   header whenever that message contains a payload. Otherwise,
-	   an RTSP packet is terminated with an empty line immediately
-	   following the last message header.
 
-	   The pseudocode is as follows:
+/* Reads whatever the server has sent on the control connection into
+ * the session's receive buffer.  Blocks if nothing is available and
+ * the control connection is blocking. */
+utility_retcode_t fill_response_buffer(struct rtsp_session *session)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	size_t space;
+	int read_ret;
 
-	   Read a chunk of data from the socket.  Parse the received
-	   data until you get '\n' which indicates the end of a
-	   header.
+	FUNC_ENTER;
 
-	   If the line you just parsed is a Content-Length header,
-	   record its value in a field in the response structure,
-	   payload_length or something, else check to see if you just
-	   read a blank line indicating the end of headers.  If you
-	   read a blank line, you're done reading headers, so check to
-	   see if there's a payload_length.  If there's a payload
-	   length, try to read that much data from the socket, and
-	   you're done.
+	/* Leave room for the terminating NUL. */
+	space = sizeof(session->recv_buf) - session->recv_len - 1;
+	if (0 == space) {
+		ERRR("Response from server \"%s\" is too large (%d bytes)\n",
+		     session->server->name, (int)session->recv_len);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
 
-	   The rest of the headers and payload will be parsed by the
-	   caller.
+	DEBG("before read from fd %d\n", session->control_fd);
 
-	*/
+	read_ret = syscalls_read(session->control_fd,
+				 session->recv_buf + session->recv_len,
+				 space);
 
-	ret = syscalls_read(session->control_fd,
-			    response->buf,
-			    response->buflen);
 	DEBG("after read from fd %d\n", session->control_fd);
 
-	if (ret > 0) {
-		response->buflen = ret;
-		NOTC("response length: %d bytes\n"
-		     "----------------------------------------\n"
-		     "%s"
-		     "----------------------------------------\n",
-		     response->buflen,
-		     response->buf);
-		ret = UTILITY_SUCCESS;
+	if (read_ret > 0) {
+		session->recv_len += read_ret;
+		session->recv_buf[session->recv_len] = '\0';
+	} else if (read_ret < 0 && EAGAIN == errno) {
+		DEBG("No response data available from server \"%s\"\n",
+		     session->server->name);
 	} else {
 		ERRR("Read from server \"%s\" failed\n",
 		     session->server->name);
 		ret = UTILITY_FAILURE;
 	}
 
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Reads one response, failing if the server hasn't sent all of it
+ * within RTSP_RESPONSE_TIMEOUT ms. */
+utility_retcode_t read_response(struct rtsp_response *response)
+{
+	struct rtsp_session *session = response->session;
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct pollfd pfd;
+	uint64_t now, deadline;
+	int poll_ret;
+
+	FUNC_ENTER;
+
+	INFO("Reading response from server \"%s\"\n", session->server->name);
+
+	/* An RTSP message is complete once its headers and as many
+	   bytes of payload as its Content-Length header specifies
+	   have been read (RFC2326, §9.2).  Anything read past the end
+	   of the message belongs to the next response, which happens
+	   when requests are pipelined, so it's kept in the session
+	   for the next call.  */
+
+	deadline = utility_time_ns() +
+		(uint64_t)RTSP_RESPONSE_TIMEOUT * 1000000;
+
+	pfd.fd = session->control_fd;
+	pfd.events = POLLIN;
+
+	while (UTILITY_FALSE == take_response(response)) {
+		now = utility_time_ns();
+		poll_ret = (now < deadline) ?
+			syscalls_poll(&pfd, 1,
+				      (int)((deadline - now + 999999) / 1000000)) :
+			0;
+
+		if (poll_ret < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+
+			ERRR("Poll on control connection to server \"%s\" "
+			     "failed: %s\n", session->server->name,
+			     strerror(errno));
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
+
+		if (0 == poll_ret) {
+			ERRR("No response from server \"%s\" within %d ms\n",
+			     session->server->name, RTSP_RESPONSE_TIMEOUT);
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
+
+		ret = fill_response_buffer(session);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+	}
+
 	INFO("Finished reading response from server.\n");
 
+out:
 	FUNC_RETURN;
 	return ret;
 }
 
 
+utility_retcode_t set_fd_blocking(int fd, utility_boolean_t blocking)
+{
+	int flags;
+
+	FUNC_ENTER;
+
+	flags = syscalls_fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		ERRR("Could not get flags for fd %d\n", fd);
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
+
+	if (blocking) {
+		flags &= ~O_NONBLOCK;
+	} else {
+		flags |= O_NONBLOCK;
+	}
+
+	if (syscalls_fcntl(fd, F_SETFL, flags) < 0) {
+		ERRR("Could not set flags for fd %d\n", fd);
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+/* Starts a connection without waiting for it to complete.  The fd
+ * polls writable once the connection attempt has finished, and
+ * finish_connect() says whether it succeeded. */
+utility_retcode_t start_connect(char *host, short port, int *fd)
+{
+	struct sockaddr_in servaddr;
+
+	FUNC_ENTER;
+
+	DEBG("Starting connection to %s:%d\n", host, port);
+
+	*fd = syscalls_socket(AF_INET, SOCK_STREAM, 0);
+	if (*fd < 0) {
+		ERRR("Could not create socket when connecting to %s:%d\n",
+		     host, port);
+		goto err;
+	}
+
+	if (UTILITY_SUCCESS != set_fd_blocking(*fd, UTILITY_FALSE)) {
+		goto close_fd;
+	}
+
+	syscalls_memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = syscalls_htons(port);
+
+	if (syscalls_inet_pton(AF_INET, host, &servaddr.sin_addr) <= 0) {
+		ERRR("Could not convert string to IP address when "
+		     "connecting to %s:%d\n", host, port);
+		goto close_fd;
+	}
+
+	if (syscalls_connect(*fd, (struct sockaddr *)&servaddr,
+			     sizeof(servaddr)) < 0 && EINPROGRESS != errno) {
+		ERRR("Connection failed when connecting to %s:%d\n",
+		     host, port);
+		goto close_fd;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+close_fd:
+	syscalls_close(*fd);
+	*fd = -1;
+err:
+	ERRR("Could not connect to %s port %d\n", host, port);
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+utility_retcode_t finish_connect(int fd)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	FUNC_ENTER;
+
+	if (syscalls_getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+	    0 != err) {
+		ERRR("Connection failed (fd: %d): %s\n", fd, strerror(err));
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
+
+	INFO("Connection succeeded (fd: %d)\n", fd);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
 utility_retcode_t connect_to_port(char *host, short port, int *fd)
 {
 	int ret;
@@ -200,3 +443,106 @@ out:
 	FUNC_RETURN;
 	return ret;
 }
+
+
+/* Opens a UDP socket on a port the kernel picks, for the server to
+ * send RTP control or timing packets to. */
+utility_retcode_t open_udp_port(int *fd, unsigned short *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	FUNC_ENTER;
+
+	*fd = syscalls_socket(AF_INET, SOCK_DGRAM, 0);
+	if (*fd < 0) {
+		ERRR("Could not create UDP socket\n");
+		goto err;
+	}
+
+	syscalls_memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = syscalls_htonl(INADDR_ANY);
+	addr.sin_port = 0;
+
+	if (syscalls_bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    syscalls_getsockname(*fd, (struct sockaddr *)&addr, &addrlen) < 0) {
+		ERRR("Could not bind UDP socket: %s\n", strerror(errno));
+		goto close_fd;
+	}
+
+	*port = syscalls_ntohs(addr.sin_port);
+
+	DEBG("Opened UDP port %u (fd %d)\n", (unsigned int)*port, *fd);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+close_fd:
+	syscalls_close(*fd);
+	*fd = -1;
+err:
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+/* Points a UDP socket at host:port, so plain write()s go out to it
+ * as datagrams and only its datagrams are read. */
+utility_retcode_t connect_udp_fd(int fd, char *host, short port)
+{
+	struct sockaddr_in servaddr;
+
+	FUNC_ENTER;
+
+	DEBG("Connecting UDP socket %d to %s:%d\n", fd, host, port);
+
+	syscalls_memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = syscalls_htons(port);
+
+	if (syscalls_inet_pton(AF_INET, host, &servaddr.sin_addr) <= 0) {
+		ERRR("Could not convert string to IP address when "
+		     "connecting to %s:%d\n", host, port);
+		goto err;
+	}
+
+	if (syscalls_connect(fd, (struct sockaddr *)&servaddr,
+			     sizeof(servaddr)) < 0) {
+		ERRR("Could not connect UDP socket to %s:%d\n", host, port);
+		goto err;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+err:
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+/* A new UDP socket connected to host:port. */
+utility_retcode_t connect_udp_port(char *host, short port, int *fd)
+{
+	FUNC_ENTER;
+
+	*fd = syscalls_socket(AF_INET, SOCK_DGRAM, 0);
+	if (*fd < 0) {
+		ERRR("Could not create UDP socket for %s:%d\n", host, port);
+		goto err;
+	}
+
+	if (UTILITY_SUCCESS != connect_udp_fd(*fd, host, port)) {
+		syscalls_close(*fd);
+		*fd = -1;
+		goto err;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+err:
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
@@ -23,7 +23,17 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 
 utility_retcode_t connect_server(struct rtsp_session *session);
 utility_retcode_t connect_to_port(char *host, short port, int *fd);
-utility_retcode_t send_request(struct rtsp_request *request);
+utility_retcode_t start_connect(char *host, short port, int *fd);
+utility_retcode_t finish_connect(int fd);
+utility_retcode_t set_fd_blocking(int fd, utility_boolean_t blocking);
+utility_retcode_t open_udp_port(int *fd, unsigned short *port);
+utility_retcode_t connect_udp_fd(int fd, char *host, short port);
+utility_retcode_t connect_udp_port(char *host, short port, int *fd);
+utility_retcode_t queue_request(struct rtsp_request *request);
+utility_retcode_t write_requests(struct rtsp_session *session);
+utility_retcode_t flush_requests(struct rtsp_session *session);
 utility_retcode_t read_response(struct rtsp_response *response);
+utility_retcode_t fill_response_buffer(struct rtsp_session *session);
+utility_boolean_t take_response(struct rtsp_response *response);
 
 #endif /* #ifndef CLIENT_H */
@@ -136,6 +136,182 @@ utility_retcode_t get_server_port(short *i)
 }
 
 
+utility_retcode_t get_rtsp_pipelining(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = RTSP_PIPELINING;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_aes_key_pool_size(int *size)
+{
+	FUNC_ENTER;
+
+	*size = AES_KEY_POOL_SIZE;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_rtp_transport(rtp_transport_t *transport)
+{
+	FUNC_ENTER;
+
+	*transport = RTP_TRANSPORT;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_playout_latency(unsigned int *ms)
+{
+	FUNC_ENTER;
+
+	*ms = PLAYOUT_LATENCY;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_audio_fan_out(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = AUDIO_FAN_OUT;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_log_async(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = LOG_ASYNC;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_log_destination(lt_output_t *output)
+{
+	FUNC_ENTER;
+
+	*output = LOG_DESTINATION;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_log_file(char *s, size_t size)
+{
+	FUNC_ENTER;
+
+	syscalls_strncpy(s, LOG_FILE, size);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_log_overflow(lt_overflow_t *overflow)
+{
+	FUNC_ENTER;
+
+	*overflow = LOG_OVERFLOW;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_flight_recorder(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = FLIGHT_RECORDER;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_flight_recorder_dir(char *s, size_t size)
+{
+	FUNC_ENTER;
+
+	syscalls_strncpy(s, FLIGHT_RECORDER_DIR, size);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_flight_recorder_stall(unsigned int *ms)
+{
+	FUNC_ENTER;
+
+	*ms = FLIGHT_RECORDER_STALL;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_stage_latency(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = STAGE_LATENCY;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_perf_counters(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = PERF_COUNTERS;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_metrics_listen(char *s, size_t size)
+{
+	FUNC_ENTER;
+
+	syscalls_strncpy(s, METRICS_LISTEN, size);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t get_syscalls_accounting(utility_boolean_t *enabled)
+{
+	FUNC_ENTER;
+
+	*enabled = SYSCALLS_ACCOUNTING;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
 utility_retcode_t get_server_encoded_rsa_public_modulo(char *s, size_t size)
 {
         char modulo[] =
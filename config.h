@@ -20,9 +20,14 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #define CONFIG_H
 
 #include "utility.h"
+#include "lt.h"
 
 #define RTSP_MAX_REQUEST_LEN	4096
 #define RTSP_MAX_RESPONSE_LEN	4096
+#define RTSP_MAX_QUEUED_REQUEST_LEN	(4 * RTSP_MAX_REQUEST_LEN)
+#define RTSP_HANDSHAKE_TIMEOUT	10000 /* miliseconds without progress */
+#define RTSP_RESPONSE_TIMEOUT	10000 /* miliseconds to wait for a response */
+#define RTSP_KEEPALIVE_INTERVAL	15000 /* idle miliseconds before OPTIONS */
 #define MAX_METHOD_LEN		32
 #define MAX_URI_LEN		64
 #define MAX_VERSION_LEN		4
@@ -34,6 +39,78 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_INSTANCE_LEN	32
 #define MAX_FILE_NAME_LEN	255
 
+/* Write RTSP requests that don't depend on an earlier response
+ * without waiting for that response.  Servers that reject this are
+ * detected and handled with one request at a time. */
+#define RTSP_PIPELINING UTILITY_TRUE
+
+/* Number of (AES key, IV, RSA encrypted key) sets kept ready by a
+ * background thread so session setup doesn't wait on RSA or the
+ * random source.  0 disables the pool. */
+#define AES_KEY_POOL_SIZE 4
+
+/* How audio packets go to the server: RTP interleaved on a TCP
+ * connection, or RTP over UDP with separate data, control and timing
+ * ports agreed in SETUP.  Over UDP one lost packet doesn't hold up
+ * the ones behind it. */
+typedef enum {
+	RTP_TRANSPORT_TCP,
+	RTP_TRANSPORT_UDP
+} rtp_transport_t;
+
+#define RTP_TRANSPORT RTP_TRANSPORT_TCP
+
+/* Over UDP, how far behind the sync packets tell the server to play
+ * each frame, measured from when its packet was written.  Long
+ * enough for a lost packet to be asked for and resent. */
+#define PLAYOUT_LATENCY 500 /* miliseconds */
+
+/* When playing to a group of servers, read and convert each chunk
+ * once and only encrypt it per server, rather than running the
+ * whole pipeline for each. */
+#define AUDIO_FAN_OUT UTILITY_TRUE
+
+/* Log messages are written out by a background thread, so a thread
+ * that logs only formats the message.  LOG_DESTINATION is
+ * LT_OUTPUT_STDOUT, LT_OUTPUT_FILE (to LOG_FILE) or LT_OUTPUT_SYSLOG.
+ * When the writer falls NUM_LT_MSGS behind, LT_OVERFLOW_DROP throws
+ * new messages away and counts them; LT_OVERFLOW_WAIT holds up the
+ * threads logging them instead. */
+#define LOG_ASYNC UTILITY_TRUE
+#define LOG_DESTINATION LT_OUTPUT_STDOUT
+#define LOG_FILE "/tmp/raopd.log"
+#define LOG_OVERFLOW LT_OVERFLOW_DROP
+
+/* Keep the last few thousand events of each session's audio stream
+ * in memory and write them to FLIGHT_RECORDER_DIR when the stream
+ * fails, on a signal (see flight_recorder.h), or when no packet has
+ * gone out for FLIGHT_RECORDER_STALL while playing.  0 turns the
+ * stall check off. */
+#define FLIGHT_RECORDER UTILITY_TRUE
+#define FLIGHT_RECORDER_DIR "/tmp"
+#define FLIGHT_RECORDER_STALL 2000 /* miliseconds */
+
+/* Time each stage of each packet through the audio pipeline, and log
+ * the percentiles at the end of each session and at exit (see
+ * stage_latency.h) */
+#define STAGE_LATENCY UTILITY_TRUE
+
+/* Count cycles, instructions, cache and branch misses for each stage
+ * timed, and for building and parsing RTSP messages (see
+ * perf_counters.h).  Each count costs two system calls, so it is off
+ * unless wanted. */
+#define PERF_COUNTERS UTILITY_FALSE
+
+/* Where to serve metrics for Prometheus (see metrics.h): a path for a
+ * Unix domain socket, or address:port for HTTP over TCP, such as
+ * "127.0.0.1:9464".  There is no access control, so keep it local.
+ * "" doesn't serve them. */
+#define METRICS_LISTEN ""
+
+/* Count the calls, bytes, errors and time of each thread's calls
+ * through syscalls.c, and log them at exit (see syscalls_acct.h) */
+#define SYSCALLS_ACCOUNTING UTILITY_TRUE
+
 // #define HTTPD_TEST
 
 #ifndef HTTPD_TEST
@@ -59,6 +136,22 @@ utility_retcode_t get_client_instance(char *s, size_t size);
 utility_retcode_t get_server_name(char *s, size_t size);
 utility_retcode_t get_server_host(char *s, size_t size);
 utility_retcode_t get_server_port(short *i);
+utility_retcode_t get_rtsp_pipelining(utility_boolean_t *enabled);
+utility_retcode_t get_aes_key_pool_size(int *size);
+utility_retcode_t get_rtp_transport(rtp_transport_t *transport);
+utility_retcode_t get_playout_latency(unsigned int *ms);
+utility_retcode_t get_audio_fan_out(utility_boolean_t *enabled);
+utility_retcode_t get_log_async(utility_boolean_t *enabled);
+utility_retcode_t get_log_destination(lt_output_t *output);
+utility_retcode_t get_log_file(char *s, size_t size);
+utility_retcode_t get_log_overflow(lt_overflow_t *overflow);
+utility_retcode_t get_flight_recorder(utility_boolean_t *enabled);
+utility_retcode_t get_flight_recorder_dir(char *s, size_t size);
+utility_retcode_t get_flight_recorder_stall(unsigned int *ms);
+utility_retcode_t get_stage_latency(utility_boolean_t *enabled);
+utility_retcode_t get_perf_counters(utility_boolean_t *enabled);
+utility_retcode_t get_metrics_listen(char *s, size_t size);
+utility_retcode_t get_syscalls_accounting(utility_boolean_t *enabled);
 utility_retcode_t get_server_encoded_rsa_public_modulo(char *s, size_t size);
 utility_retcode_t get_server_encoded_rsa_public_exponent(char *s, size_t size);
 
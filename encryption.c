@@ -24,12 +24,14 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include <openssl/bn.h>
 
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include "lt.h"
 #include "utility.h"
 #include "syscalls.h"
 #include "rtsp.h"
 #include "encryption.h"
+#include "config.h"
 #include "encoding.h"
 #include "audio_stream.h"
 
@@ -46,8 +48,6 @@ utility_retcode_t generate_aes_iv(struct aes_data *aes_data)
 
 	ret = get_random_bytes((uint8_t *)&aes_data->iv, sizeof(aes_data->iv));
 
-	ret = UTILITY_SUCCESS;
-
 	FUNC_RETURN;
 	return ret;
 }
@@ -63,8 +63,6 @@ utility_retcode_t generate_aes_key(struct aes_data *aes_data)
 
 	ret = get_random_bytes((uint8_t *)&aes_data->key, sizeof(aes_data->key));
 
-	ret = UTILITY_SUCCESS;
-
 	FUNC_RETURN;
 	return ret;
 }
@@ -95,30 +93,67 @@ out:
 
 
 
-int raopd_rsa_encrypt_openssl(uint8_t *text, int len, uint8_t *res)
+/* The server's public key never changes, so it is decoded once and
+ * shared.  Public key operations don't modify the RSA object, so
+ * concurrent callers are fine. */
+static RSA *rsa_public_key;
+static pthread_once_t rsa_public_key_once = PTHREAD_ONCE_INIT;
+
+static void load_rsa_public_key(void)
 {
 	RSA *rsa;
+	char encoded[512];
 	uint8_t modulo[300];
 	uint8_t exponent[24];
 	size_t size;
 
-        char n[] = 
-            "59dE8qLieItsH1WgjrcFRKj6eUWqi+bGLOX1HL3U3GhC/j0Qg90u3sG/1CUtwC"
-            "5vOYvfDmFI6oSFXi5ELabWJmT2dKHzBJKa3k9ok+8t9ucRqMd6DZHJ2YCCLlDR"
-            "KSKv6kDqnw4UwPdpOMXziC/AMj3Z/lUVX1G7WSHCAWKf1zNS1eLvqr+boEjXuB"
-            "OitnZ/bDzPHrTOZz0Dew0uowxf/+sG+NCK3eQJVxqcaJ/vEHKIVd2M+5qL71yJ"
-            "Q+87X6oV3eaYvt3zWZYD6z5vYTcrtij2VZ9Zmni/UAaHqn9JdsBWLUEpVviYnh"
-            "imNVvYFZeCXg/IdTQ+x4IRdiXNv5hEew==";
-
-        char e[] = "AQAB";
+	FUNC_ENTER;
 
 	rsa = RSA_new();
-	raopd_base64_decode(modulo, sizeof(modulo), n, syscalls_strlen(n), &size);
+	if (NULL == rsa) {
+		ERRR("Failed to allocate RSA public key\n");
+		goto out;
+	}
+
+	get_server_encoded_rsa_public_modulo(encoded, sizeof(encoded));
+	raopd_base64_decode(modulo, sizeof(modulo),
+			    encoded, syscalls_strlen(encoded), &size);
 	rsa->n = BN_bin2bn(modulo, size, NULL);
-	raopd_base64_decode(exponent, sizeof(exponent), e, syscalls_strlen(e), &size);
+
+	get_server_encoded_rsa_public_exponent(encoded, sizeof(encoded));
+	raopd_base64_decode(exponent, sizeof(exponent),
+			    encoded, syscalls_strlen(encoded), &size);
 	rsa->e = BN_bin2bn(exponent, size, NULL);
-	size = RSA_public_encrypt(len, text, res, rsa, RSA_PKCS1_OAEP_PADDING);
-	RSA_free(rsa);
+
+	if (NULL == rsa->n || NULL == rsa->e) {
+		ERRR("Failed to decode RSA public key\n");
+		RSA_free(rsa);
+		goto out;
+	}
+
+	DEBG("Loaded %d byte RSA public key\n", RSA_size(rsa));
+
+	rsa_public_key = rsa;
+
+out:
+	FUNC_RETURN;
+	return;
+}
+
+
+int raopd_rsa_encrypt_openssl(uint8_t *text, int len, uint8_t *res)
+{
+	int size;
+
+	syscalls_pthread_once(&rsa_public_key_once, load_rsa_public_key);
+
+	if (NULL == rsa_public_key) {
+		ERRR("No RSA public key to encrypt with\n");
+		return -1;
+	}
+
+	size = RSA_public_encrypt(len, text, res, rsa_public_key,
+				  RSA_PKCS1_OAEP_PADDING);
 
 	DEBG("RSA encrypted result (%d bytes)\n", size);
 
@@ -126,6 +161,238 @@ int raopd_rsa_encrypt_openssl(uint8_t *text, int len, uint8_t *res)
 }
 
 
+/* Generates everything a session needs to announce its stream: an
+ * AES key and IV, and the key encrypted with the server's RSA public
+ * key. */
+static utility_retcode_t generate_session_keys(struct aes_data *aes_data)
+{
+	utility_retcode_t ret;
+
+	FUNC_ENTER;
+
+	ret = generate_aes_data(aes_data);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	if (raopd_rsa_encrypt_openssl(aes_data->key,
+				      RAOP_AES_KEY_LEN,
+				      aes_data->rsa_encrypted_key) <= 0) {
+		ERRR("Failed to RSA encrypt AES key\n");
+		ret = UTILITY_FAILURE;
+	}
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+struct aes_key_pool_entry {
+	uint8_t iv[RAOP_AES_IV_LEN];
+	uint8_t key[RAOP_AES_KEY_LEN];
+	uint8_t rsa_encrypted_key[RAOP_RSA_PUB_MODULUS_LEN];
+};
+
+/* Session keys generated ahead of time by aes_key_pool_thread().
+ * Entries are handed out once and wiped as they are taken. */
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t refill;
+	pthread_t thread;
+	utility_boolean_t running;
+	int size;
+	int count;
+	unsigned long hits;
+	unsigned long misses;
+	struct aes_key_pool_entry entries[AES_KEY_POOL_MAX];
+} aes_key_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.refill = PTHREAD_COND_INITIALIZER,
+};
+
+
+static void *aes_key_pool_thread(void *arg)
+{
+	struct aes_data aes_data;
+	struct aes_key_pool_entry *entry;
+
+	(void)arg;
+
+	FUNC_ENTER;
+
+	syscalls_pthread_mutex_lock(&aes_key_pool.lock);
+
+	while (aes_key_pool.running) {
+		if (aes_key_pool.count >= aes_key_pool.size) {
+			syscalls_pthread_cond_wait(&aes_key_pool.refill,
+						   &aes_key_pool.lock);
+			continue;
+		}
+
+		/* RSA and the random source are the slow part, so
+		 * don't hold the lock while generating. */
+		syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+
+		if (UTILITY_SUCCESS != generate_session_keys(&aes_data)) {
+			syscalls_pthread_mutex_lock(&aes_key_pool.lock);
+			if (aes_key_pool.running) {
+				ERRR("Failed to generate keys for the pool, "
+				     "generating them on demand\n");
+				/* Sessions now generate their own keys
+				 * and aes_key_pool_stop() has nothing
+				 * to join. */
+				aes_key_pool.running = UTILITY_FALSE;
+				syscalls_pthread_detach(aes_key_pool.thread);
+			}
+			break;
+		}
+
+		syscalls_pthread_mutex_lock(&aes_key_pool.lock);
+
+		if (aes_key_pool.count < aes_key_pool.size) {
+			entry = &aes_key_pool.entries[aes_key_pool.count++];
+			syscalls_memcpy(entry->iv, aes_data.iv,
+					sizeof(entry->iv));
+			syscalls_memcpy(entry->key, aes_data.key,
+					sizeof(entry->key));
+			syscalls_memcpy(entry->rsa_encrypted_key,
+					aes_data.rsa_encrypted_key,
+					sizeof(entry->rsa_encrypted_key));
+		}
+	}
+
+	syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+
+	syscalls_memset(&aes_data, 0, sizeof(aes_data));
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+utility_retcode_t aes_key_pool_start(int size)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	FUNC_ENTER;
+
+	if (size <= 0) {
+		INFO("AES key pool disabled\n");
+		goto out;
+	}
+
+	if (size > AES_KEY_POOL_MAX) {
+		WARN("AES key pool size %d is too large, using %d\n",
+		     size, AES_KEY_POOL_MAX);
+		size = AES_KEY_POOL_MAX;
+	}
+
+	syscalls_pthread_mutex_lock(&aes_key_pool.lock);
+
+	if (aes_key_pool.running) {
+		syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+		WARN("AES key pool already running\n");
+		goto out;
+	}
+
+	aes_key_pool.size = size;
+	aes_key_pool.count = 0;
+	aes_key_pool.hits = 0;
+	aes_key_pool.misses = 0;
+	aes_key_pool.running = UTILITY_TRUE;
+
+	syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+
+	if (0 != syscalls_pthread_create(&aes_key_pool.thread, NULL,
+					 aes_key_pool_thread, NULL)) {
+		aes_key_pool.running = UTILITY_FALSE;
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	INFO("Started AES key pool with %d entries\n", size);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+utility_retcode_t aes_key_pool_stop(void)
+{
+	FUNC_ENTER;
+
+	syscalls_pthread_mutex_lock(&aes_key_pool.lock);
+
+	if (!aes_key_pool.running) {
+		syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+		goto out;
+	}
+
+	aes_key_pool.running = UTILITY_FALSE;
+	syscalls_pthread_cond_signal(&aes_key_pool.refill);
+
+	syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+
+	syscalls_pthread_join(aes_key_pool.thread, NULL);
+
+	INFO("Stopped AES key pool (%lu keys from pool, %lu generated "
+	     "on demand)\n", aes_key_pool.hits, aes_key_pool.misses);
+
+	syscalls_memset(aes_key_pool.entries, 0,
+			sizeof(aes_key_pool.entries));
+	aes_key_pool.count = 0;
+
+out:
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+/* Fills in a session's keys, from the pool if it has any ready and
+ * by generating them here if not. */
+utility_retcode_t take_aes_data(struct aes_data *aes_data)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct aes_key_pool_entry *entry;
+	utility_boolean_t found = UTILITY_FALSE;
+
+	FUNC_ENTER;
+
+	syscalls_pthread_mutex_lock(&aes_key_pool.lock);
+
+	if (aes_key_pool.count > 0) {
+		entry = &aes_key_pool.entries[--aes_key_pool.count];
+		syscalls_memcpy(aes_data->iv, entry->iv, sizeof(entry->iv));
+		syscalls_memcpy(aes_data->key, entry->key, sizeof(entry->key));
+		syscalls_memcpy(aes_data->rsa_encrypted_key,
+				entry->rsa_encrypted_key,
+				sizeof(entry->rsa_encrypted_key));
+		syscalls_memset(entry, 0, sizeof(*entry));
+		aes_key_pool.hits++;
+		found = UTILITY_TRUE;
+	} else if (aes_key_pool.running) {
+		aes_key_pool.misses++;
+	}
+
+	if (aes_key_pool.running) {
+		syscalls_pthread_cond_signal(&aes_key_pool.refill);
+	}
+
+	syscalls_pthread_mutex_unlock(&aes_key_pool.lock);
+
+	if (found) {
+		DEBG("Took AES data from key pool\n");
+	} else {
+		ret = generate_session_keys(aes_data);
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
 /* XXX error checking? */
 utility_retcode_t initialize_aes(struct aes_data *aes_data)
 {
@@ -162,7 +429,7 @@ utility_retcode_t shutdown_aes(struct aes_data *aes_data,
 utility_retcode_t aes_encrypt_data(struct aes_data *aes_data,
 				   uint8_t *encrypted_buf,
 				   size_t *encrypted_len,
-				   uint8_t *cleartext_buf,
+				   const uint8_t *cleartext_buf,
 				   size_t cleartext_len)
 {
 	EVP_CipherUpdate(&aes_data->ctx,
@@ -33,6 +33,8 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #define RAOP_RSA_PUB_MODULUS_LEN	256
 #define RAOP_RSA_PUB_EXPONENT_LEN	16
 
+#define AES_KEY_POOL_MAX		16
+
 struct encoded_rsa_public_key {
 	char *modulo;
 	char *exponent;
@@ -61,6 +63,10 @@ utility_retcode_t generate_aes_data(struct aes_data *aes_data);
 
 int raopd_rsa_encrypt_openssl(uint8_t *text, int len, uint8_t *res);
 
+utility_retcode_t aes_key_pool_start(int size);
+utility_retcode_t aes_key_pool_stop(void);
+utility_retcode_t take_aes_data(struct aes_data *aes_data);
+
 utility_retcode_t write_encrypted_data(int data_fd,
 				       int session_fd,
 				       struct aes_data *aes_data);
@@ -74,7 +80,7 @@ utility_retcode_t shutdown_aes(struct aes_data *aes_data,
 utility_retcode_t aes_encrypt_data(struct aes_data *aes_data,
 				   uint8_t *encrypted_buf,
 				   size_t *encrypted_len,
-				   uint8_t *cleartext_buf,
+				   const uint8_t *cleartext_buf,
 				   size_t cleartext_len);
 
 #endif /* #ifndef ENCRYPTION_H */
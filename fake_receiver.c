@@ -0,0 +1,1022 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "lt.h"
+#include "syscalls.h"
+#include "config.h"
+#include "utility.h"
+#include "rtsp.h"
+#include "rtp_timing.h"
+#include "fake_receiver.h"
+
+#define DEFAULT_FACILITY LT_FAKE_RECEIVER
+
+#define FAKE_RECEIVER_MAX_PENDING	16
+#define FAKE_RECEIVER_RESPONSE_LEN	512
+#define FAKE_RECEIVER_SESSION		"DEADBEEF"
+#define FAKE_RECEIVER_AUDIO_ACK_LEN	48
+#define FAKE_RECEIVER_AUDIO_IDLE	1000 /* miliseconds */
+#define FAKE_RECEIVER_UDP_POLL		100 /* miliseconds */
+
+struct fake_response {
+	uint64_t due; /* ns, see utility_time_ns() */
+	char text[FAKE_RECEIVER_RESPONSE_LEN];
+	size_t len;
+};
+
+struct fake_connection {
+	struct fake_receiver *receiver;
+	int fd;
+	char buf[RTSP_MAX_REQUEST_LEN];
+	size_t len;
+	struct fake_response pending[FAKE_RECEIVER_MAX_PENDING];
+	int num_pending;
+};
+
+/* What the UDP thread knows about the client's clock and stream */
+struct fake_clock {
+	uint32_t random;
+	/* The first sync since the client anchored its stream */
+	uint32_t first_sync_rtp;
+	uint64_t first_sync_ns;
+	/* Timestamp of the first audio packet, which starts the track */
+	utility_boolean_t have_first_packet;
+	uint32_t first_packet_rtp;
+	/* The client's clock less ours, from the exchange with the
+	 * shortest round trip so far */
+	utility_boolean_t have_offset;
+	int64_t client_offset_ns;
+	int64_t client_offset_rtt_ns;
+};
+
+
+static void get_request_field(const char *request,
+			      const char *name,
+			      char *value,
+			      size_t size)
+{
+	const char *begin;
+	size_t len;
+
+	value[0] = '\0';
+
+	begin = syscalls_strstr(request, name);
+	if (NULL == begin) {
+		return;
+	}
+
+	begin += syscalls_strlen(name);
+	len = strcspn(begin, " \r\n");
+	if (len >= size) {
+		len = size - 1;
+	}
+
+	syscalls_memcpy(value, begin, len);
+	value[len] = '\0';
+
+	return;
+}
+
+
+static utility_retcode_t queue_response(struct fake_connection *connection,
+					const char *request,
+					uint64_t arrival)
+{
+	struct fake_receiver *receiver = connection->receiver;
+	struct fake_response *response;
+	char method[MAX_METHOD_LEN];
+	char cseq[16];
+	char transport[128];
+	char control_port[32];
+	int status = 200;
+	const char *reason = "OK";
+
+	FUNC_ENTER;
+
+	if (FAKE_RECEIVER_MAX_PENDING == connection->num_pending) {
+		ERRR("Too many requests outstanding on fd %d\n",
+		     connection->fd);
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
+
+	response = &connection->pending[connection->num_pending];
+
+	/* The method is the first token of the request line. */
+	get_request_field(request, "", method, sizeof(method));
+	get_request_field(request, "\r\nCSeq: ", cseq, sizeof(cseq));
+	get_request_field(request, "\r\nTransport: ",
+			  transport, sizeof(transport));
+
+	DEBG("Received %s request (CSeq %s) on fd %d\n",
+	     method, cseq, connection->fd);
+
+	if (receiver->refuse_pipelining && 0 != connection->num_pending) {
+		status = 455;
+		reason = "Method Not Valid in This State";
+	} else if (NULL != receiver->refuse_method &&
+		   0 == syscalls_strcmp(method, receiver->refuse_method)) {
+		status = 453;
+		reason = "Not Enough Bandwidth";
+	}
+
+	response->len = syscalls_snprintf(response->text,
+					  sizeof(response->text),
+					  "RTSP/1.0 %d %s\r\n"
+					  "CSeq: %s\r\n"
+					  "Audio-Jack-Status: connected; type=analog\r\n",
+					  status, reason, cseq);
+
+	if (200 == status && 0 == syscalls_strcmp(method, "SETUP") &&
+	    NULL != syscalls_strstr(transport, "RTP/AVP/UDP")) {
+		/* Stops at the ';' after the port */
+		get_request_field(transport, "control_port=",
+				  control_port, sizeof(control_port));
+		receiver->client_control_port =
+			syscalls_strtoul(control_port, NULL, 0);
+		get_request_field(transport, "timing_port=",
+				  control_port, sizeof(control_port));
+		receiver->client_timing_port =
+			syscalls_strtoul(control_port, NULL, 0);
+
+		response->len +=
+			syscalls_snprintf(response->text + response->len,
+					  sizeof(response->text) - response->len,
+					  "Session: " FAKE_RECEIVER_SESSION "\r\n"
+					  "Transport: RTP/AVP/UDP;unicast;"
+					  "mode=record;server_port=%d;"
+					  "control_port=%d;timing_port=%d\r\n",
+					  receiver->udp_data_port,
+					  receiver->udp_control_port,
+					  receiver->udp_timing_port);
+	} else if (200 == status && 0 == syscalls_strcmp(method, "SETUP")) {
+		response->len +=
+			syscalls_snprintf(response->text + response->len,
+					  sizeof(response->text) - response->len,
+					  "Session: " FAKE_RECEIVER_SESSION "\r\n"
+					  "Transport: RTP/AVP/TCP;unicast;"
+					  "interleaved=0-1;mode=record;"
+					  "server_port=%d\r\n",
+					  receiver->audio_port);
+	}
+
+	response->len += syscalls_snprintf(response->text + response->len,
+					   sizeof(response->text) - response->len,
+					   "\r\n");
+
+	response->due = arrival +
+		((uint64_t)receiver->latency_ms * 1000000ULL);
+
+	connection->num_pending++;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+static utility_retcode_t read_requests(struct fake_connection *connection)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	uint64_t arrival;
+	size_t len;
+	int read_ret;
+
+	FUNC_ENTER;
+
+	read_ret = syscalls_read(connection->fd,
+				 connection->buf + connection->len,
+				 sizeof(connection->buf) - connection->len - 1);
+	if (read_ret <= 0) {
+		DEBG("Client closed connection on fd %d\n", connection->fd);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	arrival = utility_time_ns();
+	connection->len += read_ret;
+	connection->buf[connection->len] = '\0';
+
+	while (0 != (len = rtsp_message_length(connection->buf))) {
+
+		ret = queue_response(connection, connection->buf, arrival);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+
+		connection->len -= len;
+		memmove(connection->buf, connection->buf + len, connection->len);
+		connection->buf[connection->len] = '\0';
+	}
+
+	if (connection->len == sizeof(connection->buf) - 1) {
+		ERRR("Request on fd %d is too large\n", connection->fd);
+		ret = UTILITY_FAILURE;
+	}
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+static utility_retcode_t write_due_responses(struct fake_connection *connection)
+{
+	struct fake_response *response;
+	uint64_t now;
+	size_t written;
+	int write_ret;
+
+	FUNC_ENTER;
+
+	now = utility_time_ns();
+
+	while (0 != connection->num_pending &&
+	       connection->pending[0].due <= now) {
+
+		response = &connection->pending[0];
+
+		for (written = 0 ; written < response->len ; written += write_ret) {
+			write_ret = syscalls_write(connection->fd,
+						   response->text + written,
+						   response->len - written);
+			if (write_ret <= 0) {
+				FUNC_RETURN;
+				return UTILITY_FAILURE;
+			}
+		}
+
+		connection->num_pending--;
+		memmove(&connection->pending[0], &connection->pending[1],
+			connection->num_pending * sizeof(connection->pending[0]));
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+static int next_timeout_ms(struct fake_connection *connection)
+{
+	uint64_t now;
+
+	if (0 == connection->num_pending) {
+		return -1;
+	}
+
+	now = utility_time_ns();
+	if (connection->pending[0].due <= now) {
+		return 0;
+	}
+
+	/* Round up so we don't wake before the response is due. */
+	return (int)((connection->pending[0].due - now + 999999) / 1000000);
+}
+
+
+static void *serve_connection(void *arg)
+{
+	struct fake_connection *connection = arg;
+	struct pollfd pfd;
+	int poll_ret;
+
+	FUNC_ENTER;
+
+	pfd.fd = connection->fd;
+	pfd.events = POLLIN;
+
+	for (;;) {
+		poll_ret = syscalls_poll(&pfd, 1, next_timeout_ms(connection));
+		if (poll_ret < 0 && EINTR != errno) {
+			ERRR("Poll on fd %d failed: %s\n",
+			     connection->fd, strerror(errno));
+			break;
+		}
+
+		if (poll_ret > 0 &&
+		    UTILITY_SUCCESS != read_requests(connection)) {
+			break;
+		}
+
+		if (UTILITY_SUCCESS != write_due_responses(connection)) {
+			break;
+		}
+	}
+
+	syscalls_close(connection->fd);
+	syscalls_free(connection);
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+/* Reads audio packets, answering the first once the simulated round
+ * trip has passed, and hangs up after FAKE_RECEIVER_AUDIO_IDLE ms
+ * without data, which ends the stream.  Each packet header carries
+ * the length of the rest of the packet, less 4. */
+static void *serve_audio_connection(void *arg)
+{
+	struct fake_connection *connection = arg;
+	struct fake_receiver *receiver = connection->receiver;
+	uint8_t ack[FAKE_RECEIVER_AUDIO_ACK_LEN];
+	uint8_t header[4];
+	size_t header_len = 0, remaining = 0, len;
+	unsigned int packets = 0;
+	struct pollfd pfd;
+	uint64_t due;
+	int read_ret, i;
+
+	FUNC_ENTER;
+
+	pfd.fd = connection->fd;
+	pfd.events = POLLIN;
+
+	while (syscalls_poll(&pfd, 1, FAKE_RECEIVER_AUDIO_IDLE) > 0) {
+		read_ret = syscalls_read(connection->fd, connection->buf,
+					 sizeof(connection->buf));
+		if (read_ret <= 0) {
+			DEBG("Client closed audio connection on fd %d\n",
+			     connection->fd);
+			goto out;
+		}
+
+		for (i = 0 ; i < read_ret ; i += len) {
+			if (header_len < sizeof(header)) {
+				header[header_len++] = connection->buf[i];
+				len = 1;
+
+				if (sizeof(header) == header_len) {
+					remaining = (header[2] << 8) | header[3];
+				}
+				continue;
+			}
+
+			len = MIN(remaining, (size_t)(read_ret - i));
+			remaining -= len;
+
+			if (0 != remaining) {
+				continue;
+			}
+
+			header_len = 0;
+			packets++;
+
+			if (packets == receiver->audio_stall_after) {
+				DEBG("Not reading audio for %u ms\n",
+				     receiver->audio_stall_ms);
+				syscalls_usleep(receiver->audio_stall_ms * 1000);
+			}
+
+			if (1 != packets) {
+				continue;
+			}
+
+			due = utility_time_ns() +
+				(uint64_t)receiver->latency_ms * 1000000ULL;
+			while (utility_time_ns() < due) {
+				syscalls_usleep((due - utility_time_ns()) / 1000 + 1);
+			}
+
+			syscalls_memset(ack, 0, sizeof(ack));
+			syscalls_write(connection->fd, ack, sizeof(ack));
+		}
+	}
+
+	DEBG("Audio connection on fd %d idle after %u packets, closing\n",
+	     connection->fd, packets);
+
+out:
+	syscalls_close(connection->fd);
+	syscalls_free(connection);
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+static void send_to_client(struct fake_receiver *receiver,
+			   int fd,
+			   unsigned short port,
+			   const uint8_t *buf,
+			   size_t len)
+{
+	struct sockaddr_in addr;
+
+	syscalls_memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = syscalls_htons(port);
+	syscalls_inet_pton(AF_INET, receiver->host, &addr.sin_addr);
+
+	syscalls_sendto(fd, buf, len, 0, (struct sockaddr *)&addr,
+			sizeof(addr));
+}
+
+
+/* Asks the client to send count packets from seq again. */
+static void request_resend(struct fake_receiver *receiver,
+			   uint16_t seq,
+			   uint16_t count)
+{
+	static uint16_t request_seq;
+	uint8_t request[8];
+
+	request[0] = 0x80;
+	request[1] = 0xd5;
+	request[2] = request_seq >> 8;
+	request[3] = request_seq & 0xff;
+	request[4] = seq >> 8;
+	request[5] = seq & 0xff;
+	request[6] = count >> 8;
+	request[7] = count & 0xff;
+	request_seq++;
+
+	send_to_client(receiver, receiver->udp_control_fd,
+		       receiver->client_control_port,
+		       request, sizeof(request));
+}
+
+
+static void put_ntp(uint8_t *p, uint64_t ntp)
+{
+	int i;
+
+	for (i = 7 ; i >= 0 ; i--) {
+		p[i] = ntp & 0xff;
+		ntp >>= 8;
+	}
+}
+
+
+static uint64_t get_ntp(const uint8_t *p)
+{
+	uint64_t ntp = 0;
+	int i;
+
+	for (i = 0 ; i < 8 ; i++) {
+		ntp = (ntp << 8) | p[i];
+	}
+
+	return ntp;
+}
+
+
+/* Our clock, timing_offset_ms away from the client's */
+static uint64_t receiver_ntp_now(struct fake_receiver *receiver)
+{
+	int64_t offset;
+
+	offset = (int64_t)receiver->timing_offset_ms * 4294967296LL / 1000;
+
+	return rtp_timing_ntp_now() + offset;
+}
+
+
+/* Holds a timing request up for a pseudo-random part of
+ * timing_jitter_ms, as a congested link would on its way over. */
+static void delay_timing_request(struct fake_receiver *receiver,
+				 struct fake_clock *clock)
+{
+	if (0 != receiver->timing_jitter_ms) {
+		clock->random = clock->random * 1103515245 + 12345;
+		syscalls_usleep((clock->random >> 8) %
+				(receiver->timing_jitter_ms * 1000));
+	}
+}
+
+
+/* Answers a timing request from the client, after holding it up. */
+static void answer_timing_request(struct fake_receiver *receiver,
+				  const uint8_t *request,
+				  struct fake_clock *clock)
+{
+	uint8_t reply[RTP_TIMING_PACKET_LEN];
+
+	delay_timing_request(receiver, clock);
+
+	syscalls_memset(reply, 0, sizeof(reply));
+	reply[0] = 0x80;
+	reply[1] = 0xd3;
+	reply[3] = 0x07;
+	syscalls_memcpy(reply + 8, request + 24, 8);
+	put_ntp(reply + 16, receiver_ntp_now(receiver));
+	put_ntp(reply + 24, receiver_ntp_now(receiver));
+
+	send_to_client(receiver, receiver->udp_timing_fd,
+		       receiver->client_timing_port,
+		       reply, sizeof(reply));
+	receiver->timing_requests++;
+}
+
+
+static void send_timing_request(struct fake_receiver *receiver,
+				struct fake_clock *clock)
+{
+	uint8_t request[RTP_TIMING_PACKET_LEN];
+
+	syscalls_memset(request, 0, sizeof(request));
+	request[0] = 0x80;
+	request[1] = 0xd2;
+	request[3] = 0x07;
+	put_ntp(request + 24, receiver_ntp_now(receiver));
+
+	delay_timing_request(receiver, clock);
+
+	send_to_client(receiver, receiver->udp_timing_fd,
+		       receiver->client_timing_port,
+		       request, sizeof(request));
+}
+
+
+/* Works out the client's clock offset from its reply to one of our
+ * timing requests, as a real receiver would. */
+static void handle_timing_reply(struct fake_receiver *receiver,
+				const uint8_t *reply,
+				struct fake_clock *clock)
+{
+	int64_t t1, t2, t3, t4, rtt;
+
+	t4 = rtp_timing_ntp_to_ns(receiver_ntp_now(receiver));
+	t1 = rtp_timing_ntp_to_ns(get_ntp(reply + 8));
+	t2 = rtp_timing_ntp_to_ns(get_ntp(reply + 16));
+	t3 = rtp_timing_ntp_to_ns(get_ntp(reply + 24));
+
+	receiver->timing_replies++;
+
+	rtt = (t4 - t1) - (t3 - t2);
+	if (!clock->have_offset || rtt < clock->client_offset_rtt_ns) {
+		clock->client_offset_ns = ((t2 - t1) + (t3 - t4)) / 2;
+		clock->client_offset_rtt_ns = rtt;
+		clock->have_offset = UTILITY_TRUE;
+	}
+}
+
+
+/* Checks a sync packet against the first one since the client last
+ * anchored its stream: the timestamps should advance at 44.1 kHz of
+ * the client's clock.  Then works out when the first frame of the
+ * track plays here, by the real clock rather than ours, so that
+ * receivers can be compared. */
+static void handle_sync(struct fake_receiver *receiver,
+			const uint8_t *buf,
+			struct fake_clock *clock)
+{
+	uint32_t rtp_now, rtp_play, expected, drift;
+	uint64_t ns;
+	int64_t play_ns;
+
+	rtp_play = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+	rtp_now = (buf[16] << 24) | (buf[17] << 16) | (buf[18] << 8) | buf[19];
+	ns = rtp_timing_ntp_to_ns(get_ntp(buf + 8));
+
+	receiver->syncs++;
+	receiver->sync_latency_frames = rtp_now - rtp_play;
+
+	if (buf[0] & 0x10) {
+		receiver->first_syncs++;
+		clock->first_sync_rtp = rtp_now;
+		clock->first_sync_ns = ns;
+	} else if (0 != clock->first_sync_ns) {
+		expected = clock->first_sync_rtp +
+			(uint32_t)((ns - clock->first_sync_ns) *
+				   RTP_SAMPLE_RATE / 1000000000ULL);
+		drift = (int32_t)(rtp_now - expected) < 0 ?
+			expected - rtp_now : rtp_now - expected;
+		if (drift > receiver->sync_drift_max_frames) {
+			receiver->sync_drift_max_frames = drift;
+		}
+	}
+
+	if (clock->have_offset && clock->have_first_packet) {
+		/* rtp_play is due at ns by the client's clock */
+		play_ns = ns - clock->client_offset_ns -
+			(int64_t)receiver->timing_offset_ms * 1000000;
+		play_ns -= (int64_t)(int32_t)(rtp_play -
+					      clock->first_packet_rtp) *
+			1000000000LL / RTP_SAMPLE_RATE;
+		receiver->play_start_ns = play_ns;
+	}
+
+	send_timing_request(receiver, clock);
+}
+
+
+/* What a real receiver wants at the start of each audio datagram */
+static utility_boolean_t rtp_audio_header_ok(const uint8_t *buf)
+{
+	return RTP_AUDIO_UDP_BYTE0 == buf[0] &&
+		RTP_AUDIO_UDP_BYTE1 == (buf[1] & ~RTP_MARKER);
+}
+
+
+/* Reads RTP datagrams from the data port, and resent packets from
+ * the control port, until the receiver stops. */
+static void *serve_udp_audio(void *arg)
+{
+	struct fake_receiver *receiver = arg;
+	uint8_t buf[TRANSMIT_BUFLEN];
+	struct pollfd pfd[3];
+	uint16_t seq, last_seq = 0, missing_seq = 0, missing = 0;
+	unsigned int seen = 0;
+	struct fake_clock clock;
+	int read_ret;
+
+	FUNC_ENTER;
+
+	syscalls_memset(&clock, 0, sizeof(clock));
+	clock.random = 1;
+
+	pfd[0].fd = receiver->udp_data_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = receiver->udp_control_fd;
+	pfd[1].events = POLLIN;
+	pfd[2].fd = receiver->udp_timing_fd;
+	pfd[2].events = POLLIN;
+
+	while (receiver->udp_running) {
+		if (syscalls_poll(pfd, 3, FAKE_RECEIVER_UDP_POLL) <= 0) {
+			continue;
+		}
+
+		if (pfd[1].revents & POLLIN) {
+			read_ret = syscalls_read(receiver->udp_control_fd,
+						 buf, sizeof(buf));
+			if (read_ret >= 16 && 0xd6 == buf[1] &&
+			    !rtp_audio_header_ok(buf + 4)) {
+				receiver->udp_bad_headers++;
+			} else if (read_ret >= 16 && 0xd6 == buf[1]) {
+				receiver->udp_resent++;
+			} else if (read_ret >= RTP_SYNC_PACKET_LEN &&
+				   0xd4 == buf[1]) {
+				handle_sync(receiver, buf, &clock);
+			}
+		}
+
+		if (pfd[2].revents & POLLIN) {
+			read_ret = syscalls_read(receiver->udp_timing_fd,
+						 buf, sizeof(buf));
+			if (read_ret >= RTP_TIMING_PACKET_LEN &&
+			    0xd2 == buf[1]) {
+				answer_timing_request(receiver, buf, &clock);
+			} else if (read_ret >= RTP_TIMING_PACKET_LEN &&
+				   0xd3 == buf[1]) {
+				handle_timing_reply(receiver, buf, &clock);
+			}
+		}
+
+		if (!(pfd[0].revents & POLLIN)) {
+			continue;
+		}
+
+		read_ret = syscalls_read(receiver->udp_data_fd, buf, sizeof(buf));
+		if (read_ret < 12) {
+			continue;
+		}
+
+		if (!rtp_audio_header_ok(buf)) {
+			receiver->udp_bad_headers++;
+			continue;
+		}
+
+		if (buf[1] & RTP_MARKER) {
+			receiver->udp_markers++;
+		}
+
+		seq = (buf[2] << 8) | buf[3];
+		seen++;
+
+		if (!clock.have_first_packet) {
+			clock.first_packet_rtp = (buf[4] << 24) |
+				(buf[5] << 16) | (buf[6] << 8) | buf[7];
+			clock.have_first_packet = UTILITY_TRUE;
+		}
+
+		if (0 != receiver->udp_drop_every &&
+		    seen % receiver->udp_drop_every < receiver->udp_drop_burst) {
+			if (0 == missing) {
+				missing_seq = seq;
+			}
+			missing++;
+			receiver->udp_dropped++;
+			last_seq = seq;
+			continue;
+		}
+
+		if (0 != missing) {
+			request_resend(receiver, missing_seq, missing);
+			missing = 0;
+		}
+
+		if (0 != receiver->udp_packets &&
+		    seq != (uint16_t)(last_seq + 1)) {
+			receiver->udp_seq_gaps++;
+		}
+
+		last_seq = seq;
+		receiver->udp_packets++;
+	}
+
+	DEBG("UDP data port closing after %u packets, %u gaps\n",
+	     receiver->udp_packets, receiver->udp_seq_gaps);
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+static utility_retcode_t open_udp_socket(struct fake_receiver *receiver,
+					 int *fd,
+					 short *port)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	*fd = syscalls_socket(AF_INET, SOCK_DGRAM, 0);
+	if (*fd < 0) {
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	syscalls_inet_pton(AF_INET, receiver->host, &addr.sin_addr);
+
+	if (syscalls_bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syscalls_close(*fd);
+		return UTILITY_FAILURE;
+	}
+
+	syscalls_getsockname(*fd, (struct sockaddr *)&addr, &addrlen);
+	*port = syscalls_ntohs(addr.sin_port);
+
+	return UTILITY_SUCCESS;
+}
+
+
+static utility_retcode_t start_udp(struct fake_receiver *receiver)
+{
+	FUNC_ENTER;
+
+	if (UTILITY_SUCCESS != open_udp_socket(receiver,
+					       &receiver->udp_data_fd,
+					       &receiver->udp_data_port)) {
+		goto data_failed;
+	}
+
+	if (UTILITY_SUCCESS != open_udp_socket(receiver,
+					       &receiver->udp_control_fd,
+					       &receiver->udp_control_port)) {
+		goto control_failed;
+	}
+
+	if (UTILITY_SUCCESS != open_udp_socket(receiver,
+					       &receiver->udp_timing_fd,
+					       &receiver->udp_timing_port)) {
+		goto timing_failed;
+	}
+
+	receiver->udp_packets = 0;
+	receiver->udp_seq_gaps = 0;
+	receiver->udp_dropped = 0;
+	receiver->udp_resent = 0;
+	receiver->timing_requests = 0;
+	receiver->timing_replies = 0;
+	receiver->syncs = 0;
+	receiver->first_syncs = 0;
+	receiver->sync_latency_frames = 0;
+	receiver->sync_drift_max_frames = 0;
+	receiver->play_start_ns = 0;
+	receiver->udp_running = 1;
+
+	if (0 != syscalls_pthread_create(&receiver->udp_thread, NULL,
+					 serve_udp_audio, receiver)) {
+		goto thread_failed;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+thread_failed:
+	syscalls_close(receiver->udp_timing_fd);
+timing_failed:
+	syscalls_close(receiver->udp_control_fd);
+control_failed:
+	syscalls_close(receiver->udp_data_fd);
+data_failed:
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+static void stop_udp(struct fake_receiver *receiver)
+{
+	receiver->udp_running = 0;
+	syscalls_pthread_join(receiver->udp_thread, NULL);
+
+	syscalls_close(receiver->udp_data_fd);
+	syscalls_close(receiver->udp_control_fd);
+	syscalls_close(receiver->udp_timing_fd);
+}
+
+
+struct fake_listener {
+	struct fake_receiver *receiver;
+	int fd;
+	void *(*serve)(void *arg);
+};
+
+
+static void *accept_connections(void *arg)
+{
+	struct fake_listener *listener = arg;
+	struct fake_connection *connection;
+	pthread_t thread;
+	int fd;
+	int nodelay = 1;
+
+	FUNC_ENTER;
+
+	while ((fd = syscalls_accept(listener->fd, NULL, NULL)) >= 0) {
+
+		connection = syscalls_malloc(sizeof(*connection));
+		if (NULL == connection) {
+			syscalls_close(fd);
+			continue;
+		}
+
+		syscalls_memset(connection, 0, sizeof(*connection));
+		connection->receiver = listener->receiver;
+		connection->fd = fd;
+
+		/* Responses that are due together are written back
+		 * to back; don't let Nagle hold the second one. */
+		syscalls_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+				    &nodelay, sizeof(nodelay));
+
+		if (0 != syscalls_pthread_create(&thread, NULL,
+						 listener->serve,
+						 connection)) {
+			syscalls_close(fd);
+			syscalls_free(connection);
+			continue;
+		}
+
+		syscalls_pthread_detach(thread);
+	}
+
+	INFO("Fake receiver stopped accepting connections on fd %d\n",
+	     listener->fd);
+
+	syscalls_free(listener);
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+/* Listens on a port the kernel picks and serves each connection with
+ * its own thread. */
+static utility_retcode_t start_listener(struct fake_receiver *receiver,
+					void *(*serve)(void *arg),
+					int *fd,
+					short *port,
+					pthread_t *thread)
+{
+	struct fake_listener *listener;
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+
+	FUNC_ENTER;
+
+	*fd = syscalls_socket(AF_INET, SOCK_STREAM, 0);
+	if (*fd < 0) {
+		goto socket_failed;
+	}
+
+	syscalls_memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	syscalls_inet_pton(AF_INET, receiver->host, &addr.sin_addr);
+
+	if (syscalls_bind(*fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		goto bind_failed;
+	}
+
+	if (syscalls_listen(*fd, SOMAXCONN) < 0) {
+		goto bind_failed;
+	}
+
+	syscalls_getsockname(*fd, (struct sockaddr *)&addr, &addrlen);
+	*port = syscalls_ntohs(addr.sin_port);
+
+	listener = syscalls_malloc(sizeof(*listener));
+	if (NULL == listener) {
+		goto bind_failed;
+	}
+
+	listener->receiver = receiver;
+	listener->fd = *fd;
+	listener->serve = serve;
+
+	if (0 != syscalls_pthread_create(thread, NULL,
+					 accept_connections, listener)) {
+		syscalls_free(listener);
+		goto bind_failed;
+	}
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+bind_failed:
+	syscalls_close(*fd);
+socket_failed:
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+static void stop_listener(int fd, pthread_t thread)
+{
+	syscalls_shutdown(fd, SHUT_RDWR);
+	syscalls_pthread_join(thread, NULL);
+	syscalls_close(fd);
+}
+
+
+utility_retcode_t fake_receiver_start(struct fake_receiver *receiver)
+{
+	FUNC_ENTER;
+
+	syscalls_strncpy(receiver->host, "127.0.0.1", sizeof(receiver->host));
+
+	if (UTILITY_SUCCESS != start_listener(receiver, serve_connection,
+					      &receiver->listen_fd,
+					      &receiver->port,
+					      &receiver->thread)) {
+		goto control_failed;
+	}
+
+	if (UTILITY_SUCCESS != start_listener(receiver, serve_audio_connection,
+					      &receiver->audio_listen_fd,
+					      &receiver->audio_port,
+					      &receiver->audio_thread)) {
+		goto audio_failed;
+	}
+
+	if (UTILITY_SUCCESS != start_udp(receiver)) {
+		goto udp_failed;
+	}
+
+	INFO("Fake receiver listening on %s port %d, audio port %d, "
+	     "UDP ports %d/%d/%d (latency %u ms)\n",
+	     receiver->host, receiver->port, receiver->audio_port,
+	     receiver->udp_data_port, receiver->udp_control_port,
+	     receiver->udp_timing_port, receiver->latency_ms);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+
+udp_failed:
+	stop_listener(receiver->audio_listen_fd, receiver->audio_thread);
+audio_failed:
+	stop_listener(receiver->listen_fd, receiver->thread);
+control_failed:
+	ERRR("Failed to start fake receiver\n");
+	FUNC_RETURN;
+	return UTILITY_FAILURE;
+}
+
+
+/* Stops accepting connections.  Connections that are already open
+ * are served until the client closes them. */
+utility_retcode_t fake_receiver_stop(struct fake_receiver *receiver)
+{
+	FUNC_ENTER;
+
+	stop_listener(receiver->listen_fd, receiver->thread);
+	stop_listener(receiver->audio_listen_fd, receiver->audio_thread);
+	stop_udp(receiver);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
@@ -0,0 +1,114 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FAKE_RECEIVER_H
+#define FAKE_RECEIVER_H
+
+#include <pthread.h>
+
+#include "utility.h"
+
+/* A stand-in for an AirPort Express that answers the RTSP handshake
+ * on the loopback interface, so the client can be exercised and
+ * timed without hardware.  Every response is held back until
+ * latency_ms after its request arrived, which behaves like a link
+ * with that round trip time: requests that are written together are
+ * answered together. */
+struct fake_receiver {
+	char host[MAX_HOST_NAME_LEN];
+	short port;
+	int listen_fd;
+	pthread_t thread;
+	/* Returned in the SETUP response.  The first audio packet is
+	 * answered, and the connection is closed once the client has
+	 * stopped sending for a second. */
+	short audio_port;
+	int audio_listen_fd;
+	pthread_t audio_thread;
+	/* Offered instead when SETUP asks for RTP over UDP.  Datagrams
+	 * on the data port are counted, and checked for gaps in their
+	 * sequence numbers. */
+	short udp_data_port;
+	short udp_control_port;
+	short udp_timing_port;
+	int udp_data_fd;
+	int udp_control_fd;
+	int udp_timing_fd;
+	pthread_t udp_thread;
+	volatile int udp_running;
+	volatile unsigned int udp_packets;
+	volatile unsigned int udp_seq_gaps;
+	/* Datagrams, and packets inside resends, without an RTP
+	 * version 2 header of payload type 0x60, which a real receiver
+	 * would drop; and datagrams with the marker bit set */
+	volatile unsigned int udp_bad_headers;
+	volatile unsigned int udp_markers;
+	/* The client's control port from SETUP, where resend requests
+	 * go, and what came back: packets dropped on purpose and
+	 * resends received for them */
+	unsigned short client_control_port;
+	volatile unsigned int udp_dropped;
+	volatile unsigned int udp_resent;
+	/* The client's timing port from SETUP.  Timing requests from
+	 * the client are answered by a clock timing_offset_ms ahead of
+	 * ours, and each sync packet is answered with a timing request
+	 * of our own. */
+	unsigned short client_timing_port;
+	volatile unsigned int timing_requests;
+	volatile unsigned int timing_replies;
+	/* Sync packets from the client, how many of them followed an
+	 * anchor, the latency the last one asked for, and the furthest
+	 * any strayed, in frames, from the timestamp the first after
+	 * its anchor and 44.1 kHz would give */
+	volatile unsigned int syncs;
+	volatile unsigned int first_syncs;
+	volatile uint32_t sync_latency_frames;
+	volatile uint32_t sync_drift_max_frames;
+	/* When, by the real clock (ns since 1900), the first frame of
+	 * the first track plays here, from the last sync packet and our
+	 * own estimate of the client's clock; 0 until both are known */
+	volatile int64_t play_start_ns;
+
+	/* Set by the caller before starting the receiver. */
+	unsigned int latency_ms;
+	/* Answer 455 to any request that arrives while an earlier
+	 * one is still waiting for its response. */
+	utility_boolean_t refuse_pipelining;
+	/* Answer 453 to every request with this method, or NULL */
+	const char *refuse_method;
+	/* Over UDP, treat udp_drop_burst packets in every udp_drop_every
+	 * as lost and ask for them again once the next one arrives.
+	 * 0 drops nothing. */
+	unsigned int udp_drop_every;
+	unsigned int udp_drop_burst;
+	/* Over TCP, stop reading audio for audio_stall_ms after
+	 * audio_stall_after packets, as a server that has hung would.
+	 * 0 never stops. */
+	unsigned int audio_stall_after;
+	unsigned int audio_stall_ms;
+	/* Our clock less the client's, and up to how long each timing
+	 * request takes to reach the clock, which skews the offset the
+	 * client works out from it */
+	int timing_offset_ms;
+	unsigned int timing_jitter_ms;
+};
+
+utility_retcode_t fake_receiver_start(struct fake_receiver *receiver);
+utility_retcode_t fake_receiver_stop(struct fake_receiver *receiver);
+
+#endif /* #ifndef FAKE_RECEIVER_H */
@@ -0,0 +1,464 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "config.h"
+#include "flight_recorder.h"
+
+#define DEFAULT_FACILITY LT_FLIGHT_RECORDER
+
+/* Events copied out at a time when a recorder is written out */
+#define FLIGHT_DUMP_BATCH		64
+
+typedef enum {
+	FLIGHT_SLOT_FREE,
+	FLIGHT_SLOT_OPENING,
+	FLIGHT_SLOT_OPEN
+} flight_slot_t;
+
+struct flight_recorder {
+	flight_slot_t state;
+	/* Events recorded; the next goes in events[next & (EVENTS - 1)] */
+	uint32_t next;
+	/* Set by the events from FLIGHT_STALL on, cleared by FLIGHT_SENT */
+	int idle;
+	uint64_t last_sent_ns;
+	char session[FLIGHT_SESSION_LEN];
+	/* Where its files go, less the reason on the end */
+	char path[MAX_FILE_NAME_LEN];
+	struct flight_event events[FLIGHT_RECORDER_EVENTS];
+};
+
+/* Recorders are never freed, so a signal handler can write out any of
+ * them at any time.  A session takes whichever is free. */
+static struct flight_recorder recorders[FLIGHT_RECORDER_SLOTS];
+
+static const int fatal_signals[] = {
+	SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT
+};
+
+#define NUM_FATAL_SIGNALS (sizeof(fatal_signals) / sizeof(fatal_signals[0]))
+
+static int recorders_running;
+static char recorder_dir[MAX_FILE_NAME_LEN];
+static unsigned int sessions_recorded;
+static struct sigaction saved_dump_action;
+static struct sigaction saved_fatal_actions[NUM_FATAL_SIGNALS];
+
+static int watchdog_running;
+static pthread_t watchdog_thread;
+static unsigned int watchdog_stall_ms;
+
+
+static void put_event(struct flight_recorder *recorder,
+		      flight_event_t type,
+		      uint16_t seq,
+		      int32_t value,
+		      uint32_t extra,
+		      uint64_t now)
+{
+	struct flight_event *event;
+	uint32_t index;
+
+	index = __atomic_fetch_add(&recorder->next, 1, __ATOMIC_RELAXED);
+	event = &recorder->events[index & (FLIGHT_RECORDER_EVENTS - 1)];
+
+	__atomic_store_n(&event->stamp, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	event->ns = now;
+	event->type = type;
+	event->seq = seq;
+	event->value = value;
+	event->extra = extra;
+
+	__atomic_store_n(&event->stamp, index + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Records an event for the session, if it has a recorder.  Takes no
+ * lock, so any thread can record into any session's recorder. */
+void flight_record(struct flight_recorder *recorder,
+		   flight_event_t type,
+		   uint16_t seq,
+		   int32_t value,
+		   uint32_t extra)
+{
+	uint64_t now;
+
+	if (NULL == recorder) {
+		return;
+	}
+
+	now = utility_time_ns();
+	put_event(recorder, type, seq, value, extra, now);
+
+	if (FLIGHT_SENT == type) {
+		__atomic_store_n(&recorder->last_sent_ns, now,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&recorder->idle, 0, __ATOMIC_RELEASE);
+	} else if (type >= FLIGHT_STALL) {
+		__atomic_store_n(&recorder->idle, 1, __ATOMIC_RELEASE);
+	}
+}
+
+
+/* Copies event index out unless it is being written or has been
+ * written over. */
+static utility_boolean_t copy_event(struct flight_recorder *recorder,
+				    uint32_t index,
+				    struct flight_event *copy)
+{
+	struct flight_event *event;
+	uint32_t stamp;
+
+	event = &recorder->events[index & (FLIGHT_RECORDER_EVENTS - 1)];
+
+	stamp = __atomic_load_n(&event->stamp, __ATOMIC_ACQUIRE);
+	if (index + 1 != stamp) {
+		return UTILITY_FALSE;
+	}
+
+	memcpy(copy, event, sizeof(*copy));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return (stamp == __atomic_load_n(&event->stamp, __ATOMIC_RELAXED)) ?
+		UTILITY_TRUE : UTILITY_FALSE;
+}
+
+
+static size_t copy_string(char *dst, const char *src, size_t size)
+{
+	size_t len = 0;
+
+	while (len + 1 < size && '\0' != src[len]) {
+		dst[len] = src[len];
+		len++;
+	}
+	dst[len] = '\0';
+
+	return len;
+}
+
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, p, len);
+		if (ret < 0 && EINTR == errno) {
+			continue;
+		}
+		if (ret <= 0) {
+			return;
+		}
+		p += ret;
+		len -= ret;
+	}
+}
+
+
+/* Writes the recorder out to its path with reason on the end.  This
+ * runs in signal handlers, so it uses only calls that are safe there:
+ * no logging, no stdio and no locks, which rules out the syscalls_
+ * wrappers too. */
+void flight_recorder_dump(struct flight_recorder *recorder,
+			  const char *reason)
+{
+	struct flight_header header;
+	struct flight_event batch[FLIGHT_DUMP_BATCH];
+	char path[MAX_FILE_NAME_LEN];
+	uint32_t index, next;
+	size_t len, num = 0;
+	int fd;
+
+	if (NULL == recorder) {
+		return;
+	}
+
+	len = copy_string(path, recorder->path, sizeof(path));
+	copy_string(path + len, reason, sizeof(path) - len);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return;
+	}
+
+	next = __atomic_load_n(&recorder->next, __ATOMIC_ACQUIRE);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, FLIGHT_MAGIC, sizeof(header.magic));
+	header.event_size = sizeof(struct flight_event);
+	header.recorded = next;
+	header.dump_ns = utility_time_ns();
+	copy_string(header.session, recorder->session, sizeof(header.session));
+	copy_string(header.reason, reason, sizeof(header.reason));
+	write_all(fd, &header, sizeof(header));
+
+	index = (next > FLIGHT_RECORDER_EVENTS) ?
+		next - FLIGHT_RECORDER_EVENTS : 0;
+
+	for ( ; index != next ; index++) {
+		if (copy_event(recorder, index, &batch[num])) {
+			num++;
+		}
+
+		if (FLIGHT_DUMP_BATCH == num) {
+			write_all(fd, batch, num * sizeof(batch[0]));
+			num = 0;
+		}
+	}
+
+	write_all(fd, batch, num * sizeof(batch[0]));
+	close(fd);
+}
+
+
+/* Writes out every session's recorder.  Safe in a signal handler. */
+void flight_recorder_dump_all(const char *reason)
+{
+	int i;
+
+	for (i = 0 ; i < FLIGHT_RECORDER_SLOTS ; i++) {
+		if (FLIGHT_SLOT_OPEN ==
+		    __atomic_load_n(&recorders[i].state, __ATOMIC_ACQUIRE)) {
+			flight_recorder_dump(&recorders[i], reason);
+		}
+	}
+}
+
+
+/* FLIGHT_RECORDER_SIGNAL writes the recorders out on demand.  A fatal
+ * signal writes them out and is raised again, with the handler reset
+ * to the default, once this returns. */
+static void handle_signal(int sig)
+{
+	int saved_errno = errno;
+
+	if (FLIGHT_RECORDER_SIGNAL == sig) {
+		flight_recorder_dump_all("signal");
+	} else {
+		flight_recorder_dump_all("crash");
+		syscalls_raise(sig);
+	}
+
+	errno = saved_errno;
+}
+
+
+/* Writes out the recorder of any session that has stopped sending
+ * packets, once per stall, without the stream having paused or
+ * ended. */
+static void *run_watchdog(void *arg __attribute__ ((unused)))
+{
+	struct flight_recorder *recorder;
+	uint64_t now, since;
+	int i;
+
+	while (__atomic_load_n(&watchdog_running, __ATOMIC_ACQUIRE)) {
+		usleep(FLIGHT_WATCHDOG_POLL * 1000);
+		now = utility_time_ns();
+
+		for (i = 0 ; i < FLIGHT_RECORDER_SLOTS ; i++) {
+			recorder = &recorders[i];
+
+			if (FLIGHT_SLOT_OPEN !=
+			    __atomic_load_n(&recorder->state,
+					    __ATOMIC_ACQUIRE) ||
+			    __atomic_load_n(&recorder->idle,
+					    __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+
+			since = now - __atomic_load_n(&recorder->last_sent_ns,
+						      __ATOMIC_RELAXED);
+			if (since < (uint64_t)watchdog_stall_ms * 1000000) {
+				continue;
+			}
+
+			put_event(recorder, FLIGHT_STALL, 0,
+				  (int32_t)(since / 1000000), 0, now);
+			__atomic_store_n(&recorder->idle, 1, __ATOMIC_RELEASE);
+
+			WARN("No audio sent to \"%s\" for %llu ms\n",
+			     recorder->session,
+			     (unsigned long long)since / 1000000);
+			flight_recorder_dump(recorder, "stall");
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Gives sessions opened from now on a recorder writing to dir, and
+ * writes them out on a signal or, unless stall_ms is 0, when one
+ * sends nothing for stall_ms. */
+utility_retcode_t flight_recorder_start(const char *dir,
+					unsigned int stall_ms)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct sigaction action;
+	size_t i;
+
+	FUNC_ENTER;
+
+	if (__atomic_load_n(&recorders_running, __ATOMIC_ACQUIRE)) {
+		ERRR("Flight recorders are already running\n");
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	copy_string(recorder_dir, dir, sizeof(recorder_dir));
+
+	syscalls_memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigemptyset(&action.sa_mask);
+
+	action.sa_flags = SA_RESTART;
+	syscalls_sigaction(FLIGHT_RECORDER_SIGNAL, &action,
+			   &saved_dump_action);
+
+	action.sa_flags = SA_RESETHAND;
+	for (i = 0 ; i < NUM_FATAL_SIGNALS ; i++) {
+		syscalls_sigaction(fatal_signals[i], &action,
+				   &saved_fatal_actions[i]);
+	}
+
+	__atomic_store_n(&recorders_running, 1, __ATOMIC_RELEASE);
+
+	if (stall_ms > 0) {
+		watchdog_stall_ms = stall_ms;
+		__atomic_store_n(&watchdog_running, 1, __ATOMIC_RELEASE);
+
+		if (0 != syscalls_pthread_create(&watchdog_thread, NULL,
+						 run_watchdog, NULL)) {
+			__atomic_store_n(&watchdog_running, 0,
+					 __ATOMIC_RELEASE);
+			WARN("Stalled sessions won't be noticed\n");
+		}
+	}
+
+	INFO("Flight recorders write to \"%s\"\n", recorder_dir);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+void flight_recorder_stop(void)
+{
+	size_t i;
+
+	FUNC_ENTER;
+
+	if (!__atomic_load_n(&recorders_running, __ATOMIC_ACQUIRE)) {
+		goto out;
+	}
+
+	if (__atomic_load_n(&watchdog_running, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&watchdog_running, 0, __ATOMIC_RELEASE);
+		syscalls_pthread_join(watchdog_thread, NULL);
+	}
+
+	syscalls_sigaction(FLIGHT_RECORDER_SIGNAL, &saved_dump_action, NULL);
+	for (i = 0 ; i < NUM_FATAL_SIGNALS ; i++) {
+		syscalls_sigaction(fatal_signals[i], &saved_fatal_actions[i],
+				   NULL);
+	}
+
+	__atomic_store_n(&recorders_running, 0, __ATOMIC_RELEASE);
+
+out:
+	FUNC_RETURN;
+	return;
+}
+
+
+/* Returns a recorder for the session, or NULL if recorders aren't
+ * running or none is free.  flight_record() and the rest take NULL
+ * and do nothing. */
+struct flight_recorder *flight_recorder_open(const char *session)
+{
+	struct flight_recorder *recorder = NULL;
+	flight_slot_t state;
+	unsigned int number;
+	int i;
+
+	FUNC_ENTER;
+
+	if (!__atomic_load_n(&recorders_running, __ATOMIC_ACQUIRE)) {
+		goto out;
+	}
+
+	for (i = 0 ; i < FLIGHT_RECORDER_SLOTS ; i++) {
+		state = FLIGHT_SLOT_FREE;
+		if (__atomic_compare_exchange_n(&recorders[i].state, &state,
+						FLIGHT_SLOT_OPENING, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			recorder = &recorders[i];
+			break;
+		}
+	}
+
+	if (NULL == recorder) {
+		WARN("No flight recorder free for \"%s\"\n", session);
+		goto out;
+	}
+
+	syscalls_memset(recorder->events, 0, sizeof(recorder->events));
+	recorder->next = 0;
+	recorder->idle = 1;
+	recorder->last_sent_ns = 0;
+	copy_string(recorder->session, session, sizeof(recorder->session));
+
+	number = __atomic_add_fetch(&sessions_recorded, 1, __ATOMIC_RELAXED);
+	syscalls_snprintf(recorder->path, sizeof(recorder->path),
+			  "%s/raopd_flight_%d_%u.", recorder_dir,
+			  (int)syscalls_getpid(), number);
+
+	__atomic_store_n(&recorder->state, FLIGHT_SLOT_OPEN, __ATOMIC_RELEASE);
+
+	DEBG("Flight recorder for \"%s\" writes to %s*\n", session,
+	     recorder->path);
+
+out:
+	FUNC_RETURN;
+	return recorder;
+}
+
+
+void flight_recorder_close(struct flight_recorder *recorder)
+{
+	if (NULL == recorder) {
+		return;
+	}
+
+	__atomic_store_n(&recorder->state, FLIGHT_SLOT_FREE, __ATOMIC_RELEASE);
+}
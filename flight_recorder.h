@@ -0,0 +1,116 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FLIGHT_RECORDER_H
+#define FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <signal.h>
+
+#include "utility.h"
+
+/* A flight recorder keeps the last FLIGHT_RECORDER_EVENTS things that
+ * happened to one session's audio stream, in memory, for as long as
+ * the session lasts.  It is written out to a file when the stream
+ * fails, when the process gets FLIGHT_RECORDER_SIGNAL or a fatal
+ * signal, and when packets stop going out without the stream having
+ * paused or ended.  flight_render prints the file as a timeline.
+ *
+ * The file is a struct flight_header followed by the events, oldest
+ * first, each a struct flight_event, to the end of the file.
+ * Everything is in host byte order. */
+
+#define FLIGHT_MAGIC			"RAOPFLT1"
+/* Events kept for each session; a power of two.  About a minute of
+ * audio. */
+#define FLIGHT_RECORDER_EVENTS		4096
+/* Sessions that can have a recorder at once */
+#define FLIGHT_RECORDER_SLOTS		16
+#define FLIGHT_SESSION_LEN		64
+#define FLIGHT_REASON_LEN		16
+/* How often the stall watchdog looks at each session */
+#define FLIGHT_WATCHDOG_POLL		250 /* miliseconds */
+#define FLIGHT_RECORDER_SIGNAL		SIGUSR2
+
+/* What each event's seq, value and extra hold.  flight_event_names
+ * in flight_render.c must match. */
+typedef enum {
+	FLIGHT_PCM_READ,	/* -, bytes read, - */
+	FLIGHT_CONVERTED,	/* -, bytes, - */
+	FLIGHT_ENCRYPTED,	/* seq, bytes, - */
+	FLIGHT_QUEUED,		/* seq, packets queued, - */
+	FLIGHT_POLL,		/* -, select() result, FLIGHT_POLL_* */
+	FLIGHT_WRITE,		/* seq, write() result, errno */
+	FLIGHT_SERVER_READ,	/* -, read() result, errno */
+	FLIGHT_SENT,		/* seq, packet bytes, - */
+	FLIGHT_RESEND,		/* first seq, packets asked for, sent */
+	FLIGHT_RESUME,		/* -, packets queued, - */
+	/* The stream is idle after these, until the next FLIGHT_SENT */
+	FLIGHT_STALL,		/* -, ms since the last packet, - */
+	FLIGHT_PAUSE,		/* -, packets queued, - */
+	FLIGHT_TRACK_END,	/* -, -, - */
+	FLIGHT_ERROR,		/* next seq to send, -, - */
+	FLIGHT_NUM_EVENTS
+} flight_event_t;
+
+#define FLIGHT_POLL_READABLE		0x1
+#define FLIGHT_POLL_WRITABLE		0x2
+
+struct flight_header {
+	char magic[8];
+	uint32_t event_size;
+	uint32_t reserved;
+	/* Events recorded since the session started; those before the
+	 * ones in the file have been written over */
+	uint64_t recorded;
+	/* utility_time_ns() when it was written */
+	uint64_t dump_ns;
+	char session[FLIGHT_SESSION_LEN];
+	char reason[FLIGHT_REASON_LEN];
+};
+
+struct flight_event {
+	/* utility_time_ns() */
+	uint64_t ns;
+	/* The event's number from 1, set last; 0 while it is being
+	 * written */
+	uint32_t stamp;
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t seq;
+	int32_t value;
+	uint32_t extra;
+};
+
+struct flight_recorder;
+
+utility_retcode_t flight_recorder_start(const char *dir,
+					unsigned int stall_ms);
+void flight_recorder_stop(void);
+struct flight_recorder *flight_recorder_open(const char *session);
+void flight_recorder_close(struct flight_recorder *recorder);
+void flight_record(struct flight_recorder *recorder,
+		   flight_event_t type,
+		   uint16_t seq,
+		   int32_t value,
+		   uint32_t extra);
+void flight_recorder_dump(struct flight_recorder *recorder,
+			  const char *reason);
+void flight_recorder_dump_all(const char *reason);
+
+#endif /* #ifndef FLIGHT_RECORDER_H */
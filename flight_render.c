@@ -0,0 +1,261 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* flight_render prints a file written by a flight recorder (see
+ * flight_recorder.h) as a timeline: each event with the time before
+ * the file was written and the time since the event before it.  A
+ * packet that went out much later than the packets usually do is
+ * marked, and a count of each kind of event follows.
+ *
+ * usage: flight_render flight_file
+ *
+ * Like lt_decode, it is built on its own. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "flight_recorder.h"
+
+/* A packet sent this many times the median time after the one before
+ * it is marked as late */
+#define LATE_FACTOR		3
+
+static const char *flight_event_names[FLIGHT_NUM_EVENTS] = {
+	"pcm_read",
+	"converted",
+	"encrypted",
+	"queued",
+	"poll",
+	"write",
+	"server_read",
+	"sent",
+	"resend",
+	"resume",
+	"stall",
+	"pause",
+	"track_end",
+	"error"
+};
+
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/* The median time between one packet going out and the next */
+static uint64_t median_send_interval(const struct flight_event *events,
+				     size_t num)
+{
+	uint64_t *intervals, last = 0, median = 0;
+	size_t i, n = 0;
+
+	intervals = malloc((num + 1) * sizeof(*intervals));
+	if (NULL == intervals) {
+		return 0;
+	}
+
+	for (i = 0 ; i < num ; i++) {
+		if (FLIGHT_SENT != events[i].type) {
+			continue;
+		}
+		if (0 != last) {
+			intervals[n++] = events[i].ns - last;
+		}
+		last = events[i].ns;
+	}
+
+	if (n > 0) {
+		qsort(intervals, n, sizeof(*intervals), compare_u64);
+		median = intervals[n / 2];
+	}
+
+	free(intervals);
+	return median;
+}
+
+
+static void print_detail(const struct flight_event *event)
+{
+	switch (event->type) {
+	case FLIGHT_POLL:
+		printf("%d ready%s%s", event->value,
+		       (event->extra & FLIGHT_POLL_READABLE) ? " read" : "",
+		       (event->extra & FLIGHT_POLL_WRITABLE) ? " write" : "");
+		break;
+	case FLIGHT_WRITE:
+	case FLIGHT_SERVER_READ:
+		if (event->value < 0) {
+			printf("failed: %s", strerror(event->extra));
+		} else if (0 == event->value) {
+			printf("closed");
+		} else {
+			printf("%d bytes", event->value);
+		}
+		break;
+	case FLIGHT_PCM_READ:
+	case FLIGHT_CONVERTED:
+	case FLIGHT_ENCRYPTED:
+	case FLIGHT_SENT:
+		printf("%d bytes", event->value);
+		break;
+	case FLIGHT_QUEUED:
+	case FLIGHT_RESUME:
+	case FLIGHT_PAUSE:
+		printf("%d queued", event->value);
+		break;
+	case FLIGHT_RESEND:
+		printf("%u of %d resent", event->extra, event->value);
+		break;
+	case FLIGHT_STALL:
+		printf("nothing sent for %d ms", event->value);
+		break;
+	case FLIGHT_TRACK_END:
+	case FLIGHT_ERROR:
+	default:
+		break;
+	}
+}
+
+
+static int has_seq(const struct flight_event *event)
+{
+	switch (event->type) {
+	case FLIGHT_ENCRYPTED:
+	case FLIGHT_QUEUED:
+	case FLIGHT_WRITE:
+	case FLIGHT_SENT:
+	case FLIGHT_RESEND:
+	case FLIGHT_ERROR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	struct flight_header header;
+	struct flight_event *events;
+	unsigned long counts[FLIGHT_NUM_EVENTS];
+	uint64_t median, last_ns = 0, last_sent_ns = 0;
+	size_t num = 0, size = 1024, i;
+	FILE *file;
+
+	if (2 != argc) {
+		fprintf(stderr, "usage: flight_render flight_file\n");
+		return 1;
+	}
+
+	file = fopen(argv[1], "r");
+	if (NULL == file) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (1 != fread(&header, sizeof(header), 1, file) ||
+	    0 != memcmp(header.magic, FLIGHT_MAGIC, sizeof(header.magic)) ||
+	    sizeof(struct flight_event) != header.event_size) {
+		fprintf(stderr, "flight_render: %s is not a flight recorder "
+			"file\n", argv[1]);
+		return 1;
+	}
+
+	events = malloc(size * sizeof(*events));
+	while (NULL != events &&
+	       1 == fread(&events[num], sizeof(*events), 1, file)) {
+		if (++num == size) {
+			size *= 2;
+			events = realloc(events, size * sizeof(*events));
+		}
+	}
+
+	fclose(file);
+
+	if (NULL == events) {
+		fprintf(stderr, "flight_render: out of memory\n");
+		return 1;
+	}
+
+	header.session[sizeof(header.session) - 1] = '\0';
+	header.reason[sizeof(header.reason) - 1] = '\0';
+
+	printf("Session \"%s\", written on %s: the last %lu of %llu "
+	       "events\n", header.session, header.reason,
+	       (unsigned long)num, (unsigned long long)header.recorded);
+
+	median = median_send_interval(events, num);
+	if (0 != median) {
+		printf("Packets went out every %.3f ms (median)\n",
+		       median / 1e6);
+	}
+
+	printf("%12s %10s  %-12s %5s\n", "ms before", "+ms", "event",
+	       "seq");
+
+	memset(counts, 0, sizeof(counts));
+
+	for (i = 0 ; i < num ; i++) {
+		if (events[i].type >= FLIGHT_NUM_EVENTS) {
+			continue;
+		}
+		counts[events[i].type]++;
+
+		printf("%12.3f %10.3f  %-12s ",
+		       ((double)header.dump_ns - (double)events[i].ns) / 1e6,
+		       (0 == last_ns) ? 0.0 :
+		       ((double)events[i].ns - (double)last_ns) / 1e6,
+		       flight_event_names[events[i].type]);
+
+		if (has_seq(&events[i])) {
+			printf("%5u  ", events[i].seq);
+		} else {
+			printf("%5s  ", "");
+		}
+
+		print_detail(&events[i]);
+
+		if (FLIGHT_SENT == events[i].type) {
+			if (0 != last_sent_ns && 0 != median &&
+			    events[i].ns - last_sent_ns > LATE_FACTOR * median) {
+				printf("  <-- %.3f ms after the last",
+				       (events[i].ns - last_sent_ns) / 1e6);
+			}
+			last_sent_ns = events[i].ns;
+		}
+
+		printf("\n");
+		last_ns = events[i].ns;
+	}
+
+	printf("\n");
+	for (i = 0 ; i < FLIGHT_NUM_EVENTS ; i++) {
+		if (0 != counts[i]) {
+			printf("%-12s %8lu\n", flight_event_names[i],
+			       counts[i]);
+		}
+	}
+
+	free(events);
+	return 0;
+}
@@ -0,0 +1,182 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "histogram.h"
+
+#define DEFAULT_FACILITY LT_UTILITY
+
+#define HISTOGRAM_LARGEST	((((uint64_t)1) << HISTOGRAM_MAX_BITS) - 1)
+
+
+/* Values in [2^n, 2^(n + 1)) go in group n - SUB_BITS + 1, SUB_BUCKETS
+ * to a group; group 0 is the values below SUB_BUCKETS, one each. */
+static unsigned int bucket_index(uint64_t value)
+{
+	unsigned int msb, shift;
+
+	if (value < HISTOGRAM_SUB_BUCKETS) {
+		return value;
+	}
+
+	if (value > HISTOGRAM_LARGEST) {
+		value = HISTOGRAM_LARGEST;
+	}
+
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - HISTOGRAM_SUB_BITS;
+
+	return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+		(value >> shift) - HISTOGRAM_SUB_BUCKETS;
+}
+
+
+/* The largest value that goes in bucket index */
+static uint64_t bucket_top(unsigned int index)
+{
+	unsigned int group = index / HISTOGRAM_SUB_BUCKETS;
+	uint64_t sub = index % HISTOGRAM_SUB_BUCKETS;
+
+	if (0 == group) {
+		return sub;
+	}
+
+	return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (group - 1)) - 1;
+}
+
+
+void histogram_reset(struct histogram *histogram)
+{
+	syscalls_memset(histogram, 0, sizeof(*histogram));
+}
+
+
+/* Only ever called by the one thread that owns the histogram, so
+ * there is nothing to read-modify-write atomically; the stores are
+ * atomic only so readers never see half of one. */
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+	uint64_t *bucket = &histogram->buckets[bucket_index(value)];
+
+	__atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&histogram->total, histogram->total + value,
+			 __ATOMIC_RELAXED);
+	if (value > histogram->max) {
+		__atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&histogram->count, histogram->count + 1,
+			 __ATOMIC_RELAXED);
+}
+
+
+/* Adds from's counts to to's.  from may be being recorded into; to
+ * must belong to the caller. */
+void histogram_merge(struct histogram *to, const struct histogram *from)
+{
+	uint64_t max;
+	int i;
+
+	for (i = 0 ; i < HISTOGRAM_BUCKETS ; i++) {
+		to->buckets[i] += __atomic_load_n(&from->buckets[i],
+						  __ATOMIC_RELAXED);
+	}
+
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+	to->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+	to->max = MAX(to->max, max);
+}
+
+
+/* The value percentile percent of those recorded are at or below,
+ * to within a bucket, or 0 if nothing has been recorded.  The buckets
+ * are counted rather than trusting count, which a reader can see
+ * ahead of or behind them. */
+uint64_t histogram_percentile(const struct histogram *histogram,
+			      double percentile)
+{
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t total = 0, rank, seen = 0, max;
+	double exact;
+	int i;
+
+	for (i = 0 ; i < HISTOGRAM_BUCKETS ; i++) {
+		counts[i] = __atomic_load_n(&histogram->buckets[i],
+					    __ATOMIC_RELAXED);
+		total += counts[i];
+	}
+
+	if (0 == total) {
+		return 0;
+	}
+
+	/* Nearest rank, as bench.c does for its samples */
+	exact = percentile / 100.0 * total;
+	rank = (uint64_t)exact;
+	if ((double)rank < exact) {
+		rank++;
+	}
+	rank = MAX(rank, 1);
+	rank = MIN(rank, total);
+
+	max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+	for (i = 0 ; i < HISTOGRAM_BUCKETS ; i++) {
+		seen += counts[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	return MIN(bucket_top(i), max);
+}
+
+
+/* How many of the values recorded were at or below value.  Only the
+ * buckets wholly at or below it are counted, so this can be short by
+ * some of those in the bucket value falls in. */
+uint64_t histogram_count_upto(const struct histogram *histogram,
+			      uint64_t value)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0 ; i < HISTOGRAM_BUCKETS && bucket_top(i) <= value ; i++) {
+		count += __atomic_load_n(&histogram->buckets[i],
+					 __ATOMIC_RELAXED);
+	}
+
+	return count;
+}
+
+
+void histogram_summarize(const struct histogram *histogram,
+			 struct histogram_summary *summary)
+{
+	summary->count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+	summary->mean = (0 == summary->count) ? 0 :
+		__atomic_load_n(&histogram->total, __ATOMIC_RELAXED) /
+		summary->count;
+	summary->p50 = histogram_percentile(histogram, 50.0);
+	summary->p99 = histogram_percentile(histogram, 99.0);
+	summary->p999 = histogram_percentile(histogram, 99.9);
+	summary->max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,73 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#include "utility.h"
+
+/* A log-linear histogram, after HdrHistogram: values below
+ * HISTOGRAM_SUB_BUCKETS each have a bucket of their own, and each
+ * power of two above that is split into HISTOGRAM_SUB_BUCKETS buckets
+ * of equal width, so a value read back is within about 3% of what
+ * was recorded, whatever its size.  Values of 2^HISTOGRAM_MAX_BITS
+ * and more are counted as the largest that fits; in nanoseconds that
+ * is about 68 s.
+ *
+ * Only one thread may record into a histogram, and it takes no lock
+ * to do it.  Any thread can read one or merge it into another of its
+ * own at the same time; what it sees may be a packet or two behind,
+ * and count may not quite match the buckets, but nothing is torn. */
+#define HISTOGRAM_SUB_BITS		5
+#define HISTOGRAM_SUB_BUCKETS		(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS		36
+#define HISTOGRAM_BUCKETS		((HISTOGRAM_MAX_BITS - \
+					  HISTOGRAM_SUB_BITS + 1) * \
+					 HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/* What is usually wanted from a histogram.  The percentiles are the
+ * top of the bucket they fall in, but never more than max. */
+struct histogram_summary {
+	uint64_t count;
+	uint64_t mean;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+void histogram_reset(struct histogram *histogram);
+void histogram_record(struct histogram *histogram, uint64_t value);
+void histogram_merge(struct histogram *to, const struct histogram *from);
+uint64_t histogram_percentile(const struct histogram *histogram,
+			      double percentile);
+uint64_t histogram_count_upto(const struct histogram *histogram,
+			      uint64_t value);
+void histogram_summarize(const struct histogram *histogram,
+			 struct histogram_summary *summary);
+
+#endif /* #ifndef HISTOGRAM_H */
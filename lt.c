@@ -20,13 +20,174 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <syslog.h>
+#include <unistd.h>
 
 #include "lt.h"
 #include "syscalls.h"
 
 #define DEFAULT_FACILITY LT_LOG
 
-static struct lt_facility default_facility;
+struct lt_facility lt_default_facility;
+
+/* Messages are formatted by the thread that logs them and written by
+ * the writer thread while it runs; until then, after it stops, and
+ * for LT_CRIT and worse, the logging thread writes them itself. */
+static struct lt_ringbuffer ring;
+static utility_boolean_t ring_initialized;
+static pthread_t writer_thread;
+static int writer_running;
+static lt_output_t writer_output;
+static FILE *writer_file;
+static unsigned long writer_reported_dropped;
+
+
+static size_t format_message(char *msg,
+			     const char *file,
+			     const char *function,
+			     int line,
+			     const char *fmt,
+			     va_list args)
+{
+	char file_func_line[MAX_FUNCTION_NAME_LEN];
+	size_t used = 0, func_name_used;
+	int i;
+
+	func_name_used = syscalls_snprintf(file_func_line,
+					   sizeof(file_func_line),
+					   "%s:%d %s ",
+					   file, line, function);
+
+	for (i = 0 ; i < MAX_FUNCTION_NAME_LEN ; i++) {
+		func_name_used += syscalls_snprintf(file_func_line +
+						    func_name_used,
+						    sizeof(file_func_line) -
+						    func_name_used, " ");
+	}
+
+	used += syscalls_snprintf(msg + used, MAX_LT_MSG_LEN - used,
+				  "%s ", file_func_line);
+
+	used += syscalls_vsnprintf(msg + used, MAX_LT_MSG_LEN - used, fmt, args);
+
+	if (used >= MAX_LT_MSG_LEN) {
+		used = MAX_LT_MSG_LEN - 1;
+		msg[MAX_LT_MSG_LEN - 2] = '\n';
+	}
+
+	return used;
+}
+
+
+/* Takes the next slot in the ring, or returns NULL if the ring is
+ * full and the overflow policy is to drop. */
+static struct lt_message *claim_message(void)
+{
+	struct lt_message *slot;
+	uint64_t pos, sequence;
+
+	pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		slot = &ring.msg[pos & (NUM_LT_MSGS - 1)];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence == pos) {
+			if (__atomic_compare_exchange_n(&ring.head, &pos,
+							pos + 1, 0,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED)) {
+				return slot;
+			}
+			/* Another thread took it; pos is the new head */
+			continue;
+		}
+
+		if ((int64_t)(sequence - pos) > 0) {
+			pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* The slot still holds the message from a lap ago */
+		if (LT_OVERFLOW_DROP == ring.overflow) {
+			__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		}
+
+		sched_yield();
+		pos = __atomic_load_n(&ring.head, __ATOMIC_RELAXED);
+	}
+}
+
+
+/* Used by the writer thread, so it must not log. */
+static void output_message(lt_level_t level, const char *msg, size_t len)
+{
+	switch (writer_output) {
+	case LT_OUTPUT_SYSLOG:
+		syslog(level, "%s", msg);
+		break;
+	case LT_OUTPUT_FILE:
+		fwrite(msg, 1, len, writer_file);
+		break;
+	case LT_OUTPUT_STDOUT:
+	default:
+		fwrite(msg, 1, len, stdout);
+		break;
+	}
+}
+
+
+void lt_va(struct lt_facility *custom_facility,
+	   lt_mask_t mask,
+	   lt_level_t level,
+	   const char *file,
+	   const char *function,
+	   int line,
+	   const char *fmt,
+	   va_list args)
+{
+	struct lt_facility *facility;
+	struct lt_message *slot;
+	char msg[MAX_LT_MSG_LEN];
+	size_t len;
+
+	facility = (custom_facility ? custom_facility : &lt_default_facility);
+
+	if (!((*facility).masks[level] & mask)) {
+		return;
+	}
+
+	if (level > LT_CRIT &&
+	    __atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+
+		slot = claim_message();
+		if (NULL == slot) {
+			return;
+		}
+
+		slot->len = format_message(slot->msg, file, function, line,
+					   fmt, args);
+		slot->level = level;
+
+		__atomic_store_n(&slot->sequence, slot->sequence + 1,
+				 __ATOMIC_RELEASE);
+		return;
+	}
+
+	len = format_message(msg, file, function, line, fmt, args);
+
+	if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+		output_message(level, msg, len);
+	} else {
+		LOG_OUTPUT("%s", msg);
+	}
+
+	return;
+}
+
 
 void lt(struct lt_facility *custom_facility,
 	lt_mask_t mask,
@@ -38,48 +199,289 @@ void lt(struct lt_facility *custom_facility,
 	...)
 {
 	va_list args;
-	struct lt_facility *facility;
-	char msg[MAX_LT_MSG_LEN];
-	char file_func_line[MAX_FUNCTION_NAME_LEN];
-	char bits[128];
-	size_t used = 0, func_name_used;
-	int i;
 
-	bits_to_string((uint64_t)mask, sizeof(mask), bits, sizeof(bits));
+	va_start(args, fmt);
+	lt_va(custom_facility, mask, level, file, function, line, fmt, args);
+	va_end(args);
+
+	return;
+}
+
+
+/* Rate limited and sampled call sites that have held messages back */
+static struct lt_limit *limits;
 
-	facility = (custom_facility ? custom_facility : &default_facility);
 
-	if ((*facility).masks[level] & mask) {
+static void report_suppressed(struct lt_limit *limit, uint64_t now)
+{
+	unsigned long suppressed;
+
+	__atomic_store_n(&limit->reported_ns, now, __ATOMIC_RELAXED);
 
-		func_name_used = syscalls_snprintf(file_func_line,
-						   sizeof(file_func_line),
-						   "%s:%d %s ",
-						   file, line, function);
+	suppressed = __atomic_exchange_n(&limit->suppressed, 0,
+					 __ATOMIC_RELAXED);
+	if (0 == suppressed) {
+		return;
+	}
+
+	lt(NULL, limit->mask, limit->level, limit->file, limit->function,
+	   limit->line, "%lu similar messages suppressed\n", suppressed);
+}
 
-		for (i = 0 ; i < MAX_FUNCTION_NAME_LEN ; i++) {
-			func_name_used += syscalls_snprintf(file_func_line +
-							    func_name_used,
-							    sizeof(file_func_line) -
-							    func_name_used, " ");
+
+static void suppress(struct lt_limit *limit,
+		     lt_mask_t mask,
+		     lt_level_t level,
+		     uint64_t now)
+{
+	int registered = 0;
+
+	if (__atomic_compare_exchange_n(&limit->registered, &registered, 1, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+		limit->mask = mask;
+		limit->level = level;
+		limit->reported_ns = now;
+		limit->next = __atomic_load_n(&limits, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&limits, &limit->next,
+						    limit, 0,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED)) {
+			;
 		}
+	}
 
-		used += syscalls_snprintf(msg + used, sizeof(msg) - used,
-					  "%s ", file_func_line);
+	__atomic_add_fetch(&limit->suppressed, 1, __ATOMIC_RELAXED);
 
-		va_start(args, fmt);
-		used += syscalls_vsnprintf(msg + used, sizeof(msg) - used, fmt, args);
-		va_end(args);
+	if (now - __atomic_load_n(&limit->reported_ns, __ATOMIC_RELAXED) >=
+	    (uint64_t)LT_SUPPRESSED_INTERVAL * 1000000) {
+		report_suppressed(limit, now);
+	}
+}
 
-		if (used == MAX_LT_MSG_LEN) {
-			msg[MAX_LT_MSG_LEN - 1] = '\n';
+
+/* A token bucket kept as the time it would next be full (GCRA), so
+ * one compare-and-swap updates it from any thread. */
+utility_boolean_t lt_ratelimit(struct lt_limit *limit,
+			       lt_mask_t mask,
+			       lt_level_t level,
+			       unsigned int per_second,
+			       unsigned int burst)
+{
+	uint64_t now = utility_time_ns();
+	uint64_t interval = 1000000000ULL / MAX(per_second, 1);
+	uint64_t tolerance = interval * (MAX(burst, 1) - 1);
+	uint64_t tat, start;
+
+	tat = __atomic_load_n(&limit->tat, __ATOMIC_RELAXED);
+
+	do {
+		start = MAX(tat, now);
+		if (start - now > tolerance) {
+			suppress(limit, mask, level, now);
+			return UTILITY_FALSE;
 		}
+	} while (!__atomic_compare_exchange_n(&limit->tat, &tat,
+					      start + interval, 1,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
 
-		LOG_OUTPUT("%s", msg);
+	if (0 != __atomic_load_n(&limit->suppressed, __ATOMIC_RELAXED)) {
+		report_suppressed(limit, now);
 	}
 
+	return UTILITY_TRUE;
+}
+
+
+utility_boolean_t lt_sample(struct lt_limit *limit,
+			    lt_mask_t mask,
+			    lt_level_t level,
+			    unsigned int n)
+{
+	unsigned long count;
+
+	count = __atomic_fetch_add(&limit->count, 1, __ATOMIC_RELAXED);
+	if (n <= 1 || 0 == count % n) {
+		return UTILITY_TRUE;
+	}
+
+	suppress(limit, mask, level, utility_time_ns());
+
+	return UTILITY_FALSE;
+}
+
+
+/* Logs what every rate limited and sampled call site has held back
+ * since it last said. */
+void lt_report_suppressed(void)
+{
+	struct lt_limit *limit;
+	uint64_t now = utility_time_ns();
+
+	for (limit = __atomic_load_n(&limits, __ATOMIC_ACQUIRE) ;
+	     NULL != limit ; limit = limit->next) {
+		report_suppressed(limit, now);
+	}
+}
+
+
+/* Writes out every message in the ring that is ready.  Only the
+ * writer thread, or whoever has stopped it, may call this. */
+static unsigned int drain_ring(unsigned long *reported_dropped)
+{
+	struct lt_message *slot;
+	unsigned long dropped;
+	unsigned int count = 0;
+	uint64_t pos;
+	char msg[64];
+	int len;
+
+	for (;;) {
+		pos = ring.tail;
+		slot = &ring.msg[pos & (NUM_LT_MSGS - 1)];
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) !=
+		    pos + 1) {
+			break;
+		}
+
+		output_message(slot->level, slot->msg, slot->len);
+
+		__atomic_store_n(&slot->sequence, pos + NUM_LT_MSGS,
+				 __ATOMIC_RELEASE);
+		ring.tail = pos + 1;
+		count++;
+	}
+
+	dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+	if (dropped != *reported_dropped) {
+		len = snprintf(msg, sizeof(msg), "lt: %lu messages dropped\n",
+			       dropped - *reported_dropped);
+		output_message(LT_WARNING, msg, len);
+		*reported_dropped = dropped;
+	}
+
+	if (0 != count && LT_OUTPUT_SYSLOG != writer_output) {
+		fflush(LT_OUTPUT_FILE == writer_output ? writer_file : stdout);
+	}
+
+	return count;
+}
+
+
+static void *run_writer(void *arg __attribute__ ((unused)))
+{
+	while (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+		if (0 == drain_ring(&writer_reported_dropped)) {
+			usleep(LT_WRITER_POLL * 1000);
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Starts a thread writing log messages to output; path is the file
+ * for LT_OUTPUT_FILE.  From then on logging a message only formats
+ * it into the ring. */
+utility_retcode_t lt_start_writer(lt_output_t output,
+				  const char *path,
+				  lt_overflow_t overflow)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	uint64_t i;
+
+	FUNC_ENTER;
+
+	if (__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+		ERRR("Log writer is already running\n");
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	if (LT_OUTPUT_FILE == output) {
+		writer_file = fopen(path, "a");
+		if (NULL == writer_file) {
+			ERRR("Failed to open log file \"%s\"\n", path);
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
+	}
+
+	if (LT_OUTPUT_SYSLOG == output) {
+		openlog("raopd", LOG_PID, LOG_DAEMON);
+	}
+
+	if (!ring_initialized) {
+		for (i = 0 ; i < NUM_LT_MSGS ; i++) {
+			ring.msg[i].sequence = i;
+		}
+		ring_initialized = UTILITY_TRUE;
+	}
+
+	syscalls_fflush(stdout);
+	ring.overflow = overflow;
+	writer_output = output;
+	__atomic_store_n(&writer_running, 1, __ATOMIC_RELEASE);
+
+	if (0 != syscalls_pthread_create(&writer_thread, NULL,
+					 run_writer, NULL)) {
+		__atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+		drain_ring(&writer_reported_dropped);
+		ret = UTILITY_FAILURE;
+		goto close_output;
+	}
+
+	goto out;
+
+close_output:
+	if (NULL != writer_file) {
+		fclose(writer_file);
+		writer_file = NULL;
+	}
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Stops the writer thread once it has written everything logged so
+ * far.  Messages are printed by the thread logging them again. */
+void lt_stop_writer(void)
+{
+	FUNC_ENTER;
+
+	if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)) {
+		goto out;
+	}
+
+	__atomic_store_n(&writer_running, 0, __ATOMIC_RELEASE);
+	syscalls_pthread_join(writer_thread, NULL);
+
+	drain_ring(&writer_reported_dropped);
+
+	if (LT_OUTPUT_SYSLOG == writer_output) {
+		closelog();
+	}
+
+	if (NULL != writer_file) {
+		fclose(writer_file);
+		writer_file = NULL;
+	}
+
+out:
+	FUNC_RETURN;
 	return;
 }
 
+
+/* Messages thrown away because the ring was full */
+unsigned long lt_dropped(void)
+{
+	return __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+}
+
 void lt_init_custom(struct lt_facility *facility)
 {
 	lt_level_t i;
@@ -99,7 +501,7 @@ void lt_init(void)
 {
 	FUNC_ENTER;
 
-	lt_init_custom(&default_facility);
+	lt_init_custom(&lt_default_facility);
 
 	FUNC_RETURN;
 
@@ -136,7 +538,7 @@ void lt_set_level(lt_mask_t mask_bits, lt_level_t level)
 {
 	FUNC_ENTER;
 
-	lt_set_level_custom(&default_facility, mask_bits, level);
+	lt_set_level_custom(&lt_default_facility, mask_bits, level);
 
 	FUNC_RETURN;
 
@@ -167,7 +569,7 @@ void lt_set_level_by_position(lt_facility_position_t position,
 {
 	FUNC_ENTER;
 
-	lt_set_level_by_position_custom(&default_facility, position, level);
+	lt_set_level_by_position_custom(&lt_default_facility, position, level);
 
 	FUNC_RETURN;
 
@@ -199,7 +601,7 @@ void lt_show_facility(void)
 {
 	FUNC_ENTER;
 
-	lt_show_facility_custom(&default_facility);
+	lt_show_facility_custom(&lt_default_facility);
 
 	FUNC_RETURN;
 
@@ -21,38 +21,114 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdint.h>
 #include <stdio.h>
+#include <stdarg.h>
 
 #include "lt_user.h"
 #include "utility.h"
+#include "lt_trace.h"
 
 #define NUM_LT_LEVELS			8
 #define MAX_LT_MSG_LEN			1024
-#define NUM_LT_MSGS			4096
+#define NUM_LT_MSGS			4096 /* A power of two */
 #define MAX_FUNCTION_NAME_LEN		36
 #define MAX_LT_CUSTOM_FACILITIES	4
+/* How long the writer thread sleeps when it finds the ring empty */
+#define LT_WRITER_POLL			10 /* miliseconds */
+/* INFO_RATELIMITED() and DEBG_RATELIMITED(): messages per second from
+ * each call site once a burst of LT_RATELIMIT_BURST is used up */
+#define LT_RATELIMIT_RATE		1
+#define LT_RATELIMIT_BURST		10
+#define LT_SUPPRESSED_INTERVAL		10000 /* miliseconds */
 
-#define EMRG(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_EMERG, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define ALRT(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_ALERT, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define CRIT(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_CRIT, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define ERRR(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_ERR, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define WARN(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_WARNING, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define NOTC(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_NOTICE, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define INFO(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_INFO, __FILE__, __func__, __LINE__, __VA_ARGS__)
-#define DEBG(...)							\
-	lt(NULL, DEFAULT_FACILITY, LT_DEBUG, __FILE__, __func__, __LINE__, __VA_ARGS__)
-
-#define LT(level, ...)							\
-	lt(NULL, DEFAULT_FACILITY, level, __FILE__, __func__, __LINE__, __VA_ARGS__)
+/* Messages below LT_MIN_LEVEL are compiled out: their call sites are
+ * if (0), so neither the call nor its arguments survive -O2.  Build
+ * with -DLT_MIN_LEVEL=LT_INFO (make LT_MIN_LEVEL=LT_INFO) to drop
+ * DEBG() and function tracing from a production binary. */
+#ifndef LT_MIN_LEVEL
+#define LT_MIN_LEVEL LT_DEBUG
+#endif
+
+/* True if a message at level for the facilities in mask would be
+ * written.  Tested at the call site, so a disabled message costs a
+ * load and a branch and its arguments are never evaluated.  In trace
+ * mode (lt_start_trace()) an enabled one is recorded in binary. */
+#define LT_ENABLED(facility, mask, level)				\
+	((level) <= LT_MIN_LEVEL && ((facility)->masks[(level)] & (mask)))
+
+/* Logs through the call site's struct lt_site, for trace mode */
+#define LT_SITE_EMIT(facility, mask, level, ...)			\
+	{								\
+		static struct lt_site lt_site = {			\
+			0, __FILE__, __func__, __LINE__,		\
+			NULL, 0, { 0 }					\
+		};							\
+		if (lt_tracing) {					\
+			lt_trace(&lt_site, mask, level, __VA_ARGS__);	\
+		} else {						\
+			lt(facility, mask, level, __FILE__, __func__,	\
+			   __LINE__, __VA_ARGS__);			\
+		}							\
+	}
+
+#define LT_EMIT(facility, mask, level, ...)				\
+	do {								\
+		if (LT_ENABLED(&lt_default_facility, mask, level)) {	\
+			LT_SITE_EMIT(facility, mask, level, __VA_ARGS__) \
+		}							\
+	} while (0)
+
+/* For call sites hit on every packet.  LT_RATELIMITED() lets through
+ * burst messages and then per_second; LT_SAMPLED() one in n.  Each
+ * call site keeps its own count of the messages it held back and
+ * logs it, at the same level, when a rate limited site next lets one
+ * through, every LT_SUPPRESSED_INTERVAL while it is holding them
+ * back, and from lt_report_suppressed(). */
+#define LT_LIMITED(allow, mask, level, ...)				\
+	do {								\
+		if (LT_ENABLED(&lt_default_facility, mask, level)) {	\
+			static struct lt_limit lt_limit = {		\
+				__FILE__, __func__, __LINE__,		\
+				0, LT_EMERG, 0, 0, 0, 0, 0, NULL	\
+			};						\
+			if (allow) {					\
+				LT_SITE_EMIT(NULL, mask, level,		\
+					     __VA_ARGS__)		\
+			}						\
+		}							\
+	} while (0)
+
+#define LT_RATELIMITED(mask, level, per_second, burst, ...)		\
+	LT_LIMITED(lt_ratelimit(&lt_limit, mask, level, per_second, burst), \
+		   mask, level, __VA_ARGS__)
+
+#define LT_SAMPLED(mask, level, n, ...)					\
+	LT_LIMITED(lt_sample(&lt_limit, mask, level, n), mask, level,	\
+		   __VA_ARGS__)
+
+#define EMRG(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_EMERG, __VA_ARGS__)
+#define ALRT(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_ALERT, __VA_ARGS__)
+#define CRIT(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_CRIT, __VA_ARGS__)
+#define ERRR(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_ERR, __VA_ARGS__)
+#define WARN(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_WARNING, __VA_ARGS__)
+#define NOTC(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_NOTICE, __VA_ARGS__)
+#define INFO(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_INFO, __VA_ARGS__)
+#define DEBG(...) LT_EMIT(NULL, DEFAULT_FACILITY, LT_DEBUG, __VA_ARGS__)
+
+#define INFO_RATELIMITED(...)						\
+	LT_RATELIMITED(DEFAULT_FACILITY, LT_INFO, LT_RATELIMIT_RATE,	\
+		       LT_RATELIMIT_BURST, __VA_ARGS__)
+#define DEBG_RATELIMITED(...)						\
+	LT_RATELIMITED(DEFAULT_FACILITY, LT_DEBUG, LT_RATELIMIT_RATE,	\
+		       LT_RATELIMIT_BURST, __VA_ARGS__)
+#define INFO_SAMPLED(n, ...)						\
+	LT_SAMPLED(DEFAULT_FACILITY, LT_INFO, n, __VA_ARGS__)
+#define DEBG_SAMPLED(n, ...)						\
+	LT_SAMPLED(DEFAULT_FACILITY, LT_DEBUG, n, __VA_ARGS__)
+
+#define LT(level, ...) LT_EMIT(NULL, DEFAULT_FACILITY, level, __VA_ARGS__)
 
 #define LT_CUSTOM(facility, level, ...)					\
-	lt(NULL, facility, level, __FILE__, __func__, __LINE__, __VA_ARGS__)
+	LT_EMIT(NULL, facility, level, __VA_ARGS__)
 
 #define FUNC_ENTER	LT_CUSTOM(LT_FUNCTION_CALLS, LT_DEBUG, \
 				  "entering %s\n", __func__)
@@ -86,7 +162,16 @@ typedef enum {
 	LT_ENCRYPTION_POSITION,
 	LT_RAOP_PLAY_SEND_AUDIO_POSITION,
 	LT_AUDIO_STREAM_POSITION,
-	LT_AUDIO_DEBUG_POSITION
+	LT_AUDIO_DEBUG_POSITION,
+	LT_FAKE_RECEIVER_POSITION,
+	LT_BENCH_POSITION,
+	LT_TIMELINE_POSITION,
+	LT_RTP_TIMING_POSITION,
+	LT_FLIGHT_RECORDER_POSITION,
+	LT_STAGE_LATENCY_POSITION,
+	LT_METRICS_POSITION,
+	LT_SYSCALLS_ACCT_POSITION,
+	LT_PERF_COUNTERS_POSITION
 } lt_facility_position_t;
 
 typedef uint64_t lt_mask_t;
@@ -106,6 +191,15 @@ typedef uint64_t lt_mask_t;
 #define LT_RAOP_PLAY_SEND_AUDIO	(((lt_mask_t)0x1) << LT_RAOP_PLAY_SEND_AUDIO_POSITION)
 #define LT_AUDIO_STREAM		(((lt_mask_t)0x1) << LT_AUDIO_STREAM_POSITION)
 #define LT_AUDIO_DEBUG		(((lt_mask_t)0x1) << LT_AUDIO_DEBUG_POSITION)
+#define LT_FAKE_RECEIVER	(((lt_mask_t)0x1) << LT_FAKE_RECEIVER_POSITION)
+#define LT_BENCH		(((lt_mask_t)0x1) << LT_BENCH_POSITION)
+#define LT_TIMELINE		(((lt_mask_t)0x1) << LT_TIMELINE_POSITION)
+#define LT_RTP_TIMING		(((lt_mask_t)0x1) << LT_RTP_TIMING_POSITION)
+#define LT_FLIGHT_RECORDER	(((lt_mask_t)0x1) << LT_FLIGHT_RECORDER_POSITION)
+#define LT_STAGE_LATENCY	(((lt_mask_t)0x1) << LT_STAGE_LATENCY_POSITION)
+#define LT_METRICS		(((lt_mask_t)0x1) << LT_METRICS_POSITION)
+#define LT_SYSCALLS_ACCT	(((lt_mask_t)0x1) << LT_SYSCALLS_ACCT_POSITION)
+#define LT_PERF_COUNTERS	(((lt_mask_t)0x1) << LT_PERF_COUNTERS_POSITION)
 
 #define LT_DEFAULT_MASK		(((lt_mask_t)(~0)) ^ LT_FUNCTION_CALLS)
 #define LT_DEFAULT_LEVEL	LT_WARNING
@@ -117,17 +211,60 @@ struct lt_facility {
 	lt_mask_t masks[NUM_LT_LEVELS];
 };
 
+/* Where the writer thread puts messages */
+typedef enum {
+	LT_OUTPUT_STDOUT,
+	LT_OUTPUT_FILE,
+	LT_OUTPUT_SYSLOG
+} lt_output_t;
+
+/* What happens to a message logged while the ring is full */
+typedef enum {
+	LT_OVERFLOW_DROP,	/* throw it away and count it */
+	LT_OVERFLOW_WAIT	/* wait for the writer to make room */
+} lt_overflow_t;
+
+/* A slot is free for the message at ring position pos when sequence
+ * is pos, and holds it once sequence is pos + 1. */
 struct lt_message {
-	utility_lock_t lock;
+	uint64_t sequence;
+	lt_level_t level;
+	size_t len;
 	char msg[MAX_LT_MSG_LEN];
 };
 
+/* Any thread may add messages at head; only the writer thread takes
+ * them from tail. */
 struct lt_ringbuffer {
-	utility_lock_t lock;
+	uint64_t head;
+	uint64_t tail;
+	unsigned long dropped;
+	lt_overflow_t overflow;
 	struct lt_message msg[NUM_LT_MSGS];
-	int index;
 };
 
+/* A rate limited or sampled call site */
+struct lt_limit {
+	const char *file;
+	const char *function;
+	int line;
+	/* Where its summaries go, set when it first holds one back */
+	lt_mask_t mask;
+	lt_level_t level;
+	/* When the site's bucket would be full again */
+	uint64_t tat;
+	unsigned long count;
+	unsigned long suppressed;
+	uint64_t reported_ns;
+	int registered;
+	struct lt_limit *next;
+};
+
+/* The facility the EMRG() ... DEBG() macros log to */
+extern struct lt_facility lt_default_facility;
+/* Set while in trace mode */
+extern int lt_tracing;
+
 /* The format attribute specifies that a function takes printf, scanf,
  * strftime or strfmon style arguments which should be type-checked
  * against a format string.  See:
@@ -142,8 +279,39 @@ void lt(struct lt_facility *custom_facility,
 	int line,
 	const char *fmt,
 	...) __attribute__ ((format (printf, 7, 8)));
+void lt_va(struct lt_facility *custom_facility,
+	   lt_mask_t mask,
+	   lt_level_t level,
+	   const char *file,
+	   const char *function,
+	   int line,
+	   const char *fmt,
+	   va_list args);
+void lt_trace(struct lt_site *site,
+	      lt_mask_t mask,
+	      lt_level_t level,
+	      const char *fmt,
+	      ...) __attribute__ ((format (printf, 4, 5)));
+utility_boolean_t lt_ratelimit(struct lt_limit *limit,
+			       lt_mask_t mask,
+			       lt_level_t level,
+			       unsigned int per_second,
+			       unsigned int burst);
+utility_boolean_t lt_sample(struct lt_limit *limit,
+			    lt_mask_t mask,
+			    lt_level_t level,
+			    unsigned int n);
+void lt_report_suppressed(void);
+utility_retcode_t lt_start_trace(const char *path);
+void lt_stop_trace(void);
+unsigned long lt_trace_dropped(void);
 void lt_init_custom(struct lt_facility *custom_facility);
 void lt_init(void);
+utility_retcode_t lt_start_writer(lt_output_t output,
+				  const char *path,
+				  lt_overflow_t overflow);
+void lt_stop_writer(void);
+unsigned long lt_dropped(void);
 void lt_show_facility_custom(struct lt_facility *custom_facility);
 void lt_show_facility(void);
 void lt_set_level_custom(struct lt_facility *facility,
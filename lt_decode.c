@@ -0,0 +1,360 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+/* lt_decode turns a trace file written in trace mode (see lt_trace.h)
+ * back into the messages the log calls would have printed, each with
+ * the seconds since tracing started and the thread id in front.
+ *
+ * usage: lt_decode trace_file
+ *
+ * It is built on its own, without the rest of raopd, so it can be run
+ * anywhere the trace file ends up. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lt_trace.h"
+
+/* As MAX_FUNCTION_NAME_LEN in lt.h, so the columns line up */
+#define FILE_FUNC_LINE_LEN	36
+#define MAX_MESSAGE_LEN		4096
+#define MAX_SPEC_LEN		64
+
+struct decoded_site {
+	int defined;
+	uint32_t line;
+	uint8_t num_args;
+	uint8_t args[LT_TRACE_MAX_ARGS];
+	char *file;
+	char *function;
+	char *fmt;
+};
+
+static struct decoded_site sites[LT_TRACE_MAX_SITES + 1];
+
+
+static void define_site(uint32_t id, const uint8_t *payload, size_t len)
+{
+	struct lt_trace_site_def def;
+	struct decoded_site *site;
+	const char *strings, *end;
+
+	if (0 == id || id > LT_TRACE_MAX_SITES || len < sizeof(def)) {
+		fprintf(stderr, "lt_decode: bad site record %u\n", id);
+		return;
+	}
+
+	memcpy(&def, payload, sizeof(def));
+	strings = (const char *)payload + sizeof(def);
+	end = (const char *)payload + len;
+
+	site = &sites[id];
+	free(site->file);
+	site->file = strdup(strings);
+	strings += strlen(strings) + 1;
+	site->function = strdup(strings < end ? strings : "");
+	strings += strlen(strings) + 1;
+	site->fmt = strdup(strings < end ? strings : "");
+
+	site->line = def.line;
+	site->num_args = (def.num_args > LT_TRACE_MAX_ARGS) ?
+		LT_TRACE_MAX_ARGS : def.num_args;
+	memcpy(site->args, def.args, sizeof(site->args));
+	site->defined = 1;
+}
+
+
+/* Takes the next argument of the given type from a message's
+ * payload.  Returns 0 if the payload has run out. */
+static int next_arg(const uint8_t **p,
+		    const uint8_t *end,
+		    uint8_t type,
+		    int64_t *number,
+		    double *real,
+		    char *string,
+		    size_t string_size)
+{
+	int32_t i32;
+	uint16_t slen;
+
+	switch (type) {
+	case LT_TRACE_ARG_INT:
+		if (end - *p < (long)sizeof(i32)) {
+			return 0;
+		}
+		memcpy(&i32, *p, sizeof(i32));
+		*number = i32;
+		*p += sizeof(i32);
+		break;
+	case LT_TRACE_ARG_DOUBLE:
+		if (end - *p < (long)sizeof(*real)) {
+			return 0;
+		}
+		memcpy(real, *p, sizeof(*real));
+		*p += sizeof(*real);
+		break;
+	case LT_TRACE_ARG_STRING:
+		if (end - *p < (long)sizeof(slen)) {
+			return 0;
+		}
+		memcpy(&slen, *p, sizeof(slen));
+		*p += sizeof(slen);
+		if (LT_TRACE_NULL_STRING == slen) {
+			snprintf(string, string_size, "(null)");
+			break;
+		}
+		if (end - *p < slen || slen >= string_size) {
+			return 0;
+		}
+		memcpy(string, *p, slen);
+		string[slen] = '\0';
+		*p += slen;
+		break;
+	case LT_TRACE_ARG_LONG:
+	case LT_TRACE_ARG_LLONG:
+	case LT_TRACE_ARG_POINTER:
+	default:
+		if (end - *p < (long)sizeof(*number)) {
+			return 0;
+		}
+		memcpy(number, *p, sizeof(*number));
+		*p += sizeof(*number);
+		break;
+	}
+
+	return 1;
+}
+
+
+/* Formats a message with the site's format, one conversion at a time,
+ * since the arguments can't be handed to printf() as a va_list. */
+static void format_message(const struct decoded_site *site,
+			   const uint8_t *payload,
+			   size_t len,
+			   char *out,
+			   size_t out_size)
+{
+	const uint8_t *p = payload, *end = payload + len;
+	const char *f = site->fmt;
+	char spec[MAX_SPEC_LEN], string[LT_TRACE_MAX_STRING + 1];
+	size_t used = 0, spec_len;
+	int64_t number;
+	double real;
+	int arg = 0, n;
+
+#define APPEND(...)							\
+	do {								\
+		n = snprintf(out + used, out_size - used, __VA_ARGS__);	\
+		if (n > 0) {						\
+			used += ((size_t)n < out_size - used) ?		\
+				(size_t)n : out_size - used - 1;	\
+		}							\
+	} while (0)
+
+	out[0] = '\0';
+
+	while ('\0' != *f && used < out_size - 1) {
+		if ('%' != *f) {
+			out[used++] = *f++;
+			out[used] = '\0';
+			continue;
+		}
+
+		if ('%' == f[1]) {
+			APPEND("%%");
+			f += 2;
+			continue;
+		}
+
+		/* Copy the conversion, putting in the value of any '*' */
+		spec_len = 0;
+		spec[spec_len++] = *f++;
+		while ('\0' != *f && spec_len < sizeof(spec) - 24) {
+			if ('*' == *f) {
+				if (arg >= site->num_args ||
+				    !next_arg(&p, end, site->args[arg++],
+					      &number, &real, string,
+					      sizeof(string))) {
+					APPEND("<truncated>");
+					return;
+				}
+				spec_len += snprintf(spec + spec_len,
+						     sizeof(spec) - spec_len,
+						     "%d", (int)number);
+				f++;
+				continue;
+			}
+
+			spec[spec_len++] = *f;
+			if (NULL != strchr("diouxXcfFeEgGaApsn", *f++)) {
+				break;
+			}
+		}
+		spec[spec_len] = '\0';
+
+		if (arg >= site->num_args ||
+		    !next_arg(&p, end, site->args[arg], &number, &real,
+			      string, sizeof(string))) {
+			APPEND("<truncated>");
+			return;
+		}
+
+		switch (site->args[arg++]) {
+		case LT_TRACE_ARG_INT:
+			APPEND(spec, (int)number);
+			break;
+		case LT_TRACE_ARG_LONG:
+			APPEND(spec, (long)number);
+			break;
+		case LT_TRACE_ARG_LLONG:
+			APPEND(spec, (long long)number);
+			break;
+		case LT_TRACE_ARG_DOUBLE:
+			APPEND(spec, real);
+			break;
+		case LT_TRACE_ARG_POINTER:
+			APPEND(spec, (void *)(uintptr_t)number);
+			break;
+		case LT_TRACE_ARG_STRING:
+			APPEND(spec, string);
+			break;
+		default:
+			break;
+		}
+	}
+
+#undef APPEND
+}
+
+
+static void print_prefix(const struct lt_trace_header *header,
+			 const struct lt_trace_record *record)
+{
+	printf("%12.6f %6u ",
+	       (double)(int64_t)(record->ns - header->start_ns) / 1e9,
+	       record->thread);
+}
+
+
+static void print_message(const struct lt_trace_header *header,
+			  const struct lt_trace_record *record,
+			  const uint8_t *payload,
+			  size_t len)
+{
+	const struct decoded_site *site;
+	char file_func_line[FILE_FUNC_LINE_LEN];
+	char message[MAX_MESSAGE_LEN];
+	int used;
+
+	if (0 == record->site || record->site > LT_TRACE_MAX_SITES ||
+	    !sites[record->site].defined) {
+		print_prefix(header, record);
+		printf("lt_decode: message from undefined site %u\n",
+		       record->site);
+		return;
+	}
+
+	site = &sites[record->site];
+
+	/* The same columns as lt() prints */
+	used = snprintf(file_func_line, sizeof(file_func_line), "%s:%u %s ",
+			site->file, site->line, site->function);
+	if (used < 0) {
+		used = 0;
+	}
+	if ((size_t)used < sizeof(file_func_line) - 1) {
+		memset(file_func_line + used, ' ',
+		       sizeof(file_func_line) - 1 - used);
+	}
+	file_func_line[sizeof(file_func_line) - 1] = '\0';
+
+	format_message(site, payload, len, message, sizeof(message));
+
+	print_prefix(header, record);
+	printf("%s %s", file_func_line, message);
+}
+
+
+int main(int argc, char **argv)
+{
+	struct lt_trace_header header;
+	struct lt_trace_record record;
+	uint8_t payload[65536];
+	unsigned long messages = 0;
+	uint64_t dropped = 0, count;
+	size_t len;
+	FILE *file;
+
+	if (2 != argc) {
+		fprintf(stderr, "usage: lt_decode trace_file\n");
+		return 1;
+	}
+
+	file = fopen(argv[1], "r");
+	if (NULL == file) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (1 != fread(&header, sizeof(header), 1, file) ||
+	    0 != memcmp(header.magic, LT_TRACE_MAGIC, sizeof(header.magic))) {
+		fprintf(stderr, "lt_decode: %s is not a trace file\n", argv[1]);
+		return 1;
+	}
+
+	while (1 == fread(&record, sizeof(record), 1, file)) {
+		if (record.len < sizeof(record)) {
+			fprintf(stderr, "lt_decode: bad record length %u\n",
+				record.len);
+			return 1;
+		}
+
+		len = record.len - sizeof(record);
+		if (len != fread(payload, 1, len, file)) {
+			fprintf(stderr, "lt_decode: trace file ends mid record\n");
+			break;
+		}
+
+		switch (record.kind) {
+		case LT_TRACE_SITE:
+			define_site(record.site, payload, len);
+			break;
+		case LT_TRACE_MESSAGE:
+			print_message(&header, &record, payload, len);
+			messages++;
+			break;
+		case LT_TRACE_DROPPED:
+			memcpy(&count, payload, sizeof(count));
+			print_prefix(&header, &record);
+			printf("lt: %llu trace records dropped\n",
+			       (unsigned long long)count);
+			dropped += count;
+			break;
+		case LT_TRACE_PAD:
+		default:
+			break;
+		}
+	}
+
+	fprintf(stderr, "lt_decode: %lu messages, %llu dropped\n",
+		messages, (unsigned long long)dropped);
+
+	fclose(file);
+	return 0;
+}
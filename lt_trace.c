@@ -0,0 +1,654 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "lt.h"
+#include "syscalls.h"
+
+#define DEFAULT_FACILITY LT_LOG
+
+/* A thread's trace records.  The thread adds them at head and the
+ * trace writer takes them from tail; both count bytes from the start
+ * of the buffer's life. */
+struct lt_trace_buffer {
+	uint64_t head;
+	uint64_t tail;
+	unsigned long dropped;
+	uint32_t thread;
+	int exited;
+	/* Used only by the trace writer */
+	uint64_t drain_to;
+	unsigned long reported_dropped;
+	struct lt_trace_buffer *next;
+	uint8_t data[LT_TRACE_BUFLEN];
+};
+
+int lt_tracing;
+
+/* trace_lock covers the list of buffers and adding sites */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct lt_trace_buffer *trace_buffers;
+static struct lt_site *trace_sites[LT_TRACE_MAX_SITES];
+static uint32_t num_trace_sites;
+static pthread_key_t trace_buffer_key;
+static pthread_once_t trace_buffer_once = PTHREAD_ONCE_INIT;
+
+static pthread_t trace_writer_thread;
+static int trace_writer_running;
+static FILE *trace_file;
+static uint32_t written_trace_sites;
+
+
+static utility_boolean_t add_trace_arg(struct lt_site *site,
+				       lt_trace_arg_t type)
+{
+	if (site->num_args >= LT_TRACE_MAX_ARGS) {
+		return UTILITY_FALSE;
+	}
+
+	site->args[site->num_args++] = type;
+
+	return UTILITY_TRUE;
+}
+
+
+/* Works out the type of each argument fmt takes.  Fails for formats
+ * that can't be recorded: too many arguments, long doubles, wide
+ * strings, %n and %m. */
+static utility_boolean_t parse_trace_format(struct lt_site *site,
+					    const char *fmt)
+{
+	const char *p;
+	lt_trace_arg_t type;
+	int longs;
+
+	site->num_args = 0;
+
+	for (p = fmt ; '\0' != *p ; p++) {
+		if ('%' != *p) {
+			continue;
+		}
+
+		p++;
+		if ('%' == *p) {
+			continue;
+		}
+
+		while ('\0' != *p && NULL != syscalls_strchr("-+ #0'", *p)) {
+			p++;
+		}
+
+		if ('*' == *p) {
+			if (!add_trace_arg(site, LT_TRACE_ARG_INT)) {
+				return UTILITY_FALSE;
+			}
+			p++;
+		}
+		while (isdigit((unsigned char)*p)) {
+			p++;
+		}
+
+		if ('.' == *p) {
+			p++;
+			if ('*' == *p) {
+				if (!add_trace_arg(site, LT_TRACE_ARG_INT)) {
+					return UTILITY_FALSE;
+				}
+				p++;
+			}
+			while (isdigit((unsigned char)*p)) {
+				p++;
+			}
+		}
+
+		for (longs = 0 ; ; p++) {
+			if ('h' == *p) {
+				continue;
+			} else if ('l' == *p) {
+				longs++;
+			} else if ('z' == *p || 'j' == *p || 't' == *p) {
+				longs = 1;
+			} else {
+				break;
+			}
+		}
+
+		switch (*p) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			type = (0 == longs) ? LT_TRACE_ARG_INT :
+				(1 == longs) ? LT_TRACE_ARG_LONG : LT_TRACE_ARG_LLONG;
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			type = LT_TRACE_ARG_DOUBLE;
+			break;
+		case 'p':
+			type = LT_TRACE_ARG_POINTER;
+			break;
+		case 's':
+			if (0 != longs) {
+				return UTILITY_FALSE;
+			}
+			type = LT_TRACE_ARG_STRING;
+			break;
+		default:
+			return UTILITY_FALSE;
+		}
+
+		if (!add_trace_arg(site, type)) {
+			return UTILITY_FALSE;
+		}
+	}
+
+	return UTILITY_TRUE;
+}
+
+
+/* Gives the site an id the first time it is used, and the trace
+ * writer a definition to write out before its first message. */
+static uint32_t register_trace_site(struct lt_site *site, const char *fmt)
+{
+	uint32_t id;
+
+	syscalls_pthread_mutex_lock(&trace_lock);
+
+	id = site->id;
+	if (0 == id) {
+		site->fmt = fmt;
+
+		if (num_trace_sites >= LT_TRACE_MAX_SITES ||
+		    !parse_trace_format(site, fmt)) {
+			id = LT_SITE_TEXT;
+		} else {
+			trace_sites[num_trace_sites] = site;
+			id = num_trace_sites + 1;
+			__atomic_store_n(&num_trace_sites, id, __ATOMIC_RELEASE);
+		}
+
+		__atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+	}
+
+	syscalls_pthread_mutex_unlock(&trace_lock);
+
+	return id;
+}
+
+
+/* The writer frees the buffer once it has written what is left. */
+static void trace_buffer_destructor(void *arg)
+{
+	struct lt_trace_buffer *buf = arg;
+
+	__atomic_store_n(&buf->exited, 1, __ATOMIC_RELEASE);
+}
+
+
+static void trace_buffer_init(void)
+{
+	syscalls_pthread_key_create(&trace_buffer_key, trace_buffer_destructor);
+}
+
+
+static struct lt_trace_buffer *get_trace_buffer(void)
+{
+	struct lt_trace_buffer *buf;
+
+	syscalls_pthread_once(&trace_buffer_once, trace_buffer_init);
+
+	buf = pthread_getspecific(trace_buffer_key);
+	if (NULL != buf) {
+		return buf;
+	}
+
+	/* Not the syscalls_ wrappers: they log, and logging a
+	 * thread's first message is what brings us here. */
+	buf = malloc(sizeof(*buf));
+	if (NULL == buf) {
+		return NULL;
+	}
+
+	memset(buf, 0, offsetof(struct lt_trace_buffer, data));
+	buf->thread = (uint32_t)syscall(SYS_gettid);
+
+	syscalls_pthread_mutex_lock(&trace_lock);
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	syscalls_pthread_mutex_unlock(&trace_lock);
+
+	pthread_setspecific(trace_buffer_key, buf);
+
+	return buf;
+}
+
+
+/* Copies a record into the thread's buffer, or counts it as dropped
+ * if there isn't room. */
+static void put_trace_record(struct lt_trace_buffer *buf,
+			     const uint8_t *record,
+			     size_t len)
+{
+	struct lt_trace_record pad;
+	uint64_t head = buf->head;
+	uint64_t tail = __atomic_load_n(&buf->tail, __ATOMIC_ACQUIRE);
+	size_t offset = head & (LT_TRACE_BUFLEN - 1);
+	size_t to_end = LT_TRACE_BUFLEN - offset;
+	size_t pad_len = (to_end < len) ? to_end : 0;
+
+	if (LT_TRACE_BUFLEN - (head - tail) < pad_len + len) {
+		__atomic_store_n(&buf->dropped, buf->dropped + 1,
+				 __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (0 != pad_len) {
+		pad.len = pad_len;
+		pad.kind = LT_TRACE_PAD;
+		syscalls_memcpy(buf->data + offset, &pad,
+				MIN(pad_len, sizeof(pad)));
+		head += pad_len;
+		offset = 0;
+	}
+
+	syscalls_memcpy(buf->data + offset, record, len);
+
+	__atomic_store_n(&buf->head, head + len, __ATOMIC_RELEASE);
+}
+
+
+/* Called by the log macros in trace mode.  Records the site's id, the
+ * time and the raw arguments; a site whose format can't be recorded
+ * and LT_CRIT and worse are logged as text. */
+void lt_trace(struct lt_site *site,
+	      lt_mask_t mask,
+	      lt_level_t level,
+	      const char *fmt,
+	      ...)
+{
+	uint8_t record[sizeof(struct lt_trace_record) +
+		       LT_TRACE_MAX_ARGS * (2 + LT_TRACE_MAX_STRING) +
+		       LT_TRACE_ALIGN];
+	struct lt_trace_record header;
+	struct lt_trace_buffer *buf = NULL;
+	va_list args;
+	uint32_t id;
+	size_t len = sizeof(header);
+	int i;
+
+	va_start(args, fmt);
+
+	id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+	if (0 == id) {
+		id = register_trace_site(site, fmt);
+	}
+
+	if (LT_SITE_TEXT != id && level > LT_CRIT) {
+		buf = get_trace_buffer();
+	}
+
+	if (NULL == buf) {
+		lt_va(NULL, mask, level, site->file, site->function,
+		      site->line, fmt, args);
+		va_end(args);
+		return;
+	}
+
+	for (i = 0 ; i < site->num_args ; i++) {
+		switch (site->args[i]) {
+		case LT_TRACE_ARG_INT: {
+			int32_t value = va_arg(args, int);
+			syscalls_memcpy(record + len, &value, sizeof(value));
+			len += sizeof(value);
+			break;
+		}
+		case LT_TRACE_ARG_LONG: {
+			int64_t value = va_arg(args, long);
+			syscalls_memcpy(record + len, &value, sizeof(value));
+			len += sizeof(value);
+			break;
+		}
+		case LT_TRACE_ARG_LLONG: {
+			int64_t value = va_arg(args, long long);
+			syscalls_memcpy(record + len, &value, sizeof(value));
+			len += sizeof(value);
+			break;
+		}
+		case LT_TRACE_ARG_DOUBLE: {
+			double value = va_arg(args, double);
+			syscalls_memcpy(record + len, &value, sizeof(value));
+			len += sizeof(value);
+			break;
+		}
+		case LT_TRACE_ARG_POINTER: {
+			uint64_t value = (uintptr_t)va_arg(args, void *);
+			syscalls_memcpy(record + len, &value, sizeof(value));
+			len += sizeof(value);
+			break;
+		}
+		case LT_TRACE_ARG_STRING: {
+			const char *s = va_arg(args, const char *);
+			uint16_t slen = (NULL == s) ? LT_TRACE_NULL_STRING :
+				strnlen(s, LT_TRACE_MAX_STRING);
+			syscalls_memcpy(record + len, &slen, sizeof(slen));
+			len += sizeof(slen);
+			if (LT_TRACE_NULL_STRING != slen) {
+				syscalls_memcpy(record + len, s, slen);
+				len += slen;
+			}
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	va_end(args);
+
+	len = (len + LT_TRACE_ALIGN - 1) & ~(size_t)(LT_TRACE_ALIGN - 1);
+
+	header.len = len;
+	header.kind = LT_TRACE_MESSAGE;
+	header.level = level;
+	header.site = id;
+	header.ns = utility_time_ns();
+	header.thread = buf->thread;
+	header.reserved = 0;
+	syscalls_memcpy(record, &header, sizeof(header));
+
+	put_trace_record(buf, record, len);
+}
+
+
+/* The trace writer's functions must not log. */
+static void write_trace_padding(size_t len)
+{
+	static const uint8_t zeros[LT_TRACE_ALIGN];
+
+	fwrite(zeros, 1, len, trace_file);
+}
+
+
+static void write_trace_site(struct lt_site *site, uint32_t id)
+{
+	struct lt_trace_record header;
+	struct lt_trace_site_def def;
+	size_t file_len, function_len, fmt_len, len, padded;
+
+	file_len = strlen(site->file) + 1;
+	function_len = strlen(site->function) + 1;
+	fmt_len = strlen(site->fmt) + 1;
+
+	len = sizeof(header) + sizeof(def) + file_len + function_len + fmt_len;
+	padded = (len + LT_TRACE_ALIGN - 1) & ~(size_t)(LT_TRACE_ALIGN - 1);
+
+	memset(&header, 0, sizeof(header));
+	header.len = padded;
+	header.kind = LT_TRACE_SITE;
+	header.site = id;
+
+	memset(&def, 0, sizeof(def));
+	def.line = site->line;
+	def.num_args = site->num_args;
+	memcpy(def.args, site->args, sizeof(def.args));
+
+	fwrite(&header, sizeof(header), 1, trace_file);
+	fwrite(&def, sizeof(def), 1, trace_file);
+	fwrite(site->file, 1, file_len, trace_file);
+	fwrite(site->function, 1, function_len, trace_file);
+	fwrite(site->fmt, 1, fmt_len, trace_file);
+	write_trace_padding(padded - len);
+}
+
+
+static void write_trace_dropped(struct lt_trace_buffer *buf)
+{
+	struct lt_trace_record header;
+	uint64_t count;
+	unsigned long dropped;
+
+	dropped = __atomic_load_n(&buf->dropped, __ATOMIC_RELAXED);
+	if (dropped == buf->reported_dropped) {
+		return;
+	}
+
+	count = dropped - buf->reported_dropped;
+	buf->reported_dropped = dropped;
+
+	memset(&header, 0, sizeof(header));
+	header.len = sizeof(header) + sizeof(count);
+	header.kind = LT_TRACE_DROPPED;
+	header.ns = utility_time_ns();
+	header.thread = buf->thread;
+
+	fwrite(&header, sizeof(header), 1, trace_file);
+	fwrite(&count, sizeof(count), 1, trace_file);
+}
+
+
+static size_t drain_trace_buffer(struct lt_trace_buffer *buf)
+{
+	struct lt_trace_record header;
+	uint64_t tail = buf->tail;
+	size_t written = 0;
+	uint8_t *record;
+
+	while (tail < buf->drain_to) {
+		record = buf->data + (tail & (LT_TRACE_BUFLEN - 1));
+		/* Only len and kind are sure to be there in a pad */
+		memcpy(&header, record, 4);
+
+		if (LT_TRACE_PAD != header.kind) {
+			fwrite(record, 1, header.len, trace_file);
+			written += header.len;
+		}
+		tail += header.len;
+	}
+
+	__atomic_store_n(&buf->tail, tail, __ATOMIC_RELEASE);
+
+	write_trace_dropped(buf);
+
+	return written;
+}
+
+
+/* Writes every record the threads have finished, after the
+ * definitions of any sites they use, and frees the buffers of
+ * threads that have exited.  Returns the bytes of records written. */
+static size_t drain_trace_buffers(void)
+{
+	struct lt_trace_buffer *buf, **prev;
+	uint32_t num_sites;
+	size_t written = 0;
+	int exited;
+
+	syscalls_pthread_mutex_lock(&trace_lock);
+
+	for (buf = trace_buffers ; NULL != buf ; buf = buf->next) {
+		buf->drain_to = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+	}
+
+	/* Every site used by those records is registered by now */
+	num_sites = __atomic_load_n(&num_trace_sites, __ATOMIC_ACQUIRE);
+	for ( ; written_trace_sites < num_sites ; written_trace_sites++) {
+		write_trace_site(trace_sites[written_trace_sites],
+				 written_trace_sites + 1);
+	}
+
+	prev = &trace_buffers;
+	while (NULL != (buf = *prev)) {
+		exited = __atomic_load_n(&buf->exited, __ATOMIC_ACQUIRE);
+		buf->drain_to = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+		written += drain_trace_buffer(buf);
+
+		if (exited && buf->tail == buf->head) {
+			*prev = buf->next;
+			/* Logging here would need trace_lock */
+			free(buf);
+		} else {
+			prev = &buf->next;
+		}
+	}
+
+	syscalls_pthread_mutex_unlock(&trace_lock);
+
+	if (0 != written) {
+		fflush(trace_file);
+	}
+
+	return written;
+}
+
+
+static void *run_trace_writer(void *arg __attribute__ ((unused)))
+{
+	while (__atomic_load_n(&trace_writer_running, __ATOMIC_ACQUIRE)) {
+		if (0 == drain_trace_buffers()) {
+			usleep(LT_WRITER_POLL * 1000);
+		}
+	}
+
+	return NULL;
+}
+
+
+/* Switches the log macros to recording binary trace records, written
+ * to path by a thread of their own.  lt_decode turns the file back
+ * into text. */
+utility_retcode_t lt_start_trace(const char *path)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct lt_trace_header header;
+	struct timespec ts;
+
+	FUNC_ENTER;
+
+	if (__atomic_load_n(&trace_writer_running, __ATOMIC_ACQUIRE)) {
+		ERRR("Already tracing\n");
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	trace_file = fopen(path, "w");
+	if (NULL == trace_file) {
+		ERRR("Failed to open trace file \"%s\"\n", path);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	syscalls_memset(&header, 0, sizeof(header));
+	syscalls_memcpy(header.magic, LT_TRACE_MAGIC, sizeof(header.magic));
+	header.start_ns = utility_time_ns();
+	syscalls_clock_gettime(CLOCK_REALTIME, &ts);
+	header.start_realtime_ns = (uint64_t)ts.tv_sec * 1000000000ULL +
+		(uint64_t)ts.tv_nsec;
+
+	if (1 != fwrite(&header, sizeof(header), 1, trace_file)) {
+		ERRR("Failed to write trace file \"%s\"\n", path);
+		ret = UTILITY_FAILURE;
+		goto close_file;
+	}
+
+	/* A new file needs every site defined again */
+	written_trace_sites = 0;
+
+	__atomic_store_n(&trace_writer_running, 1, __ATOMIC_RELEASE);
+
+	if (0 != syscalls_pthread_create(&trace_writer_thread, NULL,
+					 run_trace_writer, NULL)) {
+		__atomic_store_n(&trace_writer_running, 0, __ATOMIC_RELEASE);
+		ret = UTILITY_FAILURE;
+		goto close_file;
+	}
+
+	__atomic_store_n(&lt_tracing, 1, __ATOMIC_RELEASE);
+
+	goto out;
+
+close_file:
+	fclose(trace_file);
+	trace_file = NULL;
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Goes back to logging text once the records so far are written. */
+void lt_stop_trace(void)
+{
+	FUNC_ENTER;
+
+	if (!__atomic_load_n(&trace_writer_running, __ATOMIC_ACQUIRE)) {
+		goto out;
+	}
+
+	__atomic_store_n(&lt_tracing, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&trace_writer_running, 0, __ATOMIC_RELEASE);
+	syscalls_pthread_join(trace_writer_thread, NULL);
+
+	drain_trace_buffers();
+
+	fclose(trace_file);
+	trace_file = NULL;
+
+out:
+	FUNC_RETURN;
+	return;
+}
+
+
+/* Trace records thrown away because a thread's buffer was full */
+unsigned long lt_trace_dropped(void)
+{
+	struct lt_trace_buffer *buf;
+	unsigned long dropped = 0;
+
+	syscalls_pthread_mutex_lock(&trace_lock);
+
+	for (buf = trace_buffers ; NULL != buf ; buf = buf->next) {
+		dropped += __atomic_load_n(&buf->dropped, __ATOMIC_RELAXED);
+	}
+
+	syscalls_pthread_mutex_unlock(&trace_lock);
+
+	return dropped;
+}
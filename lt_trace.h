@@ -0,0 +1,111 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LT_TRACE_H
+#define LT_TRACE_H
+
+#include <stdint.h>
+
+/* Binary trace records.  In trace mode a log call site copies its
+ * arguments, unformatted, into a buffer belonging to its thread; a
+ * writer thread appends the records to a trace file and lt_decode
+ * formats them later.  Everything is in host byte order.
+ *
+ * The file starts with a struct lt_trace_header.  Records follow,
+ * each a struct lt_trace_record and its payload:
+ *
+ * LT_TRACE_SITE     a call site, before its first message: a struct
+ *                   lt_trace_site_def, then the file, function and
+ *                   format, each NUL terminated
+ * LT_TRACE_MESSAGE  a message from site: its arguments one after
+ *                   another, ints as int32_t, the other numbers as
+ *                   64 bits, strings as a uint16_t length and the
+ *                   bytes (LT_TRACE_NULL_STRING for NULL)
+ * LT_TRACE_DROPPED  a uint64_t count of messages thread dropped
+ *                   because its buffer was full
+ *
+ * In a thread's buffer a record never wraps; an LT_TRACE_PAD record
+ * fills the end instead. */
+
+#define LT_TRACE_MAGIC		"LTTRACE1"
+#define LT_TRACE_MAX_ARGS	8
+#define LT_TRACE_MAX_STRING	255
+#define LT_TRACE_NULL_STRING	0xffff
+/* Each thread's buffer; a power of two */
+#define LT_TRACE_BUFLEN		(256 * 1024)
+#define LT_TRACE_MAX_SITES	4096
+/* Records are padded to a multiple of this */
+#define LT_TRACE_ALIGN		8
+
+typedef enum {
+	LT_TRACE_PAD,
+	LT_TRACE_SITE,
+	LT_TRACE_MESSAGE,
+	LT_TRACE_DROPPED
+} lt_trace_kind_t;
+
+typedef enum {
+	LT_TRACE_ARG_INT,
+	LT_TRACE_ARG_LONG,
+	LT_TRACE_ARG_LLONG,
+	LT_TRACE_ARG_DOUBLE,
+	LT_TRACE_ARG_POINTER,
+	LT_TRACE_ARG_STRING
+} lt_trace_arg_t;
+
+struct lt_trace_header {
+	char magic[8];
+	/* utility_time_ns() and the wall clock when tracing started */
+	uint64_t start_ns;
+	uint64_t start_realtime_ns;
+};
+
+struct lt_trace_record {
+	/* The whole record, this header included */
+	uint16_t len;
+	uint8_t kind;
+	uint8_t level;
+	uint32_t site;
+	uint64_t ns;
+	uint32_t thread;
+	uint32_t reserved;
+};
+
+struct lt_trace_site_def {
+	uint32_t line;
+	uint8_t num_args;
+	uint8_t args[LT_TRACE_MAX_ARGS];
+	uint8_t reserved[3];
+};
+
+/* Every log call site has one of these, static.  id is 0 until the
+ * site is first used in trace mode, and LT_SITE_TEXT if its format
+ * can't be recorded in binary, in which case it is logged as text. */
+#define LT_SITE_TEXT		0xffffffff
+
+struct lt_site {
+	uint32_t id;
+	const char *file;
+	const char *function;
+	int line;
+	const char *fmt;
+	uint8_t num_args;
+	uint8_t args[LT_TRACE_MAX_ARGS];
+};
+
+#endif /* #ifndef LT_TRACE_H */
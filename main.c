@@ -22,30 +22,231 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "client.h"
 #include "rtsp_client.h"
 #include "audio_debug.h"
+#include "encryption.h"
+#include "config.h"
+#include "timeline.h"
+#include "flight_recorder.h"
+#include "stage_latency.h"
+#include "metrics.h"
+#include "syscalls_acct.h"
+#include "perf_counters.h"
 
 #define DEFAULT_FACILITY LT_MAIN
 
+#define MAX_GROUP_SERVERS 16
 
-int main(void)
+
+/* Sets a server up from "host" or "host:port", the rest from the
+ * config. */
+static void parse_server(const char *arg, struct rtsp_server *server)
+{
+	char *colon;
+
+	init_rtsp_server(server);
+	syscalls_strncpy(server->host, arg, sizeof(server->host));
+	server->host[sizeof(server->host) - 1] = '\0';
+
+	colon = syscalls_strchr(server->host, ':');
+	if (NULL != colon) {
+		*colon = '\0';
+		server->port = syscalls_strtoul(colon + 1, NULL, 10);
+	}
+}
+
+
+/* Plays the tracks, one after another, to every server at once. */
+static void play_group(struct rtsp_server *servers,
+		       int num_servers,
+		       char **pcm_files,
+		       int num_files)
+{
+	struct rtsp_session *sessions;
+	struct rtsp_group group;
+	int i;
+
+	sessions = syscalls_malloc(num_servers * sizeof(*sessions));
+	if (NULL == sessions) {
+		return;
+	}
+
+	rtsp_group_start(&group, sessions, servers, num_servers);
+
+	if (0 == num_files) {
+		rtsp_group_play_track(&group, NULL);
+	}
+	for (i = 0 ; i < num_files ; i++) {
+		rtsp_group_play_track(&group, pcm_files[i]);
+	}
+
+	rtsp_group_log(&group);
+	rtsp_group_end(&group);
+
+	syscalls_free(sessions);
+}
+
+
+/* Hands log output to a background thread, if the config says to. */
+static void start_log_writer(void)
+{
+	utility_boolean_t async;
+	lt_output_t output;
+	lt_overflow_t overflow;
+	char file[MAX_FILE_NAME_LEN];
+
+	get_log_async(&async);
+	if (!async) {
+		return;
+	}
+
+	get_log_destination(&output);
+	get_log_file(file, sizeof(file));
+	get_log_overflow(&overflow);
+
+	if (UTILITY_SUCCESS != lt_start_writer(output, file, overflow)) {
+		WARN("Logging from each thread directly\n");
+	}
+}
+
+
+/* Starts the flight recorders, if the config says to. */
+static void start_flight_recorders(void)
+{
+	utility_boolean_t enabled;
+	char dir[MAX_FILE_NAME_LEN];
+	unsigned int stall_ms;
+
+	get_flight_recorder(&enabled);
+	if (!enabled) {
+		return;
+	}
+
+	get_flight_recorder_dir(dir, sizeof(dir));
+	get_flight_recorder_stall(&stall_ms);
+
+	flight_recorder_start(dir, stall_ms);
+}
+
+
+/* Starts counting calls through syscalls.c, if the config says to. */
+static void start_syscalls_acct(void)
+{
+	utility_boolean_t enabled;
+
+	get_syscalls_accounting(&enabled);
+	if (enabled) {
+		syscalls_acct_start();
+	}
+}
+
+
+/* Starts timing the audio pipeline's stages, if the config says to. */
+static void start_stage_latency(void)
+{
+	utility_boolean_t enabled;
+
+	get_stage_latency(&enabled);
+	if (enabled) {
+		stage_latency_start();
+	}
+}
+
+
+/* Counts hardware events, if the config says to and perf events are
+ * permitted; without them the stages are still timed. */
+static void start_perf_counters(void)
+{
+	utility_boolean_t enabled;
+
+	get_perf_counters(&enabled);
+	if (enabled && UTILITY_SUCCESS != perf_counters_start()) {
+		WARN("Not counting hardware events\n");
+	}
+}
+
+
+/* Serves metrics, if the config says where. */
+static void start_metrics(void)
+{
+	char listen_on[MAX_FILE_NAME_LEN];
+
+	get_metrics_listen(listen_on, sizeof(listen_on));
+	if ('\0' != listen_on[0]) {
+		metrics_start(listen_on);
+	}
+}
+
+
+/* Each "-s host[:port]" adds a server to play to; with more than
+ * one, they play in step.  Any other arguments are PCM files to play
+ * back to back; with none, the PCM file from the config is played. */
+int main(int argc, char **argv)
 {
 	struct rtsp_session session;
+	struct rtsp_server servers[MAX_GROUP_SERVERS];
+	int key_pool_size, num_servers = 0, first_file = 1, exit_code = 0;
 
 	/* We can't output anything to the user until the lt framework
 	 * is initialized, so do that before anything else. */
 	lt_init();
+	start_log_writer();
+	timeline_mark_process_start();
+	start_syscalls_acct();
 	FUNC_ENTER;
 
 	//test_audio();
 
 	NOTC("raopd starting\n");
 
-	if (UTILITY_SUCCESS == rtsp_start_client(&session)) {
-		rtsp_send_data(&session);
+	get_aes_key_pool_size(&key_pool_size);
+	aes_key_pool_start(key_pool_size);
+	start_flight_recorders();
+	start_perf_counters();
+	start_stage_latency();
+	start_metrics();
+
+	while (first_file + 1 < argc &&
+	       0 == syscalls_strcmp(argv[first_file], "-s")) {
+		if (MAX_GROUP_SERVERS == num_servers) {
+			ERRR("Too many servers, at most %d can play "
+			     "together\n", MAX_GROUP_SERVERS);
+			exit_code = 1;
+			goto stop;
+		}
+
+		parse_server(argv[first_file + 1], &servers[num_servers]);
+		num_servers++;
+		first_file += 2;
+	}
+
+	if (num_servers > 1) {
+		play_group(servers, num_servers, &argv[first_file],
+			   argc - first_file);
+	} else if (UTILITY_SUCCESS == (1 == num_servers ?
+				       rtsp_start_session(&session, &servers[0]) :
+				       rtsp_start_client(&session))) {
+		if (argc > first_file) {
+			rtsp_play_playlist(&session,
+					   (const char * const *)&argv[first_file],
+					   argc - first_file);
+			rtsp_end_session(&session);
+		} else {
+			rtsp_send_data(&session);
+		}
 	}
 
+stop:
+	metrics_stop();
+	stage_latency_stop();
+	perf_counters_stop();
+	flight_recorder_stop();
+	aes_key_pool_stop();
+	syscalls_acct_stop();
+
+	lt_report_suppressed();
 	NOTC("raopd exiting\n");
 
 	FUNC_RETURN;
-	return 0;
+	lt_stop_writer();
+	return exit_code;
 }
 
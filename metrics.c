@@ -0,0 +1,657 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stddef.h>
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "config.h"
+#include "stage_latency.h"
+#include "syscalls_acct.h"
+#include "metrics.h"
+
+#define DEFAULT_FACILITY LT_METRICS
+
+/* Where a page is rendered to first; it grows if it has to */
+#define METRICS_PAGE_LEN		(16 * 1024)
+
+typedef enum {
+	METRIC_COUNTER,
+	METRIC_GAUGE,
+	METRIC_HISTOGRAM
+} metric_type_t;
+
+struct metric_def {
+	const char *name;
+	metric_type_t type;
+	const char *help;
+};
+
+static const struct metric_def metric_defs[METRIC_NUM] = {
+	{ "raopd_packets_sent_total", METRIC_COUNTER,
+	  "Audio packets written to servers." },
+	{ "raopd_bytes_sent_total", METRIC_COUNTER,
+	  "Bytes written on audio connections, headers included." },
+	{ "raopd_packets_resent_total", METRIC_COUNTER,
+	  "Audio packets sent again at a server's request." },
+	{ "raopd_socket_stalls_total", METRIC_COUNTER,
+	  "Audio packets that took more than one wait for the socket "
+	  "to write." },
+	{ "raopd_handshake_failures_total", METRIC_COUNTER,
+	  "RTSP handshakes that failed or timed out." },
+	{ "raopd_streams", METRIC_GAUGE,
+	  "Audio streams connected to servers." },
+	{ "raopd_send_queue_packets", METRIC_GAUGE,
+	  "Packets encrypted and waiting to be written, all streams." },
+	{ "raopd_receiver_buffer", METRIC_GAUGE,
+	  "Buffer fill a server last reported on its audio connection, "
+	  "in the server's units." },
+	{ "raopd_rtsp_rtt_seconds", METRIC_HISTOGRAM,
+	  "Time from an RTSP request being written to its response "
+	  "being read." },
+};
+
+/* In nanoseconds, and as Prometheus shows them */
+static const uint64_t histogram_bounds[METRIC_HISTOGRAM_BUCKETS] = {
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000,
+	100000000, 250000000, 500000000, 1000000000, 2500000000ULL,
+	5000000000ULL,
+};
+static const char *histogram_les[METRIC_HISTOGRAM_BUCKETS] = {
+	"0.001", "0.0025", "0.005", "0.01", "0.025", "0.05",
+	"0.1", "0.25", "0.5", "1", "2.5", "5",
+};
+
+#define STAGE_BUCKETS 13
+
+static const uint64_t stage_bounds[STAGE_BUCKETS] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+	500000, 1000000, 2500000, 5000000, 10000000,
+};
+static const char *stage_les[STAGE_BUCKETS] = {
+	"1e-06", "2.5e-06", "5e-06", "1e-05", "2.5e-05", "5e-05",
+	"0.0001", "0.00025", "0.0005", "0.001", "0.0025", "0.005", "0.01",
+};
+
+/* Every field is only ever updated atomically */
+struct metric {
+	int64_t value;
+	uint64_t count;
+	uint64_t sum;
+	/* Not cumulative; the last is +Inf */
+	uint64_t buckets[METRIC_HISTOGRAM_BUCKETS + 1];
+};
+
+static struct metric metrics[METRIC_NUM];
+
+static int metrics_running;
+static int listen_fd = -1;
+static char socket_path[MAX_FILE_NAME_LEN];
+static pthread_t metrics_thread;
+
+/* Where the metrics thread renders pages */
+struct metrics_page {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+
+void metrics_add(metric_t metric, uint64_t n)
+{
+	__atomic_fetch_add(&metrics[metric].value, n, __ATOMIC_RELAXED);
+}
+
+
+void metrics_gauge_add(metric_t metric, int64_t n)
+{
+	__atomic_fetch_add(&metrics[metric].value, n, __ATOMIC_RELAXED);
+}
+
+
+void metrics_set(metric_t metric, int64_t value)
+{
+	__atomic_store_n(&metrics[metric].value, value, __ATOMIC_RELAXED);
+}
+
+
+void metrics_observe_ns(metric_t metric, uint64_t ns)
+{
+	struct metric *m = &metrics[metric];
+	int i;
+
+	for (i = 0 ; i < METRIC_HISTOGRAM_BUCKETS ; i++) {
+		if (ns <= histogram_bounds[i]) {
+			break;
+		}
+	}
+
+	__atomic_fetch_add(&m->buckets[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->sum, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&m->count, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Adds to the page, or just counts what would have been added once
+ * it is full.  syscalls_vsnprintf() doesn't say how much it left
+ * out, so this uses vsnprintf() itself. */
+static void page_printf(struct metrics_page *page, const char *format, ...)
+{
+	va_list args;
+	int ret;
+
+	va_start(args, format);
+	ret = vsnprintf(page->buf + MIN(page->len, page->size),
+			page->size - MIN(page->len, page->size),
+			format, args);
+	va_end(args);
+
+	if (ret > 0) {
+		page->len += ret;
+	}
+}
+
+
+static void render_histogram(struct metrics_page *page,
+			     const char *name,
+			     struct metric *m)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0 ; i < METRIC_HISTOGRAM_BUCKETS ; i++) {
+		total += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+		page_printf(page, "%s_bucket{le=\"%s\"} %llu\n", name,
+			    histogram_les[i], (unsigned long long)total);
+	}
+
+	total += __atomic_load_n(&m->buckets[i], __ATOMIC_RELAXED);
+	page_printf(page, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+		    (unsigned long long)total);
+	page_printf(page, "%s_sum %.9f\n", name,
+		    __atomic_load_n(&m->sum, __ATOMIC_RELAXED) / 1e9);
+	/* Must match +Inf, which count read separately might not */
+	page_printf(page, "%s_count %llu\n", name, (unsigned long long)total);
+}
+
+
+/* The stage times of every stream so far, from stage_latency.c */
+static void render_stages(struct metrics_page *page)
+{
+	struct stage_latency *total;
+	struct histogram *stage;
+	uint64_t count;
+	int path, i, j;
+
+	total = syscalls_malloc(sizeof(*total));
+	if (NULL == total) {
+		return;
+	}
+
+	page_printf(page, "# HELP raopd_stage_seconds Time each audio "
+		    "packet spent in each stage of the pipeline.\n");
+	page_printf(page, "# TYPE raopd_stage_seconds histogram\n");
+
+	for (path = 0 ; path < STAGE_LATENCY_NUM_PATHS ; path++) {
+		stage_latency_total(path, total);
+
+		for (i = 0 ; i < STAGE_LATENCY_NUM_STAGES ; i++) {
+			stage = &total->stages[i];
+			if (0 == stage->count) {
+				continue;
+			}
+
+			for (j = 0 ; j < STAGE_BUCKETS ; j++) {
+				page_printf(page, "raopd_stage_seconds_bucket"
+					    "{path=\"%s\",stage=\"%s\","
+					    "le=\"%s\"} %llu\n",
+					    stage_latency_path_name(path),
+					    stage_latency_stage_name(i),
+					    stage_les[j],
+					    (unsigned long long)
+					    histogram_count_upto(stage,
+								 stage_bounds[j]));
+			}
+
+			/* The buckets, not count, so +Inf adds up */
+			count = histogram_count_upto(stage, UINT64_MAX);
+
+			page_printf(page, "raopd_stage_seconds_bucket"
+				    "{path=\"%s\",stage=\"%s\",le=\"+Inf\"} "
+				    "%llu\n", stage_latency_path_name(path),
+				    stage_latency_stage_name(i),
+				    (unsigned long long)count);
+			page_printf(page, "raopd_stage_seconds_sum"
+				    "{path=\"%s\",stage=\"%s\"} %.9f\n",
+				    stage_latency_path_name(path),
+				    stage_latency_stage_name(i),
+				    stage->total / 1e9);
+			page_printf(page, "raopd_stage_seconds_count"
+				    "{path=\"%s\",stage=\"%s\"} %llu\n",
+				    stage_latency_path_name(path),
+				    stage_latency_stage_name(i),
+				    (unsigned long long)count);
+		}
+	}
+
+	syscalls_free(total);
+}
+
+
+/* One counter from syscalls_acct.h, for each call that has been made */
+static void render_syscall_counter(struct metrics_page *page,
+				   const struct syscalls_acct *counts,
+				   const char *name,
+				   const char *help,
+				   size_t offset)
+{
+	uint64_t value;
+	int i;
+
+	page_printf(page, "# HELP %s %s\n# TYPE %s counter\n",
+		    name, help, name);
+
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		if (0 == counts[i].calls) {
+			continue;
+		}
+
+		value = *(const uint64_t *)((const char *)&counts[i] + offset);
+		page_printf(page, "%s{call=\"%s\"} %llu\n", name,
+			    syscalls_acct_name(i), (unsigned long long)value);
+	}
+}
+
+
+/* Every thread's calls through syscalls.c so far */
+static void render_syscalls(struct metrics_page *page)
+{
+	struct syscalls_acct counts[SYSCALLS_ACCT_NUM];
+	int i;
+
+	syscalls_acct_total(counts);
+
+	render_syscall_counter(page, counts, "raopd_syscall_calls_total",
+			       "Calls through each system call wrapper.",
+			       offsetof(struct syscalls_acct, calls));
+	render_syscall_counter(page, counts, "raopd_syscall_bytes_total",
+			       "Bytes read, written or allocated.",
+			       offsetof(struct syscalls_acct, bytes));
+	render_syscall_counter(page, counts, "raopd_syscall_errors_total",
+			       "Calls that failed, other than with EAGAIN.",
+			       offsetof(struct syscalls_acct, errors));
+	render_syscall_counter(page, counts, "raopd_syscall_eagain_total",
+			       "Calls that failed with EAGAIN.",
+			       offsetof(struct syscalls_acct, eagain));
+	render_syscall_counter(page, counts, "raopd_syscall_eintr_total",
+			       "Calls interrupted by a signal and made again.",
+			       offsetof(struct syscalls_acct, eintr));
+	render_syscall_counter(page, counts, "raopd_syscall_lock_waits_total",
+			       "Lock calls that found the lock held.",
+			       offsetof(struct syscalls_acct, waits));
+
+	page_printf(page, "# HELP raopd_syscall_seconds_total Time in each "
+		    "system call wrapper; for locks, time waiting.\n"
+		    "# TYPE raopd_syscall_seconds_total counter\n");
+
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		if (0 == counts[i].calls) {
+			continue;
+		}
+
+		page_printf(page, "raopd_syscall_seconds_total{call=\"%s\"} "
+			    "%.9f\n", syscalls_acct_name(i),
+			    counts[i].ns / 1e9);
+	}
+}
+
+
+/* Writes every metric into buf in Prometheus' text format.  Returns
+ * the length of the whole page; if that is size or more, the page
+ * didn't fit and buf holds only the start of it. */
+size_t metrics_render(char *buf, size_t size)
+{
+	struct metrics_page page;
+	const struct metric_def *def;
+	int i;
+
+	page.buf = buf;
+	page.size = size;
+	page.len = 0;
+
+	for (i = 0 ; i < METRIC_NUM ; i++) {
+		def = &metric_defs[i];
+
+		page_printf(&page, "# HELP %s %s\n", def->name, def->help);
+
+		switch (def->type) {
+		case METRIC_COUNTER:
+			page_printf(&page, "# TYPE %s counter\n%s %lld\n",
+				    def->name, def->name, (long long)
+				    __atomic_load_n(&metrics[i].value,
+						    __ATOMIC_RELAXED));
+			break;
+		case METRIC_GAUGE:
+			page_printf(&page, "# TYPE %s gauge\n%s %lld\n",
+				    def->name, def->name, (long long)
+				    __atomic_load_n(&metrics[i].value,
+						    __ATOMIC_RELAXED));
+			break;
+		case METRIC_HISTOGRAM:
+		default:
+			page_printf(&page, "# TYPE %s histogram\n", def->name);
+			render_histogram(&page, def->name, &metrics[i]);
+			break;
+		}
+	}
+
+	render_stages(&page);
+	render_syscalls(&page);
+
+	return page.len;
+}
+
+
+static utility_retcode_t write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		/* Not syscalls_write(): a client that hangs up early
+		 * mustn't get us SIGPIPE */
+		ret = syscalls_sendto(fd, buf, len, MSG_NOSIGNAL, NULL, 0);
+		if (ret <= 0) {
+			return UTILITY_FAILURE;
+		}
+
+		buf += ret;
+		len -= ret;
+	}
+
+	return UTILITY_SUCCESS;
+}
+
+
+/* Reads the request line and headers, as far as the blank line */
+static utility_retcode_t read_request(int fd, char *buf, size_t size)
+{
+	struct pollfd pfd;
+	size_t len = 0;
+	ssize_t ret;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+
+	while (len < size - 1) {
+		if (syscalls_poll(&pfd, 1, METRICS_REQUEST_TIMEOUT) <= 0) {
+			return UTILITY_FAILURE;
+		}
+
+		ret = syscalls_recv(fd, buf + len, size - 1 - len, 0);
+		if (ret <= 0) {
+			return UTILITY_FAILURE;
+		}
+
+		len += ret;
+		buf[len] = '\0';
+
+		if (NULL != syscalls_strstr(buf, "\r\n\r\n") ||
+		    NULL != syscalls_strstr(buf, "\n\n")) {
+			return UTILITY_SUCCESS;
+		}
+	}
+
+	return UTILITY_FAILURE;
+}
+
+
+static void serve_request(int fd, struct metrics_page *page)
+{
+	char request[METRICS_MAX_REQUEST_LEN];
+	char header[128];
+	size_t len;
+	char *buf;
+	int header_len;
+
+	if (UTILITY_SUCCESS != read_request(fd, request, sizeof(request))) {
+		return;
+	}
+
+	if (0 != syscalls_strncmp(request, "GET /metrics ", 13) &&
+	    0 != syscalls_strncmp(request, "GET / ", 6)) {
+		header_len = syscalls_snprintf(header, sizeof(header),
+					       "HTTP/1.0 404 Not Found\r\n"
+					       "Content-Length: 0\r\n\r\n");
+		write_all(fd, header, header_len);
+		return;
+	}
+
+	len = metrics_render(page->buf, page->size);
+	if (len >= page->size) {
+		buf = syscalls_malloc(len * 2);
+		if (NULL == buf) {
+			return;
+		}
+
+		syscalls_free(page->buf);
+		page->buf = buf;
+		page->size = len * 2;
+
+		/* It can only have grown by a line or two since */
+		len = metrics_render(page->buf, page->size);
+		len = MIN(len, page->size - 1);
+	}
+
+	header_len = syscalls_snprintf(header, sizeof(header),
+				       "HTTP/1.0 200 OK\r\n"
+				       "Content-Type: text/plain; "
+				       "version=0.0.4\r\n"
+				       "Content-Length: %lu\r\n\r\n",
+				       (unsigned long)len);
+
+	if (UTILITY_SUCCESS == write_all(fd, header, header_len)) {
+		write_all(fd, page->buf, len);
+	}
+}
+
+
+/* Serves one client at a time until the listening socket is shut
+ * down.  Scrapes are rare and quick, so that is plenty. */
+static void *serve_metrics(void *arg)
+{
+	struct metrics_page page;
+	int fd;
+
+	(void)arg;
+
+	page.size = METRICS_PAGE_LEN;
+	page.buf = syscalls_malloc(page.size);
+	if (NULL == page.buf) {
+		return NULL;
+	}
+
+	while (__atomic_load_n(&metrics_running, __ATOMIC_ACQUIRE)) {
+		fd = syscalls_accept(listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (EAGAIN == errno || ECONNABORTED == errno) {
+				continue;
+			}
+			break;
+		}
+
+		serve_request(fd, &page);
+		syscalls_close(fd);
+	}
+
+	syscalls_free(page.buf);
+
+	return NULL;
+}
+
+
+/* A Unix domain socket at path, replacing whatever socket was left
+ * there last time */
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (syscalls_strlen(path) >= sizeof(addr.sun_path)) {
+		ERRR("Metrics socket path \"%s\" is too long\n", path);
+		return -1;
+	}
+
+	fd = syscalls_socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	syscalls_memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	syscalls_strncpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+	unlink(path);
+
+	if (syscalls_bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syscalls_close(fd);
+		return -1;
+	}
+
+	syscalls_strncpy(socket_path, path, sizeof(socket_path));
+
+	return fd;
+}
+
+
+/* A TCP socket on "address:port" */
+static int listen_tcp(const char *listen_on)
+{
+	struct sockaddr_in addr;
+	char host[MAX_HOST_NAME_LEN];
+	char *colon;
+	int fd, on = 1;
+
+	syscalls_strncpy(host, listen_on, sizeof(host));
+	host[sizeof(host) - 1] = '\0';
+
+	colon = syscalls_strrchr(host, ':');
+	if (NULL == colon) {
+		ERRR("Metrics address \"%s\" has no port\n", listen_on);
+		return -1;
+	}
+	*colon = '\0';
+
+	syscalls_memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = syscalls_htons(syscalls_strtoul(colon + 1, NULL, 10));
+	if (syscalls_inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+		return -1;
+	}
+
+	fd = syscalls_socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	syscalls_setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (syscalls_bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syscalls_close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/* Serves the metrics from listen_on: a path for a Unix domain socket,
+ * otherwise "address:port", which should be a loopback address as
+ * there is no access control.  The metrics are kept whether or not
+ * they are served. */
+utility_retcode_t metrics_start(const char *listen_on)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	FUNC_ENTER;
+
+	listen_fd = ('/' == listen_on[0]) ?
+		listen_unix(listen_on) : listen_tcp(listen_on);
+	if (listen_fd < 0) {
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	if (syscalls_listen(listen_fd, SOMAXCONN) < 0) {
+		ret = UTILITY_FAILURE;
+		goto close;
+	}
+
+	__atomic_store_n(&metrics_running, 1, __ATOMIC_RELEASE);
+
+	if (0 != syscalls_pthread_create(&metrics_thread, NULL,
+					 serve_metrics, NULL)) {
+		__atomic_store_n(&metrics_running, 0, __ATOMIC_RELEASE);
+		ret = UTILITY_FAILURE;
+		goto close;
+	}
+
+	INFO("Serving metrics on %s\n", listen_on);
+	goto out;
+
+close:
+	syscalls_close(listen_fd);
+	listen_fd = -1;
+out:
+	if (UTILITY_SUCCESS != ret) {
+		WARN("Not serving metrics on %s\n", listen_on);
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+void metrics_stop(void)
+{
+	FUNC_ENTER;
+
+	if (!__atomic_exchange_n(&metrics_running, 0, __ATOMIC_ACQ_REL)) {
+		goto out;
+	}
+
+	/* Wakes the thread from accept() */
+	syscalls_shutdown(listen_fd, SHUT_RDWR);
+	syscalls_pthread_join(metrics_thread, NULL);
+	syscalls_close(listen_fd);
+	listen_fd = -1;
+
+	if ('\0' != socket_path[0]) {
+		unlink(socket_path);
+		socket_path[0] = '\0';
+	}
+
+out:
+	FUNC_RETURN;
+}
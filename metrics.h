@@ -0,0 +1,62 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include "utility.h"
+
+/* Counters, gauges and histograms for the whole process, served in
+ * Prometheus' text format over HTTP from a local socket (see
+ * metrics_start()).  Updating one is a single atomic add or store and
+ * takes no lock, so they can go anywhere in the audio path.  The
+ * audio pipeline's stage times are served too, from stage_latency.h.
+ *
+ * metric_defs in metrics.c must match. */
+typedef enum {
+	METRIC_PACKETS_SENT,
+	METRIC_BYTES_SENT,
+	METRIC_PACKETS_RESENT,
+	METRIC_SOCKET_STALLS,
+	METRIC_HANDSHAKE_FAILURES,
+	METRIC_STREAMS,
+	METRIC_SEND_QUEUE,
+	METRIC_RECEIVER_BUFFER,
+	METRIC_RTSP_RTT,
+	METRIC_NUM
+} metric_t;
+
+/* Bounds of the buckets of the histograms above; the ones for the
+ * stage times are in metrics.c too */
+#define METRIC_HISTOGRAM_BUCKETS 12
+
+#define METRICS_MAX_REQUEST_LEN 1024
+/* Longest a client gets to send its request */
+#define METRICS_REQUEST_TIMEOUT 1000 /* miliseconds */
+
+utility_retcode_t metrics_start(const char *listen_on);
+void metrics_stop(void);
+void metrics_add(metric_t metric, uint64_t n);
+void metrics_gauge_add(metric_t metric, int64_t n);
+void metrics_set(metric_t metric, int64_t value);
+void metrics_observe_ns(metric_t metric, uint64_t ns);
+size_t metrics_render(char *buf, size_t size);
+
+#endif /* #ifndef METRICS_H */
@@ -0,0 +1,452 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "perf_counters.h"
+
+#define DEFAULT_FACILITY LT_PERF_COUNTERS
+
+#define PERF_PARANOID_FILE "/proc/sys/kernel/perf_event_paranoid"
+
+struct perf_event_def {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+static const struct perf_event_def perf_event_defs[PERF_NUM_EVENTS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES }
+};
+
+static const char *site_names[PERF_NUM_SITES] = {
+	"build",
+	"parse"
+};
+
+/* A thread's group of counters.  Reading the leader gives the value
+ * of every counter in the group, in the order they were opened. */
+struct perf_thread {
+	int fds[PERF_NUM_EVENTS];
+	int num_fds;
+	/* Where each event is in what the leader reads, or -1 */
+	int positions[PERF_NUM_EVENTS];
+};
+
+static int perf_running;
+/* The events that could be opened when counting started, a bit for
+ * each; threads don't try the others */
+static unsigned int perf_available;
+static pthread_key_t perf_key;
+static pthread_once_t perf_once = PTHREAD_ONCE_INIT;
+/* Added to by whichever thread builds or parses a message */
+static struct perf_counts site_counts[PERF_NUM_SITES];
+
+
+static int open_event(perf_event_t event, int group_fd)
+{
+	struct perf_event_attr attr;
+
+	syscalls_memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = perf_event_defs[event].type;
+	attr.config = perf_event_defs[event].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	/* What perf_event_paranoid 2, the usual default, allows */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd,
+			    PERF_FLAG_FD_CLOEXEC);
+}
+
+
+/* Opens a group counting the calling thread with each of events that
+ * will open.  Returns the errno of the first that won't, or 0. */
+static int open_thread(struct perf_thread *thread, unsigned int events)
+{
+	int event, fd, err = 0;
+
+	thread->num_fds = 0;
+
+	for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+		thread->positions[event] = -1;
+
+		if (!(events & (1U << event))) {
+			continue;
+		}
+
+		fd = open_event(event, 0 == thread->num_fds ?
+				-1 : thread->fds[0]);
+		if (fd < 0) {
+			if (0 == err) {
+				err = errno;
+			}
+			continue;
+		}
+
+		thread->positions[event] = thread->num_fds;
+		thread->fds[thread->num_fds++] = fd;
+	}
+
+	return err;
+}
+
+
+static void close_thread(void *arg)
+{
+	struct perf_thread *thread = arg;
+	int i;
+
+	for (i = 0 ; i < thread->num_fds ; i++) {
+		syscalls_close(thread->fds[i]);
+	}
+
+	syscalls_free(thread);
+}
+
+
+static void perf_init(void)
+{
+	syscalls_pthread_key_create(&perf_key, close_thread);
+}
+
+
+/* The calling thread's group, opened if it hasn't been yet */
+static struct perf_thread *get_thread(void)
+{
+	struct perf_thread *thread;
+
+	thread = pthread_getspecific(perf_key);
+	if (NULL != thread) {
+		return thread;
+	}
+
+	thread = syscalls_malloc(sizeof(*thread));
+	if (NULL == thread) {
+		return NULL;
+	}
+
+	/* A thread whose counters won't open keeps its empty group, so
+	 * it doesn't try again on every read */
+	open_thread(thread, perf_available);
+	pthread_setspecific(perf_key, thread);
+
+	return thread;
+}
+
+
+static int read_paranoid(void)
+{
+	char buf[16];
+	ssize_t len;
+	int fd;
+
+	fd = syscalls_open(PERF_PARANOID_FILE, O_RDONLY, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	len = syscalls_read(fd, buf, sizeof(buf) - 1);
+	syscalls_close(fd);
+
+	if (len <= 0) {
+		return -1;
+	}
+
+	buf[len] = '\0';
+
+	return atoi(buf);
+}
+
+
+/* Starts counting, if the counters will open for this thread.  If
+ * only some of them will, it counts with those. */
+utility_retcode_t perf_counters_start(void)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct perf_thread *thread;
+	int event, err;
+
+	FUNC_ENTER;
+
+	if (__atomic_load_n(&perf_running, __ATOMIC_ACQUIRE)) {
+		goto out;
+	}
+
+	syscalls_pthread_once(&perf_once, perf_init);
+
+	thread = syscalls_malloc(sizeof(*thread));
+	if (NULL == thread) {
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	err = open_thread(thread, (1U << PERF_NUM_EVENTS) - 1);
+	if (0 == thread->num_fds) {
+		WARN("Hardware counters aren't available: %s "
+		     "(perf_event_paranoid: %d)\n", strerror(err),
+		     read_paranoid());
+		syscalls_free(thread);
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	perf_available = 0;
+	for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+		if (thread->positions[event] >= 0) {
+			perf_available |= 1U << event;
+		} else {
+			WARN("No %s counter, so it won't be counted\n",
+			     perf_event_defs[event].name);
+		}
+	}
+
+	/* From an earlier start, perhaps with other events */
+	if (NULL != pthread_getspecific(perf_key)) {
+		close_thread(pthread_getspecific(perf_key));
+	}
+	pthread_setspecific(perf_key, thread);
+
+	__atomic_store_n(&perf_running, 1, __ATOMIC_RELEASE);
+
+	INFO("Counting %d hardware events per thread\n", thread->num_fds);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Stops counting and logs the counts for RTSP. */
+void perf_counters_stop(void)
+{
+	FUNC_ENTER;
+
+	if (__atomic_exchange_n(&perf_running, 0, __ATOMIC_ACQ_REL)) {
+		perf_counters_log_sites();
+	}
+
+	FUNC_RETURN;
+}
+
+
+/* Reads the calling thread's counters.  The sample is left invalid if
+ * they aren't being counted, or won't open for this thread. */
+void perf_counters_read(struct perf_sample *sample)
+{
+	uint64_t buf[1 + PERF_NUM_EVENTS];
+	struct perf_thread *thread;
+	ssize_t len;
+	int event;
+
+	sample->valid = UTILITY_FALSE;
+
+	if (!__atomic_load_n(&perf_running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	thread = get_thread();
+	if (NULL == thread || 0 == thread->num_fds) {
+		return;
+	}
+
+	/* Not syscalls_read(), which would log every read and count
+	 * this among the audio path's reads */
+	len = read(thread->fds[0], buf, sizeof(buf));
+	if (len < (ssize_t)((1 + thread->num_fds) * sizeof(buf[0]))) {
+		return;
+	}
+
+	for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+		sample->values[event] = thread->positions[event] < 0 ? 0 :
+			buf[1 + thread->positions[event]];
+	}
+
+	sample->valid = UTILITY_TRUE;
+}
+
+
+/* Adds what the counters have gone up by since begin to counts, which
+ * only the calling thread may add to. */
+void perf_counters_add_since(struct perf_counts *counts,
+			     const struct perf_sample *begin)
+{
+	struct perf_sample now;
+	int event;
+
+	if (!begin->valid) {
+		return;
+	}
+
+	perf_counters_read(&now);
+	if (!now.valid) {
+		return;
+	}
+
+	for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+		__atomic_store_n(&counts->values[event],
+				 counts->values[event] +
+				 now.values[event] - begin->values[event],
+				 __ATOMIC_RELAXED);
+	}
+
+	__atomic_store_n(&counts->count, counts->count + 1, __ATOMIC_RELAXED);
+}
+
+
+/* As perf_counters_add_since(), for one of the sites any thread may
+ * add to */
+void perf_counters_site(perf_site_t site, const struct perf_sample *begin)
+{
+	struct perf_counts *counts = &site_counts[site];
+	struct perf_sample now;
+	int event;
+
+	if (!begin->valid) {
+		return;
+	}
+
+	perf_counters_read(&now);
+	if (!now.valid) {
+		return;
+	}
+
+	for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+		__atomic_fetch_add(&counts->values[event],
+				   now.values[event] - begin->values[event],
+				   __ATOMIC_RELAXED);
+	}
+
+	__atomic_fetch_add(&counts->count, 1, __ATOMIC_RELAXED);
+}
+
+
+void perf_counts_merge(struct perf_counts *to, const struct perf_counts *from)
+{
+	int event;
+
+	for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+		to->values[event] += __atomic_load_n(&from->values[event],
+						     __ATOMIC_RELAXED);
+	}
+
+	to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+}
+
+
+/* An event's count per stretch of code, or "-" if it wasn't counted */
+static void format_per(char *buf, size_t size,
+		       const struct perf_counts *counts,
+		       perf_event_t event)
+{
+	if (!(perf_available & (1U << event))) {
+		syscalls_snprintf(buf, size, "-");
+		return;
+	}
+
+	syscalls_snprintf(buf, size, "%.1f",
+			  (double)counts->values[event] / counts->count);
+}
+
+
+/* A line for each of the num counts that has counted anything, per
+ * what (a packet, say).  IPC is instructions per cycle. */
+void perf_counts_log(const char *title,
+		     const char *what,
+		     const char * const *names,
+		     const struct perf_counts *counts,
+		     int num)
+{
+	char per[PERF_NUM_EVENTS][24];
+	char ipc[16];
+	uint64_t cycles, instructions;
+	int i, event;
+
+	for (i = 0 ; i < num ; i++) {
+		if (0 != counts[i].count) {
+			break;
+		}
+	}
+
+	if (i == num) {
+		return;
+	}
+
+	INFO("Hardware counters for %s, per %s:\n", title, what);
+	INFO("  %-8s %9s %12s %12s %5s %12s %13s\n", "", "count",
+	     "cycles", "instructions", "IPC", "cache misses",
+	     "branch misses");
+
+	for (i = 0 ; i < num ; i++) {
+		if (0 == counts[i].count) {
+			continue;
+		}
+
+		for (event = 0 ; event < PERF_NUM_EVENTS ; event++) {
+			format_per(per[event], sizeof(per[event]),
+				   &counts[i], event);
+		}
+
+		cycles = counts[i].values[PERF_CYCLES];
+		instructions = counts[i].values[PERF_INSTRUCTIONS];
+
+		if ((perf_available & (1U << PERF_INSTRUCTIONS)) &&
+		    0 != cycles) {
+			syscalls_snprintf(ipc, sizeof(ipc), "%.2f",
+					  (double)instructions / cycles);
+		} else {
+			syscalls_snprintf(ipc, sizeof(ipc), "-");
+		}
+
+		INFO("  %-8s %9llu %12s %12s %5s %12s %13s\n", names[i],
+		     (unsigned long long)counts[i].count,
+		     per[PERF_CYCLES], per[PERF_INSTRUCTIONS], ipc,
+		     per[PERF_CACHE_MISSES], per[PERF_BRANCH_MISSES]);
+	}
+}
+
+
+/* Building and parsing RTSP messages, in every thread so far */
+void perf_counters_log_sites(void)
+{
+	struct perf_counts counts[PERF_NUM_SITES];
+	int site;
+
+	syscalls_memset(counts, 0, sizeof(counts));
+
+	for (site = 0 ; site < PERF_NUM_SITES ; site++) {
+		perf_counts_merge(&counts[site], &site_counts[site]);
+	}
+
+	perf_counts_log("RTSP messages", "message", site_names, counts,
+			PERF_NUM_SITES);
+}
@@ -0,0 +1,79 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+#include "utility.h"
+
+/* Hardware counters (cycles, instructions, cache and branch misses)
+ * for the stretches of code that stage_latency.h times, and for
+ * building and parsing RTSP messages.  Each thread opens its own
+ * group of counters with perf_event_open() the first time it reads
+ * them.  Where perf events aren't permitted, or the machine has no
+ * counters, perf_counters_start() says so and every sample is simply
+ * left invalid.
+ *
+ * Counting is user space only, and a read costs a system call, so
+ * this is an instrumentation mode rather than something to leave on.
+ *
+ * perf_event_names in perf_counters.c must match. */
+typedef enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_NUM_EVENTS
+} perf_event_t;
+
+/* Counted outside the audio pipeline's stages */
+typedef enum {
+	PERF_SITE_RTSP_BUILD,
+	PERF_SITE_RTSP_PARSE,
+	PERF_NUM_SITES
+} perf_site_t;
+
+/* The calling thread's counters at some moment */
+struct perf_sample {
+	utility_boolean_t valid;
+	uint64_t values[PERF_NUM_EVENTS];
+};
+
+/* What the counters went up by over count stretches of code */
+struct perf_counts {
+	uint64_t count;
+	uint64_t values[PERF_NUM_EVENTS];
+};
+
+utility_retcode_t perf_counters_start(void);
+void perf_counters_stop(void);
+void perf_counters_read(struct perf_sample *sample);
+void perf_counters_add_since(struct perf_counts *counts,
+			     const struct perf_sample *begin);
+void perf_counters_site(perf_site_t site, const struct perf_sample *begin);
+void perf_counts_merge(struct perf_counts *to, const struct perf_counts *from);
+void perf_counts_log(const char *title,
+		     const char *what,
+		     const char * const *names,
+		     const struct perf_counts *counts,
+		     int num);
+void perf_counters_log_sites(void);
+
+#endif /* #ifndef PERF_COUNTERS_H */
@@ -0,0 +1,73 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PROBES_H
+#define PROBES_H
+
+/* USDT probes for perf, bpftrace and systemtap, all under the provider
+ * "raopd".  Built with systemtap's <sys/sdt.h> (the Makefile looks for
+ * it), each probe is a nop in the code plus a note in the binary
+ * saying where it is and where its arguments live; a tracer that
+ * attaches swaps the nop for a breakpoint.  Without <sys/sdt.h> they
+ * compile to nothing.  Either way, don't compute anything just for a
+ * probe: its arguments should be values that are already at hand.
+ *
+ * Audio pipeline, per packet.  seq is the sequence number the packet
+ * goes out with; a group's shared source (see init_audio_source())
+ * reads and converts with session "source" and seq 0.
+ *   read_start     session, seq
+ *   read_done      session, seq, PCM bytes
+ *   convert_start  session, seq
+ *   convert_done   session, seq, converted bytes
+ *   encrypt_start  session, seq
+ *   encrypt_done   session, seq, encrypted bytes
+ *   write_start    session, seq, packet bytes
+ *   write_done     session, seq, bytes written
+ *   resend         session, first seq, packets asked for, sent
+ *
+ * RTSP, per message.  Requests are seen when they are queued; with
+ * pipelining several go out in one write.
+ *   rtsp_request   session, method, CSeq, bytes
+ *   rtsp_response  session, status, CSeq (0 if the server sent none)
+ *
+ * Every syscalls_write():
+ *   write          fd, bytes, write()'s result
+ *
+ * The session is the RTSP session identifier, a string.  See the .bt
+ * scripts for examples. */
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define RAOPD_PROBE2(name, a, b) \
+	DTRACE_PROBE2(raopd, name, a, b)
+#define RAOPD_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(raopd, name, a, b, c)
+#define RAOPD_PROBE4(name, a, b, c, d) \
+	DTRACE_PROBE4(raopd, name, a, b, c, d)
+
+#else /* #ifdef HAVE_SYS_SDT_H */
+
+#define RAOPD_PROBE2(name, a, b)		do { } while (0)
+#define RAOPD_PROBE3(name, a, b, c)		do { } while (0)
+#define RAOPD_PROBE4(name, a, b, c, d)		do { } while (0)
+
+#endif /* #ifdef HAVE_SYS_SDT_H */
+
+#endif /* #ifndef PROBES_H */
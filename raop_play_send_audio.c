@@ -33,6 +33,8 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #define DEFAULT_FACILITY LT_RAOP_PLAY_SEND_AUDIO
 
 static raopld_t *raopld;
+/* Timed the same stages as audio_stream.c, to compare the two */
+static struct stage_latency *latency;
 
 /*
  * if newsize < 4096, align the size to power of 2
@@ -270,13 +272,16 @@ static int pcm_get_next_sample(auds_t *auds, uint8_t **data, int *size)
 	uint8_t *rbuf=NULL;
 	size_t bytes_read;
 	static int total_read = 0;
+	uint64_t begin;
 
 	INFO("Preparing to get next PCM audio sample (fd: %d\n", pcm->dfd);
 
 	if(!(rbuf=(uint8_t*)malloc(bsize*4))) return -1;
 	memset(rbuf,0,bsize*4);
 	/* ds.u.mem.size, ds.u.mem.data */
+	begin = stage_latency_begin(latency);
 	bytes_read = syscalls_read(pcm->dfd,rbuf,bsize*4);
+	stage_latency_end(latency, STAGE_READ, begin);
 	ds.u.mem.size = bytes_read;
 	total_read += bytes_read;
 
@@ -304,7 +309,9 @@ static int pcm_get_next_sample(auds_t *auds, uint8_t **data, int *size)
 	/* ds is a local that gets rbuf as one of its fields; output
 	 * of auds_write_pcm goes to pcm->buffer, converted size is
 	 * returned in size */
+	begin = stage_latency_begin(latency);
 	rval = auds_write_pcm(pcm->buffer, data, size, bsize, &ds);
+	stage_latency_end(latency, STAGE_CONVERT, begin);
 
 	free(rbuf);
 	return rval;
@@ -433,7 +440,8 @@ static int fd_event_callback(void *p, int flags)
 }
 
 
-static int raopcl_send_sample(raopcl_t *p, uint8_t *sample, int count)
+static int raopcl_send_sample(raopcl_t *p, uint8_t *sample, int count,
+			      int frames)
 {
 	int rval=-1;
 	uint16_t len;
@@ -452,6 +460,7 @@ static int raopcl_send_sample(raopcl_t *p, uint8_t *sample, int count)
 
 	const int header_size = sizeof(header);
 	raopcl_data_t *raopcld;
+	uint64_t begin;
 
 	if (NULL == p) {
 		return -1;
@@ -461,6 +470,8 @@ static int raopcl_send_sample(raopcl_t *p, uint8_t *sample, int count)
 
 	datap = &raopcld->data;
 
+	begin = stage_latency_begin(latency);
+
 	if (realloc_memory((void **)datap,
 			   count + header_size + 16,
 			   __func__)) {
@@ -470,6 +481,13 @@ static int raopcl_send_sample(raopcl_t *p, uint8_t *sample, int count)
 	syscalls_memcpy(raopcld->data, header, header_size);
 	syscalls_memcpy(raopcld->data + header_size, sample, count);
 
+	fill_rtp_header(raopcld->data, raopcld->rtp_seq, raopcld->rtp_time);
+	raopcld->rtp_seq++;
+	raopcld->rtp_time += frames;
+
+	stage_latency_end(latency, STAGE_FRAME, begin);
+	begin = stage_latency_begin(latency);
+
 	syscalls_memcpy(&aes_data.key, raopcld->key, RAOP_AES_KEY_LEN);
 	syscalls_memcpy(&aes_data.iv, raopcld->iv, RAOP_AES_IV_LEN);
 
@@ -494,6 +512,8 @@ static int raopcl_send_sample(raopcl_t *p, uint8_t *sample, int count)
 
 	free(encrypted_buffer);
 
+	stage_latency_end(latency, STAGE_ENCRYPT, begin);
+
 	dump_encrypted(raopcld->data + header_size, encrypted_len);//count);
 
 	len = count + header_size - 4;
@@ -702,17 +722,21 @@ static int raopcl_sample_remsize(raopcl_t *p)
 }
 
 
-int hacked_send_audio(char *pcm_audio_file, int session_fd, struct aes_data *aes_data)
+int hacked_send_audio(char *pcm_audio_file, int session_fd,
+		      struct aes_data *aes_data, struct stage_latency *stages)
 {
 	int rval = 0;
 	uint8_t *buf = NULL;
 	int size = 0;
 	raopcl_data_t *raopcl;
 	int i;
+	int frames;
 	int pcm_datafile_open = 0;
+	uint64_t begin;
 
 	DEBG("PCM audio file: \"%s\" session_fd: %d\n", pcm_audio_file, session_fd);
 
+	latency = stages;
 	raopld = syscalls_malloc(sizeof(*raopld));
 	for (i = 0 ; i < MAX_NUM_OF_FDS ; i++) {
 		raopld->fds[i].fd = -1;
@@ -736,15 +760,18 @@ int hacked_send_audio(char *pcm_audio_file, int session_fd, struct aes_data *aes
 			continue;
 		}
 
+		frames = raopld->auds->chunk_size;
 		if(pcm_get_next_sample(raopld->auds, &buf, &size)){
 			auds_close(raopld->auds);
 			raopld->auds=NULL;
 			raopcl_wait_songdone(raopld->raopcl,1);
 		}
-		if(raopcl_send_sample(raopld->raopcl,buf,size)) break;
+		if(raopcl_send_sample(raopld->raopcl,buf,size,frames)) break;
+		begin = stage_latency_begin(latency);
 		do{
 			if((rval=main_event_handler())) break;
 		}while(raopld->auds && raopcl_sample_remsize(raopld->raopcl));
+		stage_latency_end(latency, STAGE_WRITE, begin);
 	}
 
 	return 0;
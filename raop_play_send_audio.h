@@ -25,6 +25,7 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include <samplerate.h>
 
 #include "encryption.h"
+#include "stage_latency.h"
 
 #define MAIN_EVENT_TIMEOUT 3 // sec unit
 
@@ -144,6 +145,8 @@ typedef struct raopcl_data_t {
 	time_t paused_time;
 	int size_in_aex;
 	struct timeval last_read_tv;
+	uint16_t rtp_seq;
+	uint32_t rtp_time;
 } raopcl_data_t;
 
 typedef struct fdev_t{
@@ -161,6 +164,7 @@ typedef struct raopld_t{
 	dfev_t fds[MAX_NUM_OF_FDS];
 }raopld_t;
 
-int hacked_send_audio(char *pcm_audio_file, int session_fd, struct aes_data *aes_data);
+int hacked_send_audio(char *pcm_audio_file, int session_fd,
+		      struct aes_data *aes_data, struct stage_latency *latency);
 
 #endif /* #ifndef RAOP_PLAY_SEND_AUDIO_H */
@@ -0,0 +1,479 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "rtp_timing.h"
+
+#define DEFAULT_FACILITY LT_RTP_TIMING
+
+/* Seconds from the NTP epoch (1900) to the Unix one */
+#define NTP_EPOCH_OFFSET 2208988800ULL
+
+uint64_t rtp_timing_ntp_now(void)
+{
+	struct timespec ts;
+
+	syscalls_clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (((uint64_t)ts.tv_sec + NTP_EPOCH_OFFSET) << 32) |
+		((((uint64_t)ts.tv_nsec) << 32) / 1000000000ULL);
+}
+
+
+uint64_t rtp_timing_ntp_to_ns(uint64_t ntp)
+{
+	return (ntp >> 32) * 1000000000ULL +
+		(((ntp & 0xffffffffULL) * 1000000000ULL) >> 32);
+}
+
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+	p[0] = value >> 24;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+
+static void put_u64(uint8_t *p, uint64_t value)
+{
+	put_u32(p, value >> 32);
+	put_u32(p + 4, value & 0xffffffff);
+}
+
+
+static uint64_t get_u64(const uint8_t *p)
+{
+	uint64_t value = 0;
+	int i;
+
+	for (i = 0 ; i < 8 ; i++) {
+		value = (value << 8) | p[i];
+	}
+
+	return value;
+}
+
+
+static void begin_timing_packet(uint8_t *buf, uint8_t type)
+{
+	syscalls_memset(buf, 0, RTP_TIMING_PACKET_LEN);
+	buf[0] = 0x80;
+	buf[1] = type;
+	buf[3] = 0x07;
+}
+
+
+/* Called with the lock held. */
+static void send_timing_request(struct rtp_timing *timing, uint64_t now)
+{
+	uint8_t buf[RTP_TIMING_PACKET_LEN];
+
+	begin_timing_packet(buf, 0xd2);
+	timing->last_request_ntp = rtp_timing_ntp_now();
+	put_u64(buf + 24, timing->last_request_ntp);
+
+	if (syscalls_write(timing->timing_fd, buf, sizeof(buf)) ==
+	    sizeof(buf)) {
+		timing->stats.requests_sent++;
+	}
+
+	if (0 != timing->burst_left) {
+		timing->burst_left--;
+		timing->next_request_ns = now +
+			(uint64_t)RTP_TIMING_BURST_INTERVAL * 1000000;
+	} else {
+		timing->next_request_ns = now +
+			(uint64_t)RTP_TIMING_INTERVAL * 1000000;
+	}
+}
+
+
+/* Tells the server that the frame with timestamp rtp_now is being
+ * played now, by our clock, and that it is to play rtp_now less the
+ * latency.  The first after an anchor is marked with the extension
+ * bit.  Called with the lock held. */
+static void send_sync(struct rtp_timing *timing, utility_boolean_t first)
+{
+	uint8_t buf[RTP_SYNC_PACKET_LEN];
+	uint32_t rtp_now;
+	uint64_t now, ntp;
+
+	now = utility_time_ns();
+	ntp = rtp_timing_ntp_now();
+
+	rtp_now = timing->anchor_rtp_time +
+		(uint32_t)((now - timing->anchor_ns) * RTP_SAMPLE_RATE /
+			   1000000000ULL);
+
+	buf[0] = first ? 0x90 : 0x80;
+	buf[1] = 0xd4;
+	buf[2] = 0x00;
+	buf[3] = 0x07;
+	put_u32(buf + 4, rtp_now - timing->latency_frames);
+	put_u64(buf + 8, ntp);
+	put_u32(buf + 16, rtp_now);
+
+	if (syscalls_write(timing->control_fd, buf, sizeof(buf)) ==
+	    sizeof(buf)) {
+		timing->stats.syncs_sent++;
+	}
+
+	timing->next_sync_ns = now + (uint64_t)RTP_SYNC_INTERVAL * 1000000;
+}
+
+
+/* Works out the offset and round trip from the reply to our last
+ * request, which arrived at arrival (NTP), and takes the offset from
+ * the sample with the shortest round trip of the last
+ * RTP_TIMING_FILTER_LEN.  Called with the lock held. */
+static void handle_timing_reply(struct rtp_timing *timing,
+				const uint8_t *buf,
+				uint64_t arrival)
+{
+	struct rtp_timing_stats *stats = &timing->stats;
+	struct rtp_timing_sample *sample, *best;
+	int64_t t1, t2, t3, t4, rtt;
+	unsigned int i, num;
+
+	if (0 == timing->last_request_ntp ||
+	    get_u64(buf + 8) != timing->last_request_ntp) {
+		stats->stale_replies++;
+		return;
+	}
+
+	timing->last_request_ntp = 0;
+
+	t1 = rtp_timing_ntp_to_ns(get_u64(buf + 8));
+	t2 = rtp_timing_ntp_to_ns(get_u64(buf + 16));
+	t3 = rtp_timing_ntp_to_ns(get_u64(buf + 24));
+	t4 = rtp_timing_ntp_to_ns(arrival);
+
+	/* Time on the wire: the whole exchange less the time the
+	 * server held the request */
+	rtt = (t4 - t1) - (t3 - t2);
+	if (rtt < 0) {
+		rtt = 0;
+	}
+
+	sample = &timing->samples[timing->num_samples %
+				  RTP_TIMING_FILTER_LEN];
+	sample->rtt_ns = rtt;
+	sample->offset_ns = ((t2 - t1) + (t3 - t4)) / 2;
+	timing->num_samples++;
+
+	if (0 == stats->replies || sample->rtt_ns < stats->rtt_min_ns) {
+		stats->rtt_min_ns = sample->rtt_ns;
+	}
+	if (sample->rtt_ns > stats->rtt_max_ns) {
+		stats->rtt_max_ns = sample->rtt_ns;
+	}
+	if (0 == stats->replies ||
+	    sample->offset_ns < stats->raw_offset_min_ns) {
+		stats->raw_offset_min_ns = sample->offset_ns;
+	}
+	if (0 == stats->replies ||
+	    sample->offset_ns > stats->raw_offset_max_ns) {
+		stats->raw_offset_max_ns = sample->offset_ns;
+	}
+	stats->rtt_total_ns += sample->rtt_ns;
+	stats->replies++;
+
+	num = MIN(timing->num_samples, RTP_TIMING_FILTER_LEN);
+	best = &timing->samples[0];
+	for (i = 1 ; i < num ; i++) {
+		if (timing->samples[i].rtt_ns < best->rtt_ns) {
+			best = &timing->samples[i];
+		}
+	}
+
+	stats->offset_ns = best->offset_ns;
+	stats->offset_rtt_ns = best->rtt_ns;
+}
+
+
+/* Answers a timing request from the server that arrived at arrival
+ * (NTP). */
+static void answer_timing_request(struct rtp_timing *timing,
+				  const uint8_t *request,
+				  uint64_t arrival)
+{
+	uint8_t buf[RTP_TIMING_PACKET_LEN];
+
+	begin_timing_packet(buf, 0xd3);
+	syscalls_memcpy(buf + 8, request + 24, 8);
+	put_u64(buf + 16, arrival);
+	put_u64(buf + 24, rtp_timing_ntp_now());
+
+	if (syscalls_write(timing->timing_fd, buf, sizeof(buf)) ==
+	    sizeof(buf)) {
+		timing->stats.requests_answered++;
+	}
+}
+
+
+static void *timing_thread(void *arg)
+{
+	struct rtp_timing *timing = arg;
+	uint8_t buf[64];
+	struct pollfd pfd;
+	uint64_t now, wake, arrival;
+	int read_ret, timeout;
+
+	FUNC_ENTER;
+
+	pfd.fd = timing->timing_fd;
+	pfd.events = POLLIN;
+
+	while (timing->running) {
+		now = utility_time_ns();
+
+		syscalls_pthread_mutex_lock(&timing->lock);
+
+		if (now >= timing->next_request_ns) {
+			send_timing_request(timing, now);
+		}
+
+		if (timing->anchored && now >= timing->next_sync_ns) {
+			send_sync(timing, UTILITY_FALSE);
+		}
+
+		wake = timing->next_request_ns;
+		if (timing->anchored && timing->next_sync_ns < wake) {
+			wake = timing->next_sync_ns;
+		}
+
+		syscalls_pthread_mutex_unlock(&timing->lock);
+
+		timeout = RTP_TIMING_POLL;
+		if (wake - now < (uint64_t)RTP_TIMING_POLL * 1000000) {
+			timeout = (wake - now) / 1000000;
+		}
+
+		if (syscalls_poll(&pfd, 1, timeout) <= 0) {
+			continue;
+		}
+
+		read_ret = syscalls_recv(timing->timing_fd, buf, sizeof(buf),
+					 MSG_DONTWAIT);
+		arrival = rtp_timing_ntp_now();
+		if (read_ret < RTP_TIMING_PACKET_LEN) {
+			continue;
+		}
+
+		syscalls_pthread_mutex_lock(&timing->lock);
+
+		if (0xd3 == buf[1]) {
+			handle_timing_reply(timing, buf, arrival);
+		} else if (0xd2 == buf[1]) {
+			answer_timing_request(timing, buf, arrival);
+		}
+
+		syscalls_pthread_mutex_unlock(&timing->lock);
+	}
+
+	FUNC_RETURN;
+	return NULL;
+}
+
+
+void rtp_clock_init(struct rtp_clock *clock, unsigned int latency_ms)
+{
+	syscalls_memset(clock, 0, sizeof(*clock));
+	syscalls_pthread_mutex_init(&clock->lock, NULL);
+	clock->latency_frames = (uint64_t)latency_ms * RTP_SAMPLE_RATE / 1000;
+}
+
+
+void rtp_clock_destroy(struct rtp_clock *clock)
+{
+	pthread_mutex_destroy(&clock->lock);
+}
+
+
+/* Starts the clock exchange on timing_fd, and sync packets on
+ * control_fd once rtp_timing_anchor() has been called.  Both must be
+ * connected to the server's ports.  The stream is timed from clock
+ * if there is one, else from a clock of its own latency_ms behind.
+ * The stream plays without any of this if it fails, on whatever the
+ * server buffers. */
+utility_retcode_t rtp_timing_start(struct rtp_timing *timing,
+				   int timing_fd,
+				   int control_fd,
+				   unsigned int latency_ms,
+				   struct rtp_clock *clock)
+{
+	FUNC_ENTER;
+
+	syscalls_memset(timing, 0, sizeof(*timing));
+	timing->timing_fd = timing_fd;
+	timing->control_fd = control_fd;
+	timing->next_request_ns = utility_time_ns();
+	timing->burst_left = RTP_TIMING_BURST - 1;
+
+	if (NULL == clock) {
+		rtp_clock_init(&timing->own_clock, latency_ms);
+		clock = &timing->own_clock;
+	}
+	timing->clock = clock;
+	timing->latency_frames = clock->latency_frames;
+
+	syscalls_pthread_mutex_init(&timing->lock, NULL);
+	timing->running = 1;
+
+	if (0 != syscalls_pthread_create(&timing->thread, NULL,
+					 timing_thread, timing)) {
+		WARN("Failed to start timing thread\n");
+		timing->running = 0;
+		pthread_mutex_destroy(&timing->lock);
+		if (&timing->own_clock == clock) {
+			rtp_clock_destroy(clock);
+		}
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
+
+	DEBG("Timing started, latency %u frames\n", timing->latency_frames);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+void rtp_timing_stop(struct rtp_timing *timing)
+{
+	FUNC_ENTER;
+
+	if (!timing->running) {
+		goto out;
+	}
+
+	timing->running = 0;
+	syscalls_pthread_join(timing->thread, NULL);
+	pthread_mutex_destroy(&timing->lock);
+	if (&timing->own_clock == timing->clock) {
+		rtp_clock_destroy(timing->clock);
+	}
+
+	rtp_timing_log(timing);
+
+out:
+	FUNC_RETURN;
+}
+
+
+/* Notes that the packet with timestamp rtp_time, the first since the
+ * stream started or was flushed, was written at now_ns
+ * (utility_time_ns()), and sends the first sync packet.  If the
+ * clock was already set by another session, the stream is timed from
+ * then instead: every session sharing the clock starts its stream
+ * with the same frame, so the frame with timestamp rtp_time plays at
+ * the same moment on all their servers. */
+void rtp_timing_anchor(struct rtp_timing *timing,
+		       uint32_t rtp_time,
+		       uint64_t now_ns)
+{
+	struct rtp_clock *clock = timing->clock;
+
+	if (!timing->running) {
+		return;
+	}
+
+	syscalls_pthread_mutex_lock(&clock->lock);
+	if (!clock->anchored) {
+		clock->anchor_ns = now_ns;
+		clock->anchored = UTILITY_TRUE;
+	}
+	now_ns = clock->anchor_ns;
+	syscalls_pthread_mutex_unlock(&clock->lock);
+
+	syscalls_pthread_mutex_lock(&timing->lock);
+
+	timing->anchor_rtp_time = rtp_time;
+	timing->anchor_ns = now_ns;
+	timing->anchored = UTILITY_TRUE;
+	send_sync(timing, UTILITY_TRUE);
+
+	syscalls_pthread_mutex_unlock(&timing->lock);
+}
+
+
+/* Stops the sync packets until the next anchor, for a FLUSH, and
+ * releases the clock for the next session to write to set. */
+void rtp_timing_unanchor(struct rtp_timing *timing)
+{
+	struct rtp_clock *clock = timing->clock;
+
+	if (!timing->running) {
+		return;
+	}
+
+	syscalls_pthread_mutex_lock(&timing->lock);
+	timing->anchored = UTILITY_FALSE;
+	syscalls_pthread_mutex_unlock(&timing->lock);
+
+	syscalls_pthread_mutex_lock(&clock->lock);
+	clock->anchored = UTILITY_FALSE;
+	syscalls_pthread_mutex_unlock(&clock->lock);
+}
+
+
+void rtp_timing_get_stats(struct rtp_timing *timing,
+			  struct rtp_timing_stats *stats)
+{
+	if (!timing->running) {
+		*stats = timing->stats;
+		return;
+	}
+
+	syscalls_pthread_mutex_lock(&timing->lock);
+	*stats = timing->stats;
+	syscalls_pthread_mutex_unlock(&timing->lock);
+}
+
+
+void rtp_timing_log(struct rtp_timing *timing)
+{
+	struct rtp_timing_stats stats;
+
+	rtp_timing_get_stats(timing, &stats);
+
+	if (0 == stats.replies) {
+		INFO("Timing: %u requests, no replies, %u syncs sent\n",
+		     stats.requests_sent, stats.syncs_sent);
+		return;
+	}
+
+	INFO("Timing: offset %lld us (rtt %llu us), rtt min/mean/max "
+	     "%llu/%llu/%llu us over %u of %u requests, %u stale, "
+	     "%u answered, %u syncs sent\n",
+	     (long long)stats.offset_ns / 1000,
+	     (unsigned long long)stats.offset_rtt_ns / 1000,
+	     (unsigned long long)stats.rtt_min_ns / 1000,
+	     (unsigned long long)stats.rtt_total_ns / stats.replies / 1000,
+	     (unsigned long long)stats.rtt_max_ns / 1000,
+	     stats.replies, stats.requests_sent, stats.stale_replies,
+	     stats.requests_answered, stats.syncs_sent);
+}
@@ -0,0 +1,142 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef RTP_TIMING_H
+#define RTP_TIMING_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "utility.h"
+
+#define RTP_SAMPLE_RATE 44100
+
+/* Timing requests go out RTP_TIMING_BURST at a time, spaced
+ * RTP_TIMING_BURST_INTERVAL apart, when streaming starts; after that
+ * one every RTP_TIMING_INTERVAL. */
+#define RTP_TIMING_BURST 8
+#define RTP_TIMING_BURST_INTERVAL 20 /* miliseconds */
+#define RTP_TIMING_INTERVAL 3000 /* miliseconds */
+#define RTP_SYNC_INTERVAL 1000 /* miliseconds */
+/* Longest the timing thread sleeps before checking whether it has
+ * been stopped */
+#define RTP_TIMING_POLL 100 /* miliseconds */
+/* Exchanges the offset estimate is picked from: the one with the
+ * shortest round trip, as it had the least room for queueing on
+ * either leg to skew it. */
+#define RTP_TIMING_FILTER_LEN 8
+
+#define RTP_TIMING_PACKET_LEN 32
+#define RTP_SYNC_PACKET_LEN 20
+
+/* When the stream started playing by our clock, and how far behind
+ * it the servers are to play.  Each session normally has its own;
+ * sessions that play together share one, so that every server is
+ * told to play the same frame at the same moment.  The first session
+ * to write a packet after the clock was released sets it. */
+struct rtp_clock {
+	pthread_mutex_t lock;
+	utility_boolean_t anchored;
+	uint64_t anchor_ns;
+	uint32_t latency_frames;
+};
+
+struct rtp_timing_sample {
+	int64_t offset_ns;
+	uint64_t rtt_ns;
+};
+
+struct rtp_timing_stats {
+	unsigned int requests_sent;
+	unsigned int replies;
+	/* Replies to a request other than the last one sent */
+	unsigned int stale_replies;
+	/* Timing requests from the server, and sync packets sent */
+	unsigned int requests_answered;
+	unsigned int syncs_sent;
+
+	uint64_t rtt_min_ns;
+	uint64_t rtt_max_ns;
+	uint64_t rtt_total_ns;
+	/* Spread of the offsets measured by each exchange */
+	int64_t raw_offset_min_ns;
+	int64_t raw_offset_max_ns;
+
+	/* The server's clock less ours, and the round trip of the
+	 * exchange that estimate came from */
+	int64_t offset_ns;
+	uint64_t offset_rtt_ns;
+};
+
+/* The NTP-style clock exchange with one server, and the sync packets
+ * that tell it which RTP timestamp to play when.
+ *
+ * A thread owns the timing socket: it sends timing requests, works
+ * out the clock offset and round trip from the replies, and answers
+ * the server's own timing requests.  Once the stream is anchored it
+ * sends a sync packet on the control socket every
+ * RTP_SYNC_INTERVAL. */
+struct rtp_timing {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	volatile int running;
+
+	/* Both connected to the server's ports; the control socket
+	 * belongs to the caller */
+	int timing_fd;
+	int control_fd;
+	/* own_clock unless the session plays in a group */
+	struct rtp_clock *clock;
+	struct rtp_clock own_clock;
+	uint32_t latency_frames;
+
+	/* RTP timestamp of the first frame played from anchor_ns
+	 * (utility_time_ns()), as set on the clock */
+	utility_boolean_t anchored;
+	uint32_t anchor_rtp_time;
+	uint64_t anchor_ns;
+	uint64_t next_sync_ns;
+
+	uint64_t next_request_ns;
+	uint64_t last_request_ntp;
+	unsigned int burst_left;
+
+	struct rtp_timing_sample samples[RTP_TIMING_FILTER_LEN];
+	unsigned int num_samples;
+	struct rtp_timing_stats stats;
+};
+
+void rtp_clock_init(struct rtp_clock *clock, unsigned int latency_ms);
+void rtp_clock_destroy(struct rtp_clock *clock);
+utility_retcode_t rtp_timing_start(struct rtp_timing *timing,
+				   int timing_fd,
+				   int control_fd,
+				   unsigned int latency_ms,
+				   struct rtp_clock *clock);
+void rtp_timing_stop(struct rtp_timing *timing);
+void rtp_timing_anchor(struct rtp_timing *timing,
+		       uint32_t rtp_time,
+		       uint64_t now_ns);
+void rtp_timing_unanchor(struct rtp_timing *timing);
+void rtp_timing_get_stats(struct rtp_timing *timing,
+			  struct rtp_timing_stats *stats);
+void rtp_timing_log(struct rtp_timing *timing);
+uint64_t rtp_timing_ntp_now(void);
+uint64_t rtp_timing_ntp_to_ns(uint64_t ntp);
+
+#endif /* #ifndef RTP_TIMING_H */
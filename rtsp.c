@@ -24,6 +24,8 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "sdp.h"
 #include "encryption.h"
 #include "encoding.h"
+#include "probes.h"
+#include "perf_counters.h"
 
 #define DEFAULT_FACILITY LT_RTSP
 
@@ -235,12 +237,26 @@ utility_retcode_t create_user_agent_header(struct rtsp_request *request)
 utility_retcode_t create_transport_header(struct rtsp_request *request)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_session *session = request->session;
+	char value[128];
 
 	FUNC_ENTER;
 
+	if (RTP_TRANSPORT_UDP == session->server->transport) {
+		syscalls_snprintf(value, sizeof(value),
+				  "RTP/AVP/UDP;unicast;interleaved=0-1;"
+				  "mode=record;control_port=%u;timing_port=%u",
+				  (unsigned int)session->rtp_control_port,
+				  (unsigned int)session->rtp_timing_port);
+	} else {
+		syscalls_strncpy(value,
+				 "RTP/AVP/TCP;unicast;interleaved=0-1;mode=record",
+				 sizeof(value));
+	}
+
 	ret = add_rtsp_header(&request->headers,
 			      "Transport",
-			      "RTP/AVP/TCP;unicast;interleaved=0-1;mode=record",
+			      value,
 			      "Transport header");
 
 	FUNC_RETURN;
@@ -280,15 +296,22 @@ utility_retcode_t create_range_header(struct rtsp_request *request)
 }
 
 
+/* The sequence number and timestamp of the next packet to be sent */
 utility_retcode_t create_rtp_info_header(struct rtsp_request *request)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct audio_stream *audio_stream = &request->session->audio_stream;
+	char value[64];
 
 	FUNC_ENTER;
 
+	syscalls_snprintf(value, sizeof(value), "seq=%u;rtptime=%u",
+			  (unsigned int)audio_stream->rtp_seq,
+			  (unsigned int)audio_stream->rtp_time);
+
 	ret = add_rtsp_header(&request->headers,
 			      "RTP-Info",
-			      "seq=0;rtptime=0",
+			      value,
 			      "RTP-Info header");
 
 	FUNC_RETURN;
@@ -381,9 +404,12 @@ static utility_retcode_t add_blank_line(struct rtsp_request *request)
 utility_retcode_t build_request_string(struct rtsp_request *request)
 {
 	utility_retcode_t ret;
+	struct perf_sample perf_begin;
 
 	FUNC_ENTER;
 
+	perf_counters_read(&perf_begin);
+
 	if (NULL == request->buf) {
 		request->buf = syscalls_malloc(RTSP_MAX_REQUEST_LEN);
 		request->buflen = RTSP_MAX_REQUEST_LEN;
@@ -414,6 +440,8 @@ utility_retcode_t build_request_string(struct rtsp_request *request)
 
 	request->request_length = syscalls_strlen(request->buf);
 
+	perf_counters_site(PERF_SITE_RTSP_BUILD, &perf_begin);
+
 	ret = UTILITY_SUCCESS;
 out:
 	FUNC_RETURN;
@@ -533,6 +561,9 @@ utility_retcode_t init_rtsp_server(struct rtsp_server *server)
 	get_server_name(server->name, sizeof(server->name));
 	get_server_host(server->host, sizeof(server->host));
 	get_server_port(&server->port);
+	get_rtsp_pipelining(&server->pipelining);
+	get_rtp_transport(&server->transport);
+	get_playout_latency(&server->playout_latency_ms);
 
 	FUNC_RETURN;
 	return UTILITY_SUCCESS;
@@ -552,6 +583,9 @@ utility_retcode_t init_rtsp_session(struct rtsp_session *session,
 
 	session->client = client;
 	session->server = server;
+	session->control_fd = -1;
+	session->rtp_control_fd = -1;
+	session->rtp_timing_fd = -1;
 
 	ret = get_random_bytes(buf, sizeof(buf));
 	if (UTILITY_SUCCESS != ret) {
@@ -566,14 +600,7 @@ utility_retcode_t init_rtsp_session(struct rtsp_session *session,
 	syscalls_snprintf(session->url, MAX_URL_LEN, "rtsp://%s/%s",
 			  client->host, session->identifier);
 
-	ret = generate_aes_data(aes_data);
-	if (UTILITY_SUCCESS != ret) {
-		goto out;
-	}
-
-	raopd_rsa_encrypt_openssl(aes_data->key,
-				  RAOP_AES_KEY_LEN,
-				  aes_data->rsa_encrypted_key);
+	ret = take_aes_data(aes_data);
 
 out:
 	FUNC_RETURN;
@@ -589,7 +616,8 @@ utility_retcode_t clear_rtsp_request(struct rtsp_request *request)
 
 	utility_list_remove_all(&request->headers, header_destructor);
 
-	request->msg_body = '\0';
+	syscalls_free(request->msg_body);
+	request->msg_body = NULL;
 	request->msg_bodyp = request->msg_body;
 
 	FUNC_RETURN;
@@ -626,6 +654,26 @@ utility_retcode_t init_rtsp_request(struct rtsp_request *request,
 }
 
 
+/* Frees what building requests allocated; the request itself is the
+ * caller's. */
+utility_retcode_t destroy_rtsp_request(struct rtsp_request *request)
+{
+	FUNC_ENTER;
+
+	utility_list_remove_all(&request->headers, header_destructor);
+	utility_list_remove_all(&request->sdp_fields, header_destructor);
+
+	syscalls_free(request->msg_body);
+	syscalls_free(request->buf);
+	request->msg_body = NULL;
+	request->msg_bodyp = NULL;
+	request->buf = NULL;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
 utility_retcode_t clear_rtsp_response(struct rtsp_response *response)
 {
 	utility_retcode_t ret;
@@ -638,6 +686,9 @@ utility_retcode_t clear_rtsp_response(struct rtsp_response *response)
 	}
 
 	response->parsep = response->buf;
+	response->status_line.status_code = 0;
+	response->content_length = 0;
+	response->cseq = 0;
 
 	return ret;
 }
@@ -655,6 +706,23 @@ utility_retcode_t init_rtsp_response(struct rtsp_response *response,
 }
 
 
+/* Frees the buffers allocate_response_buffers() set up; the response
+ * itself is the caller's. */
+utility_retcode_t destroy_rtsp_response(struct rtsp_response *response)
+{
+	syscalls_free(response->current_header.value);
+	syscalls_free(response->current_header.name);
+	syscalls_free(response->tmpbuf);
+	syscalls_free(response->buf);
+	response->current_header.value = NULL;
+	response->current_header.name = NULL;
+	response->tmpbuf = NULL;
+	response->buf = NULL;
+
+	return UTILITY_SUCCESS;
+}
+
+
 static utility_retcode_t next_line(struct rtsp_response *response)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
@@ -790,6 +858,20 @@ static utility_retcode_t parse_content_length(struct rtsp_response *response)
 }
 
 
+static utility_retcode_t parse_cseq(struct rtsp_response *response)
+{
+	char *value = response->current_header.value;
+
+	FUNC_ENTER;
+
+	response->cseq = syscalls_strtoul(value, NULL, 0);
+	DEBG("Response CSeq is %u\n", response->cseq);
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
 static utility_retcode_t parse_apple_response(struct rtsp_response *response)
 {
 	FUNC_ENTER;
@@ -855,6 +937,7 @@ static utility_retcode_t parse_session(struct rtsp_response *response)
 
 static utility_retcode_t parse_transport(struct rtsp_response *response)
 {
+	struct rtsp_session *session = response->session;
 	char *value = response->current_header.value;
 	char *port_string;
 
@@ -863,10 +946,34 @@ static utility_retcode_t parse_transport(struct rtsp_response *response)
 	DEBG("value: \"%s\"\n", value);
 
 	port_string = begin_token(value, "server_port=");
+	if (NULL == port_string) {
+		ERRR("No server_port in Transport header \"%s\"\n", value);
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
+
+	session->port = syscalls_strtoul(port_string, NULL, 0);
+
+	INFO("Session IP port: %d\n", session->port);
 
-	response->session->port = syscalls_strtoul(port_string, NULL, 0);
+	port_string = begin_token(value, "control_port=");
+	if (NULL != port_string) {
+		session->server_control_port =
+			syscalls_strtoul(port_string, NULL, 0);
+	}
+
+	port_string = begin_token(value, "timing_port=");
+	if (NULL != port_string) {
+		session->server_timing_port =
+			syscalls_strtoul(port_string, NULL, 0);
+	}
 
-	INFO("Session IP port: %d\n", response->session->port);
+	if (RTP_TRANSPORT_UDP == session->server->transport &&
+	    NULL == begin_token(value, "RTP/AVP/UDP")) {
+		ERRR("Server didn't accept RTP over UDP: \"%s\"\n", value);
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
+	}
 
 	FUNC_RETURN;
 	return UTILITY_SUCCESS;
@@ -921,6 +1028,8 @@ static utility_retcode_t parse_one_header(struct rtsp_response *response)
 
 	if (0 == syscalls_strcmp(header_name, "Content-Length")) {
 		ret = parse_content_length(response);
+	} else if (0 == syscalls_strcmp(header_name, "CSeq")) {
+		ret = parse_cseq(response);
 	} else if (0 == syscalls_strcmp(header_name, "Apple-Response")) {
 		ret = parse_apple_response(response);
 	} else if (0 == syscalls_strcmp(header_name, "Audio-Jack-Status")) {
@@ -981,8 +1090,11 @@ failed:
 utility_retcode_t rtsp_parse_response(struct rtsp_response *response)
 {
 	utility_retcode_t ret;
+	struct perf_sample perf_begin;
 	FUNC_ENTER;
 
+	perf_counters_read(&perf_begin);
+
 	ret = parse_status_line(response);
 	if (UTILITY_SUCCESS != ret) {
 		ERRR("Failed to parse status line\n");
@@ -995,9 +1107,52 @@ utility_retcode_t rtsp_parse_response(struct rtsp_response *response)
 		goto out;
 	}
 
+	RAOPD_PROBE3(rtsp_response, response->session->identifier,
+		     response->status_line.status_code, response->cseq);
+
 	/* Here we will need to parse the message body, if any. */
 
+	perf_counters_site(PERF_SITE_RTSP_PARSE, &perf_begin);
+
 out:
 	FUNC_RETURN;
 	return ret;
 }
+
+
+/* Returns the length of the first complete RTSP message in the NUL
+ * terminated string buf, or 0 if more data is needed to complete it.
+ *
+ * RFC2326, §9.2 Reliability and Acknowledgements
+ *
+ * Unlike HTTP, an RTSP message MUST contain a Content-Length header
+ * whenever that message contains a payload. Otherwise, an RTSP packet
+ * is terminated with an empty line immediately following the last
+ * message header.
+ *
+ * This is called for every read on the control connection, so it
+ * does not log. */
+size_t rtsp_message_length(const char *buf)
+{
+	const char *end_headers, *content_length;
+	size_t header_len, body_len = 0;
+
+	end_headers = syscalls_strstr(buf, "\r\n\r\n");
+	if (NULL == end_headers) {
+		return 0;
+	}
+
+	header_len = (end_headers - buf) + sizeof("\r\n\r\n") - 1;
+
+	content_length = syscalls_strstr(buf, "\r\nContent-Length: ");
+	if (NULL != content_length && content_length < end_headers) {
+		content_length += sizeof("\r\nContent-Length: ") - 1;
+		body_len = syscalls_strtoul(content_length, NULL, 10);
+	}
+
+	if (syscalls_strlen(end_headers) - (sizeof("\r\n\r\n") - 1) < body_len) {
+		return 0;
+	}
+
+	return header_len + body_len;
+}
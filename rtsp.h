@@ -22,6 +22,8 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "utility.h"
 #include "encryption.h"
 #include "audio_stream.h"
+#include "timeline.h"
+#include "rtp_timing.h"
 
 struct rtsp_client {
 	char name[MAX_NAME_LEN];
@@ -41,6 +43,13 @@ struct rtsp_server {
 	short port;
 	struct rsa_data rsa_data;
 	int audio_jack_status;
+	/* Set if requests that don't depend on earlier responses may
+	 * be written without waiting for those responses.  Cleared if
+	 * the server rejects a pipelined request. */
+	utility_boolean_t pipelining;
+	rtp_transport_t transport;
+	/* Over UDP, see PLAYOUT_LATENCY */
+	unsigned int playout_latency_ms;
 };
 
 /* 
@@ -85,6 +94,8 @@ struct rtsp_status_line {
 	char *reason;
 };
 
+#define RTSP_STATUS_IS_SUCCESS(code) ((code) >= 200 && (code) < 300)
+
 struct rtsp_response {
 	struct rtsp_session *session;
 	char *buf;
@@ -97,6 +108,33 @@ struct rtsp_response {
 	char *parsep; /* used to track position when parsing */
 	struct key_value_pair current_header;
 	size_t content_length;
+	unsigned int cseq; /* 0 if the server did not send one */
+};
+
+typedef enum {
+	RTSP_HANDSHAKE_CONNECTING,
+	RTSP_HANDSHAKE_WRITING,
+	RTSP_HANDSHAKE_READING,
+	RTSP_HANDSHAKE_DONE,
+	RTSP_HANDSHAKE_FAILED
+} rtsp_handshake_state_t;
+
+#define RTSP_MAX_HANDSHAKE_STEPS 8
+
+/* Where a session is in the handshake that brings it up.  The
+ * handshake is driven from poll() so that one thread can bring up
+ * many sessions at once; see rtsp_handshake_continue(). */
+struct rtsp_handshake {
+	rtsp_handshake_state_t state;
+	struct rtsp_request *request;
+	struct rtsp_response *response;
+	int first_step; /* first step whose response is outstanding */
+	int next_step;  /* next step to be queued */
+	int responses_read;
+	uint64_t sent_ns; /* when the current group was written */
+	uint64_t progress_ns; /* when poll() last reported an event */
+	unsigned int cseq[RTSP_MAX_HANDSHAKE_STEPS];
+	int status[RTSP_MAX_HANDSHAKE_STEPS];
 };
 
 struct rtsp_session {
@@ -111,9 +149,51 @@ struct rtsp_session {
 	char url[MAX_URL_LEN];
 	short port;
 	int control_fd;
+	/* Data read from the control connection that has not yet been
+	 * handed out as a response.  Pipelined responses can arrive
+	 * in a single read. */
+	char recv_buf[RTSP_MAX_RESPONSE_LEN];
+	size_t recv_len;
+	/* Requests that have been built but not yet written. */
+	char send_buf[RTSP_MAX_QUEUED_REQUEST_LEN];
+	size_t send_len;
+	struct rtsp_handshake handshake;
 	unsigned int sequence_number;
 	struct aes_data aes_data;
 	struct audio_stream audio_stream;
+	/* Set once the audio connection is up; later tracks reuse it. */
+	utility_boolean_t streaming;
+	/* utility_time_ns() of the last exchange on the control
+	 * connection, for keepalives */
+	uint64_t last_request_ns;
+	struct timeline timeline;
+	/* RTP over UDP: the local control and timing ports offered in
+	 * SETUP, and the server's from its reply.  The server's data
+	 * port is port. */
+	int rtp_control_fd;
+	int rtp_timing_fd;
+	unsigned short rtp_control_port;
+	unsigned short rtp_timing_port;
+	unsigned short server_control_port;
+	unsigned short server_timing_port;
+	/* Clock exchange on the timing port and sync packets on the
+	 * control port, while streaming over UDP.  The sync packets are
+	 * timed from clock if the session plays in a group. */
+	struct rtp_timing timing;
+	struct rtp_clock *clock;
+};
+
+/* Sessions that play one source together.  They share one clock, so
+ * every server is told to play each frame at the same moment; what
+ * is left between rooms is how well each server knows our clock. */
+struct rtsp_group {
+	struct rtsp_session *sessions;
+	int num_sessions;
+	struct rtp_clock clock;
+	/* See AUDIO_FAN_OUT; may be cleared before the first track.
+	 * The source reads and converts for all the sessions. */
+	utility_boolean_t fan_out;
+	struct audio_stream source;
 };
 
 utility_retcode_t add_rtsp_header(struct utility_locked_list *list,
@@ -144,11 +224,14 @@ utility_retcode_t init_rtsp_session(struct rtsp_session *session,
 				    struct rtsp_client *client,
 				    struct rtsp_server *server);
 utility_retcode_t clear_rtsp_request(struct rtsp_request *request);
+utility_retcode_t destroy_rtsp_request(struct rtsp_request *request);
 utility_retcode_t init_rtsp_request(struct rtsp_request *request,
 				    struct rtsp_session *session);
 utility_retcode_t clear_rtsp_response(struct rtsp_response *response);
 utility_retcode_t init_rtsp_response(struct rtsp_response *response,
 				     struct rtsp_session *session);
+utility_retcode_t destroy_rtsp_response(struct rtsp_response *response);
 utility_retcode_t rtsp_parse_response(struct rtsp_response *response);
+size_t rtsp_message_length(const char *buf);
 
 #endif /* #ifndef RTSP_H */
@@ -16,6 +16,9 @@ for more details.
 You should have received a copy of the GNU General Public License
 along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 */
+#include <poll.h>
+#include <errno.h>
+
 #include "syscalls.h"
 #include "config.h"
 #include "utility.h"
@@ -25,6 +28,7 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "rtsp_client.h"
 #include "audio_stream.h"
 #include "sdp.h"
+#include "metrics.h"
 
 #define DEFAULT_FACILITY LT_RTSP_CLIENT
 
@@ -63,14 +67,14 @@ static utility_retcode_t finish_request(struct rtsp_request *request)
 		goto out;
 	}
 
-	ret = send_request(request);
+	ret = queue_request(request);
 	if (UTILITY_SUCCESS != ret) {
-		ERRR("Failed to send \"%s\" request.\n",
+		ERRR("Failed to queue \"%s\" request.\n",
 		     request->request_line.method);
 		goto out;
 	}
 
-	DEBG("Sent \"%s\" request successfully\n",
+	DEBG("Queued \"%s\" request successfully\n",
 	     request->request_line.method);
 
 out:
@@ -284,18 +288,45 @@ out:
 }
 
 
-
-/*
-utility_retcode_t send_options_request(struct rtsp_request *request)
+/* Tells the server to drop what it has buffered.  RTP-Info says
+ * where the stream picks up, so the next track can follow straight
+ * on over the same connections. */
+static utility_retcode_t send_flush_request(struct rtsp_request *request)
 {
 	utility_retcode_t ret;
 
 	FUNC_ENTER;
 
-	DEBG("Starting to send OPTIONS request\n");
+	ret = begin_request(request, "FLUSH");
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
 
-	ret = begin_request(request, "OPTIONS");
+	syscalls_strncpy(request->request_line.uri,
+			 request->session->url,
+			 sizeof(request->request_line.uri));
+
+	ret = create_session_header(request);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Could not create Session header\n");
+		goto out;
+	}
+
+	ret = create_rtp_info_header(request);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Could not create RTP-Info header\n");
+		goto out;
+	}
+
+	ret = create_user_agent_header(request);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Could not create User-Agent header\n");
+		goto out;
+	}
+
+	ret = create_client_instance_header(request);
 	if (UTILITY_SUCCESS != ret) {
+		ERRR("Could not create Client-Instance header\n");
 		goto out;
 	}
 
@@ -305,159 +336,1409 @@ out:
 	FUNC_RETURN;
 	return ret;
 }
-*/
 
-static utility_retcode_t read_rtsp_response(struct rtsp_response *response)
+
+/* Keeps an idle control connection from being dropped. */
+static utility_retcode_t send_options_request(struct rtsp_request *request)
 {
 	utility_retcode_t ret;
 
 	FUNC_ENTER;
 
-	clear_rtsp_response(response);
+	ret = begin_request(request, "OPTIONS");
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
 
-	ret = read_response(response);
+	syscalls_strncpy(request->request_line.uri, "*",
+			 sizeof(request->request_line.uri));
+
+	ret = create_user_agent_header(request);
 	if (UTILITY_SUCCESS != ret) {
-		ERRR("Failed to read response from server \"%s\"\n",
-			response->session->server->name);
-	} else {
-		ret = rtsp_parse_response(response);
+		ERRR("Could not create User-Agent header\n");
+		goto out;
+	}
+
+	ret = create_client_instance_header(request);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Could not create Client-Instance header\n");
+		goto out;
 	}
 
+	ret = finish_request(request);
+
+out:
 	FUNC_RETURN;
 	return ret;
 }
 
-utility_retcode_t rtsp_start_client(struct rtsp_session *session)
+
+/* Sends one request on a session whose handshake is done and waits
+ * for the response. */
+static utility_retcode_t rtsp_transact(struct rtsp_session *session,
+				       utility_retcode_t (*send)(struct rtsp_request *request))
 {
 	utility_retcode_t ret;
-	struct rtsp_client *client;
-	struct rtsp_server *server;
-	struct rtsp_request *request;
-	struct rtsp_response *response;
+	struct rtsp_request *request = session->handshake.request;
+	struct rtsp_response *response = session->handshake.response;
+	uint64_t start;
 
 	FUNC_ENTER;
 
-	INFO("Starting RTSP client\n");
-
-	client = syscalls_malloc(sizeof(*client));
-	server = syscalls_malloc(sizeof(*server));
-	request = syscalls_malloc(sizeof(*request));
-	response = syscalls_malloc(sizeof(*response));
-
-	init_rtsp_client(client);
-
-	ret = init_rtsp_server(server);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to initialize server\n");
+	ret = send(request);
+	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
-	init_rtsp_session(session, client, server);
-	init_rtsp_request(request, session);
-	init_rtsp_response(response, session);
-
-	INFO("Connecting to server \"%s\"\n", server->name);
+	start = utility_time_ns();
 
-	ret = connect_server(session);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to connect to server \"%s\"\n", server->name);
+	ret = flush_requests(session);
+	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
-	/*
-	send_options_request(request);
-	read_rtsp_response(response);
-	*/
-
-	ret = send_announce_request(request);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to send ANNOUNCE request to server \"%s\"\n",
-		     server->name);
+	ret = clear_rtsp_response(response);
+	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
-	ret = read_rtsp_response(response);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to read ANNOUNCE response from server \"%s\"\n",
-		     server->name);
+	ret = read_response(response);
+	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
-	ret = send_setup_request(request);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to send SETUP request to server \"%s\"\n",
-		     server->name);
+	ret = rtsp_parse_response(response);
+	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
-	ret = read_rtsp_response(response);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to read SETUP response from server \"%s\"\n",
-		     server->name);
-		goto out;
+	session->last_request_ns = utility_time_ns();
+	metrics_observe_ns(METRIC_RTSP_RTT, session->last_request_ns - start);
+
+	if (!RTSP_STATUS_IS_SUCCESS(response->status_line.status_code)) {
+		ERRR("Server \"%s\" refused %s request (status %d)\n",
+		     session->server->name, request->request_line.method,
+		     response->status_line.status_code);
+		ret = UTILITY_FAILURE;
 	}
 
-	ret = send_record_request(request);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to send RECORD request to server \"%s\"\n",
-		     server->name);
-		goto out;
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+struct handshake_step {
+	const char *method;
+	utility_retcode_t (*send)(struct rtsp_request *request);
+	/* Set if the request uses something from an earlier response,
+	 * e.g. the Session header returned by SETUP, so it can't be
+	 * queued until all outstanding responses have been read. */
+	utility_boolean_t needs_responses;
+	timeline_milestone_t sent;
+	timeline_milestone_t replied;
+};
+
+static const struct handshake_step handshake_steps[] = {
+	{ "ANNOUNCE", send_announce_request, UTILITY_FALSE,
+	  TIMELINE_ANNOUNCE_SENT, TIMELINE_ANNOUNCE_REPLIED },
+	{ "SETUP", send_setup_request, UTILITY_FALSE,
+	  TIMELINE_SETUP_SENT, TIMELINE_SETUP_REPLIED },
+	{ "RECORD", send_record_request, UTILITY_TRUE,
+	  TIMELINE_RECORD_SENT, TIMELINE_RECORD_REPLIED },
+	{ "SET_PARAMETER", send_volume_request, UTILITY_FALSE,
+	  TIMELINE_SET_PARAMETER_SENT, TIMELINE_SET_PARAMETER_REPLIED },
+};
+
+#define NUM_HANDSHAKE_STEPS \
+	(int)(sizeof(handshake_steps) / sizeof(handshake_steps[0]))
+
+
+/* Queues the next group of requests.  When the server takes
+ * pipelined requests, a group is every request up to the next one
+ * that needs the responses to the ones before it; otherwise it is a
+ * single request. */
+static utility_retcode_t queue_handshake_group(struct rtsp_session *session)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_handshake *handshake = &session->handshake;
+	int step;
+
+	FUNC_ENTER;
+
+	handshake->first_step = handshake->next_step;
+	handshake->responses_read = 0;
+
+	do {
+		step = handshake->next_step;
+
+		ret = handshake_steps[step].send(handshake->request);
+		if (UTILITY_FAILURE == ret) {
+			ERRR("Failed to send %s request to server \"%s\"\n",
+			     handshake_steps[step].method,
+			     session->server->name);
+			goto out;
+		}
+
+		handshake->cseq[step] = session->sequence_number;
+		handshake->status[step] = 0;
+		handshake->next_step++;
+
+	} while (session->server->pipelining &&
+		 handshake->next_step < NUM_HANDSHAKE_STEPS &&
+		 !handshake_steps[handshake->next_step].needs_responses);
+
+	DEBG("%d requests queued to server \"%s\"\n",
+	     handshake->next_step - handshake->first_step,
+	     session->server->name);
+
+	handshake->state = RTSP_HANDSHAKE_WRITING;
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Finds the outstanding request that a response answers.  Servers
+ * that don't echo CSeq are assumed to answer in order. */
+static int match_response(struct rtsp_handshake *handshake)
+{
+	struct rtsp_response *response = handshake->response;
+	int i;
+
+	FUNC_ENTER;
+
+	for (i = handshake->first_step ; i < handshake->next_step ; i++) {
+		if (0 != handshake->status[i]) {
+			continue;
+		}
+
+		if (0 == response->cseq || handshake->cseq[i] == response->cseq) {
+			handshake->status[i] = response->status_line.status_code;
+			FUNC_RETURN;
+			return i;
+		}
 	}
 
-	ret = read_rtsp_response(response);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to read RECORD response from server \"%s\"\n",
-		     server->name);
-		goto out;
+	FUNC_RETURN;
+	return -1;
+}
+
+
+/* Called once every response to the current group has been read. */
+static utility_retcode_t finish_handshake_group(struct rtsp_session *session)
+{
+	struct rtsp_handshake *handshake = &session->handshake;
+	int i;
+
+	FUNC_ENTER;
+
+	/* The first request of each group was written after every
+	 * earlier response had been read, so if it was refused, the
+	 * server refused the request itself. */
+	i = handshake->first_step;
+	if (!RTSP_STATUS_IS_SUCCESS(handshake->status[i])) {
+		ERRR("Server \"%s\" refused %s request (status %d)\n",
+		     session->server->name, handshake_steps[i].method,
+		     handshake->status[i]);
+		FUNC_RETURN;
+		return UTILITY_FAILURE;
 	}
 
-	ret = send_volume_request(request);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to send SET_PARAMETERS (volume) request to server \"%s\"\n",
-		     server->name);
-		goto out;
+	/* Only the ones after it can have been refused for being
+	 * pipelined. */
+	for (i = handshake->first_step + 1 ; i < handshake->next_step ; i++) {
+		if (!RTSP_STATUS_IS_SUCCESS(handshake->status[i])) {
+			WARN("Server \"%s\" refused pipelined %s request "
+			     "(status %d), sending one request at a time\n",
+			     session->server->name, handshake_steps[i].method,
+			     handshake->status[i]);
+			session->server->pipelining = UTILITY_FALSE;
+			handshake->next_step = i;
+			break;
+		}
 	}
 
-	ret = read_rtsp_response(response);
-	if (UTILITY_FAILURE == ret) {
-		ERRR("Failed to read SET_PARAMETERS response from server \"%s\"\n",
-		     server->name);
+	if (handshake->next_step < NUM_HANDSHAKE_STEPS) {
+		FUNC_RETURN;
+		return queue_handshake_group(session);
+	}
+
+	INFO("Handshake with server \"%s\" complete\n", session->server->name);
+
+	session->last_request_ns = utility_time_ns();
+
+	handshake->state = RTSP_HANDSHAKE_DONE;
+
+	/* Everything after the handshake uses the control connection
+	 * one request at a time. */
+	FUNC_RETURN;
+	return set_fd_blocking(session->control_fd, UTILITY_TRUE);
+}
+
+
+static utility_retcode_t read_handshake_responses(struct rtsp_session *session)
+{
+	utility_retcode_t ret;
+	struct rtsp_handshake *handshake = &session->handshake;
+	struct rtsp_response *response = handshake->response;
+	int step;
+
+	FUNC_ENTER;
+
+	ret = fill_response_buffer(session);
+	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
+	while (handshake->responses_read <
+	       handshake->next_step - handshake->first_step) {
+
+		ret = clear_rtsp_response(response);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+
+		if (UTILITY_FALSE == take_response(response)) {
+			/* Wait for more data */
+			goto out;
+		}
+
+		ret = rtsp_parse_response(response);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+
+		step = match_response(handshake);
+		if (step < 0) {
+			ERRR("Server \"%s\" sent a response (CSeq %u) "
+			     "to a request that was not outstanding\n",
+			     session->server->name, response->cseq);
+			ret = UTILITY_FAILURE;
+			goto out;
+		}
+
+		DEBG("Matched response to %s request (CSeq %u)\n",
+		     handshake_steps[step].method, handshake->cseq[step]);
+
+		timeline_mark(&session->timeline, handshake_steps[step].replied);
+		metrics_observe_ns(METRIC_RTSP_RTT,
+				   utility_time_ns() - handshake->sent_ns);
+
+		handshake->responses_read++;
+	}
+
+	ret = finish_handshake_group(session);
+
 out:
 	FUNC_RETURN;
 	return ret;
 }
 
 
-utility_retcode_t rtsp_send_data(struct rtsp_session *session)
+/* The poll events a session is waiting for, or 0 if its handshake is
+ * over. */
+short rtsp_handshake_events(struct rtsp_session *session)
+{
+	switch (session->handshake.state) {
+	case RTSP_HANDSHAKE_CONNECTING:
+	case RTSP_HANDSHAKE_WRITING:
+		return POLLOUT;
+	case RTSP_HANDSHAKE_READING:
+		return POLLIN;
+	case RTSP_HANDSHAKE_DONE:
+	case RTSP_HANDSHAKE_FAILED:
+	default:
+		return 0;
+	}
+}
+
+
+/* Moves a session's handshake along as far as it can go without
+ * blocking, given the events poll() reported on its control fd. */
+utility_retcode_t rtsp_handshake_continue(struct rtsp_session *session,
+					  short revents)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_handshake *handshake = &session->handshake;
+	int i;
 
 	FUNC_ENTER;
 
-	DEBG("Connecting to host \"%s\" port %d\n",
-	     session->server->host, session->port);
+	handshake->progress_ns = utility_time_ns();
+
+	if (revents & (POLLERR | POLLHUP | POLLNVAL) &&
+	    RTSP_HANDSHAKE_READING != handshake->state) {
+		/* For a connection in progress, finish_connect()
+		 * reports why. */
+		revents |= POLLOUT;
+	}
+
+	switch (handshake->state) {
+	case RTSP_HANDSHAKE_CONNECTING:
+		if (!(revents & POLLOUT)) {
+			break;
+		}
+
+		ret = finish_connect(session->control_fd);
+		if (UTILITY_SUCCESS != ret) {
+			ERRR("Failed to connect to server \"%s\"\n",
+			     session->server->name);
+			break;
+		}
+
+		timeline_mark(&session->timeline, TIMELINE_TCP_CONNECTED);
+
+		ret = queue_handshake_group(session);
+		break;
+
+	case RTSP_HANDSHAKE_WRITING:
+		if (!(revents & POLLOUT)) {
+			break;
+		}
+
+		ret = write_requests(session);
+		if (UTILITY_SUCCESS != ret || 0 != session->send_len) {
+			break;
+		}
+
+		for (i = handshake->first_step ; i < handshake->next_step ; i++) {
+			timeline_mark(&session->timeline,
+				      handshake_steps[i].sent);
+		}
+
+		handshake->sent_ns = utility_time_ns();
+		handshake->state = RTSP_HANDSHAKE_READING;
+		break;
+
+	case RTSP_HANDSHAKE_READING:
+		if (!(revents & (POLLIN | POLLERR | POLLHUP))) {
+			break;
+		}
+
+		ret = read_handshake_responses(session);
+		break;
+
+	case RTSP_HANDSHAKE_DONE:
+	case RTSP_HANDSHAKE_FAILED:
+	default:
+		break;
+	}
+
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Handshake with server \"%s\" failed\n",
+		     session->server->name);
+		handshake->state = RTSP_HANDSHAKE_FAILED;
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+static void close_rtp_ports(struct rtsp_session *session)
+{
+	/* The timing thread writes to both */
+	rtp_timing_stop(&session->timing);
+	session->audio_stream.timing = NULL;
+	session->audio_stream.rtp_control_fd = -1;
+
+	if (session->rtp_control_fd >= 0) {
+		syscalls_close(session->rtp_control_fd);
+		session->rtp_control_fd = -1;
+	}
+
+	if (session->rtp_timing_fd >= 0) {
+		syscalls_close(session->rtp_timing_fd);
+		session->rtp_timing_fd = -1;
+	}
+}
+
+
+/* Opens the control and timing ports to offer in SETUP. */
+static utility_retcode_t open_rtp_ports(struct rtsp_session *session)
+{
+	utility_retcode_t ret;
 
-	ret = connect_to_port(session->server->host,
-			      session->port,
-			      &session->audio_stream.session_fd);
+	FUNC_ENTER;
 
+	ret = open_udp_port(&session->rtp_control_fd,
+			    &session->rtp_control_port);
 	if (UTILITY_SUCCESS != ret) {
 		goto out;
 	}
 
-	if (UTILITY_SUCCESS != init_audio_stream(&session->audio_stream)) {
-		ERRR("Failed to initialized audio stream\n");
+	ret = open_udp_port(&session->rtp_timing_fd,
+			    &session->rtp_timing_port);
+	if (UTILITY_SUCCESS != ret) {
+		close_rtp_ports(session);
+	}
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Sets a session up and starts connecting to its server. */
+utility_retcode_t rtsp_handshake_begin(struct rtsp_session *session,
+				       struct rtsp_server *server)
+{
+	utility_retcode_t ret, init_ret;
+	struct rtsp_client *client;
+	struct rtsp_request *request;
+	struct rtsp_response *response;
+	uint64_t start;
+
+	FUNC_ENTER;
+
+	start = utility_time_ns();
+
+	client = syscalls_malloc(sizeof(*client));
+	request = syscalls_malloc(sizeof(*request));
+	response = syscalls_malloc(sizeof(*response));
+
+	if (NULL == client || NULL == request || NULL == response) {
+		ERRR("Failed to allocate memory for session with "
+		     "server \"%s\"\n", server->name);
+		syscalls_free(client);
+		syscalls_free(request);
+		syscalls_free(response);
+
+		/* Enough for rtsp_end_session() */
+		syscalls_memset(session, 0, sizeof(*session));
+		session->server = server;
+		session->control_fd = -1;
+		session->rtp_control_fd = -1;
+		session->rtp_timing_fd = -1;
+		session->handshake.state = RTSP_HANDSHAKE_FAILED;
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	init_ret = init_rtsp_client(client);
+
+	ret = init_rtsp_session(session, client, server);
+	if (UTILITY_SUCCESS != init_ret) {
+		ret = init_ret;
+	}
+
+	init_rtsp_request(request, session);
+	init_rtsp_response(response, session);
+
+	/* Count the time taken to set the session up, keys included */
+	session->timeline.at[TIMELINE_SESSION_START] = start;
+
+	session->handshake.request = request;
+	session->handshake.response = response;
+	session->handshake.state = RTSP_HANDSHAKE_CONNECTING;
+	session->handshake.progress_ns = start;
+
+	/* Both fail if the random source does, leaving the session
+	 * with no challenge or no keys */
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Failed to set up session with server \"%s\"\n",
+		     server->name);
+		session->handshake.state = RTSP_HANDSHAKE_FAILED;
 		goto out;
 	}
 
-	send_audio_stream(&session->audio_stream,
-			  &session->aes_data);
+	if (RTP_TRANSPORT_UDP == server->transport) {
+		ret = open_rtp_ports(session);
+		if (UTILITY_SUCCESS != ret) {
+			session->handshake.state = RTSP_HANDSHAKE_FAILED;
+			goto out;
+		}
+	}
+
+	INFO("Connecting to server \"%s\"\n", server->name);
+
+	ret = connect_server(session);
+	if (UTILITY_FAILURE == ret) {
+		ERRR("Failed to connect to server \"%s\"\n", server->name);
+		session->handshake.state = RTSP_HANDSHAKE_FAILED;
+	}
 
 out:
 	FUNC_RETURN;
 	return ret;
 }
 
+
+/* Fails the handshake if it has gone RTSP_HANDSHAKE_TIMEOUT ms
+ * without an event, otherwise returns how many ms it has left. */
+static int handshake_time_left(struct rtsp_session *session, uint64_t now)
+{
+	struct rtsp_handshake *handshake = &session->handshake;
+	uint64_t idle_ms;
+
+	idle_ms = (now - handshake->progress_ns) / 1000000;
+	if (idle_ms < RTSP_HANDSHAKE_TIMEOUT) {
+		return RTSP_HANDSHAKE_TIMEOUT - (int)idle_ms;
+	}
+
+	ERRR("Handshake with server \"%s\" made no progress for %d ms\n",
+	     session->server->name, RTSP_HANDSHAKE_TIMEOUT);
+	handshake->state = RTSP_HANDSHAKE_FAILED;
+
+	return 0;
+}
+
+
+/* Brings up num sessions, the nth with the nth server, from one
+ * thread.  Returns UTILITY_SUCCESS only if every handshake
+ * completed; each session's handshake.state says how it went.  A
+ * session that goes RTSP_HANDSHAKE_TIMEOUT ms without progress fails
+ * on its own, however busy the others are. */
+utility_retcode_t rtsp_start_sessions(struct rtsp_session *sessions,
+				      struct rtsp_server *servers,
+				      int num)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct pollfd *pfds;
+	int i, num_pending, poll_ret, timeout, left;
+	uint64_t now;
+
+	FUNC_ENTER;
+
+	pfds = syscalls_malloc(num * sizeof(*pfds));
+	if (NULL == pfds) {
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	for (i = 0 ; i < num ; i++) {
+		rtsp_handshake_begin(&sessions[i], &servers[i]);
+	}
+
+	for (;;) {
+		num_pending = 0;
+		timeout = RTSP_HANDSHAKE_TIMEOUT;
+		now = utility_time_ns();
+
+		for (i = 0 ; i < num ; i++) {
+			pfds[i].fd = sessions[i].control_fd;
+			pfds[i].events = rtsp_handshake_events(&sessions[i]);
+			pfds[i].revents = 0;
+
+			if (0 != pfds[i].events) {
+				left = handshake_time_left(&sessions[i], now);
+				if (0 == left) {
+					pfds[i].events = 0;
+				} else if (left < timeout) {
+					timeout = left;
+				}
+			}
+
+			if (0 == pfds[i].events) {
+				/* poll() ignores negative fds */
+				pfds[i].fd = -1;
+			} else {
+				num_pending++;
+			}
+		}
+
+		if (0 == num_pending) {
+			break;
+		}
+
+		/* Wake up in time to fail the oldest handshake */
+		poll_ret = syscalls_poll(pfds, num, timeout);
+		if (poll_ret < 0 && EINTR != errno) {
+			ERRR("Poll on control connections failed: %s\n",
+			     strerror(errno));
+			break;
+		}
+
+		for (i = 0 ; poll_ret > 0 && i < num ; i++) {
+			if (0 != pfds[i].revents) {
+				rtsp_handshake_continue(&sessions[i],
+							pfds[i].revents);
+			}
+		}
+	}
+
+	for (i = 0 ; i < num ; i++) {
+		if (RTSP_HANDSHAKE_DONE != sessions[i].handshake.state) {
+			sessions[i].handshake.state = RTSP_HANDSHAKE_FAILED;
+			metrics_add(METRIC_HANDSHAKE_FAILURES, 1);
+			ret = UTILITY_FAILURE;
+		}
+	}
+
+	syscalls_free(pfds);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Logs how long each step of bringing the session up took, as a
+ * table and as one line of JSON for scripts. */
+void rtsp_log_timeline(struct rtsp_session *session)
+{
+	char json[TIMELINE_MAX_JSON_LEN];
+
+	INFO("Startup timeline for session %s with server \"%s\":\n",
+	     session->identifier, session->server->name);
+
+	timeline_log(&session->timeline, session->identifier);
+
+	if (UTILITY_SUCCESS == timeline_to_json(&session->timeline,
+						session->identifier,
+						json, sizeof(json))) {
+		INFO("timeline: %s\n", json);
+	}
+}
+
+
+/* Runs the handshake with a server that has already been initialized,
+ * so callers can pick the server. */
+utility_retcode_t rtsp_start_session(struct rtsp_session *session,
+				     struct rtsp_server *server)
+{
+	return rtsp_start_sessions(session, server, 1);
+}
+
+
+utility_retcode_t rtsp_start_client(struct rtsp_session *session)
+{
+	utility_retcode_t ret;
+	struct rtsp_server *server;
+
+	FUNC_ENTER;
+
+	INFO("Starting RTSP client\n");
+
+	server = syscalls_malloc(sizeof(*server));
+
+	ret = init_rtsp_server(server);
+	if (UTILITY_FAILURE == ret) {
+		ERRR("Failed to initialize server\n");
+		goto out;
+	}
+
+	ret = rtsp_start_session(session, server);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Makes the server drop what it has buffered.  Sync packets stop
+ * until the next packet written anchors the stream again. */
+static utility_retcode_t flush_stream(struct rtsp_session *session)
+{
+	struct audio_stream *audio_stream = &session->audio_stream;
+
+	if (NULL != audio_stream->timing) {
+		rtp_timing_unanchor(audio_stream->timing);
+		audio_stream->reanchor = UTILITY_TRUE;
+	}
+	audio_stream->marker = UTILITY_TRUE;
+
+	return rtsp_transact(session, send_flush_request);
+}
+
+
+/* Sends the current track.  If it stops for a pause or a seek, a
+ * FLUSH makes the server drop what it has buffered; after a seek the
+ * track carries on from the new position. */
+static utility_retcode_t send_track(struct rtsp_session *session)
+{
+	utility_retcode_t ret;
+	struct audio_stream *audio_stream = &session->audio_stream;
+	uint64_t frame;
+
+	for (;;) {
+		ret = send_audio_track(audio_stream, &session->aes_data);
+		if (UTILITY_SUCCESS != ret || !audio_stream->paused) {
+			goto out;
+		}
+
+		if (__atomic_load_n(&audio_stream->seek_requested,
+				    __ATOMIC_ACQUIRE)) {
+			audio_stream->restart_ns = utility_time_ns();
+		}
+
+		DEBG("Stopped at seq %u rtptime %u\n",
+		     audio_stream->rtp_seq, audio_stream->rtp_time);
+
+		ret = flush_stream(session);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+
+		/* Clearing the flag as it is read keeps a seek that
+		 * comes in meanwhile */
+		if (__atomic_exchange_n(&audio_stream->seek_requested, 0,
+					__ATOMIC_ACQUIRE)) {
+			frame = __atomic_load_n(&audio_stream->seek_frame,
+						__ATOMIC_RELAXED);
+			ret = seek_audio_track(audio_stream, frame);
+			if (UTILITY_SUCCESS != ret) {
+				goto out;
+			}
+		}
+
+		if (__atomic_exchange_n(&audio_stream->pause_requested, 0,
+					__ATOMIC_ACQUIRE)) {
+			goto out;
+		}
+	}
+
+out:
+	return ret;
+}
+
+
+/* Gets a session ready to send a track, NULL meaning the PCM file
+ * from the config.  The first track connects the audio stream.
+ * Later ones go over the same control and audio connections after a
+ * FLUSH, so there is no handshake between tracks.  The PCM file is
+ * only opened if open_track is set; a group fanning the track out
+ * reads it once, from its source. */
+static utility_retcode_t begin_track(struct rtsp_session *session,
+				     const char *pcm_file,
+				     utility_boolean_t open_track)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct audio_stream *audio_stream = &session->audio_stream;
+	char name[FLIGHT_SESSION_LEN];
+
+	FUNC_ENTER;
+
+	if (session->streaming) {
+		if (audio_stream->paused) {
+			/* Already flushed when it paused */
+			close_audio_track(audio_stream);
+		} else {
+			DEBG("Flushing for next track at seq %u rtptime %u\n",
+			     audio_stream->rtp_seq, audio_stream->rtp_time);
+
+			ret = flush_stream(session);
+			if (UTILITY_SUCCESS != ret) {
+				goto out;
+			}
+		}
+
+		if (open_track) {
+			ret = open_audio_track(audio_stream, pcm_file);
+		}
+		goto out;
+	}
+
+	DEBG("Connecting to host \"%s\" port %d\n",
+	     session->server->host, session->port);
+
+	if (RTP_TRANSPORT_UDP == session->server->transport) {
+		ret = connect_udp_port(session->server->host,
+				       session->port,
+				       &audio_stream->session_fd);
+		audio_stream->rtp_over_udp = UTILITY_TRUE;
+	} else {
+		ret = connect_to_port(session->server->host,
+				      session->port,
+				      &audio_stream->session_fd);
+	}
+
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	timeline_mark(&session->timeline, TIMELINE_AUDIO_CONNECTED);
+	audio_stream->timeline = &session->timeline;
+
+	syscalls_snprintf(name, sizeof(name), "%s:%u %s", session->server->host,
+			  (unsigned short)session->server->port,
+			  session->identifier);
+	audio_stream->recorder = flight_recorder_open(name);
+	audio_stream->latency = stage_latency_open(name, STAGE_PATH_RAOPD);
+	audio_stream->session_id = session->identifier;
+
+	ret = init_audio_stream(audio_stream);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Failed to initialized audio stream\n");
+		goto out;
+	}
+
+	if (open_track) {
+		ret = open_audio_track(audio_stream, pcm_file);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+	}
+
+	/* Resend requests come from the server's control port */
+	if (audio_stream->rtp_over_udp && 0 != session->server_control_port &&
+	    UTILITY_SUCCESS == connect_udp_fd(session->rtp_control_fd,
+					      session->server->host,
+					      session->server_control_port)) {
+		audio_stream->rtp_control_fd = session->rtp_control_fd;
+	}
+
+	/* Sync packets need the control port too */
+	if (audio_stream->rtp_control_fd >= 0 &&
+	    0 != session->server_timing_port &&
+	    UTILITY_SUCCESS == connect_udp_fd(session->rtp_timing_fd,
+					      session->server->host,
+					      session->server_timing_port) &&
+	    UTILITY_SUCCESS ==
+	    rtp_timing_start(&session->timing,
+			     session->rtp_timing_fd,
+			     session->rtp_control_fd,
+			     session->server->playout_latency_ms,
+			     session->clock)) {
+		audio_stream->timing = &session->timing;
+		audio_stream->reanchor = UTILITY_TRUE;
+	}
+
+	begin_audio_stream_debug();
+
+	ret = initialize_aes(&session->aes_data);
+	if (UTILITY_SUCCESS != ret) {
+		ERRR("Failed to initialize AES data\n");
+		goto out;
+	}
+
+	session->streaming = UTILITY_TRUE;
+	metrics_gauge_add(METRIC_STREAMS, 1);
+
+out:
+	if (!session->streaming) {
+		flight_recorder_close(audio_stream->recorder);
+		audio_stream->recorder = NULL;
+		stage_latency_close(audio_stream->latency);
+		audio_stream->latency = NULL;
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Plays one track, NULL meaning the PCM file from the config (see
+ * begin_track()).  Returns once the track has been sent, or once it
+ * has paused (see rtsp_request_pause()); call rtsp_end_session()
+ * after the last one. */
+utility_retcode_t rtsp_play_track(struct rtsp_session *session,
+				  const char *pcm_file)
+{
+	utility_retcode_t ret;
+
+	FUNC_ENTER;
+
+	ret = begin_track(session, pcm_file, UTILITY_TRUE);
+	if (UTILITY_SUCCESS == ret) {
+		ret = send_track(session);
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Plays the tracks back to back as one stream: no FLUSH between
+ * them, and a track that ends part way through a packet is joined to
+ * the start of the next in that packet.  The next track is opened and
+ * read while the current one plays. */
+utility_retcode_t rtsp_play_playlist(struct rtsp_session *session,
+				     const char * const *pcm_files,
+				     int num_files)
+{
+	struct audio_stream *audio_stream = &session->audio_stream;
+	utility_retcode_t ret;
+
+	FUNC_ENTER;
+
+	DEBG("Playing %d tracks without gaps\n", num_files);
+
+	audio_stream->playlist = pcm_files + 1;
+	audio_stream->playlist_len = num_files - 1;
+	audio_stream->playlist_next = 0;
+
+	ret = rtsp_play_track(session, pcm_files[0]);
+
+	audio_stream->playlist = NULL;
+	audio_stream->playlist_len = 0;
+	audio_stream->playlist_next = 0;
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Asks the track being played to pause after the packet it is
+ * writing.  Safe to call from another thread or a signal handler;
+ * rtsp_play_track() then returns with the stream paused. */
+void rtsp_request_pause(struct rtsp_session *session)
+{
+	__atomic_store_n(&session->audio_stream.pause_requested, 1,
+			 __ATOMIC_RELEASE);
+}
+
+
+/* Asks the track being played to move to frame (see
+ * seek_audio_track()).  Like rtsp_request_pause(), safe from another
+ * thread or a signal handler. */
+void rtsp_request_seek(struct rtsp_session *session, uint64_t frame)
+{
+	__atomic_store_n(&session->audio_stream.seek_frame, frame,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&session->audio_stream.seek_requested, 1,
+			 __ATOMIC_RELEASE);
+}
+
+
+/* Moves a paused track to frame; rtsp_resume() plays from there. */
+utility_retcode_t rtsp_seek(struct rtsp_session *session, uint64_t frame)
+{
+	utility_retcode_t ret = UTILITY_FAILURE;
+
+	FUNC_ENTER;
+
+	if (!session->audio_stream.paused) {
+		WARN("Seek without a paused track\n");
+		goto out;
+	}
+
+	ret = seek_audio_track(&session->audio_stream, frame);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Picks a paused track up where it stopped.  The packets that were
+ * queued when it paused are already encrypted, so they go out as
+ * soon as the server has the RECORD.  Returns like
+ * rtsp_play_track(). */
+utility_retcode_t rtsp_resume(struct rtsp_session *session)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct audio_stream *audio_stream = &session->audio_stream;
+
+	FUNC_ENTER;
+
+	if (!audio_stream->paused) {
+		WARN("Resume without a paused track\n");
+		goto out;
+	}
+
+	audio_stream->restart_ns = utility_time_ns();
+
+	DEBG("Resuming at seq %u rtptime %u\n",
+	     audio_stream->rtp_seq, audio_stream->rtp_time);
+
+	ret = rtsp_transact(session, send_record_request);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	ret = send_track(session);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Sends OPTIONS if nothing has gone over the control connection for
+ * RTSP_KEEPALIVE_INTERVAL ms. */
+utility_retcode_t rtsp_keepalive(struct rtsp_session *session)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+
+	FUNC_ENTER;
+
+	if (utility_time_ns() - session->last_request_ns >=
+	    (uint64_t)RTSP_KEEPALIVE_INTERVAL * 1000000) {
+		DEBG("Control connection idle, sending OPTIONS\n");
+		ret = rtsp_transact(session, send_options_request);
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Waits between tracks for up to ms milliseconds, keeping the
+ * connections alive. */
+utility_retcode_t rtsp_idle(struct rtsp_session *session, unsigned int ms)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	uint64_t now, until, next;
+
+	FUNC_ENTER;
+
+	now = utility_time_ns();
+	until = now + (uint64_t)ms * 1000000;
+
+	while (now < until) {
+		next = session->last_request_ns +
+			(uint64_t)RTSP_KEEPALIVE_INTERVAL * 1000000;
+		if (next > until) {
+			next = until;
+		}
+
+		if (next > now) {
+			syscalls_usleep((next - now) / 1000);
+		}
+
+		ret = rtsp_keepalive(session);
+		if (UTILITY_SUCCESS != ret) {
+			break;
+		}
+
+		now = utility_time_ns();
+	}
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Lets the last track play out and waits for the server to hang up,
+ * then closes the session's connections and frees what
+ * rtsp_handshake_begin() allocated.  Works on a session whose
+ * handshake failed, and on one already ended. */
+utility_retcode_t rtsp_end_session(struct rtsp_session *session)
+{
+	FUNC_ENTER;
+
+	if (session->streaming) {
+		close_audio_track(&session->audio_stream);
+		finish_audio_stream(&session->audio_stream);
+		flight_recorder_close(session->audio_stream.recorder);
+		session->audio_stream.recorder = NULL;
+		stage_latency_log(session->audio_stream.latency);
+		stage_latency_close(session->audio_stream.latency);
+		session->audio_stream.latency = NULL;
+		syscalls_close(session->audio_stream.session_fd);
+		session->audio_stream.session_fd = -1;
+		session->streaming = UTILITY_FALSE;
+		metrics_gauge_add(METRIC_STREAMS, -1);
+	}
+
+	close_rtp_ports(session);
+
+	if (session->control_fd >= 0) {
+		syscalls_close(session->control_fd);
+		session->control_fd = -1;
+	}
+
+	rtsp_log_timeline(session);
+
+	if (NULL != session->handshake.request) {
+		destroy_rtsp_request(session->handshake.request);
+	}
+	if (NULL != session->handshake.response) {
+		destroy_rtsp_response(session->handshake.response);
+	}
+	syscalls_free(session->handshake.request);
+	syscalls_free(session->handshake.response);
+	syscalls_free(session->client);
+	session->handshake.request = NULL;
+	session->handshake.response = NULL;
+	session->client = NULL;
+
+	FUNC_RETURN;
+	return UTILITY_SUCCESS;
+}
+
+
+utility_retcode_t rtsp_send_data(struct rtsp_session *session)
+{
+	utility_retcode_t ret;
+
+	FUNC_ENTER;
+
+	ret = rtsp_play_track(session, NULL);
+
+	rtsp_end_session(session);
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+
+/* Brings up a session with each of num servers, to play as one
+ * group.  The servers are all told to play latency behind the clock,
+ * the longest of their playout latencies.  Returns UTILITY_SUCCESS
+ * only if every handshake completed; the group plays to those that
+ * did either way. */
+utility_retcode_t rtsp_group_start(struct rtsp_group *group,
+				   struct rtsp_session *sessions,
+				   struct rtsp_server *servers,
+				   int num)
+{
+	utility_retcode_t ret;
+	unsigned int latency_ms = 0;
+	int i;
+
+	FUNC_ENTER;
+
+	group->sessions = sessions;
+	group->num_sessions = num;
+
+	for (i = 0 ; i < num ; i++) {
+		latency_ms = MAX(latency_ms, servers[i].playout_latency_ms);
+	}
+
+	rtp_clock_init(&group->clock, latency_ms);
+
+	/* The source is set up with the first track */
+	get_audio_fan_out(&group->fan_out);
+	group->source.pcm_buf = NULL;
+
+	ret = rtsp_start_sessions(sessions, servers, num);
+
+	for (i = 0 ; i < num ; i++) {
+		sessions[i].clock = &group->clock;
+	}
+
+	DEBG("Group of %d sessions, latency %u ms\n", num, latency_ms);
+
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Sends a packet to each session in turn, each reading and
+ * converting the track for itself, until all have sent the track.
+ * Clears sending for a session once it is done or has failed. */
+static utility_retcode_t send_group_packets(struct rtsp_group *group,
+					    utility_boolean_t *sending,
+					    int num_sending)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_session *session;
+	utility_boolean_t done;
+	int i;
+
+	while (num_sending > 0) {
+		for (i = 0 ; i < group->num_sessions ; i++) {
+			if (!sending[i]) {
+				continue;
+			}
+
+			session = &group->sessions[i];
+
+			if (UTILITY_SUCCESS !=
+			    send_audio_packet(&session->audio_stream,
+					      &session->aes_data, &done)) {
+				ERRR("Server \"%s\" dropped from track\n",
+				     session->server->host);
+				ret = UTILITY_FAILURE;
+				done = UTILITY_TRUE;
+			}
+
+			if (done) {
+				close_audio_track(&session->audio_stream);
+				sending[i] = UTILITY_FALSE;
+				num_sending--;
+			}
+		}
+	}
+
+	return ret;
+}
+
+
+/* Reads and converts each chunk of the track once, from the group's
+ * source, and encrypts and sends it to each session in turn. */
+static utility_retcode_t fan_out_group_packets(struct rtsp_group *group,
+					       const char *pcm_file,
+					       utility_boolean_t *sending,
+					       int num_sending)
+{
+	utility_retcode_t ret;
+	struct rtsp_session *session;
+	struct audio_chunk chunk;
+	int i;
+
+	ret = open_audio_track(&group->source, pcm_file);
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
+	}
+
+	while (num_sending > 0) {
+		ret = read_audio_chunk(&group->source, &chunk);
+		if (UTILITY_SUCCESS != ret || 0 == chunk.pcm_len) {
+			break;
+		}
+
+		for (i = 0 ; i < group->num_sessions ; i++) {
+			if (!sending[i]) {
+				continue;
+			}
+
+			session = &group->sessions[i];
+
+			if (UTILITY_SUCCESS !=
+			    send_audio_chunk(&session->audio_stream,
+					     &session->aes_data, &chunk)) {
+				ERRR("Server \"%s\" dropped from track\n",
+				     session->server->host);
+				ret = UTILITY_FAILURE;
+				close_audio_track(&session->audio_stream);
+				sending[i] = UTILITY_FALSE;
+				num_sending--;
+			}
+		}
+	}
+
+	close_audio_track(&group->source);
+
+	/* And for the sessions' flight recorders, theirs */
+	for (i = 0 ; i < group->num_sessions ; i++) {
+		if (sending[i]) {
+			close_audio_track(&group->sessions[i].audio_stream);
+		}
+	}
+
+out:
+	return ret;
+}
+
+
+/* Plays one track to every session in the group, a packet to each
+ * in turn, so that no server falls behind the others.  A session
+ * that fails is dropped from the track and the rest carry on.
+ * Sessions in a group can't be paused or sought. */
+utility_retcode_t rtsp_group_play_track(struct rtsp_group *group,
+					const char *pcm_file)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct rtsp_session *session;
+	utility_boolean_t *sending;
+	int i, num_sending = 0;
+
+	FUNC_ENTER;
+
+	sending = syscalls_malloc(group->num_sessions * sizeof(*sending));
+	if (NULL == sending) {
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	if (group->fan_out && NULL == group->source.pcm_buf &&
+	    UTILITY_SUCCESS != init_audio_source(&group->source)) {
+		WARN("Reading the source for each session\n");
+		group->fan_out = UTILITY_FALSE;
+	}
+
+	/* Every session is flushed, releasing the clock, before any
+	 * writes the packet that sets it again */
+	for (i = 0 ; i < group->num_sessions ; i++) {
+		session = &group->sessions[i];
+		sending[i] = UTILITY_FALSE;
+
+		if (RTSP_HANDSHAKE_DONE != session->handshake.state) {
+			continue;
+		}
+
+		if (UTILITY_SUCCESS != begin_track(session, pcm_file,
+						   !group->fan_out)) {
+			ERRR("Server \"%s\" dropped from track\n",
+			     session->server->host);
+			ret = UTILITY_FAILURE;
+			continue;
+		}
+
+		sending[i] = UTILITY_TRUE;
+		num_sending++;
+	}
+
+	if (group->fan_out) {
+		if (UTILITY_SUCCESS != fan_out_group_packets(group, pcm_file,
+							     sending,
+							     num_sending)) {
+			ret = UTILITY_FAILURE;
+		}
+	} else if (UTILITY_SUCCESS != send_group_packets(group, sending,
+							 num_sending)) {
+		ret = UTILITY_FAILURE;
+	}
+
+	syscalls_free(sending);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+/* Logs each server's view of our clock.  An offset estimate is out
+ * by at most half the round trip it was made from, so two rooms can
+ * be told apart by no more than the two worst of those together;
+ * servers estimate our clock the same way.  That is a bound from
+ * round trips, not a measured skew, and it only covers rooms with a
+ * timing exchange: not those on TCP or whose handshake failed. */
+void rtsp_group_log(struct rtsp_group *group)
+{
+	struct rtsp_session *session;
+	struct rtp_timing_stats stats;
+	uint64_t worst = 0, second = 0, bound;
+	int i, num_synced = 0;
+
+	for (i = 0 ; i < group->num_sessions ; i++) {
+		session = &group->sessions[i];
+		rtp_timing_get_stats(&session->timing, &stats);
+
+		if (RTSP_HANDSHAKE_DONE != session->handshake.state ||
+		    0 == stats.replies) {
+			INFO("Room %d (%s:%u): unsynchronised, no timing "
+			     "exchange\n", i, session->server->host,
+			     (unsigned short)session->server->port);
+			continue;
+		}
+
+		INFO("Room %d (%s:%u): offset %lld us from an exchange with "
+		     "rtt %llu us, %u syncs\n", i,
+		     session->server->host,
+		     (unsigned short)session->server->port,
+		     (long long)stats.offset_ns / 1000,
+		     (unsigned long long)stats.offset_rtt_ns / 1000,
+		     stats.syncs_sent);
+
+		num_synced++;
+		bound = stats.offset_rtt_ns / 2;
+		if (bound > worst) {
+			second = worst;
+			worst = bound;
+		} else if (bound > second) {
+			second = bound;
+		}
+	}
+
+	INFO("Skew between %d of %d rooms within %llu us (bound from "
+	     "round trips), latency %u frames\n", num_synced,
+	     group->num_sessions, (unsigned long long)(worst + second) / 1000,
+	     group->clock.latency_frames);
+}
+
+
+/* Ends every session in the group. */
+void rtsp_group_end(struct rtsp_group *group)
+{
+	int i;
+
+	FUNC_ENTER;
+
+	for (i = 0 ; i < group->num_sessions ; i++) {
+		rtsp_end_session(&group->sessions[i]);
+	}
+
+	if (NULL != group->source.pcm_buf) {
+		destroy_audio_source(&group->source);
+	}
+	rtp_clock_destroy(&group->clock);
+
+	FUNC_RETURN;
+}
@@ -22,6 +22,37 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include "rtsp.h"
 
 utility_retcode_t rtsp_start_client(struct rtsp_session *session);
+utility_retcode_t rtsp_start_session(struct rtsp_session *session,
+				     struct rtsp_server *server);
+utility_retcode_t rtsp_start_sessions(struct rtsp_session *sessions,
+				      struct rtsp_server *servers,
+				      int num);
+utility_retcode_t rtsp_handshake_begin(struct rtsp_session *session,
+				       struct rtsp_server *server);
+short rtsp_handshake_events(struct rtsp_session *session);
+utility_retcode_t rtsp_handshake_continue(struct rtsp_session *session,
+					  short revents);
+void rtsp_log_timeline(struct rtsp_session *session);
+utility_retcode_t rtsp_play_track(struct rtsp_session *session,
+				  const char *pcm_file);
+utility_retcode_t rtsp_play_playlist(struct rtsp_session *session,
+				     const char * const *pcm_files,
+				     int num_files);
+void rtsp_request_pause(struct rtsp_session *session);
+void rtsp_request_seek(struct rtsp_session *session, uint64_t frame);
+utility_retcode_t rtsp_seek(struct rtsp_session *session, uint64_t frame);
+utility_retcode_t rtsp_resume(struct rtsp_session *session);
+utility_retcode_t rtsp_keepalive(struct rtsp_session *session);
+utility_retcode_t rtsp_idle(struct rtsp_session *session, unsigned int ms);
+utility_retcode_t rtsp_end_session(struct rtsp_session *session);
 utility_retcode_t rtsp_send_data(struct rtsp_session *session);
+utility_retcode_t rtsp_group_start(struct rtsp_group *group,
+				   struct rtsp_session *sessions,
+				   struct rtsp_server *servers,
+				   int num);
+utility_retcode_t rtsp_group_play_track(struct rtsp_group *group,
+					const char *pcm_file);
+void rtsp_group_log(struct rtsp_group *group);
+void rtsp_group_end(struct rtsp_group *group);
 
 #endif /* #ifndef RTSP_CLIENT_H */
@@ -0,0 +1,270 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "stage_latency.h"
+
+#define DEFAULT_FACILITY LT_STAGE_LATENCY
+
+static const char *stage_names[STAGE_LATENCY_NUM_STAGES] = {
+	"read",
+	"convert",
+	"encrypt",
+	"frame",
+	"write",
+};
+
+/* As CODE_VERSION in audio_stream.h */
+static const char *path_names[STAGE_LATENCY_NUM_PATHS] = {
+	"raopd",
+	"raop_play",
+};
+
+static int latency_running;
+/* The sets open and the totals of those closed, under latency_lock.
+ * Nothing that records takes it. */
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stage_latency *open_sets;
+static struct stage_latency closed_totals[STAGE_LATENCY_NUM_PATHS];
+
+
+void stage_latency_start(void)
+{
+	FUNC_ENTER;
+
+	__atomic_store_n(&latency_running, 1, __ATOMIC_RELEASE);
+
+	FUNC_RETURN;
+}
+
+
+/* Logs the totals.  Sets still open carry on recording, but no more
+ * are opened. */
+void stage_latency_stop(void)
+{
+	FUNC_ENTER;
+
+	if (__atomic_exchange_n(&latency_running, 0, __ATOMIC_ACQ_REL)) {
+		stage_latency_log_total();
+	}
+
+	FUNC_RETURN;
+}
+
+
+/* A set for one session's stream, or NULL if stage latency isn't
+ * being kept.  The stage functions take NULL and do nothing. */
+struct stage_latency *stage_latency_open(const char *name,
+					 stage_latency_path_t path)
+{
+	struct stage_latency *latency;
+
+	if (!__atomic_load_n(&latency_running, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	latency = syscalls_malloc(sizeof(*latency));
+	if (NULL == latency) {
+		WARN("No stage latency for session %s\n", name);
+		return NULL;
+	}
+
+	syscalls_memset(latency, 0, sizeof(*latency));
+	syscalls_strncpy(latency->name, name, sizeof(latency->name));
+	latency->name[sizeof(latency->name) - 1] = '\0';
+	latency->path = path;
+
+	syscalls_pthread_mutex_lock(&latency_lock);
+	latency->next = open_sets;
+	open_sets = latency;
+	syscalls_pthread_mutex_unlock(&latency_lock);
+
+	return latency;
+}
+
+
+/* Adds the set to the totals for its path and frees it. */
+void stage_latency_close(struct stage_latency *latency)
+{
+	struct stage_latency **p;
+	int i;
+
+	if (NULL == latency) {
+		return;
+	}
+
+	syscalls_pthread_mutex_lock(&latency_lock);
+
+	for (p = &open_sets ; NULL != *p ; p = &(*p)->next) {
+		if (latency == *p) {
+			*p = latency->next;
+			break;
+		}
+	}
+
+	for (i = 0 ; i < STAGE_LATENCY_NUM_STAGES ; i++) {
+		histogram_merge(&closed_totals[latency->path].stages[i],
+				&latency->stages[i]);
+		perf_counts_merge(&closed_totals[latency->path].perf[i],
+				  &latency->perf[i]);
+	}
+
+	syscalls_pthread_mutex_unlock(&latency_lock);
+
+	syscalls_free(latency);
+}
+
+
+/* The time a stage starts, to pass to stage_latency_end().  The
+ * counters are read outside the time taken, as reading them is a
+ * system call. */
+uint64_t stage_latency_begin(struct stage_latency *latency)
+{
+	if (NULL == latency) {
+		return 0;
+	}
+
+	perf_counters_read(&latency->perf_begin);
+
+	return utility_time_ns();
+}
+
+
+void stage_latency_end(struct stage_latency *latency,
+		       stage_latency_stage_t stage,
+		       uint64_t begin)
+{
+	if (NULL == latency) {
+		return;
+	}
+
+	histogram_record(&latency->stages[stage], utility_time_ns() - begin);
+	perf_counters_add_since(&latency->perf[stage], &latency->perf_begin);
+}
+
+
+/* Everything recorded for path so far, closed sets and open ones,
+ * into total. */
+void stage_latency_total(stage_latency_path_t path,
+			 struct stage_latency *total)
+{
+	struct stage_latency *latency;
+	int i;
+
+	syscalls_memset(total, 0, sizeof(*total));
+	syscalls_snprintf(total->name, sizeof(total->name), "all sessions");
+	total->path = path;
+
+	syscalls_pthread_mutex_lock(&latency_lock);
+
+	for (i = 0 ; i < STAGE_LATENCY_NUM_STAGES ; i++) {
+		histogram_merge(&total->stages[i],
+				&closed_totals[path].stages[i]);
+		perf_counts_merge(&total->perf[i],
+				  &closed_totals[path].perf[i]);
+	}
+
+	for (latency = open_sets ; NULL != latency ; latency = latency->next) {
+		if (path != latency->path) {
+			continue;
+		}
+
+		for (i = 0 ; i < STAGE_LATENCY_NUM_STAGES ; i++) {
+			histogram_merge(&total->stages[i], &latency->stages[i]);
+			perf_counts_merge(&total->perf[i], &latency->perf[i]);
+		}
+	}
+
+	syscalls_pthread_mutex_unlock(&latency_lock);
+}
+
+
+/* A line for each stage that has been timed, in microseconds, and
+ * the same for the hardware counters if they were counted */
+void stage_latency_log(struct stage_latency *latency)
+{
+	struct histogram_summary summary;
+	char title[STAGE_LATENCY_NAME_LEN + 16];
+	int i;
+
+	if (NULL == latency) {
+		return;
+	}
+
+	INFO("Stage latency for %s (%s), us:\n", latency->name,
+	     path_names[latency->path]);
+	INFO("  %-8s %9s %9s %9s %9s %9s %9s\n", "stage", "packets",
+	     "mean", "p50", "p99", "p99.9", "max");
+
+	for (i = 0 ; i < STAGE_LATENCY_NUM_STAGES ; i++) {
+		histogram_summarize(&latency->stages[i], &summary);
+		if (0 == summary.count) {
+			continue;
+		}
+
+		INFO("  %-8s %9llu %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+		     stage_names[i], (unsigned long long)summary.count,
+		     summary.mean / 1e3, summary.p50 / 1e3,
+		     summary.p99 / 1e3, summary.p999 / 1e3,
+		     summary.max / 1e3);
+	}
+
+	syscalls_snprintf(title, sizeof(title), "%s (%s)", latency->name,
+			  path_names[latency->path]);
+	perf_counts_log(title, "packet", stage_names, latency->perf,
+			STAGE_LATENCY_NUM_STAGES);
+}
+
+
+/* Logs the totals for each path that has sent anything. */
+void stage_latency_log_total(void)
+{
+	struct stage_latency *total;
+	int path;
+
+	total = syscalls_malloc(sizeof(*total));
+	if (NULL == total) {
+		return;
+	}
+
+	for (path = 0 ; path < STAGE_LATENCY_NUM_PATHS ; path++) {
+		stage_latency_total(path, total);
+		if (0 != total->stages[STAGE_READ].count ||
+		    0 != total->stages[STAGE_WRITE].count) {
+			stage_latency_log(total);
+		}
+	}
+
+	syscalls_free(total);
+}
+
+
+const char *stage_latency_stage_name(stage_latency_stage_t stage)
+{
+	return stage_names[stage];
+}
+
+
+const char *stage_latency_path_name(stage_latency_path_t path)
+{
+	return path_names[path];
+}
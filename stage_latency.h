@@ -0,0 +1,83 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef STAGE_LATENCY_H
+#define STAGE_LATENCY_H
+
+#include <stdint.h>
+
+#include "utility.h"
+#include "histogram.h"
+#include "perf_counters.h"
+
+/* How long each packet spends in each stage of the audio pipeline, a
+ * histogram (see histogram.h) per stage.  Each session's audio stream
+ * opens a set and times its stages into it from the one thread that
+ * sends its audio, so recording takes no lock.  A set closed is added
+ * to the totals for its path, and stage_latency_total() adds the sets
+ * still open to those.
+ *
+ * While hardware counters are being counted (see perf_counters.h),
+ * each stage's counts go into the set too. */
+
+typedef enum {
+	STAGE_READ,
+	STAGE_CONVERT,
+	STAGE_ENCRYPT,
+	STAGE_FRAME,
+	STAGE_WRITE,
+	STAGE_LATENCY_NUM_STAGES
+} stage_latency_stage_t;
+
+/* The two ways of sending audio (see audio_stream.h), kept apart so
+ * they can be compared */
+typedef enum {
+	STAGE_PATH_RAOPD,
+	STAGE_PATH_RAOP_PLAY,
+	STAGE_LATENCY_NUM_PATHS
+} stage_latency_path_t;
+
+#define STAGE_LATENCY_NAME_LEN 64
+
+struct stage_latency {
+	char name[STAGE_LATENCY_NAME_LEN];
+	stage_latency_path_t path;
+	struct histogram stages[STAGE_LATENCY_NUM_STAGES];
+	struct perf_counts perf[STAGE_LATENCY_NUM_STAGES];
+	/* The counters when the stage being timed began */
+	struct perf_sample perf_begin;
+	struct stage_latency *next;
+};
+
+void stage_latency_start(void);
+void stage_latency_stop(void);
+struct stage_latency *stage_latency_open(const char *name,
+					 stage_latency_path_t path);
+void stage_latency_close(struct stage_latency *latency);
+uint64_t stage_latency_begin(struct stage_latency *latency);
+void stage_latency_end(struct stage_latency *latency,
+		       stage_latency_stage_t stage,
+		       uint64_t begin);
+void stage_latency_total(stage_latency_path_t path,
+			 struct stage_latency *total);
+void stage_latency_log(struct stage_latency *latency);
+void stage_latency_log_total(void);
+const char *stage_latency_stage_name(stage_latency_stage_t stage);
+const char *stage_latency_path_name(stage_latency_path_t path);
+
+#endif /* #ifndef STAGE_LATENCY_H */
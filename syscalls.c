@@ -24,9 +24,12 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/random.h>
 
 #include "lt.h"
 #include "syscalls.h"
+#include "syscalls_acct.h"
+#include "probes.h"
 
 #define DEFAULT_FACILITY LT_SYSCALLS
 
@@ -58,9 +61,15 @@ int syscalls_snprintf(char *str, size_t size, const char *format, ...)
 
 int syscalls_socket(int domain, int type, int protocol)
 {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
 	int ret;
 
-	if ((ret = socket(domain, type, protocol)) < 0) {
+	ret = socket(domain, type, protocol);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_SOCKET, begin, 0,
+			  ret < 0 ? errno : 0);
+
+	if (ret < 0) {
 		ERRR("Failed to create socket: %s\n", strerror(errno));
 	}
 
@@ -82,11 +91,85 @@ int syscalls_inet_pton(int af, const char *src, void *dst)
 int syscalls_connect(int sockfd,
 		     const struct sockaddr *serv_addr,
 		     socklen_t addrlen)
+{
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
+	int ret;
+
+	ret = connect(sockfd, serv_addr, addrlen);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_CONNECT, begin, 0,
+			  ret < 0 ? errno : 0);
+
+	if (ret < 0) {
+		if (EINPROGRESS == errno) {
+			DEBG("Connection in progress (fd: %d)\n", sockfd);
+		} else {
+			ERRR("Failed to connect to socket: %s\n",
+			     strerror(errno));
+		}
+	}
+
+	return ret;
+}
+
+int syscalls_bind(int sockfd,
+		  const struct sockaddr *addr,
+		  socklen_t addrlen)
+{
+	int ret;
+
+	if ((ret = bind(sockfd, addr, addrlen)) < 0) {
+		ERRR("Failed to bind socket: %s\n", strerror(errno));
+	}
+
+	return ret;
+}
+
+int syscalls_listen(int sockfd, int backlog)
+{
+	int ret;
+
+	if ((ret = listen(sockfd, backlog)) < 0) {
+		ERRR("Failed to listen on socket: %s\n", strerror(errno));
+	}
+
+	return ret;
+}
+
+int syscalls_setsockopt(int sockfd, int level, int optname,
+			const void *optval, socklen_t optlen)
 {
 	int ret;
 
-	if ((ret = connect(sockfd, serv_addr, addrlen)) < 0) {
-		ERRR("Failed to connect to socket: %s\n", strerror(errno));
+	if ((ret = setsockopt(sockfd, level, optname, optval, optlen)) < 0) {
+		ERRR("Failed to set socket option %d (fd: %d): %s\n",
+		     optname, sockfd, strerror(errno));
+	}
+
+	return ret;
+}
+
+/* Failures are only logged at debug level, because accept fails as
+ * a matter of course when a listening socket is shut down. */
+int syscalls_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
+	int ret;
+
+again:
+	ret = accept(sockfd, addr, addrlen);
+
+	if (ret < 0 && errno == EINTR) {
+		syscalls_acct_retry(acct, SYSCALLS_ACCT_ACCEPT);
+		goto again;
+	}
+
+	syscalls_acct_end(acct, SYSCALLS_ACCT_ACCEPT, begin, 0,
+			  ret < 0 ? errno : 0);
+
+	if (ret < 0) {
+		DEBG("Accept failed: %s (fd: %d)\n", strerror(errno), sockfd);
 	}
 
 	return ret;
@@ -110,19 +193,28 @@ char *syscalls_strncpy(char *dest, const char *src, size_t n)
 
 ssize_t syscalls_read(int fd, void *buf, size_t count)
 {
+	struct syscalls_acct *acct;
+	uint64_t begin;
 	ssize_t ret;
 
-	DEBG("Attempting to read %d bytes from fd %d\n",
-	     (int)count, (int)fd);
+	DEBG_RATELIMITED("Attempting to read %d bytes from fd %d\n",
+			 (int)count, (int)fd);
+
+	acct = syscalls_acct_thread();
+	begin = syscalls_acct_begin(acct);
 
 again:
 	ret = read(fd, buf, count);
 
-	if (ret < 0) {
-		if (errno == EINTR) {
-			goto again;
-		}
+	if (ret < 0 && errno == EINTR) {
+		syscalls_acct_retry(acct, SYSCALLS_ACCT_READ);
+		goto again;
+	}
+
+	syscalls_acct_end(acct, SYSCALLS_ACCT_READ, begin,
+			  ret < 0 ? 0 : (uint64_t)ret, ret < 0 ? errno : 0);
 
+	if (ret < 0) {
 		if (errno == EAGAIN) {
 			DEBG("Got EAGAIN from read\n");
 		} else {
@@ -131,7 +223,33 @@ again:
 
 	} else {
 
-		INFO("Read %d bytes (fd: %d)\n", (int)ret, (int)fd);
+		INFO_RATELIMITED("Read %d bytes (fd: %d)\n", (int)ret, (int)fd);
+	}
+
+	return ret;
+}
+
+
+ssize_t syscalls_getrandom(void *buf, size_t buflen, unsigned int flags)
+{
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
+	ssize_t ret;
+
+again:
+	ret = getrandom(buf, buflen, flags);
+
+	if (ret < 0 && errno == EINTR) {
+		syscalls_acct_retry(acct, SYSCALLS_ACCT_GETRANDOM);
+		goto again;
+	}
+
+	syscalls_acct_end(acct, SYSCALLS_ACCT_GETRANDOM, begin,
+			  ret < 0 ? 0 : (uint64_t)ret, ret < 0 ? errno : 0);
+
+	if (ret < 0) {
+		ERRR("getrandom of %d bytes failed: %s\n",
+		     (int)buflen, strerror(errno));
 	}
 
 	return ret;
@@ -140,13 +258,28 @@ again:
 /* XXX TODO FIXME Handle SIGPIPE */
 ssize_t syscalls_write(int fd, const void *buf, size_t count)
 {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
 	ssize_t ret;
+	int err;
 
 	ret = write(fd, buf, count);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_WRITE, begin,
+			  ret < 0 ? 0 : (uint64_t)ret, ret < 0 ? errno : 0);
+	RAOPD_PROBE3(write, fd, count, ret);
 	if (ret < 0) {
-		ERRR("Write failed: %s (fd: %d)\n", strerror(errno), (int)fd);
+		/* A full non-blocking socket is the caller's to handle,
+		 * and it needs errno to see that */
+		err = errno;
+		if (EAGAIN == err) {
+			DEBG("Got EAGAIN from write (fd: %d)\n", (int)fd);
+		} else {
+			ERRR("Write failed: %s (fd: %d)\n", strerror(err),
+			     (int)fd);
+		}
+		errno = err;
 	}
-	DEBG("Wrote %d bytes (fd: %d)\n", (int)ret, (int)fd);
+	DEBG_RATELIMITED("Wrote %d bytes (fd: %d)\n", (int)ret, (int)fd);
  
 	return ret;
 }
@@ -166,9 +299,13 @@ unsigned int syscalls_sleep(unsigned int seconds)
 
 unsigned int syscalls_usleep(unsigned int usec)
 {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
 	unsigned int ret;
 
 	ret = usleep(usec);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_USLEEP, begin, 0,
+			  0 != ret ? errno : 0);
 	if (0 != ret) {
 		switch (errno) {
 		case EINTR:
@@ -188,11 +325,19 @@ unsigned int syscalls_usleep(unsigned int usec)
 }
 
 void *syscalls_malloc(size_t size) {
+	struct syscalls_acct *acct;
+	uint64_t begin;
 	void *ret;
 
 	DEBG("Attempting to malloc %d bytes\n", (int)size);
 
-	if ((ret = malloc(size)) == NULL) {
+	acct = syscalls_acct_thread();
+	begin = syscalls_acct_begin(acct);
+	ret = malloc(size);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_MALLOC, begin, size,
+			  NULL == ret ? ENOMEM : 0);
+
+	if (ret == NULL) {
 		ERRR("Failed to malloc %d bytes\n", (int)size);
 		goto err;
 	}
@@ -208,8 +353,15 @@ err:
 }
 
 void syscalls_free(void *ptr) {
+	struct syscalls_acct *acct;
+	uint64_t begin;
+
 	DEBG("Freeing %p\n", ptr);
+
+	acct = syscalls_acct_thread();
+	begin = syscalls_acct_begin(acct);
 	free(ptr);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_FREE, begin, 0, 0);
 }
 
 void *syscalls_memset(void *s, int c, size_t n)
@@ -309,11 +461,26 @@ int syscalls_pthread_rwlock_destroy(pthread_rwlock_t *rwlock){
 /* Failures in locking and unlocking are bad.  There are only a few
  * reasons why a lock operation would fail, but all of them indicate
  * programming errors.  Don't attempt to log anything--the
- * opportunities for deadlock are just too available.  */
+ * opportunities for deadlock are just too available.
+ *
+ * While calls are being counted, the lock wrappers try the lock first
+ * and time only the calls that have to wait for it. */
 int syscalls_pthread_mutex_lock(pthread_mutex_t *mutex) {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin;
 	int err;
 
-	if ((err = pthread_mutex_lock(mutex))) {
+	if (NULL == acct) {
+		err = pthread_mutex_lock(mutex);
+	} else if (0 == (err = pthread_mutex_trylock(mutex))) {
+		syscalls_acct_count(acct, SYSCALLS_ACCT_MUTEX_LOCK);
+	} else {
+		begin = syscalls_acct_begin(acct);
+		err = pthread_mutex_lock(mutex);
+		syscalls_acct_wait(acct, SYSCALLS_ACCT_MUTEX_LOCK, begin);
+	}
+
+	if (err) {
 		printf("Error locking mutex: %s\n", strerror(err));
 		abort();
 	}
@@ -350,9 +517,21 @@ int syscalls_pthread_mutex_unlock(pthread_mutex_t *mutex) {
 }
 
 int syscalls_pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin;
 	int err;
 
-	if ((err = pthread_rwlock_wrlock(rwlock))) {
+	if (NULL == acct) {
+		err = pthread_rwlock_wrlock(rwlock);
+	} else if (0 == (err = pthread_rwlock_trywrlock(rwlock))) {
+		syscalls_acct_count(acct, SYSCALLS_ACCT_RWLOCK_WRLOCK);
+	} else {
+		begin = syscalls_acct_begin(acct);
+		err = pthread_rwlock_wrlock(rwlock);
+		syscalls_acct_wait(acct, SYSCALLS_ACCT_RWLOCK_WRLOCK, begin);
+	}
+
+	if (err) {
 		switch (err) {
 		case EBUSY:
 			break;
@@ -366,9 +545,21 @@ int syscalls_pthread_rwlock_wrlock(pthread_rwlock_t *rwlock) {
 }
 
 int syscalls_pthread_rwlock_rdlock(pthread_rwlock_t *rwlock) {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin;
 	int err;
 
-	if ((err = pthread_rwlock_rdlock(rwlock))) {
+	if (NULL == acct) {
+		err = pthread_rwlock_rdlock(rwlock);
+	} else if (0 == (err = pthread_rwlock_tryrdlock(rwlock))) {
+		syscalls_acct_count(acct, SYSCALLS_ACCT_RWLOCK_RDLOCK);
+	} else {
+		begin = syscalls_acct_begin(acct);
+		err = pthread_rwlock_rdlock(rwlock);
+		syscalls_acct_wait(acct, SYSCALLS_ACCT_RWLOCK_RDLOCK, begin);
+	}
+
+	if (err) {
 		abort();
 	}
 
@@ -387,9 +578,14 @@ int syscalls_pthread_rwlock_unlock(pthread_rwlock_t *rwlock) {
 
 int syscalls_pthread_cond_wait(pthread_cond_t *cond,
 			       pthread_mutex_t *mutex) {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
 	int err;
 
-	if ((err = pthread_cond_wait(cond, mutex))) {
+	err = pthread_cond_wait(cond, mutex);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_COND_WAIT, begin, 0, err);
+
+	if (err) {
 		EMRG("Error invoking pthread_cond_wait "
 		     "(cond: %p mutex: %p): %s\n", (void *)cond, (void *)mutex, strerror(err));
 		abort();
@@ -420,9 +616,23 @@ int syscalls_pthread_join(pthread_t thread, void **value_ptr) {
 	return ret;
 }
 
+int syscalls_pthread_once(pthread_once_t *once, void (*init_routine)(void)) {
+	int ret;
+
+	if ((ret = pthread_once(once, init_routine))) {
+		EMRG("Error invoking pthread_once (once: %p): %s\n",
+		     (void *)once, strerror(ret));
+		abort();
+	}
+
+	return ret;
+}
+
 
 int syscalls_open(const char *pathname, int flags, mode_t mode)
 {
+	struct syscalls_acct *acct;
+	uint64_t begin;
 	int ret;
 
 	if (!pathname) {
@@ -433,7 +643,13 @@ int syscalls_open(const char *pathname, int flags, mode_t mode)
 	DEBG("Attempting to open \"%s\" with flags 0x%x and mode 0x%x\n",
 	     pathname, flags, mode);
 
-	if ((ret = open(pathname, flags, mode)) < 0) {
+	acct = syscalls_acct_thread();
+	begin = syscalls_acct_begin(acct);
+	ret = open(pathname, flags, mode);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_OPEN, begin, 0,
+			  ret < 0 ? errno : 0);
+
+	if (ret < 0) {
 		ERRR("Failed to open \"%s\" with flags 0x%x and mode 0x%x: %s\n",
 		     pathname, flags, mode, strerror(ret));
 	}
@@ -447,9 +663,13 @@ int syscalls_open(const char *pathname, int flags, mode_t mode)
 
 int syscalls_close(int fd)
 {
+	struct syscalls_acct *acct = syscalls_acct_thread();
+	uint64_t begin = syscalls_acct_begin(acct);
 	int ret;
 
 	ret = close(fd);
+	syscalls_acct_end(acct, SYSCALLS_ACCT_CLOSE, begin, 0,
+			  ret < 0 ? errno : 0);
 
 	DEBG("Attempting to close fd %d\n", fd);
 	if (ret == -1) {
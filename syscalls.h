@@ -28,6 +28,7 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 int syscalls_open(const char *pathname, int flags, mode_t mode);
@@ -41,7 +42,15 @@ int syscalls_inet_pton(int af, const char *src, void *dst);
 int syscalls_connect(int sockfd,
 		     const struct sockaddr *serv_addr,
 		     socklen_t addrlen);
+int syscalls_bind(int sockfd,
+		  const struct sockaddr *addr,
+		  socklen_t addrlen);
+int syscalls_listen(int sockfd, int backlog);
+int syscalls_setsockopt(int sockfd, int level, int optname,
+			const void *optval, socklen_t optlen);
+int syscalls_accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
 ssize_t syscalls_read(int fd, void *buf, size_t count);
+ssize_t syscalls_getrandom(void *buf, size_t buflen, unsigned int flags);
 ssize_t syscalls_write(int fd, const void *buf, size_t count);
 unsigned int syscalls_sleep(unsigned int seconds);
 unsigned int syscalls_usleep(unsigned int usec);
@@ -69,6 +78,7 @@ int syscalls_pthread_rwlock_unlock(pthread_rwlock_t *rwlock);
 int syscalls_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
 int syscalls_pthread_cond_signal(pthread_cond_t *cond);
 int syscalls_pthread_join(pthread_t thread, void **value_ptr);
+int syscalls_pthread_once(pthread_once_t *once, void (*init_routine)(void));
 
 /* These defines are here so we know we've examined the error cases &
  * determined that the standard syscall needs no additional error
@@ -92,6 +102,19 @@ int syscalls_pthread_join(pthread_t thread, void **value_ptr);
 #define syscalls_getpid getpid
 #define syscalls_fork fork
 #define syscalls_fflush fflush
+#define syscalls_getsockname getsockname
+#define syscalls_getsockopt getsockopt
+#define syscalls_fcntl fcntl
+#define syscalls_shutdown shutdown
+#define syscalls_fstat fstat
+#define syscalls_pread pread
+#define syscalls_lseek lseek
+#define syscalls_posix_fadvise posix_fadvise
+#define syscalls_recv recv
+#define syscalls_sendmmsg sendmmsg
+#define syscalls_sendto sendto
+#define syscalls_sigaction sigaction
+#define syscalls_raise raise
 
 #define syscalls_htonl htonl
 #define syscalls_htons htons
@@ -100,6 +123,7 @@ int syscalls_pthread_join(pthread_t thread, void **value_ptr);
 
 #define syscalls_abort abort
 #define syscalls_gettimeofday gettimeofday
+#define syscalls_clock_gettime clock_gettime
 
 /* XXX needs error checking */
 #define syscalls_poll poll
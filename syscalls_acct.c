@@ -0,0 +1,434 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "syscalls_acct.h"
+
+#define DEFAULT_FACILITY LT_SYSCALLS_ACCT
+
+/* A thread's counters.  Only the thread writes them; anyone holding
+ * acct_lock may read them. */
+struct acct_thread {
+	uint32_t tid;
+	struct syscalls_acct calls[SYSCALLS_ACCT_NUM];
+	struct acct_thread *next;
+};
+
+static const char *acct_names[SYSCALLS_ACCT_NUM] = {
+	"read",
+	"write",
+	"getrandom",
+	"socket",
+	"connect",
+	"accept",
+	"open",
+	"close",
+	"malloc",
+	"free",
+	"usleep",
+	"mutex_lock",
+	"rwlock_rdlock",
+	"rwlock_wrlock",
+	"cond_wait"
+};
+
+/* acct_lock covers the list of threads and the counts of the threads
+ * that have exited.  Setting a thread up and tearing it down call
+ * pthreads and libc directly rather than through the wrappers, which
+ * would count into the thread being set up or torn down. */
+static pthread_mutex_t acct_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct acct_thread *acct_threads;
+static struct syscalls_acct exited[SYSCALLS_ACCT_NUM];
+static pthread_key_t acct_key;
+static pthread_once_t acct_once = PTHREAD_ONCE_INIT;
+static int acct_running;
+static uint64_t acct_start_ns;
+
+
+/* Only the thread that owns counter adds to it */
+static void acct_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+
+static void add_counts(struct syscalls_acct *to,
+		       const struct syscalls_acct *from)
+{
+	to->calls += __atomic_load_n(&from->calls, __ATOMIC_RELAXED);
+	to->bytes += __atomic_load_n(&from->bytes, __ATOMIC_RELAXED);
+	to->errors += __atomic_load_n(&from->errors, __ATOMIC_RELAXED);
+	to->eagain += __atomic_load_n(&from->eagain, __ATOMIC_RELAXED);
+	to->eintr += __atomic_load_n(&from->eintr, __ATOMIC_RELAXED);
+	to->ns += __atomic_load_n(&from->ns, __ATOMIC_RELAXED);
+	to->waits += __atomic_load_n(&from->waits, __ATOMIC_RELAXED);
+}
+
+
+/* Folds an exiting thread's counts into exited. */
+static void acct_thread_exit(void *arg)
+{
+	struct acct_thread *thread = arg;
+	struct acct_thread **p;
+	int i;
+
+	pthread_mutex_lock(&acct_lock);
+
+	for (p = &acct_threads ; NULL != *p ; p = &(*p)->next) {
+		if (thread == *p) {
+			*p = thread->next;
+			break;
+		}
+	}
+
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		add_counts(&exited[i], &thread->calls[i]);
+	}
+
+	pthread_mutex_unlock(&acct_lock);
+
+	free(thread);
+}
+
+
+static void acct_init(void)
+{
+	if (0 != pthread_key_create(&acct_key, acct_thread_exit)) {
+		abort();
+	}
+}
+
+
+/* Starts counting, in every thread */
+void syscalls_acct_start(void)
+{
+	FUNC_ENTER;
+
+	pthread_once(&acct_once, acct_init);
+	acct_start_ns = utility_time_ns();
+	__atomic_store_n(&acct_running, 1, __ATOMIC_RELEASE);
+
+	FUNC_RETURN;
+}
+
+
+/* Stops counting and logs what was counted. */
+void syscalls_acct_stop(void)
+{
+	FUNC_ENTER;
+
+	if (__atomic_exchange_n(&acct_running, 0, __ATOMIC_ACQ_REL)) {
+		syscalls_acct_log();
+	}
+
+	FUNC_RETURN;
+}
+
+
+/* The calling thread's counters, to pass to the functions below, or
+ * NULL if calls aren't being counted.  They take NULL and do
+ * nothing. */
+struct syscalls_acct *syscalls_acct_thread(void)
+{
+	struct acct_thread *thread;
+
+	if (!__atomic_load_n(&acct_running, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	thread = pthread_getspecific(acct_key);
+	if (NULL != thread) {
+		return thread->calls;
+	}
+
+	thread = calloc(1, sizeof(*thread));
+	if (NULL == thread) {
+		return NULL;
+	}
+
+	thread->tid = (uint32_t)syscall(SYS_gettid);
+
+	pthread_mutex_lock(&acct_lock);
+	thread->next = acct_threads;
+	acct_threads = thread;
+	pthread_mutex_unlock(&acct_lock);
+
+	pthread_setspecific(acct_key, thread);
+
+	return thread->calls;
+}
+
+
+/* The time a call starts, to pass to syscalls_acct_end() or
+ * syscalls_acct_wait() */
+uint64_t syscalls_acct_begin(struct syscalls_acct *acct)
+{
+	if (NULL == acct) {
+		return 0;
+	}
+
+	return utility_time_ns();
+}
+
+
+/* Counts a call that has returned: bytes if it succeeded, otherwise
+ * the errno it failed with. */
+void syscalls_acct_end(struct syscalls_acct *acct,
+		       syscalls_acct_call_t call,
+		       uint64_t begin,
+		       uint64_t bytes,
+		       int err)
+{
+	struct syscalls_acct *counts;
+
+	if (NULL == acct) {
+		return;
+	}
+
+	counts = &acct[call];
+
+	acct_add(&counts->calls, 1);
+	acct_add(&counts->ns, utility_time_ns() - begin);
+
+	if (0 == err) {
+		acct_add(&counts->bytes, bytes);
+	} else if (EAGAIN == err) {
+		acct_add(&counts->eagain, 1);
+	} else {
+		acct_add(&counts->errors, 1);
+	}
+}
+
+
+/* Counts a call interrupted by a signal, that is about to be made
+ * again */
+void syscalls_acct_retry(struct syscalls_acct *acct,
+			 syscalls_acct_call_t call)
+{
+	if (NULL == acct) {
+		return;
+	}
+
+	acct_add(&acct[call].eintr, 1);
+}
+
+
+/* Counts a call without timing it: a lock that was free */
+void syscalls_acct_count(struct syscalls_acct *acct,
+			 syscalls_acct_call_t call)
+{
+	if (NULL == acct) {
+		return;
+	}
+
+	acct_add(&acct[call].calls, 1);
+}
+
+
+/* Counts a call that had to wait for a lock, and the time it waited */
+void syscalls_acct_wait(struct syscalls_acct *acct,
+			syscalls_acct_call_t call,
+			uint64_t begin)
+{
+	struct syscalls_acct *counts;
+
+	if (NULL == acct) {
+		return;
+	}
+
+	counts = &acct[call];
+
+	acct_add(&counts->calls, 1);
+	acct_add(&counts->waits, 1);
+	acct_add(&counts->ns, utility_time_ns() - begin);
+}
+
+
+/* The calling thread's counts so far; all zero if it hasn't been
+ * counted. */
+void syscalls_acct_self(struct syscalls_acct counts[SYSCALLS_ACCT_NUM])
+{
+	struct acct_thread *thread = NULL;
+	int i;
+
+	syscalls_memset(counts, 0, sizeof(*counts) * SYSCALLS_ACCT_NUM);
+
+	if (__atomic_load_n(&acct_running, __ATOMIC_ACQUIRE)) {
+		thread = pthread_getspecific(acct_key);
+	}
+
+	if (NULL == thread) {
+		return;
+	}
+
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		add_counts(&counts[i], &thread->calls[i]);
+	}
+}
+
+
+/* Every thread's counts so far, those of threads that have exited
+ * included, added up */
+void syscalls_acct_total(struct syscalls_acct counts[SYSCALLS_ACCT_NUM])
+{
+	struct acct_thread *thread;
+	int i;
+
+	syscalls_memset(counts, 0, sizeof(*counts) * SYSCALLS_ACCT_NUM);
+
+	pthread_mutex_lock(&acct_lock);
+
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		add_counts(&counts[i], &exited[i]);
+	}
+
+	for (thread = acct_threads ; NULL != thread ; thread = thread->next) {
+		for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+			add_counts(&counts[i], &thread->calls[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&acct_lock);
+}
+
+
+const char *syscalls_acct_name(syscalls_acct_call_t call)
+{
+	return acct_names[call];
+}
+
+
+/* A line for each wrapper that has been called.  For the lock
+ * wrappers the time is the time spent waiting, and ns each is per
+ * wait. */
+static void log_counts(const char *who,
+		       const struct syscalls_acct *counts,
+		       double minutes)
+{
+	const struct syscalls_acct *c;
+	uint64_t divisor;
+	int i;
+
+	INFO("System calls by %s:\n", who);
+	INFO("  %-13s %10s %10s %12s %7s %7s %7s %7s %10s %8s\n",
+	     "call", "calls", "per min", "bytes", "errors", "EAGAIN",
+	     "EINTR", "waits", "ms", "ns each");
+
+	for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+		c = &counts[i];
+		if (0 == c->calls) {
+			continue;
+		}
+
+		switch (i) {
+		case SYSCALLS_ACCT_MUTEX_LOCK:
+		case SYSCALLS_ACCT_RWLOCK_RDLOCK:
+		case SYSCALLS_ACCT_RWLOCK_WRLOCK:
+			divisor = c->waits;
+			break;
+		default:
+			divisor = c->calls;
+			break;
+		}
+
+		INFO("  %-13s %10llu %10.1f %12llu %7llu %7llu %7llu %7llu "
+		     "%10.3f %8llu\n", acct_names[i],
+		     (unsigned long long)c->calls,
+		     minutes > 0 ? c->calls / minutes : 0.0,
+		     (unsigned long long)c->bytes,
+		     (unsigned long long)c->errors,
+		     (unsigned long long)c->eagain,
+		     (unsigned long long)c->eintr,
+		     (unsigned long long)c->waits,
+		     c->ns / 1e6,
+		     (unsigned long long)(divisor ? c->ns / divisor : 0));
+	}
+}
+
+
+/* Logs each thread's counts and the totals.  The counts are copied
+ * out first, so nothing is logged holding acct_lock. */
+void syscalls_acct_log(void)
+{
+	struct acct_thread *thread, *copies;
+	struct syscalls_acct total[SYSCALLS_ACCT_NUM];
+	char who[32];
+	double minutes;
+	int num_threads = 0, n, i;
+
+	minutes = (utility_time_ns() - acct_start_ns) / 60e9;
+
+	pthread_mutex_lock(&acct_lock);
+
+	for (thread = acct_threads ; NULL != thread ; thread = thread->next) {
+		num_threads++;
+	}
+
+	copies = calloc(num_threads + 1, sizeof(*copies));
+	if (NULL != copies) {
+		for (n = 0, thread = acct_threads ;
+		     NULL != thread ;
+		     n++, thread = thread->next) {
+			copies[n].tid = thread->tid;
+			for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+				add_counts(&copies[n].calls[i],
+					   &thread->calls[i]);
+			}
+		}
+
+		for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+			add_counts(&copies[n].calls[i], &exited[i]);
+		}
+	}
+
+	pthread_mutex_unlock(&acct_lock);
+
+	if (NULL == copies) {
+		WARN("No memory to log system call counts\n");
+		return;
+	}
+
+	for (n = 0 ; n < num_threads ; n++) {
+		syscalls_snprintf(who, sizeof(who), "thread %u",
+				  (unsigned int)copies[n].tid);
+		log_counts(who, copies[n].calls, minutes);
+	}
+
+	log_counts("threads that have exited", copies[num_threads].calls,
+		   minutes);
+
+	syscalls_memset(total, 0, sizeof(total));
+	for (n = 0 ; n <= num_threads ; n++) {
+		for (i = 0 ; i < SYSCALLS_ACCT_NUM ; i++) {
+			add_counts(&total[i], &copies[n].calls[i]);
+		}
+	}
+
+	free(copies);
+
+	log_counts("all threads", total, minutes);
+}
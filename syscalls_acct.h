@@ -0,0 +1,84 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SYSCALLS_ACCT_H
+#define SYSCALLS_ACCT_H
+
+#include <stdint.h>
+
+/* What each thread spends in the wrappers in syscalls.c, counted by
+ * the thread itself into its own set of counters, so counting takes no
+ * lock.  syscalls_acct_total() adds up every thread's, including those
+ * of threads that have exited, and syscalls_acct_stop() logs them.
+ *
+ * acct_names in syscalls_acct.c must match. */
+typedef enum {
+	SYSCALLS_ACCT_READ,
+	SYSCALLS_ACCT_WRITE,
+	SYSCALLS_ACCT_GETRANDOM,
+	SYSCALLS_ACCT_SOCKET,
+	SYSCALLS_ACCT_CONNECT,
+	SYSCALLS_ACCT_ACCEPT,
+	SYSCALLS_ACCT_OPEN,
+	SYSCALLS_ACCT_CLOSE,
+	SYSCALLS_ACCT_MALLOC,
+	SYSCALLS_ACCT_FREE,
+	SYSCALLS_ACCT_USLEEP,
+	SYSCALLS_ACCT_MUTEX_LOCK,
+	SYSCALLS_ACCT_RWLOCK_RDLOCK,
+	SYSCALLS_ACCT_RWLOCK_WRLOCK,
+	SYSCALLS_ACCT_COND_WAIT,
+	SYSCALLS_ACCT_NUM
+} syscalls_acct_call_t;
+
+/* The lock wrappers try the lock first and only time the calls that
+ * find it held: for them ns is the time spent waiting for the lock,
+ * and waits the number of calls that had to wait. */
+struct syscalls_acct {
+	uint64_t calls;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t eagain;
+	/* Calls interrupted by a signal and made again */
+	uint64_t eintr;
+	uint64_t ns;
+	uint64_t waits;
+};
+
+void syscalls_acct_start(void);
+void syscalls_acct_stop(void);
+struct syscalls_acct *syscalls_acct_thread(void);
+uint64_t syscalls_acct_begin(struct syscalls_acct *acct);
+void syscalls_acct_end(struct syscalls_acct *acct,
+		       syscalls_acct_call_t call,
+		       uint64_t begin,
+		       uint64_t bytes,
+		       int err);
+void syscalls_acct_retry(struct syscalls_acct *acct,
+			 syscalls_acct_call_t call);
+void syscalls_acct_count(struct syscalls_acct *acct,
+			 syscalls_acct_call_t call);
+void syscalls_acct_wait(struct syscalls_acct *acct,
+			syscalls_acct_call_t call,
+			uint64_t begin);
+void syscalls_acct_self(struct syscalls_acct counts[SYSCALLS_ACCT_NUM]);
+void syscalls_acct_total(struct syscalls_acct counts[SYSCALLS_ACCT_NUM]);
+void syscalls_acct_log(void);
+const char *syscalls_acct_name(syscalls_acct_call_t call);
+
+#endif /* #ifndef SYSCALLS_ACCT_H */
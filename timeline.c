@@ -0,0 +1,166 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "lt.h"
+#include "utility.h"
+#include "syscalls.h"
+#include "timeline.h"
+
+#define DEFAULT_FACILITY LT_TIMELINE
+
+static const char *timeline_names[TIMELINE_NUM_MILESTONES] = {
+	"session_start",
+	"tcp_connected",
+	"announce_sent",
+	"announce_replied",
+	"setup_sent",
+	"setup_replied",
+	"record_sent",
+	"record_replied",
+	"set_parameter_sent",
+	"set_parameter_replied",
+	"audio_connected",
+	"first_packet_written",
+	"first_server_ack",
+};
+
+/* Set once by main so the log can say how long the process had been
+ * running when a session started. */
+static uint64_t process_start_ns;
+
+
+void timeline_mark_process_start(void)
+{
+	process_start_ns = utility_time_ns();
+}
+
+
+void timeline_reset(struct timeline *timeline)
+{
+	syscalls_memset(timeline, 0, sizeof(*timeline));
+}
+
+
+/* Only the first time a milestone is reached counts. */
+void timeline_mark(struct timeline *timeline, timeline_milestone_t milestone)
+{
+	if (0 == timeline->at[milestone]) {
+		timeline->at[milestone] = utility_time_ns();
+	}
+}
+
+
+/* Microseconds from the start of the session to the milestone, or -1
+ * if either hasn't been reached. */
+int64_t timeline_offset_us(struct timeline *timeline,
+			   timeline_milestone_t milestone)
+{
+	uint64_t start = timeline->at[TIMELINE_SESSION_START];
+
+	if (0 == start || 0 == timeline->at[milestone]) {
+		return -1;
+	}
+
+	return (int64_t)(timeline->at[milestone] - start) / 1000;
+}
+
+
+const char *timeline_name(timeline_milestone_t milestone)
+{
+	return timeline_names[milestone];
+}
+
+
+void timeline_log(struct timeline *timeline, const char *session_id)
+{
+	uint64_t previous = timeline->at[TIMELINE_SESSION_START];
+	int64_t offset;
+	int i;
+
+	if (0 == previous) {
+		return;
+	}
+
+	if (0 != process_start_ns) {
+		INFO("Session %s started %.3f ms after process start\n",
+		     session_id, (previous - process_start_ns) / 1e6);
+	}
+
+	for (i = TIMELINE_SESSION_START + 1 ; i < TIMELINE_NUM_MILESTONES ; i++) {
+		offset = timeline_offset_us(timeline, i);
+		if (offset < 0) {
+			INFO("  %-22s          -\n", timeline_names[i]);
+			continue;
+		}
+
+		/* Pipelined requests go out together, so a milestone
+		 * can share its time with the one listed before it. */
+		INFO("  %-22s %9.3f ms  (+%.3f ms)\n", timeline_names[i],
+		     offset / 1e3,
+		     (timeline->at[i] > previous) ?
+		     (timeline->at[i] - previous) / 1e6 : 0.0);
+
+		previous = MAX(previous, timeline->at[i]);
+	}
+}
+
+
+/* One line of JSON with the offset of each milestone in microseconds,
+ * null for those that weren't reached. */
+utility_retcode_t timeline_to_json(struct timeline *timeline,
+				   const char *session_id,
+				   char *buf,
+				   size_t size)
+{
+	size_t used = 0;
+	int64_t offset;
+	int i, ret;
+
+	ret = syscalls_snprintf(buf, size, "{\"session\":\"%s\"", session_id);
+	if (ret < 0 || (size_t)ret >= size) {
+		return UTILITY_FAILURE;
+	}
+	used += ret;
+
+	for (i = TIMELINE_SESSION_START + 1 ; i < TIMELINE_NUM_MILESTONES ; i++) {
+		offset = timeline_offset_us(timeline, i);
+
+		if (offset < 0) {
+			ret = syscalls_snprintf(buf + used, size - used,
+						",\"%s_us\":null",
+						timeline_names[i]);
+		} else {
+			ret = syscalls_snprintf(buf + used, size - used,
+						",\"%s_us\":%lld",
+						timeline_names[i],
+						(long long)offset);
+		}
+
+		if (ret < 0 || (size_t)ret >= size - used) {
+			return UTILITY_FAILURE;
+		}
+		used += ret;
+	}
+
+	ret = syscalls_snprintf(buf + used, size - used, "}");
+	if (ret < 0 || (size_t)ret >= size - used) {
+		return UTILITY_FAILURE;
+	}
+
+	return UTILITY_SUCCESS;
+}
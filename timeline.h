@@ -0,0 +1,65 @@
+/* 
+Copyright 2008, David Allan
+
+This file is part of raopd.
+
+raopd is free software: you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your
+option) any later version.
+
+raopd is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with raopd.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+
+#include "utility.h"
+
+/* Points in bringing up a session, in the order they normally
+ * happen.  timeline_names in timeline.c must match. */
+typedef enum {
+	TIMELINE_SESSION_START,
+	TIMELINE_TCP_CONNECTED,
+	TIMELINE_ANNOUNCE_SENT,
+	TIMELINE_ANNOUNCE_REPLIED,
+	TIMELINE_SETUP_SENT,
+	TIMELINE_SETUP_REPLIED,
+	TIMELINE_RECORD_SENT,
+	TIMELINE_RECORD_REPLIED,
+	TIMELINE_SET_PARAMETER_SENT,
+	TIMELINE_SET_PARAMETER_REPLIED,
+	TIMELINE_AUDIO_CONNECTED,
+	TIMELINE_FIRST_PACKET_WRITTEN,
+	TIMELINE_FIRST_SERVER_ACK,
+	TIMELINE_NUM_MILESTONES
+} timeline_milestone_t;
+
+/* Monotonic times (utility_time_ns()) at which each milestone was
+ * first reached, 0 if it hasn't been. */
+struct timeline {
+	uint64_t at[TIMELINE_NUM_MILESTONES];
+};
+
+#define TIMELINE_MAX_JSON_LEN 1024
+
+void timeline_mark_process_start(void);
+void timeline_reset(struct timeline *timeline);
+void timeline_mark(struct timeline *timeline, timeline_milestone_t milestone);
+int64_t timeline_offset_us(struct timeline *timeline,
+			   timeline_milestone_t milestone);
+const char *timeline_name(timeline_milestone_t milestone);
+void timeline_log(struct timeline *timeline, const char *session_id);
+utility_retcode_t timeline_to_json(struct timeline *timeline,
+				   const char *session_id,
+				   char *buf,
+				   size_t size);
+
+#endif /* #ifndef TIMELINE_H */
@@ -24,7 +24,8 @@ along with raopd.  If not, see <http://www.gnu.org/licenses/>.
 
 #define DEFAULT_FACILITY LT_UTILITY
 
-/* bits_to_string is used by lt()  Do not attempt to log anything. */
+/* bits_to_string is used by the lt functions.  Do not attempt to log
+ * anything. */
 void bits_to_string(uint64_t num, int size, char *buf, size_t buflen)
 {
 	int i;
@@ -560,6 +561,178 @@ utility_retcode_t utility_list_destroy(struct utility_locked_list *list)
 }
 
 
+/* See header file for uses of parameters. */
+utility_retcode_t utility_buf_pool_create(struct utility_buf_pool **pool,
+					  size_t bufsize,
+					  int max_free,
+					  const char *description)
+{
+	utility_retcode_t ret;
+
+	FUNC_ENTER;
+
+	*pool = syscalls_malloc(sizeof(struct utility_buf_pool));
+	if (NULL == *pool) {
+		ERRR("Could not allocate memory to create buffer pool \"%s\"\n",
+		     description);
+		goto malloc_failed;
+	}
+
+	syscalls_memset(*pool, 0, sizeof(**pool));
+
+	if ((syscalls_pthread_mutex_init(&(*pool)->lock, NULL)) != 0) {
+		ERRR("Could not initialize mutex for buffer pool \"%s\"\n",
+		     description);
+		goto mutex_init_failed;
+	}
+
+	utility_refcnt_init(&(*pool)->refcnt, 1);
+	(*pool)->bufsize = bufsize;
+	(*pool)->max_free = max_free;
+	syscalls_strncpy((*pool)->description, description, MAX_NAME_LEN - 1);
+
+	DEBG("Created buffer pool \"%s\" of %d byte buffers\n",
+	     (*pool)->description, (int)bufsize);
+
+	ret = UTILITY_SUCCESS;
+	goto out;
+
+mutex_init_failed:
+	syscalls_free(*pool);
+	*pool = NULL;
+
+malloc_failed:
+	ret = UTILITY_FAILURE;
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+static void put_buf_pool(struct utility_buf_pool *pool)
+{
+	if (0 != utility_refcnt_put(&pool->refcnt)) {
+		return;
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	syscalls_free(pool);
+}
+
+
+/* Frees the buffers on the free list.  Buffers still out are freed
+ * as they come back, and the pool with the last of them. */
+void utility_buf_pool_destroy(struct utility_buf_pool *pool)
+{
+	struct utility_buf *buf, *next;
+
+	FUNC_ENTER;
+
+	syscalls_pthread_mutex_lock(&pool->lock);
+
+	buf = pool->free_list;
+	pool->free_list = NULL;
+	pool->num_free = 0;
+	pool->max_free = 0;
+
+	DEBG("Destroying buffer pool \"%s\": %lu allocations, %lu misses\n",
+	     pool->description, pool->allocs, pool->misses);
+
+	syscalls_pthread_mutex_unlock(&pool->lock);
+
+	for ( ; NULL != buf ; buf = next) {
+		next = buf->next_free;
+		syscalls_free(buf);
+	}
+
+	put_buf_pool(pool);
+
+	FUNC_RETURN;
+	return;
+}
+
+
+/* The buffer functions are used for every packet, so they do not
+ * log.  The buffer comes back with one reference and len 0. */
+struct utility_buf *utility_buf_alloc(struct utility_buf_pool *pool)
+{
+	struct utility_buf *buf;
+
+	syscalls_pthread_mutex_lock(&pool->lock);
+
+	buf = pool->free_list;
+	if (NULL != buf) {
+		pool->free_list = buf->next_free;
+		pool->num_free--;
+	} else {
+		pool->misses++;
+	}
+	pool->allocs++;
+
+	syscalls_pthread_mutex_unlock(&pool->lock);
+
+	if (NULL == buf) {
+		buf = syscalls_malloc(sizeof(*buf) + pool->bufsize);
+		if (NULL == buf) {
+			return NULL;
+		}
+		buf->pool = pool;
+		buf->size = pool->bufsize;
+	}
+
+	utility_refcnt_init(&buf->refcnt, 1);
+	utility_refcnt_get(&pool->refcnt);
+	buf->next_free = NULL;
+	buf->len = 0;
+
+	return buf;
+}
+
+
+struct utility_buf *utility_buf_get(struct utility_buf *buf)
+{
+	utility_refcnt_get(&buf->refcnt);
+
+	return buf;
+}
+
+
+void utility_buf_put(struct utility_buf *buf)
+{
+	struct utility_buf_pool *pool = buf->pool;
+
+	if (0 != utility_refcnt_put(&buf->refcnt)) {
+		return;
+	}
+
+	syscalls_pthread_mutex_lock(&pool->lock);
+
+	if (pool->num_free < pool->max_free) {
+		buf->next_free = pool->free_list;
+		pool->free_list = buf;
+		pool->num_free++;
+		buf = NULL;
+	}
+
+	syscalls_pthread_mutex_unlock(&pool->lock);
+
+	if (NULL != buf) {
+		syscalls_free(buf);
+	}
+
+	put_buf_pool(pool);
+}
+
+
+/* Whether anyone but the caller holds a reference, in which case the
+ * buffer must not be written to. */
+utility_boolean_t utility_buf_shared(const struct utility_buf *buf)
+{
+	return utility_refcnt_read(&buf->refcnt) > 1 ?
+		UTILITY_TRUE : UTILITY_FALSE;
+}
+
+
 utility_retcode_t utility_copy_token(char *dest,
 				     size_t size,
 				     const char *src,
@@ -633,47 +806,292 @@ char *begin_token(const char *s, const char *delim)
 }
 
 
-utility_retcode_t get_random_bytes(uint8_t *buf, size_t size)
+/* Random bytes come from a per-thread ChaCha20 generator with fast
+ * key erasure: each refill of the buffer starts with the key for the
+ * next refill, and every byte is wiped from the buffer once it has
+ * been handed out, so earlier output can't be recovered from the
+ * state.  The key is mixed with fresh bytes from the kernel after
+ * RANDOM_RESEED_BYTES of output, after RANDOM_RESEED_INTERVAL
+ * seconds, and in the child after a fork. */
+#define RANDOM_KEY_LEN		32
+#define RANDOM_BLOCK_LEN	64
+#define RANDOM_BUFLEN		(16 * RANDOM_BLOCK_LEN)
+#define RANDOM_RESEED_BYTES	(1024 * 1024)
+#define RANDOM_RESEED_INTERVAL	300 /* seconds */
+
+struct random_state {
+	uint32_t key[RANDOM_KEY_LEN / 4];
+	uint64_t counter;
+	uint64_t reseed_ns;
+	size_t since_reseed;
+	unsigned int fork_generation;
+	size_t avail;
+	uint8_t buf[RANDOM_BUFLEN];
+};
+
+static pthread_key_t random_state_key;
+static pthread_once_t random_state_once = PTHREAD_ONCE_INIT;
+static volatile unsigned int random_fork_generation;
+
+
+#define CHACHA_ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QUARTERROUND(x, a, b, c, d)				\
+	do {								\
+		x[a] += x[b]; x[d] ^= x[a]; x[d] = CHACHA_ROTL(x[d], 16); \
+		x[c] += x[d]; x[b] ^= x[c]; x[b] = CHACHA_ROTL(x[b], 12); \
+		x[a] += x[b]; x[d] ^= x[a]; x[d] = CHACHA_ROTL(x[d], 8); \
+		x[c] += x[d]; x[b] ^= x[c]; x[b] = CHACHA_ROTL(x[b], 7); \
+	} while (0)
+
+static void chacha20_block(const uint32_t key[8],
+			   uint64_t counter,
+			   uint8_t out[RANDOM_BLOCK_LEN])
+{
+	uint32_t in[16], x[16];
+	int i;
+
+	in[0] = 0x61707865;
+	in[1] = 0x3320646e;
+	in[2] = 0x79622d32;
+	in[3] = 0x6b206574;
+	for (i = 0 ; i < 8 ; i++) {
+		in[4 + i] = key[i];
+	}
+	in[12] = (uint32_t)counter;
+	in[13] = (uint32_t)(counter >> 32);
+	in[14] = 0;
+	in[15] = 0;
+
+	syscalls_memcpy(x, in, sizeof(x));
+
+	for (i = 0 ; i < 10 ; i++) {
+		CHACHA_QUARTERROUND(x, 0, 4, 8, 12);
+		CHACHA_QUARTERROUND(x, 1, 5, 9, 13);
+		CHACHA_QUARTERROUND(x, 2, 6, 10, 14);
+		CHACHA_QUARTERROUND(x, 3, 7, 11, 15);
+		CHACHA_QUARTERROUND(x, 0, 5, 10, 15);
+		CHACHA_QUARTERROUND(x, 1, 6, 11, 12);
+		CHACHA_QUARTERROUND(x, 2, 7, 8, 13);
+		CHACHA_QUARTERROUND(x, 3, 4, 9, 14);
+	}
+
+	for (i = 0 ; i < 16 ; i++) {
+		x[i] += in[i];
+		out[4 * i] = (uint8_t)x[i];
+		out[4 * i + 1] = (uint8_t)(x[i] >> 8);
+		out[4 * i + 2] = (uint8_t)(x[i] >> 16);
+		out[4 * i + 3] = (uint8_t)(x[i] >> 24);
+	}
+}
+
+
+/* Reads size bytes from the kernel, from getrandom() or, on kernels
+ * without it, from RANDOM_SOURCE_PATH. */
+static utility_retcode_t read_kernel_random(uint8_t *buf, size_t size)
 {
 	utility_retcode_t ret = UTILITY_SUCCESS;
-	int fd, syscallret;
+	ssize_t syscallret;
+	size_t got = 0;
+	int fd;
 
 	FUNC_ENTER;
 
+	while (got < size) {
+		syscallret = syscalls_getrandom(buf + got, size - got, 0);
+		if (syscallret < 0) {
+			break;
+		}
+		got += syscallret;
+	}
+
+	if (got == size) {
+		goto out;
+	}
+
+	WARN("getrandom() unavailable, reading \"%s\"\n",
+	     RANDOM_SOURCE_PATH);
+
 	fd = syscalls_open(RANDOM_SOURCE_PATH, O_RDONLY, 0);
 	if (fd < 0) {
-		ERRR("Failed to open random source \"%s\"\n", RANDOM_SOURCE_PATH);
-		goto failed;
+		ERRR("Failed to open random source \"%s\"\n",
+		     RANDOM_SOURCE_PATH);
+		ret = UTILITY_FAILURE;
+		goto out;
 	}
 
-	DEBG("Opened random source \"%s\"\n", RANDOM_SOURCE_PATH);
+	while (got < size) {
+		syscallret = syscalls_read(fd, buf + got, size - got);
+		if (syscallret <= 0) {
+			ERRR("Read of %d bytes from random source \"%s\" "
+			     "failed\n", (int)(size - got), RANDOM_SOURCE_PATH);
+			ret = UTILITY_FAILURE;
+			break;
+		}
+		got += syscallret;
+	}
+
+	syscalls_close(fd);
+
+out:
+	FUNC_RETURN;
+	return ret;
+}
+
+
+static utility_retcode_t reseed_random_state(struct random_state *state)
+{
+	utility_retcode_t ret;
+	uint32_t seed[RANDOM_KEY_LEN / 4];
+	int i;
+
+	FUNC_ENTER;
 
-	syscallret = syscalls_read(fd, buf, size);
-	if (syscallret < 0) {
-		ERRR("Read of %d bytes from random source \"%s\" failed: %d\n",
-		     size, RANDOM_SOURCE_PATH, syscallret);
+	ret = read_kernel_random((uint8_t *)seed, sizeof(seed));
+	if (UTILITY_SUCCESS != ret) {
+		goto out;
 	}
 
-	if (syscallret < (int)size) {
-		ERRR("Read only %d bytes from \"%s\" when %d bytes were requested\n",
-		     syscallret, RANDOM_SOURCE_PATH, size);
+	for (i = 0 ; i < RANDOM_KEY_LEN / 4 ; i++) {
+		state->key[i] ^= seed[i];
 	}
 
-	DEBG("Read %d bytes from random source \"%s\"\n",
-	     syscallret, RANDOM_SOURCE_PATH);
+	/* Nothing generated from the old key may be handed out */
+	syscalls_memset(state->buf, 0, sizeof(state->buf));
+	syscalls_memset(seed, 0, sizeof(seed));
+	state->avail = 0;
+	state->since_reseed = 0;
+	state->reseed_ns = utility_time_ns();
+	state->fork_generation = random_fork_generation;
 
-	ret = UTILITY_SUCCESS;
+	DEBG("Reseeded random state %p\n", (void *)state);
 
-	goto out;
+out:
+	FUNC_RETURN;
+	return ret;
+}
 
-failed:
-	syscallret = syscalls_close(fd);
-	if (syscallret < 0) {
-		ERRR("Failed to close random source \"%s\"\n",
-		     RANDOM_SOURCE_PATH);
+
+static utility_retcode_t refill_random_state(struct random_state *state)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	int i;
+
+	if (state->since_reseed >= RANDOM_RESEED_BYTES ||
+	    utility_time_ns() - state->reseed_ns >=
+	    (uint64_t)RANDOM_RESEED_INTERVAL * 1000000000) {
+		ret = reseed_random_state(state);
+		if (UTILITY_SUCCESS != ret) {
+			return ret;
+		}
 	}
 
-	ret = UTILITY_FAILURE;
+	for (i = 0 ; i < RANDOM_BUFLEN / RANDOM_BLOCK_LEN ; i++) {
+		chacha20_block(state->key, state->counter++,
+			       state->buf + i * RANDOM_BLOCK_LEN);
+	}
+
+	syscalls_memcpy(state->key, state->buf, RANDOM_KEY_LEN);
+	syscalls_memset(state->buf, 0, RANDOM_KEY_LEN);
+	state->avail = RANDOM_BUFLEN - RANDOM_KEY_LEN;
+
+	return ret;
+}
+
+
+static void random_state_destructor(void *arg)
+{
+	struct random_state *state = arg;
+
+	syscalls_memset(state, 0, sizeof(*state));
+	syscalls_free(state);
+}
+
+
+static void random_atfork_child(void)
+{
+	random_fork_generation++;
+}
+
+
+static void random_state_init(void)
+{
+	syscalls_pthread_key_create(&random_state_key, random_state_destructor);
+	pthread_atfork(NULL, NULL, random_atfork_child);
+}
+
+
+static struct random_state *get_random_state(void)
+{
+	struct random_state *state;
+
+	syscalls_pthread_once(&random_state_once, random_state_init);
+
+	state = pthread_getspecific(random_state_key);
+	if (NULL != state) {
+		return state;
+	}
+
+	state = syscalls_malloc(sizeof(*state));
+	if (NULL == state) {
+		return NULL;
+	}
+
+	syscalls_memset(state, 0, sizeof(*state));
+
+	if (UTILITY_SUCCESS != reseed_random_state(state)) {
+		syscalls_free(state);
+		return NULL;
+	}
+
+	pthread_setspecific(random_state_key, state);
+
+	return state;
+}
+
+
+utility_retcode_t get_random_bytes(uint8_t *buf, size_t size)
+{
+	utility_retcode_t ret = UTILITY_SUCCESS;
+	struct random_state *state;
+	uint8_t *src;
+	size_t len;
+
+	FUNC_ENTER;
+
+	state = get_random_state();
+	if (NULL == state) {
+		ERRR("No random state for this thread\n");
+		ret = UTILITY_FAILURE;
+		goto out;
+	}
+
+	if (state->fork_generation != random_fork_generation) {
+		/* The parent holds the same state */
+		ret = reseed_random_state(state);
+		if (UTILITY_SUCCESS != ret) {
+			goto out;
+		}
+	}
+
+	while (size > 0) {
+		if (0 == state->avail) {
+			ret = refill_random_state(state);
+			if (UTILITY_SUCCESS != ret) {
+				goto out;
+			}
+		}
+
+		len = MIN(size, state->avail);
+		src = state->buf + RANDOM_BUFLEN - state->avail;
+
+		syscalls_memcpy(buf, src, len);
+		syscalls_memset(src, 0, len);
+
+		buf += len;
+		size -= len;
+		state->avail -= len;
+		state->since_reseed += len;
+	}
 
 out:
 	FUNC_RETURN;
@@ -681,3 +1099,16 @@ out:
 }
 
 
+
+
+/* utility_time_ns is used to time things on hot paths, so it does
+ * not log.  The clock is monotonic; the values are only meaningful
+ * relative to each other. */
+uint64_t utility_time_ns(void)
+{
+	struct timespec ts;
+
+	syscalls_clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
@@ -67,6 +67,59 @@ struct utility_list_entry {
 	char description[MAX_NAME_LEN];
 };
 
+/* A buffer shared by reference count.  It may be filled in while its
+ * allocator holds the only reference; once it has been handed on with
+ * utility_buf_get() nobody writes to it.  The last utility_buf_put()
+ * gives it back to its pool. */
+struct utility_buf {
+	utility_refcnt_t refcnt;
+	struct utility_buf_pool *pool;
+	struct utility_buf *next_free;
+	size_t size;
+	size_t len;
+	uint8_t data[];
+};
+
+/* Buffers of one size, kept for reuse.  Each buffer out of the pool
+ * holds a reference on it, so it goes away after
+ * utility_buf_pool_destroy() once the last buffer comes back. */
+struct utility_buf_pool {
+	utility_lock_t lock;
+	utility_refcnt_t refcnt;
+	struct utility_buf *free_list;
+	size_t bufsize;
+	int num_free;
+	int max_free;
+	/* Buffers handed out, and how many of those had to be
+	 * malloc()ed because the free list was empty */
+	unsigned long allocs;
+	unsigned long misses;
+	char description[MAX_NAME_LEN];
+};
+
+/* Reference counts may be changed from any thread.  Whoever takes a
+ * count to 0 with utility_refcnt_put() owns the object again. */
+static inline void utility_refcnt_init(utility_refcnt_t *refcnt,
+				       utility_refcnt_t value)
+{
+	__atomic_store_n(refcnt, value, __ATOMIC_RELAXED);
+}
+
+static inline void utility_refcnt_get(utility_refcnt_t *refcnt)
+{
+	__atomic_add_fetch(refcnt, 1, __ATOMIC_RELAXED);
+}
+
+static inline utility_refcnt_t utility_refcnt_put(utility_refcnt_t *refcnt)
+{
+	return __atomic_sub_fetch(refcnt, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline utility_refcnt_t utility_refcnt_read(const utility_refcnt_t *refcnt)
+{
+	return __atomic_load_n(refcnt, __ATOMIC_ACQUIRE);
+}
+
 void bits_to_string(uint64_t num, int size, char *buf, size_t buflen);
 
 utility_retcode_t utility_list_add(struct utility_locked_list *list,
@@ -144,6 +197,15 @@ utility_retcode_t utility_list_walk(
 utility_retcode_t utility_list_create(struct utility_locked_list **list,
 				      const char *description);
 utility_retcode_t utility_list_destroy(struct utility_locked_list *list);
+utility_retcode_t utility_buf_pool_create(struct utility_buf_pool **pool,
+					  size_t bufsize,
+					  int max_free,
+					  const char *description);
+void utility_buf_pool_destroy(struct utility_buf_pool *pool);
+struct utility_buf *utility_buf_alloc(struct utility_buf_pool *pool);
+struct utility_buf *utility_buf_get(struct utility_buf *buf);
+void utility_buf_put(struct utility_buf *buf);
+utility_boolean_t utility_buf_shared(const struct utility_buf *buf);
 utility_retcode_t utility_copy_token(char *dest,
 				     size_t size,
 				     const char *src,
@@ -151,6 +213,7 @@ utility_retcode_t utility_copy_token(char *dest,
 				     char **next);
 char *begin_token(const char *s, const char *delim);
 utility_retcode_t get_random_bytes(uint8_t *buf, size_t size);
+uint64_t utility_time_ns(void);
 utility_retcode_t utility_base64_encode(uint8_t *dst,
 					size_t dstlen,
 					uint8_t *src,